@@ -392,6 +392,9 @@ static void correct_eps_bbox(const QByteArray& epsdata,
 			     double vectorscale, QRgb bgcolor, QByteArray * epsdatacorrected);
 
 static void replace_svg_width_or_height(QByteArray *svgdata, const char * attr, double val);
+static QStringList gs_png_argv(const KLFBackend::klfSettings& settings, const KLFBackend::klfInput& in,
+                               int dpi, const QString& outFile);
+static QImage image_scaled_to_dpi(const QImage& image, int imageDpi, int dpi);
 
 
 static inline bool has_userscript_output(const QSet<QString>& fmts, const QString& format)
@@ -485,6 +488,70 @@ static inline bool assert_have_formats_for(const KLFStringSet& outputs, const KL
 
 
 
+struct KLFPngCrc32Table
+{
+  KLFPngCrc32Table()
+  {
+    for (quint32 n = 0; n < 256; ++n) {
+      quint32 c = n;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+      }
+      table[n] = c;
+    }
+  }
+  quint32 table[256];
+};
+
+static quint32 klf_png_crc32(const char *data, int len)
+{
+  // computed on first use; the initialization of a function-local static is thread-safe
+  static const KLFPngCrc32Table crctable;
+  quint32 crc = 0xffffffffu;
+  for (int i = 0; i < len; ++i) {
+    crc = crctable.table[(crc ^ (uchar)data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc ^ 0xffffffffu;
+}
+
+static void klf_png_append_be32(QByteArray *data, quint32 x)
+{
+  data->append((char)((x >> 24) & 0xff));
+  data->append((char)((x >> 16) & 0xff));
+  data->append((char)((x >> 8) & 0xff));
+  data->append((char)(x & 0xff));
+}
+
+/** \internal
+ * Inserts a \c tEXt chunk for each of the given \c texts just before the \c IEND chunk of
+ * the given PNG data. The values must be latin1 (KLFImageLatexMetaInfo escapes them). Returns
+ * FALSE, leaving \c png untouched, if \c png doesn't look like well-formed PNG data.
+ */
+static bool klf_png_add_text_chunks(QByteArray *png, const QMap<QString,QString>& texts)
+{
+  static const char png_signature[] = "\x89PNG\r\n\x1a\n";
+  if (png->size() < 8+12 || !png->startsWith(QByteArray(png_signature, 8))) {
+    return false;
+  }
+  const int iendpos = png->size() - 12;
+  if (png->mid(iendpos, 8) != QByteArray("\0\0\0\0IEND", 8)) {
+    return false;
+  }
+
+  QByteArray chunks;
+  for (QMap<QString,QString>::const_iterator it = texts.constBegin(); it != texts.constEnd(); ++it) {
+    QByteArray chunk = "tEXt";
+    chunk += it.key().left(79).toLatin1();
+    chunk += '\0';
+    chunk += it.value().toLatin1();
+    klf_png_append_be32(&chunks, (quint32)(chunk.size() - 4));
+    chunks += chunk;
+    klf_png_append_be32(&chunks, klf_png_crc32(chunk.constData(), chunk.size()));
+  }
+  png->insert(iendpos, chunks);
+  return true;
+}
+
 KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const klfSettings& usersettings,
 						  bool isMainThread)
 {
@@ -518,6 +585,7 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
   res.status = KLFERR_NOERROR;
   res.errorstr = QString();
   res.result = QImage();
+  res.extraResults.clear();
   res.pngdata_raw = QByteArray();
   res.pngdata = QByteArray();
   res.dvidata = QByteArray();
@@ -629,6 +697,7 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
   QString fnBBoxEps = tempfname + "-bbox.eps";
   QString fnProcessedEps = tempfname + "-processed.eps";
   QString fnRawPng = tempfname + "-raw.png";
+  QString fnRawPngHiRes = tempfname + "-raw-hires.png";
   QString fnPdfMarks = tempfname + ".pdfmarks";
   QString fnPdf = tempfname + ".pdf";
   QString fnGsSvg = tempfname + "-gs.svg";
@@ -1117,6 +1186,14 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
     }
   }
 
+  // the highest of the extra resolutions, if it is higher than the main one
+  int hiResDpi = 0;
+  QImage hiResResult;
+  foreach (int dpi, settings.extraRasterDpis) {
+    if (dpi > in.dpi && dpi > hiResDpi)
+      hiResDpi = dpi;
+  }
+
   if (!has_userscript_output(us_outputs, "png") && !our_skipfmts.contains("png")) {
 
     ASSERT_HAVE_FORMATS_FOR("png") ;
@@ -1141,15 +1218,7 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
      */
     // ### wait... do we want vector scaling to apply to the PNG as well??
 
-    p.setArgv(QStringList() << settings.gsexec
-	      << "-dNOPAUSE" << "-dSAFER" << "-dTextAlphaBits=4" << "-dGraphicsAlphaBits=4"
-	      << "-r"+QString::number(in.dpi) << "-dEPSCrop" << "-dMaxBitmap=2147483647");
-    if (qAlpha(in.bg_color) > 0) { // we're forcing a background color
-      p.addArgv("-sDEVICE=png16m");
-    } else {
-      p.addArgv("-sDEVICE=pngalpha");
-    }
-    p.addArgv(QStringList() << "-sOutputFile="+QDir::toNativeSeparators(fnRawPng) << "-q" << "-dBATCH" << "-");
+    p.setArgv(gs_png_argv(settings, in, in.dpi, fnRawPng));
 
     ok = p.run(bboxepsdata, fnRawPng, &res.pngdata_raw);
     if (!ok) {
@@ -1158,6 +1227,21 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
     }
 
     res.result.loadFromData(res.pngdata_raw, "PNG");
+
+    if (hiResDpi > 0) {
+      // rasterize once more at the highest extra resolution; the other extra resolutions are
+      // downsampled from this image or from the main one below.
+      KLFBackendFilterProgram phr(QLatin1String("gs (PNG, high resolution)"), &settings, isMainThread,
+                                  tempdir.path());
+      phr.setArgv(gs_png_argv(settings, in, hiResDpi, fnRawPngHiRes));
+      QByteArray hiResPngData;
+      if (phr.run(bboxepsdata, fnRawPngHiRes, &hiResPngData)) {
+        hiResResult.loadFromData(hiResPngData, "PNG");
+      } else {
+        klfWarning("Failed to rasterize the equation at "<<hiResDpi<<" DPI; the higher resolutions "
+                   "will not be available.") ;
+      }
+    }
   } // raw PNG
   else {
     if (us_skipfmts.contains("png")) {
@@ -1178,10 +1262,25 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
   if (!our_skipfmts.contains("png")) { // generate tagged/labeled PNG
 
     // store some meta-information into result
+    QMap<QString,QString> rawtexts;
+    foreach (const QString& key, res.result.textKeys()) {
+      rawtexts[key] = res.result.text(key);
+    }
     KLFImageLatexMetaInfo metainfo(&res.result);
     metainfo.saveMetaInfo(in, settings);
-    
-    { // create "final" PNG data
+
+    // create "final" PNG data. If we have the raw PNG data, we only need to add the new
+    // meta-information as text chunks instead of encoding the whole image again.
+    QMap<QString,QString> newtexts;
+    foreach (const QString& key, res.result.textKeys()) {
+      QString value = res.result.text(key);
+      if (!rawtexts.contains(key) || rawtexts.value(key) != value) {
+        newtexts[key] = value;
+      }
+    }
+    res.pngdata = res.pngdata_raw;
+    if (res.pngdata.isEmpty() || !klf_png_add_text_chunks(&res.pngdata, newtexts)) {
+      res.pngdata = QByteArray();
       QBuffer buf(&res.pngdata);
       buf.open(QIODevice::WriteOnly);
 
@@ -1195,6 +1294,29 @@ KLFBackend::klfOutput KLFBackend::getLatexFormula(const klfInput& input, const k
     klfDbg("prepared final PNG data.") ;
   }
 
+  if (!res.result.isNull()) {
+    foreach (int dpi, settings.extraRasterDpis) {
+      if (dpi <= 0 || dpi == in.dpi || res.extraResults.contains(dpi)) {
+        continue;
+      }
+      QImage img;
+      if (dpi > in.dpi) {
+        if (hiResResult.isNull()) {
+          klfWarning("No high resolution rendering available for "<<dpi<<" DPI.") ;
+          continue;
+        }
+        img = (dpi == hiResDpi) ? hiResResult : image_scaled_to_dpi(hiResResult, hiResDpi, dpi);
+      } else {
+        img = image_scaled_to_dpi(res.result, in.dpi, dpi);
+      }
+      klfInput dpiInput = in;
+      dpiInput.dpi = dpi;
+      KLFImageLatexMetaInfo dpimetainfo(&img);
+      dpimetainfo.saveMetaInfo(dpiInput, settings);
+      res.extraResults[dpi] = img;
+    }
+  }
+
   if ( settings.wantPDF && !has_userscript_output(us_outputs, "pdf") && !our_skipfmts.contains("pdf") ) {
 
     ASSERT_HAVE_FORMATS_FOR("pdf") ;
@@ -1600,6 +1722,38 @@ static void replace_svg_width_or_height(QByteArray *svgdata, const char * attreq
 
   svgdata->replace(i, j-i, buffer);
 }
+
+
+static QStringList gs_png_argv(const KLFBackend::klfSettings& settings, const KLFBackend::klfInput& in,
+                               int dpi, const QString& outFile)
+{
+  QStringList argv;
+  argv << settings.gsexec
+       << "-dNOPAUSE" << "-dSAFER" << "-dTextAlphaBits=4" << "-dGraphicsAlphaBits=4"
+       << "-r"+QString::number(dpi) << "-dEPSCrop" << "-dMaxBitmap=2147483647";
+  if (qAlpha(in.bg_color) > 0) { // we're forcing a background color
+    argv << "-sDEVICE=png16m";
+  } else {
+    argv << "-sDEVICE=pngalpha";
+  }
+  argv << "-sOutputFile="+QDir::toNativeSeparators(outFile) << "-q" << "-dBATCH" << "-";
+  return argv;
+}
+
+static QImage image_scaled_to_dpi(const QImage& image, int imageDpi, int dpi)
+{
+  QSize size(qMax(1, qRound((double)image.width() * dpi / imageDpi)),
+             qMax(1, qRound((double)image.height() * dpi / imageDpi)));
+
+  // Qt's smooth transformation averages the source pixels when downsampling. Do this on
+  // premultiplied colors, so that fully transparent pixels don't bleed into the edges.
+  if (image.hasAlphaChannel()) {
+    return image.convertToFormat(QImage::Format_ARGB32_Premultiplied)
+      .scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation)
+      .convertToFormat(QImage::Format_ARGB32);
+  }
+  return image.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+}
    
 
 
@@ -1637,7 +1791,8 @@ KLF_EXPORT bool operator==(const KLFBackend::klfSettings& a, const KLFBackend::k
     a.wantPDF == b.wantPDF &&
     a.wantSVG == b.wantSVG &&
     a.execenv == b.execenv &&
-    a.templateGenerator == b.templateGenerator ;
+    a.templateGenerator == b.templateGenerator &&
+    a.extraRasterDpis == b.extraRasterDpis ;
 }
 
 
@@ -1688,40 +1843,86 @@ QStringList KLFBackend::availableSaveFormats(const klfOutput& klfoutput)
   return formats;
 }
 
-bool KLFBackend::saveOutputToDevice(const klfOutput& klfoutput, QIODevice *device,
-				    const QString& fmt, QString *errorStringPtr)
+// static
+QString KLFBackend::EncodedDataStore::makeKey(const QString& format, int dpi, const QVariantMap& params)
+{
+  QString key = format.trimmed().toUpper() + QLatin1Char('@') + QString::number(dpi);
+  for (QVariantMap::const_iterator it = params.constBegin(); it != params.constEnd(); ++it) {
+    key += QLatin1Char(';') + it.key() + QLatin1Char('=') + it.value().toString();
+  }
+  return key;
+}
+
+bool KLFBackend::EncodedDataStore::contains(const QString& key) const
+{
+  QMutexLocker lock(&pMutex);
+  return pData.contains(key);
+}
+
+QByteArray KLFBackend::EncodedDataStore::value(const QString& key) const
+{
+  QMutexLocker lock(&pMutex);
+  return pData.value(key);
+}
+
+void KLFBackend::EncodedDataStore::insert(const QString& key, const QByteArray& data)
+{
+  QMutexLocker lock(&pMutex);
+  pData[key] = data;
+}
+
+
+/** \internal
+ * Returns the data of \c klfoutput in \c format (in upper case) if the output holds it, or NULL if
+ * \c format is another image format, which is encoded from \ref KLFBackend::klfOutput::result. */
+static const QByteArray * klf_output_data_for_format(const KLFBackend::klfOutput& klfoutput,
+						     const QString& format)
+{
+  if (format == "PNG")
+    return &klfoutput.pngdata;
+  if (format == "EPS" || format == "PS")
+    return &klfoutput.epsdata;
+  if (format == "DVI")
+    return &klfoutput.dvidata;
+  if (format == "PDF")
+    return &klfoutput.pdfdata;
+  if (format == "SVG")
+    return &klfoutput.svgdata;
+  return NULL;
+}
+
+bool KLFBackend::getOutputData(const klfOutput& klfoutput, const QString& fmt, QByteArray *data,
+                               QString *errorStringPtr)
 {
   QString format = fmt.trimmed().toUpper();
 
-  // now choose correct data source and write to fout
-  if (format == "PNG") {
-    device->write(klfoutput.pngdata);
-  } else if (format == "EPS" || format == "PS") {
-    device->write(klfoutput.epsdata);
-  } else if (format == "DVI") {
-    device->write(klfoutput.dvidata);
-  } else if (format == "PDF") {
-    if (klfoutput.pdfdata.isEmpty()) {
-      QString error = QObject::tr("PDF format is not available!",
-				  "KLFBackend::saveOutputToFile");
+  // now choose correct data source
+  const QByteArray *outputdata = klf_output_data_for_format(klfoutput, format);
+  if (outputdata != NULL) {
+    if (outputdata->isEmpty() && (format == "PDF" || format == "SVG")) {
+      QString error = (format == "PDF")
+	? QObject::tr("PDF format is not available!", "KLFBackend::saveOutputToFile")
+	: QObject::tr("SVG format is not available!", "KLFBackend::saveOutputToFile");
       qWarning("%s", qPrintable(error));
       if (errorStringPtr != NULL)
 	errorStringPtr->operator=(error);
       return false;
     }
-    device->write(klfoutput.pdfdata);
-  } else if (format == "SVG") {
-    if (klfoutput.svgdata.isEmpty()) {
-      QString error = QObject::tr("SVG format is not available!",
-				  "KLFBackend::saveOutputToFile");
-      qWarning("%s", qPrintable(error));
-      if (errorStringPtr != NULL)
-	errorStringPtr->operator=(error);
-      return false;
+    *data = *outputdata;
+  } else {
+    // another image format, which we encode from the result image once for all the
+    // copies of this output
+    const QString key = EncodedDataStore::makeKey(format, klfoutput.input.dpi);
+    if (klfoutput.encodedData != NULL && klfoutput.encodedData->contains(key)) {
+      *data = klfoutput.encodedData->value(key);
+      return true;
+    }
+    QByteArray imgdata;
+    bool res;
+    { QBuffer buf(&imgdata);
+      buf.open(QIODevice::WriteOnly);
+      res = klfoutput.result.save(&buf, format.toLatin1());
     }
-    device->write(klfoutput.svgdata);
- } else {
-    bool res = klfoutput.result.save(device, format.toLatin1());
     if ( ! res ) {
       QString errstr = QObject::tr("Unable to save image in format `%1'!",
 				   "KLFBackend::saveOutputToDevice").arg(format);
@@ -1730,11 +1931,85 @@ bool KLFBackend::saveOutputToDevice(const klfOutput& klfoutput, QIODevice *devic
 	*errorStringPtr = errstr;
       return false;
     }
+    if (klfoutput.encodedData != NULL) {
+      klfoutput.encodedData->insert(key, imgdata);
+    }
+    *data = imgdata;
   }
 
   return true;
 }
 
+// static
+QImage KLFBackend::getResultForDpi(const klfOutput& klfoutput, int dpi)
+{
+  if (dpi <= 0 || dpi == klfoutput.input.dpi || klfoutput.input.dpi <= 0 || klfoutput.result.isNull()) {
+    return klfoutput.result;
+  }
+  if (klfoutput.extraResults.contains(dpi)) {
+    return klfoutput.extraResults.value(dpi);
+  }
+  QImage img = image_scaled_to_dpi(klfoutput.result, klfoutput.input.dpi, dpi);
+  foreach (const QString& key, klfoutput.result.textKeys()) {
+    img.setText(key, klfoutput.result.text(key));
+  }
+  return img;
+}
+
+/** Result images with more raw pixel data than this (in bytes) are encoded directly into the
+ * device instead of being encoded in memory and remembered in klfOutput::encodedData */
+static const qint64 klf_stream_image_min_size = 32*1024*1024;
+
+static bool write_data_to_device(QIODevice *device, const QByteArray& data, QString *errorStringPtr)
+{
+  if (device->write(data) != data.size()) {
+    QString errstr = QObject::tr("Unable to write data: %1",
+				 "KLFBackend::saveOutputToDevice").arg(device->errorString());
+    qWarning("%s", qPrintable(errstr));
+    if (errorStringPtr != NULL)
+      *errorStringPtr = errstr;
+    return false;
+  }
+  return true;
+}
+
+bool KLFBackend::saveOutputToDevice(const klfOutput& klfoutput, QIODevice *device,
+				    const QString& fmt, QString *errorStringPtr)
+{
+  QString format = fmt.trimmed().toUpper();
+
+  if (klf_output_data_for_format(klfoutput, format) == NULL && !device->isSequential()) {
+    // an image format encoded from the result image. Unless we already have the data, encode
+    // huge images directly into the device, so as not to hold the whole encoded data in memory
+    // in addition to the image. Some image writers seek back in the device, so only do this
+    // with random-access devices.
+    const QString key = EncodedDataStore::makeKey(format, klfoutput.input.dpi);
+    bool haveData = (klfoutput.encodedData != NULL && klfoutput.encodedData->contains(key));
+    qint64 imageSize = (qint64)klfoutput.result.bytesPerLine() * klfoutput.result.height();
+    if (!haveData && imageSize > klf_stream_image_min_size) {
+      klfDbg("encoding "<<imageSize<<" bytes image in format "<<format<<" directly into the device") ;
+      QImageWriter writer(device, format.toLatin1());
+      if ( ! writer.write(klfoutput.result) ) {
+	QString errstr = QObject::tr("Unable to save image in format `%1'! %2",
+				     "KLFBackend::saveOutputToDevice").arg(format).arg(writer.errorString());
+	qWarning("%s", qPrintable(errstr));
+	if (errorStringPtr != NULL)
+	  *errorStringPtr = errstr;
+	return false;
+      }
+      return true;
+    }
+  }
+
+  // the data is shared with the output object, write it out without copying it
+  QByteArray data;
+  if ( ! getOutputData(klfoutput, format, &data, errorStringPtr) ) {
+    return false;
+  }
+
+  return write_data_to_device(device, data, errorStringPtr);
+}
+
 bool KLFBackend::saveOutputToFile(const klfOutput& klfoutput, const QString& fileName,
 				  const QString& fmt, QString *errorStringPtr)
 {
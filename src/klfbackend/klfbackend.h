@@ -31,6 +31,8 @@
 #include <QMutex>
 #include <QMap>
 #include <QVariant>
+#include <QHash>
+#include <QSharedPointer>
 
 #include <klfdefs.h>
 #include <klfpobj.h>
@@ -298,6 +300,16 @@ public:
      *  corresponding interpreter (e.g. "/usr/bin/python")
      */
     QMap<QString,QString> userScriptInterpreters;
+
+    /** Additional resolutions, in dots per inch, at which the PNG stage should provide the
+     * resulting image, e.g. twice \ref klfInput::dpi for high-DPI screens. The images are
+     * stored in \ref klfOutput::extraResults.
+     *
+     * The equation is rasterized only once more, at the highest of these resolutions if it is
+     * higher than \ref klfInput::dpi, and all other variants are downsampled from that image
+     * or from \ref klfOutput::result. This is much cheaper than calling getLatexFormula()
+     * again for each resolution. Empty by default. */
+    QList<int> extraRasterDpis;
   };
 
   //! Specific input to KLFBackend::getLatexFormula()
@@ -364,11 +376,53 @@ public:
     QMap<QString,QString> userScriptParam;
   };
 
+  /** \brief Encoded data shared between all copies of a \ref klfOutput
+   *
+   * Stores the data which was encoded from an output (e.g. the result image saved in a
+   * format which latex and ghostscript don't produce directly, or rescaled to another
+   * DPI), so that each encoding is only produced once. Since copies of a \ref klfOutput
+   * share the same store, and since QByteArray is implicitly shared, consumers of the same
+   * output (clipboard, exporters, ...) all read the same bytes without copying them.
+   *
+   * Keys are built with \ref makeKey(). This class is thread-safe.
+   */
+  class KLF_EXPORT EncodedDataStore
+  {
+  public:
+    EncodedDataStore() { }
+
+    /** \brief A key identifying the given encoding
+     *
+     * \c format is case-insensitive. \c params may hold further encoding parameters (they
+     * must be convertible to strings).
+     */
+    static QString makeKey(const QString& format, int dpi, const QVariantMap& params = QVariantMap());
+
+    //! Returns TRUE if data was stored for \c key
+    bool contains(const QString& key) const;
+    //! The data stored for \c key, or a null QByteArray if none
+    QByteArray value(const QString& key) const;
+    //! Store \c data for \c key (any existing data for that key is replaced)
+    void insert(const QString& key, const QByteArray& data);
+
+  private:
+    mutable QMutex pMutex;
+    QHash<QString,QByteArray> pData;
+
+    Q_DISABLE_COPY(EncodedDataStore)
+  };
+
   //! KLFBackend::getLatexFormula() result
   /** This struct contains data that is returned from getLatexFormula(). This includes error handling
    * information, the resulting image (as a QImage) as well as data for PNG, (E)PS and PDF files */
   struct klfOutput
   {
+    /** A default constructor, which creates an empty store for \ref encodedData */
+    klfOutput()
+      : status(KLFERR_NOERROR), width_pt(0), height_pt(0), encodedData(new EncodedDataStore)
+    {
+    }
+
     /** \brief A code describing the status of the request.
      *
      * A zero value means success for everything. A positive value means that a program (latex, dvips,
@@ -391,6 +445,11 @@ public:
 
     /** \brief The actual resulting image. */
     QImage result;
+    /** \brief The resulting image at the additional resolutions requested in
+     * \ref klfSettings::extraRasterDpis, indexed by DPI
+     *
+     * See also \ref getResultForDpi(). */
+    QMap<int,QImage> extraResults;
 
     /** \brief The input parameters used to generate this output */
     klfInput input;
@@ -451,6 +510,12 @@ public:
     double width_pt;
     /** \brief Width in points of the resulting equation */
     double height_pt;
+
+    /** \brief Data encoded from this output, shared with all copies of this object
+     *
+     * See \ref EncodedDataStore. The data is produced from the fields above, so do not
+     * modify them after the store was filled (assign a new store if you really need to). */
+    QSharedPointer<EncodedDataStore> encodedData;
   };
 
   /** \brief The function that processes everything.
@@ -572,10 +637,37 @@ public:
    *
    * Overloaded function, provided for convenience. Behaves very much like \ref saveOutputToFile(),
    * except that the format cannot be guessed.
+   *
+   * The data is written without being copied, and write errors are reported. Very large result
+   * images that need to be encoded to another image format are encoded directly into \c device
+   * (if it is not sequential), and the encoded data is then not remembered in
+   * klfOutput::encodedData. This saves keeping a copy of the encoded data, but the result image
+   * itself is held in memory in any case.
    */
   static bool saveOutputToDevice(const klfOutput& output, QIODevice *device,
 				 const QString& format = QString("PNG"), QString* errorString = NULL);
 
+  /** \brief Get the output data in the given format
+   *
+   * Stores the data for \c format into \c data, and returns TRUE, or returns FALSE and sets
+   * \c errorString (if non-NULL) if the format is not available.
+   *
+   * The data is not copied: formats produced directly by latex and ghostscript (PNG, PS,
+   * EPS, DVI, PDF, SVG) are shared with the corresponding fields of \c output, and other
+   * image formats are encoded from the result image only once and then shared through
+   * klfOutput::encodedData.
+   */
+  static bool getOutputData(const klfOutput& output, const QString& format, QByteArray *data,
+                            QString* errorString = NULL);
+
+  /** \brief Get the resulting image at the given resolution
+   *
+   * Returns \ref klfOutput::result if \c dpi is the resolution of the output (or is not
+   * positive), the corresponding image in \ref klfOutput::extraResults if it was rendered,
+   * and otherwise \ref klfOutput::result rescaled to the given resolution.
+   */
+  static QImage getResultForDpi(const klfOutput& output, int dpi);
+
   /** \brief Detects the system settings and stores the guessed values in \c settings.
    *
    * This function tries to find the latex, dvips, gs, and epstopdf in standard locations on the
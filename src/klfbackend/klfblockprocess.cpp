@@ -134,7 +134,7 @@ bool KLFBlockProcess::startProcess(QStringList cmd, QStringList env)
   return startProcess(cmd, QByteArray(), env);
 }
 
-bool KLFBlockProcess::startProcess(QStringList cmd, QByteArray stdindata, QStringList env)
+bool KLFBlockProcess::startProcessNoWait(QStringList cmd, QByteArray stdindata, QStringList env)
 {
   KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
 
@@ -181,6 +181,17 @@ bool KLFBlockProcess::startProcess(QStringList cmd, QByteArray stdindata, QStrin
 
   klfDbg("wrote input data (size="<<stdindata.size()<<")") ;
 
+  return true;
+}
+
+bool KLFBlockProcess::startProcess(QStringList cmd, QByteArray stdindata, QStringList env)
+{
+  KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
+
+  if ( ! startProcessNoWait(cmd, stdindata, env) ) {
+    return false;
+  }
+
   if (mProcessAppEvents) {
     klfDbg("letting current thread (="<<QThread::currentThread()<<") process events ...") ;
     while (_runstatus == 0) {
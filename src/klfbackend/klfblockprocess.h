@@ -124,6 +124,14 @@ public slots:
    * anything to it. */
   bool startProcess(QStringList cmd, QStringList env = QStringList());
 
+  /** Same as startProcess(), but returns as soon as the process was started and was given
+   * its stdin data, without waiting for it to finish. Listen to the QProcess::finished()
+   * signal to know when the process has finished.
+   *
+   * \returns TRUE if the process was started, FALSE otherwise.
+   */
+  bool startProcessNoWait(QStringList cmd, QByteArray stdindata, QStringList env = QStringList());
+
   /** Same as getAllStderr(), except result is returned here as QString. */
   QString readStderrString() {
     return QString::fromLocal8Bit(getAllStderr());
@@ -127,6 +127,13 @@ struct KLFFilterProcessPrivate {
 
   int res;
   QString resErrorString;
+
+  //! Prepare \a proc to run our program
+  void setupProcess(KLFBlockProcess *proc);
+  //! Set the result to \ref KLFFP_NOSTART
+  void setNoStartError();
+  //! Check how \a proc exited, and collect its output into \a outdatalist
+  bool collectResults(KLFBlockProcess *proc, const QMap<QString, QByteArray*>& outdatalist);
 };
 
 // ---------
@@ -313,49 +320,98 @@ bool KLFFilterProcess::do_run(const QByteArray& indata, const QMap<QString, QByt
 
   KLFFilterProcessBlockProcess proc(this);
 
-  d->exitCode = 0;
-  d->exitStatus = 0;
-
   KLF_ASSERT_CONDITION(d->argv.size() > 0, "argv array is empty! No program is given!", return false; ) ;
-  
-  proc.setWorkingDirectory(d->programCwd);
 
-  proc.setProcessAppEvents(d->processAppEvents);
+  d->setupProcess(&proc);
 
-  klfDbg("about to exec "<<d->progTitle<<" ...") ;
-  klfDbg("\t"<<qPrintable(d->argv.join(" "))) ;
   bool r = proc.startProcess(d->argv, indata, d->execEnviron);
   klfDbg(d->progTitle<<" returned.") ;
 
   if (!r) {
-    klfDbg("couldn't launch " << d->progTitle) ;
-    d->res = KLFFP_NOSTART;
-    d->resErrorString = QObject::tr("Unable to start %1 program `%2'!", "KLFBackend").arg(d->progTitle, d->argv[0]);
+    d->setNoStartError();
     return false;
   }
-  if (!proc.processNormalExit()) {
-    klfDbg(d->progTitle<<" did not exit normally (crashed)") ;
-    d->exitStatus = proc.exitStatus();
-    d->exitCode = -1;
-    d->res = KLFFP_NOEXIT;
-    d->resErrorString = QObject::tr("Program %1 crashed!", "KLFBackend").arg(d->progTitle);
+
+  return d->collectResults(&proc, outdatalist);
+}
+
+KLFBlockProcess * KLFFilterProcess::startRun(const QByteArray& indata)
+{
+  KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
+
+  KLF_ASSERT_CONDITION(d->argv.size() > 0, "argv array is empty! No program is given!", return NULL; ) ;
+
+  KLFFilterProcessBlockProcess * proc = new KLFFilterProcessBlockProcess(this);
+  d->setupProcess(proc);
+
+  if ( ! proc->startProcessNoWait(d->argv, indata, d->execEnviron) ) {
+    delete proc;
+    d->setNoStartError();
+    return NULL;
+  }
+
+  return proc;
+}
+
+bool KLFFilterProcess::finishRun(KLFBlockProcess *process, const QMap<QString, QByteArray*> outdatalist)
+{
+  return do_finish_run(process, outdatalist);
+}
+
+bool KLFFilterProcess::do_finish_run(KLFBlockProcess *process, const QMap<QString, QByteArray*> outdatalist)
+{
+  KLF_ASSERT_NOT_NULL(process, "Given NULL process!", return false; ) ;
+
+  klfDbg(d->progTitle<<" finished.") ;
+  return d->collectResults(process, outdatalist);
+}
+
+
+void KLFFilterProcessPrivate::setupProcess(KLFBlockProcess *proc)
+{
+  exitCode = 0;
+  exitStatus = 0;
+
+  proc->setWorkingDirectory(programCwd);
+
+  proc->setProcessAppEvents(processAppEvents);
+
+  klfDbg("about to exec "<<progTitle<<" ...") ;
+  klfDbg("\t"<<qPrintable(argv.join(" "))) ;
+}
+
+void KLFFilterProcessPrivate::setNoStartError()
+{
+  klfDbg("couldn't launch " << progTitle) ;
+  res = KLFFP_NOSTART;
+  resErrorString = QObject::tr("Unable to start %1 program `%2'!", "KLFBackend").arg(progTitle, argv[0]);
+}
+
+bool KLFFilterProcessPrivate::collectResults(KLFBlockProcess *proc, const QMap<QString, QByteArray*>& outdatalist)
+{
+  if (!proc->processNormalExit()) {
+    klfDbg(progTitle<<" did not exit normally (crashed)") ;
+    exitStatus = proc->exitStatus();
+    exitCode = -1;
+    res = KLFFP_NOEXIT;
+    resErrorString = QObject::tr("Program %1 crashed!", "KLFBackend").arg(progTitle);
     return false;
   }
-  if (proc.processExitStatus() != 0) {
-    d->exitStatus = 0;
-    d->exitCode = proc.processExitStatus();
-    klfDbg(d->progTitle<<" exited with code "<<d->exitCode) ;
-    d->res = KLFFP_NOSUCCESSEXIT;
-    d->resErrorString = progErrorMsg(d->progTitle, proc.processExitStatus(), proc.readStderrString(),
-				     proc.readStdoutString());
+  if (proc->processExitStatus() != 0) {
+    exitStatus = 0;
+    exitCode = proc->processExitStatus();
+    klfDbg(progTitle<<" exited with code "<<exitCode) ;
+    res = KLFFP_NOSUCCESSEXIT;
+    resErrorString = progErrorMsg(progTitle, proc->processExitStatus(), proc->readStderrString(),
+                                  proc->readStdoutString());
     return false;
   }
 
-  if (d->collectStdout != NULL) {
-    *d->collectStdout = proc.getAllStdout();
+  if (collectStdout != NULL) {
+    *collectStdout = proc->getAllStdout();
   }
-  if (d->collectStderr != NULL) {
-    *d->collectStderr = proc.getAllStderr();
+  if (collectStderr != NULL) {
+    *collectStderr = proc->getAllStderr();
   }
 
   for (QMap<QString,QByteArray*>::const_iterator it = outdatalist.begin(); it != outdatalist.end(); ++it) {
@@ -370,21 +426,21 @@ bool KLFFilterProcess::do_run(const QByteArray& indata, const QMap<QString, QByt
     if (outFileName.isEmpty()) {
       // empty outFileName means to use standard output
       *outdata = QByteArray();
-      if (d->outputStdout) {
-	QByteArray stdoutdata = (d->collectStdout != NULL) ? *d->collectStdout : proc.getAllStdout();
+      if (outputStdout) {
+	QByteArray stdoutdata = (collectStdout != NULL) ? *collectStdout : proc->getAllStdout();
 	*outdata += stdoutdata;
       }
-      if (d->outputStderr) {
-	QByteArray stderrdata = (d->collectStderr != NULL) ? *d->collectStderr : proc.getAllStderr();
+      if (outputStderr) {
+	QByteArray stderrdata = (collectStderr != NULL) ? *collectStderr : proc->getAllStderr();
 	*outdata += stderrdata;
       }
       if (outdata->isEmpty()) {
 	// no data
-	QString stderrstr = (!d->outputStderr) ? ("\n"+proc.readStderrString()) : QString();
-	klfDbg(d->progTitle<<" did not provide any data. Error message: "<<stderrstr);
-	d->res = KLFFP_NODATA;
-	d->resErrorString = QObject::tr("Program %1 did not provide any output data.", "KLFBackend")
-	  .arg(d->progTitle) + stderrstr;
+	QString stderrstr = (!outputStderr) ? ("\n"+proc->readStderrString()) : QString();
+	klfDbg(progTitle<<" did not provide any data. Error message: "<<stderrstr);
+	res = KLFFP_NODATA;
+	resErrorString = QObject::tr("Program %1 did not provide any output data.", "KLFBackend")
+	  .arg(progTitle) + stderrstr;
 	return false;
       }
       // read standard output to buffer, continue with other possible outputs
@@ -392,20 +448,19 @@ bool KLFFilterProcess::do_run(const QByteArray& indata, const QMap<QString, QByt
     }
 
     if (!QFile::exists(outFileName)) {
-      klfDbg("File "<<outFileName<<" did not appear after running "<<d->progTitle) ;
-      d->res = KLFFP_NODATA;
-      d->resErrorString = QObject::tr("Output file didn't appear after having called %1!", "KLFBackend")
-	.arg(d->progTitle);
+      klfDbg("File "<<outFileName<<" did not appear after running "<<progTitle) ;
+      res = KLFFP_NODATA;
+      resErrorString = QObject::tr("Output file didn't appear after having called %1!", "KLFBackend")
+	.arg(progTitle);
       return false;
     }
 
     // read output file into outdata
     QFile outfile(outFileName);
-    r = outfile.open(QIODevice::ReadOnly);
-    if ( ! r ) {
-      klfDbg("File "<<outFileName<<" cannot be read (after running "<<d->progTitle<<")") ;
-      d->res = KLFFP_DATAREADFAIL;
-      d->resErrorString = QObject::tr("Can't read file '%1'!\n", "KLFBackend").arg(outFileName);
+    if ( ! outfile.open(QIODevice::ReadOnly) ) {
+      klfDbg("File "<<outFileName<<" cannot be read (after running "<<progTitle<<")") ;
+      res = KLFFP_DATAREADFAIL;
+      resErrorString = QObject::tr("Can't read file '%1'!\n", "KLFBackend").arg(outFileName);
       return false;
     }
       
@@ -413,13 +468,13 @@ bool KLFFilterProcess::do_run(const QByteArray& indata, const QMap<QString, QByt
     klfDbg("Read file "<<outFileName<<", got data, length="<<outdata->size());
   }
 
-  klfDbg(d->progTitle<<" was successfully run and output successfully retrieved.") ;
+  klfDbg(progTitle<<" was successfully run and output successfully retrieved.") ;
 
   // all OK
-  d->exitStatus = 0;
-  d->exitCode = 0;
-  d->res = KLFFP_NOERR;
-  d->resErrorString = QString();
+  exitStatus = 0;
+  exitCode = 0;
+  res = KLFFP_NOERR;
+  resErrorString = QString();
 
   return true;
 }
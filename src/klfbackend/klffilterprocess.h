@@ -141,6 +141,26 @@ public:
     return do_run(indata, outdatalist);
   }
 
+  /** \brief Start the program without waiting for it to finish
+   *
+   * Returns the started process, or NULL if it could not be started (in which case \ref
+   * resultStatus() is \ref KLFFP_NOSTART). The caller takes ownership of the returned
+   * object. Connect to its QProcess::finished() signal, and call \ref finishRun() from
+   * there to check how the program exited and to collect its output. The process may be
+   * killed in the meantime to abort the run.
+   *
+   * \param indata a QByteArray to write into the program's standard input
+   */
+  KLFBlockProcess * startRun(const QByteArray& indata = QByteArray());
+
+  /** \brief Collect the output of a process started with \ref startRun()
+   *
+   * The process must have finished. The arguments and the return value have the same
+   * meaning as for run().
+   */
+  bool finishRun(KLFBlockProcess *process,
+                 const QMap<QString, QByteArray*> outdatalist = QMap<QString, QByteArray*>());
+
 protected:
 
   friend class KLFFilterProcessBlockProcess;
@@ -156,6 +176,13 @@ protected:
    */
   virtual bool do_run(const QByteArray& indata, const QMap<QString, QByteArray*> outdatalist);
 
+  /** \brief Collect the output of a process started with startRun()
+   *
+   * finishRun() internally just redirects to this function. Subclasses which reimplement
+   * do_run() for bookkeeping will usually want to reimplement this function as well.
+   */
+  virtual bool do_finish_run(KLFBlockProcess *process, const QMap<QString, QByteArray*> outdatalist);
+
   /** \brief The collected stdout data of the process that just ran.
    *
    * Convenience method for subclasses.  Stdout data collection must have been enabled
@@ -846,6 +846,9 @@ struct KLFUserScriptFilterProcessPrivate
 
   // log of user script output
   static QStringList log;
+
+  //! Append the output of the run which just finished to \ref log
+  void logRun();
 };
 
 // static
@@ -885,11 +888,24 @@ void KLFUserScriptFilterProcess::addUserScriptConfig(const QVariantMap& usconfig
 bool KLFUserScriptFilterProcess::do_run(const QByteArray& indata, const QMap<QString, QByteArray*> outdatalist)
 {
   bool ret = KLFFilterProcess::do_run(indata, outdatalist);
+  d->logRun();
+  return ret;
+}
+
+bool KLFUserScriptFilterProcess::do_finish_run(KLFBlockProcess *process,
+                                               const QMap<QString, QByteArray*> outdatalist)
+{
+  bool ret = KLFFilterProcess::do_finish_run(process, outdatalist);
+  d->logRun();
+  return ret;
+}
 
+void KLFUserScriptFilterProcessPrivate::logRun()
+{
   // for user script debugging
   QString thislog = QString::fromLatin1("<h1 class=\"userscript-run\">")
     + QObject::tr("Output from %1", "KLFUserScriptFilterProcess").arg(QLatin1String("<span class=\"userscriptname\">")
-                                                                      +d->usinfo->userScriptBaseName().toHtmlEscaped()
+                                                                      +usinfo->userScriptBaseName().toHtmlEscaped()
                                                                       +QLatin1String("</span>")) +
     QLatin1String("</h1>\n") +
     QLatin1String("<p class=\"userscript-run-datetime\">") +
@@ -897,7 +913,7 @@ bool KLFUserScriptFilterProcess::do_run(const QByteArray& indata, const QMap<QSt
     + QLatin1String("</p>") ;
   
   // error message, if any
-  QString errstr = resultErrorString();
+  QString errstr = K->resultErrorString();
   if (errstr.size()) {
     thislog += QString::fromLatin1("<div class=\"userscript-error\">%1</div>").arg(errstr); // errstr is already HTML
   }
@@ -905,23 +921,21 @@ bool KLFUserScriptFilterProcess::do_run(const QByteArray& indata, const QMap<QSt
   QString templ = QString::fromLatin1("<p><span class=\"output-type\">%1</span>\n"
                                       "<pre class=\"output\">%2</pre></p>\n") ;
 
-  QByteArray bstdout = collectedStdout();
+  QByteArray bstdout = K->collectedStdout();
   if (bstdout.size()) {
     thislog += templ.arg("STDOUT").arg(QString::fromLocal8Bit(bstdout).toHtmlEscaped());
   }
-  QByteArray bstderr = collectedStderr();
+  QByteArray bstderr = K->collectedStderr();
   if (bstderr.size()) {
     thislog += templ.arg("STDERR").arg(QString::fromLocal8Bit(bstderr).toHtmlEscaped());
   }
 
   // start discarding old logs after 255 entries
-  if (KLFUserScriptFilterProcessPrivate::log.size() > 255) {
-    KLFUserScriptFilterProcessPrivate::log.erase(KLFUserScriptFilterProcessPrivate::log.begin());
+  if (log.size() > 255) {
+    log.erase(log.begin());
   }
 
-  KLFUserScriptFilterProcessPrivate::log << thislog;
-
-  return ret;
+  log << thislog;
 }
 
 
@@ -225,6 +225,8 @@ protected:
    *
    */
   virtual bool do_run(const QByteArray& indata, const QMap<QString, QByteArray*> outdatalist);
+  /** Same book-keeping as do_run(), for runs started with \a startRun(). */
+  virtual bool do_finish_run(KLFBlockProcess *process, const QMap<QString, QByteArray*> outdatalist);
 
 private:
   KLF_DECLARE_PRIVATE(KLFUserScriptFilterProcess);
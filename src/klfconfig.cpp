@@ -360,6 +360,7 @@ void KLFConfig::loadDefaults()
   KLFCONFIGPROP_INIT(ExportData.oooExportScale, 1.6) ;
   KLFCONFIGPROP_INIT(ExportData.htmlExportDpi, 180);
   KLFCONFIGPROP_INIT(ExportData.htmlExportDisplayDpi, 180);
+  KLFCONFIGPROP_INIT(ExportData.tempFilesMaxSize, 200);
 
   KLFCONFIGPROP_INIT(SyntaxHighlighter.enabled, true) ;
   KLFCONFIGPROP_INIT(SyntaxHighlighter.highlightParensOnly, false) ;
@@ -423,6 +424,7 @@ void KLFConfig::loadDefaults()
   KLFCONFIGPROP_INIT(LibraryBrowser.treePreviewSizePercent, 75) ;
   KLFCONFIGPROP_INIT(LibraryBrowser.listPreviewSizePercent, 75) ;
   KLFCONFIGPROP_INIT(LibraryBrowser.iconPreviewSizePercent, 100) ;
+  KLFCONFIGPROP_INIT(LibraryBrowser.searchIgnoresAccents, false) ;
 
   // User Scripts
   UserScripts.userScriptConfig = QMap< QString, QMap<QString,QVariant> >() ;
@@ -622,6 +624,7 @@ int KLFConfig::readFromConfig_v2(const QString& fname)
   klf_config_read(s, "oooexportscale", &ExportData.oooExportScale);
   klf_config_read(s, "htmlexportdpi", &ExportData.htmlExportDpi);
   klf_config_read(s, "htmlexportdisplaydpi", &ExportData.htmlExportDisplayDpi);
+  klf_config_read(s, "tempfilesmaxsize", &ExportData.tempFilesMaxSize);
   s.endGroup();
 
   s.beginGroup("SyntaxHighlighter");
@@ -669,6 +672,7 @@ int KLFConfig::readFromConfig_v2(const QString& fname)
   klf_config_read(s, "treepreviewsizepercent", &LibraryBrowser.treePreviewSizePercent);
   klf_config_read(s, "listpreviewsizepercent", &LibraryBrowser.listPreviewSizePercent);
   klf_config_read(s, "iconpreviewsizepercent", &LibraryBrowser.iconPreviewSizePercent);
+  klf_config_read(s, "searchignoresaccents", &LibraryBrowser.searchIgnoresAccents);
   s.endGroup();
 
   // Special treatment for UserScripts.userScriptConfig
@@ -785,6 +789,7 @@ int KLFConfig::writeToConfig()
   klf_config_write(s, "oooexportscale", &ExportData.oooExportScale);
   klf_config_write(s, "htmlexportdpi", &ExportData.htmlExportDpi);
   klf_config_write(s, "htmlexportdisplaydpi", &ExportData.htmlExportDisplayDpi);
+  klf_config_write(s, "tempfilesmaxsize", &ExportData.tempFilesMaxSize);
   s.endGroup();
 
   s.beginGroup("SyntaxHighlighter");
@@ -831,6 +836,7 @@ int KLFConfig::writeToConfig()
   klf_config_write(s, "treepreviewsizepercent", &LibraryBrowser.treePreviewSizePercent);
   klf_config_write(s, "listpreviewsizepercent", &LibraryBrowser.listPreviewSizePercent);
   klf_config_write(s, "iconpreviewsizepercent", &LibraryBrowser.iconPreviewSizePercent);
+  klf_config_write(s, "searchignoresaccents", &LibraryBrowser.searchIgnoresAccents);
   s.endGroup();
 
   // // Special treatment for Plugins.pluginConfig
@@ -303,6 +303,8 @@ public:
     KLFConfigProp<double> oooExportScale;
     KLFConfigProp<int> htmlExportDpi;
     KLFConfigProp<int> htmlExportDisplayDpi;
+    /** Disk budget for the temporary files referred to by copied or dragged data, in MB */
+    KLFConfigProp<int> tempFilesMaxSize;
 
   } ExportData;
 
@@ -358,6 +360,8 @@ public:
     KLFConfigProp<int> listPreviewSizePercent;
     KLFConfigProp<int> iconPreviewSizePercent;
 
+    KLFConfigProp<bool> searchIgnoresAccents;
+
   } LibraryBrowser;
 
   // struct {
@@ -24,6 +24,14 @@
 
 #include <QVariant>
 #include <QVariantList>
+#include <QHash>
+#include <QMultiMap>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QDateTime>
+#include <QCryptographicHash>
 
 #include <klfdefs.h>
 
@@ -87,6 +95,294 @@ KLFExporterManager * KLFExporter::getExporterManager() const
   return d->exporterManager;
 }
 
+KLFExporterJob * KLFExporter::getDataAsync(const QString& format, const KLFBackend::klfOutput& klfoutput,
+                                           const QVariantMap& param)
+{
+  KLFExporterJob * job = new KLFExporterJob(this, format, klfoutput, param);
+  job->start();
+  return job;
+}
+
+
+// =============================================================================
+
+
+struct KLFExporterJobPrivate
+{
+  KLF_PRIVATE_HEAD(KLFExporterJob)
+  {
+    exporter = NULL;
+    started = false;
+    finished = false;
+    canceled = false;
+    cancelFlag = QSharedPointer<QAtomicInt>(new QAtomicInt(0));
+  }
+
+  KLFExporter * exporter;
+  QString format;
+  KLFBackend::klfOutput output;
+  QVariantMap params;
+
+  bool started;
+  bool finished;
+  bool canceled;
+
+  QByteArray data;
+  QString errorString;
+
+  //! Shared with the KLFExporterJobTask, which may outlive us
+  QSharedPointer<QAtomicInt> cancelFlag;
+};
+
+KLFExporterJob::KLFExporterJob(KLFExporter *exporter, const QString& format,
+                               const KLFBackend::klfOutput& output, const QVariantMap& params,
+                               QObject *parent)
+  : QObject(parent)
+{
+  KLF_INIT_PRIVATE(KLFExporterJob) ;
+
+  d->exporter = exporter;
+  d->format = format;
+  d->output = output;
+  d->params = params;
+}
+
+KLFExporterJob::~KLFExporterJob()
+{
+  // don't bother running a task that is still pending
+  d->cancelFlag->storeRelease(1);
+
+  KLF_DELETE_PRIVATE ;
+}
+
+KLFExporter * KLFExporterJob::exporter() const
+{
+  return d->exporter;
+}
+QString KLFExporterJob::format() const
+{
+  return d->format;
+}
+QVariantMap KLFExporterJob::params() const
+{
+  return d->params;
+}
+const KLFBackend::klfOutput& KLFExporterJob::output() const
+{
+  return d->output;
+}
+
+bool KLFExporterJob::isRunning() const
+{
+  return d->started && !d->finished;
+}
+bool KLFExporterJob::isFinished() const
+{
+  return d->finished;
+}
+bool KLFExporterJob::isCanceled() const
+{
+  return d->canceled;
+}
+bool KLFExporterJob::isSuccessful() const
+{
+  return d->finished && !d->canceled && !d->data.isEmpty();
+}
+
+QByteArray KLFExporterJob::data() const
+{
+  return d->data;
+}
+QString KLFExporterJob::errorString() const
+{
+  return d->errorString;
+}
+
+bool KLFExporterJob::waitForFinished(QEventLoop::ProcessEventsFlags flags)
+{
+  if (!d->started) {
+    start();
+  }
+  if (!d->finished) {
+    // finished() is emitted from the event loop only, so quit() can't be called before exec().
+    QEventLoop loop;
+    connect(this, SIGNAL(finished(bool)), &loop, SLOT(quit()));
+    loop.exec(flags);
+  }
+  return isSuccessful();
+}
+
+void KLFExporterJob::start()
+{
+  if (d->started) {
+    return;
+  }
+  d->started = true;
+
+  startExport();
+}
+
+void KLFExporterJob::startExport()
+{
+  KLF_ASSERT_NOT_NULL( d->exporter, "Exporter is NULL!",
+                       QMetaObject::invokeMethod(this, "setResult", Qt::QueuedConnection,
+                                                 Q_ARG(QByteArray, QByteArray()),
+                                                 Q_ARG(QString, tr("No exporter was given.")));
+                       return ; ) ;
+
+  const QString key = klf_exporter_memo_key(d->exporter, d->format, d->output, d->params);
+  if (!key.isNull() && d->output.encodedData->contains(key)) {
+    klfDbg("have memoized data for "<<key) ;
+    QMetaObject::invokeMethod(this, "setResult", Qt::QueuedConnection,
+                              Q_ARG(QByteArray, d->output.encodedData->value(key)),
+                              Q_ARG(QString, QString()));
+    return;
+  }
+
+  KLFExporterJobTask * task = new KLFExporterJobTask(d->exporter, d->format, d->output, d->params,
+                                                     d->cancelFlag);
+  connect(task, SIGNAL(done(const QByteArray&, const QString&)),
+          this, SLOT(setResult(const QByteArray&, const QString&)));
+
+  KLFExporterManager * exporterManager = d->exporter->getExporterManager();
+  if (exporterManager != NULL && d->exporter->canExportInWorkerThread()) {
+    klfDbg("exporting "<<d->format<<" in the worker pool") ;
+    exporterManager->workerPool()->start(task);
+  } else {
+    klfDbg("exporting "<<d->format<<" from the event loop") ;
+    QMetaObject::invokeMethod(task, "runInThisThread", Qt::QueuedConnection);
+  }
+}
+
+void KLFExporterJob::cancel()
+{
+  if (d->finished) {
+    return;
+  }
+  klfDbg("canceling export of "<<d->format) ;
+  cancelExport();
+  d->canceled = true;
+  d->finished = true;
+  d->errorString = tr("The export was canceled.");
+  emit finished(false);
+}
+
+void KLFExporterJob::cancelExport()
+{
+  d->cancelFlag->storeRelease(1);
+}
+
+void KLFExporterJob::setResult(const QByteArray& data, const QString& errorString)
+{
+  if (d->finished) {
+    return;
+  }
+  d->finished = true;
+  d->data = data;
+  d->errorString = errorString;
+  if (data.isEmpty() && errorString.isEmpty()) {
+    d->errorString = tr("No data was exported.");
+  }
+  emit finished(!data.isEmpty());
+}
+
+
+// =============================================================================
+
+KLFExporterJob * KLFUserScriptExporter::getDataAsync(const QString& format, const KLFBackend::klfOutput& klfoutput,
+                                                     const QVariantMap& params)
+{
+  KLFExporterJob * job = new KLFUserScriptExporterJob(this, format, klfoutput, params);
+  job->start();
+  return job;
+}
+
+KLFUserScriptExporterJob::KLFUserScriptExporterJob(KLFUserScriptExporter *exporter, const QString& format,
+                                                   const KLFBackend::klfOutput& output,
+                                                   const QVariantMap& params)
+  : KLFExporterJob(exporter, format, output, params), pUserScriptExporter(exporter), pProcess(NULL)
+{
+}
+
+KLFUserScriptExporterJob::~KLFUserScriptExporterJob()
+{
+  killProcess();
+}
+
+void KLFUserScriptExporterJob::startExport()
+{
+  KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
+
+  KLFExporterManager * exporterManager = pUserScriptExporter->getExporterManager();
+  QMutexLocker lock(exporterManager != NULL ? exporterManager->exporterMutex(pUserScriptExporter) : NULL);
+
+  // the script's input data is obtained from other exporters right away
+  pRun.reset(pUserScriptExporter->prepareRun(format(), output(), params()));
+  if (!pRun.isNull()) {
+    pProcess = pRun->process.startRun();
+  }
+  if (pProcess == NULL) {
+    if (!pRun.isNull()) {
+      // sets the error string
+      pUserScriptExporter->collectRun(pRun.data(), false);
+      pRun.reset();
+    }
+    QMetaObject::invokeMethod(this, "setResult", Qt::QueuedConnection,
+                              Q_ARG(QByteArray, QByteArray()),
+                              Q_ARG(QString, pUserScriptExporter->errorString()));
+    return;
+  }
+
+  pProcess->setParent(this);
+  connect(pProcess, SIGNAL(finished(int, QProcess::ExitStatus)), this, SLOT(processFinished()));
+}
+
+void KLFUserScriptExporterJob::cancelExport()
+{
+  killProcess();
+}
+
+void KLFUserScriptExporterJob::processFinished()
+{
+  KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
+
+  KLF_ASSERT_NOT_NULL(pProcess, "No process is running!", return; ) ;
+
+  KLFExporterManager * exporterManager = pUserScriptExporter->getExporterManager();
+  QMutexLocker lock(exporterManager != NULL ? exporterManager->exporterMutex(pUserScriptExporter) : NULL);
+
+  bool ok = pRun->process.finishRun(pProcess, pRun->outdatamap);
+  QByteArray data = pUserScriptExporter->collectRun(pRun.data(), ok);
+  QString errorString = ok ? QString() : pUserScriptExporter->errorString();
+
+  // we're called from one of its signals
+  pProcess->deleteLater();
+  pProcess = NULL;
+  pRun.reset();
+
+  lock.unlock();
+
+  setResult(data, errorString);
+}
+
+void KLFUserScriptExporterJob::killProcess()
+{
+  if (pProcess != NULL) {
+    klfDbg("killing user script process") ;
+    disconnect(pProcess, NULL, this, NULL);
+    pProcess->kill();
+    pProcess->waitForFinished(1000);
+    delete pProcess;
+    pProcess = NULL;
+  }
+  if (!pRun.isNull()) {
+    if (pRun->outfn.size() && QFile::exists(pRun->outfn)) {
+      QFile::remove(pRun->outfn);
+    }
+    pRun.reset();
+  }
+}
+
 
 // =============================================================================
 
@@ -109,6 +405,11 @@ struct KLFExporterManagerPrivate
   }
 
   QList<KLFExporter*> pExporters;
+
+  QMutex pExporterMutexesLock;
+  QHash<KLFExporter*, QMutex*> pExporterMutexes;
+
+  QThreadPool pWorkerPool;
 };
 
 KLFExporterManager::KLFExporterManager()
@@ -117,11 +418,15 @@ KLFExporterManager::KLFExporterManager()
 }
 KLFExporterManager::~KLFExporterManager()
 {
+  // tasks in the worker pool may still be using our exporters
+  d->pWorkerPool.waitForDone();
+
   foreach (KLFExporter * exporter, d->pExporters) {
     if (exporter != NULL) {
       delete exporter;
     }
   }
+  qDeleteAll(d->pExporterMutexes);
 
   KLF_DELETE_PRIVATE ;
 }
@@ -163,6 +468,22 @@ QList<KLFExporter*> KLFExporterManager::exporterList()
   return d->pExporters;
 }
 
+QMutex * KLFExporterManager::exporterMutex(KLFExporter * exporter) const
+{
+  QMutexLocker lock(&d->pExporterMutexesLock);
+  QMutex * mutex = d->pExporterMutexes.value(exporter, NULL);
+  if (mutex == NULL) {
+    mutex = new QMutex(QMutex::Recursive);
+    d->pExporterMutexes[exporter] = mutex;
+  }
+  return mutex;
+}
+
+QThreadPool * KLFExporterManager::workerPool()
+{
+  return &d->pWorkerPool;
+}
+
 
 
 bool KLFExporterManager::supportsExporterNameAndFormat(const QString & exporterName, const QString & format,
@@ -206,9 +527,25 @@ QByteArray KLFExporterManager::getDataByExporterNameAndFormat(const QString & ex
   if ( ! exporter->supports(format, output) ) {
     return QByteArray();
   }
+  QMutexLocker lock(exporterMutex(exporter));
   return exporter->getData(format, output, params);
 }
 
+KLFExporterJob * KLFExporterManager::getDataAsync(const QString & exporterName, const QString & format,
+                                                  const KLFBackend::klfOutput & output,
+                                                  const QVariantMap & params)
+{
+  KLFExporter * exporter = exporterByName(exporterName);
+  if (exporter == NULL) {
+    klfWarning("Can't find exporter name = " << exporterName << "!") ;
+    return NULL;
+  }
+  if ( ! exporter->supports(format, output) ) {
+    return NULL;
+  }
+  return exporter->getDataAsync(format, output, params);
+}
+
 QByteArray KLFExporterManager::getDataByExporterNamesAndFormats(const KLFExporterNameAndFormatList& exporterNamesAndFormats,
                                                                 const KLFBackend::klfOutput & output,
                                                                 const QVariantMap & params,
@@ -235,15 +572,218 @@ QByteArray KLFExporterManager::getDataByExporterNamesAndFormats(const KLFExporte
 
 
 // =============================================================================
-// =============================================================================
 
 
-// static members for specific exporters
+struct KLFTempArtifactStorePrivate
+{
+  KLF_PRIVATE_HEAD(KLFTempArtifactStore)
+  {
+    maxSize = 0;
+    scanned = false;
+    totalSize = 0;
+  }
+
+  //! Files handed out during this session less than this many seconds ago are never removed
+  enum { GracePeriodSecs = 3600 };
+
+  struct StoredFile {
+    StoredFile() : size(0), usedInSession(false) { }
+    qint64 size;
+    QDateTime lastUsed;
+    bool usedInSession;
+  };
+
+  QMutex mutex;
+
+  QString directory;
+  qint64 maxSize;
+
+  //! Whether \ref files was initialized from the contents of \ref directory
+  bool scanned;
+  //! Stored files, by file name (relative to \ref directory)
+  QHash<QString,StoredFile> files;
+  qint64 totalSize;
+
+  void scanDirectory();
+  void touch(const QString& fname);
+  void enforceBudget();
+};
+
+void KLFTempArtifactStorePrivate::scanDirectory()
+{
+  files.clear();
+  totalSize = 0;
+  QFileInfoList entries = QDir(directory).entryInfoList(QStringList() << "klf_*", QDir::Files);
+  foreach (const QFileInfo& fi, entries) {
+    StoredFile f;
+    f.size = fi.size();
+    f.lastUsed = fi.lastModified();
+    files[fi.fileName()] = f;
+    totalSize += f.size;
+  }
+  scanned = true;
+  klfDbg("found "<<files.size()<<" stored files in "<<directory<<", total size "<<totalSize) ;
+}
+
+void KLFTempArtifactStorePrivate::touch(const QString& fname)
+{
+  StoredFile & f = files[fname];
+  f.lastUsed = QDateTime::currentDateTime();
+  f.usedInSession = true;
+#if QT_VERSION >= 0x050a00
+  // so that the file is also known to be recently used in later sessions
+  QFile file(QDir(directory).absoluteFilePath(fname));
+  if (file.open(QIODevice::Append)) {
+    file.setFileTime(f.lastUsed, QFileDevice::FileModificationTime);
+  }
+#endif
+}
+
+void KLFTempArtifactStorePrivate::enforceBudget()
+{
+  if (maxSize <= 0 || totalSize <= maxSize) {
+    return;
+  }
+
+  const QDateTime now = QDateTime::currentDateTime();
+
+  QMultiMap<QDateTime,QString> byLastUsed;
+  QHash<QString,StoredFile>::const_iterator it;
+  for (it = files.constBegin(); it != files.constEnd(); ++it) {
+    byLastUsed.insert(it.value().lastUsed, it.key());
+  }
+
+  QDir dir(directory);
+  QMultiMap<QDateTime,QString>::const_iterator lit;
+  for (lit = byLastUsed.constBegin(); lit != byLastUsed.constEnd() && totalSize > maxSize; ++lit) {
+    const StoredFile f = files.value(lit.value());
+    if (f.usedInSession && f.lastUsed.secsTo(now) < GracePeriodSecs) {
+      continue;
+    }
+    if (!QFile::remove(dir.absoluteFilePath(lit.value())) && dir.exists(lit.value())) {
+      klfDbg("can't remove "<<lit.value()) ;
+      continue;
+    }
+    klfDbg("removed "<<lit.value()<<" ("<<f.size<<" bytes)") ;
+    totalSize -= f.size;
+    files.remove(lit.value());
+  }
+}
+
+
+KLFTempArtifactStore::KLFTempArtifactStore(const QString& directory, qint64 maxSize)
+{
+  KLF_INIT_PRIVATE(KLFTempArtifactStore) ;
+
+  d->directory = directory;
+  d->maxSize = maxSize;
+}
+
+KLFTempArtifactStore::~KLFTempArtifactStore()
+{
+  KLF_DELETE_PRIVATE ;
+}
+
+QString KLFTempArtifactStore::directory() const
+{
+  QMutexLocker lock(&d->mutex);
+  return d->directory;
+}
+qint64 KLFTempArtifactStore::maxSize() const
+{
+  QMutexLocker lock(&d->mutex);
+  return d->maxSize;
+}
+
+void KLFTempArtifactStore::setDirectory(const QString& directory)
+{
+  QMutexLocker lock(&d->mutex);
+  if (directory == d->directory) {
+    return;
+  }
+  d->directory = directory;
+  d->scanned = false;
+  d->files.clear();
+  d->totalSize = 0;
+}
+void KLFTempArtifactStore::setMaxSize(qint64 maxSize)
+{
+  QMutexLocker lock(&d->mutex);
+  d->maxSize = maxSize;
+}
+
+QString KLFTempArtifactStore::storeData(const QByteArray& data, const QString& extension)
+{
+  KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
+
+  if (data.isEmpty()) {
+    klfWarning("Refusing to store empty data") ;
+    return QString();
+  }
+
+  const QString fname = QLatin1String("klf_")
+    + QString::fromLatin1(QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex())
+    + QLatin1Char('.') + extension.toLower();
+
+  QMutexLocker lock(&d->mutex);
+
+  QDir dir(d->directory);
+  if (!dir.exists() && !dir.mkpath(QLatin1String("."))) {
+    klfWarning("Can't create temporary file directory " << d->directory) ;
+    return QString();
+  }
+  if (!d->scanned) {
+    d->scanDirectory();
+  }
 
+  const QString path = dir.absoluteFilePath(fname);
+
+  QFileInfo fi(path);
+  if (fi.exists() && fi.size() == data.size()) {
+    klfDbg("reusing stored file "<<path) ;
+    if (!d->files.contains(fname)) {
+      // written by another session meanwhile
+      d->files[fname].size = data.size();
+      d->totalSize += data.size();
+    }
+    d->touch(fname);
+    return path;
+  }
+
+  QSaveFile file(path);
+  if (!file.open(QIODevice::WriteOnly) || file.write(data) != data.size() || !file.commit()) {
+    klfWarning("Can't write temporary file " << path << ": " << file.errorString()) ;
+    return QString();
+  }
+
+  d->totalSize += data.size() - d->files.value(fname).size;
+  d->files[fname].size = data.size();
+  d->touch(fname);
+
+  klfDbg("Wrote temp file with name " << path) ;
+
+  d->enforceBudget();
+
+  return path;
+}
+
+void KLFTempArtifactStore::cleanUp()
+{
+  QMutexLocker lock(&d->mutex);
+  if (!d->scanned) {
+    d->scanDirectory();
+  }
+  d->enforceBudget();
+}
 
 // static
-QMap<QString,QMap<qint64,QString> > KLFTempFileUriExporter::tempFilesCache
-   = QMap<QString,QMap<qint64,QString> >();
+KLFTempArtifactStore * KLFTempArtifactStore::defaultStore()
+{
+  // set up from the settings once; KLFMainWin updates it when the settings change
+  static KLFTempArtifactStore store(klfconfig.BackendSettings.tempDir + QLatin1String("/klf-tempfiles"),
+                                    (qint64)klfconfig.ExportData.tempFilesMaxSize * 1024 * 1024);
+  return &store;
+}
 
 
 
@@ -34,6 +34,10 @@
 #include <QMimeData>
 #include <QTemporaryFile>
 #include <QTemporaryDir>
+#include <QMutex>
+#include <QThreadPool>
+#include <QObject>
+#include <QEventLoop>
 
 #include <klfdefs.h>
 #include <klfpobj.h>
@@ -42,6 +46,7 @@
 
 
 class KLFExporterManager;
+class KLFExporterJob;
 
 struct KLFExporterPrivate;
 
@@ -70,6 +75,32 @@ public:
    */
   virtual bool isSuitableForFileSave() const { return true; }
 
+  /** \brief Whether getData() may be called from a worker thread
+   *
+   * Exporters which only work on the given klf output, and which neither create objects
+   * living in the main thread nor rely on other exporters which might, can return TRUE
+   * here. Their data may then be prepared in the background (e.g. by \ref KLFMimeData).
+   *
+   * Calls to getData() must still be serialized, see \ref
+   * KLFExporterManager::exporterMutex().
+   *
+   * The default implementation returns FALSE.
+   */
+  virtual bool canExportInWorkerThread() const { return false; }
+
+  /** \brief Whether the exported data only depends on the klf output, the format and the
+   *         parameters
+   *
+   * Data exported by such exporters is memoized in the output's \ref
+   * KLFBackend::klfOutput::encodedData "encoded data store" and reused for later exports of
+   * the same output. Exporters whose result also depends on other state (e.g. configuration
+   * settings, or temporary files which may have been removed in the meantime) must return
+   * FALSE.
+   *
+   * The default implementation returns FALSE.
+   */
+  virtual bool isPureFunctionOfOutput() const { return false; }
+
   /** \brief List of formats this exporter can export to (e.g. "pdf", "svg", "eps", "png@150dpi")
    *
    * The format name can be chosen freely, and does not have to coincide with a mime type
@@ -116,6 +147,24 @@ public:
   virtual QByteArray getData(const QString& format, const KLFBackend::klfOutput& klfoutput,
                              const QVariantMap& param = QVariantMap()) = 0;
 
+  /** \brief Start getting the data corresponding to the given klf output in the background
+   *
+   * Returns a job which is already started, and which emits \ref KLFExporterJob::finished()
+   * once the data is available. The caller takes ownership of the returned job; deleting it
+   * cancels the export.
+   *
+   * The base implementation runs getData() in the exporter manager's \ref
+   * KLFExporterManager::workerPool() "worker pool" if \ref canExportInWorkerThread(), and
+   * otherwise from the event loop of the calling thread. If \ref isPureFunctionOfOutput(),
+   * successfully exported data is memoized in the output's \ref
+   * KLFBackend::klfOutput::encodedData "encoded data store".
+   * Subclasses which can do better (e.g. wait for an external process without blocking)
+   * may reimplement this function to return a KLFExporterJob subclass which reimplements
+   * \ref KLFExporterJob::startExport() and \ref KLFExporterJob::cancelExport().
+   */
+  virtual KLFExporterJob * getDataAsync(const QString& format, const KLFBackend::klfOutput& klfoutput,
+                                        const QVariantMap& param = QVariantMap());
+
 
   //! Returns an error string describing the last error.
   QString errorString() const;
@@ -151,6 +200,85 @@ private:
 };
 
 
+struct KLFExporterJobPrivate;
+
+//! A handle to data being exported in the background
+/** Objects of this class are returned by \ref KLFExporter::getDataAsync() and \ref
+ * KLFExporterManager::getDataAsync(). They live in the thread that requested the data, in
+ * which \ref finished() is emitted, always from the event loop.
+ */
+class KLF_EXPORT KLFExporterJob : public QObject
+{
+  Q_OBJECT
+public:
+  KLFExporterJob(KLFExporter *exporter, const QString& format, const KLFBackend::klfOutput& output,
+                 const QVariantMap& params = QVariantMap(), QObject *parent = NULL);
+  virtual ~KLFExporterJob();
+
+  KLFExporter * exporter() const;
+  QString format() const;
+  QVariantMap params() const;
+  const KLFBackend::klfOutput& output() const;
+
+  //! Whether the job was started and has not finished yet
+  bool isRunning() const;
+  //! Whether the job has finished, successfully or not
+  bool isFinished() const;
+  //! Whether \ref cancel() was called before the job finished
+  bool isCanceled() const;
+  //! Whether the job has finished and provided non-empty data
+  bool isSuccessful() const;
+
+  //! The exported data, once the job has finished
+  QByteArray data() const;
+  //! A description of the error, if the job finished unsuccessfully
+  QString errorString() const;
+
+  //! Waits until the job has finished
+  /** Starts the job if needed, and runs a local event loop with the given \c flags until the
+   * job has finished. Only allow user input events if a modal dialog (e.g. with a cancel
+   * button) is shown meanwhile. Returns \ref isSuccessful(). */
+  bool waitForFinished(QEventLoop::ProcessEventsFlags flags = QEventLoop::ExcludeUserInputEvents);
+
+signals:
+  //! The job has finished
+  /** \c success is FALSE if the export failed or was canceled. */
+  void finished(bool success);
+
+public slots:
+  //! Run the export as described in \ref KLFExporter::getDataAsync()
+  /** Has no effect if the job was already started. */
+  void start();
+  //! Stop waiting for the data
+  /** finished() is emitted with FALSE right away, after \ref cancelExport() was called. Has
+   * no effect if the job has already finished. */
+  void cancel();
+
+  //! Provide the result of the job and emit finished()
+  /** Reimplementations of \ref startExport() call this slot once the data is available. It
+   * must be called from the event loop of the job's thread (e.g. from a slot connected to
+   * the \c finished() signal of an external process, or with a queued
+   * QMetaObject::invokeMethod()), as finished() is emitted from within this call. Has no
+   * effect if the job has already finished (e.g. if it was canceled). */
+  void setResult(const QByteArray& data, const QString& errorString = QString());
+
+protected:
+  //! Actually start the export
+  /** Called by \ref start(). The base implementation runs \ref KLFExporter::getData() as
+   * described in \ref KLFExporter::getDataAsync(). */
+  virtual void startExport();
+  //! Abort the export
+  /** Called by \ref cancel() for a job which has not finished yet. The base implementation
+   * can't interrupt a getData() call which is already running, but its result is
+   * discarded. Subclasses which reimplement this function should also abort their export
+   * when the job is deleted. */
+  virtual void cancelExport();
+
+private:
+  KLF_DECLARE_PRIVATE(KLFExporterJob) ;
+};
+
+
 
 struct KLFExporterNameAndFormat
 {
@@ -186,6 +314,22 @@ public:
 
   QList<KLFExporter*> exporterList();
 
+  /** \brief The mutex to hold while calling getData() on \a exporter
+   *
+   * Exporters keep some state (e.g. their error string), so that calls to getData() on a
+   * same exporter must not overlap when they are made from different threads. The
+   * returned mutex is recursive. getDataByExporterNameAndFormat() already locks it.
+   */
+  QMutex * exporterMutex(KLFExporter * exporter) const;
+
+  /** \brief A thread pool to prepare exported data in the background
+   *
+   * Only exporters which \ref KLFExporter::canExportInWorkerThread() "can export in a
+   * worker thread" may be called from tasks run in this pool. The manager waits for all
+   * the tasks to finish before deleting its exporters.
+   */
+  QThreadPool * workerPool();
+
   //! Whether the given exporter name and format is supported for the given output
   bool supportsExporterNameAndFormat(const QString & exporterName, const QString & format,
                                      const KLFBackend::klfOutput & output) const;
@@ -210,6 +354,15 @@ public:
                                               const QVariantMap & params,
                                               KLFExporterNameAndFormat * whichExporterNameAndFormat = NULL) ;
 
+  /** \brief Start getting data from the given exporter and format in the background
+   *
+   * Returns the job created by \ref KLFExporter::getDataAsync(), which the caller owns, or
+   * NULL if the exporter is not found or doesn't support the format for this output.
+   */
+  KLFExporterJob * getDataAsync(const QString & exporterName, const QString & format,
+                                const KLFBackend::klfOutput & output,
+                                const QVariantMap & params = QVariantMap()) ;
+
 private:
   KLF_DECLARE_PRIVATE( KLFExporterManager ) ;
 };
@@ -217,6 +370,60 @@ private:
 
 
 
+struct KLFTempArtifactStorePrivate;
+
+/** \brief Shared store of temporary files referred to by exported data (e.g. text/uri-list)
+ *
+ * Files are named after a hash of their contents, so that identical data is written only once,
+ * even across different outputs and application sessions. The files are kept after the
+ * application exits; instead, the total size of the files in the store directory is kept
+ * within a budget by removing the least recently used files. Files which were handed out
+ * recently during this session are never removed, since the clipboard or a drop target may
+ * still refer to them.
+ *
+ * All methods are thread-safe.
+ */
+class KLF_EXPORT KLFTempArtifactStore
+{
+public:
+  KLFTempArtifactStore(const QString& directory, qint64 maxSize);
+  virtual ~KLFTempArtifactStore();
+
+  //! The directory in which the files are stored
+  QString directory() const;
+  //! The maximum total size of the stored files, in bytes. Zero or negative means no limit.
+  qint64 maxSize() const;
+
+  void setDirectory(const QString& directory);
+  void setMaxSize(qint64 maxSize);
+
+  /** \brief Returns the absolute path of a file with the given contents
+   *
+   * The file is written only if it doesn't exist already. \a extension is the file name
+   * extension to use (e.g. "png"). Returns an empty string on error.
+   */
+  QString storeData(const QByteArray& data, const QString& extension);
+
+  //! Remove least recently used files until the budget given by \ref maxSize() is respected
+  void cleanUp();
+
+  /** \brief The store used by the exporters
+   *
+   * Its directory and budget are read from the configuration (\c klfconfig) when it is first
+   * used. \ref KLFMainWin updates them when the settings change, and calls \ref cleanUp() when
+   * the application quits.
+   */
+  static KLFTempArtifactStore * defaultStore();
+
+private:
+  KLF_DECLARE_PRIVATE(KLFTempArtifactStore) ;
+
+  Q_DISABLE_COPY(KLFTempArtifactStore)
+};
+
+
+
+
 
 // -----------------------------------------------------------------------------
 // user script definitions:
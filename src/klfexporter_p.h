@@ -30,6 +30,14 @@
 #include <QBuffer>
 #include <QDomDocument>
 #include <QTimer>
+#include <QRunnable>
+#include <QSharedPointer>
+#include <QAtomicInt>
+#include <QMutexLocker>
+#include <QThread>
+#include <QApplication>
+#include <QScopedPointer>
+#include <QTemporaryFile>
 
 #include <klfdefs.h>
 #include <klfutil.h>
@@ -74,6 +82,101 @@ static inline QByteArray toHtmlAttrTextAscii(QString s)
 }
 
 
+//
+// Utility: base64-encoded PNG data, shared through the output's encoded data store. \a png
+// must be the PNG data of \a output at \a dpi.
+//
+static inline QByteArray klf_exporter_base64_png_data(const KLFBackend::klfOutput& output,
+                                                      const QByteArray& png, int dpi)
+{
+  QVariantMap params;
+  params["encoding"] = QLatin1String("base64");
+  const QString key = KLFBackend::EncodedDataStore::makeKey("PNG", dpi, params);
+  if (output.encodedData != NULL && output.encodedData->contains(key)) {
+    return output.encodedData->value(key);
+  }
+  QByteArray base64 = png.toBase64();
+  if (output.encodedData != NULL) {
+    output.encodedData->insert(key, base64);
+  }
+  return base64;
+}
+
+
+//
+// Utility: the key under which the data exported by \a exporter in \a format is memoized in
+// the output's encoded data store, or a null string if that data must not be memoized (see
+// KLFExporter::isPureFunctionOfOutput())
+//
+static inline QString klf_exporter_memo_key(KLFExporter *exporter, const QString& format,
+                                            const KLFBackend::klfOutput& output,
+                                            const QVariantMap& params)
+{
+  if (output.encodedData == NULL || !exporter->isPureFunctionOfOutput()) {
+    return QString();
+  }
+  return KLFBackend::EncodedDataStore::makeKey(QLatin1String("exporter:") + exporter->exporterName()
+                                               + QLatin1Char('/') + format,
+                                               output.input.dpi, params);
+}
+
+
+/** \internal
+ *
+ * Calls getData() for a \ref KLFExporterJob, either in the exporter manager's worker pool or
+ * from the event loop (see runInThisThread()). The task lives in the thread of the job, and
+ * deletes itself once done() was emitted; the job only shares the cancel flag with it, so
+ * that the job may be deleted in the meantime.
+ */
+class KLFExporterJobTask : public QObject, public QRunnable
+{
+  Q_OBJECT
+public:
+  KLFExporterJobTask(KLFExporter *exporter, const QString& format, const KLFBackend::klfOutput& output,
+                     const QVariantMap& params, const QSharedPointer<QAtomicInt>& canceled)
+    : QObject(), QRunnable(), pExporter(exporter), pFormat(format), pOutput(output), pParams(params),
+      pCanceled(canceled)
+  {
+    setAutoDelete(false);
+  }
+
+  void run()
+  {
+    QByteArray data;
+    QString errorString;
+    if (pCanceled->loadAcquire() == 0) {
+      KLFExporterManager *exporterManager = pExporter->getExporterManager();
+      QMutexLocker lock(exporterManager != NULL ? exporterManager->exporterMutex(pExporter) : NULL);
+      data = pExporter->getData(pFormat, pOutput, pParams);
+      if (data.isEmpty()) {
+        errorString = pExporter->errorString();
+      } else {
+        // memoize while still holding the lock, so that whoever waited for it finds the data
+        const QString key = klf_exporter_memo_key(pExporter, pFormat, pOutput, pParams);
+        if (!key.isNull()) {
+          pOutput.encodedData->insert(key, data);
+        }
+      }
+    }
+    emit done(data, errorString);
+    deleteLater();
+  }
+
+signals:
+  void done(const QByteArray& data, const QString& errorString);
+
+public slots:
+  void runInThisThread() { run(); }
+
+private:
+  KLFExporter *pExporter;
+  QString pFormat;
+  KLFBackend::klfOutput pOutput;
+  QVariantMap pParams;
+  QSharedPointer<QAtomicInt> pCanceled;
+};
+
+
 
 
 
@@ -97,6 +200,9 @@ public:
     return QLatin1String("KLFBackendFormatsExporter");
   }
 
+  virtual bool canExportInWorkerThread() const { return true; }
+  virtual bool isPureFunctionOfOutput() const { return true; }
+
   virtual QStringList supportedFormats(const KLFBackend::klfOutput& output) const
   {
     return KLFBackend::availableSaveFormats(output);
@@ -125,13 +231,8 @@ public:
 
     QString error;
     QByteArray data;
-    bool res = false;
-    {
-      QBuffer buffer(&data);
-      buffer.open(QIODevice::WriteOnly);
-      res = KLFBackend::saveOutputToDevice(output, &buffer, format, &error);
-      buffer.close();
-    }
+    // shares the data with the output object, no copy
+    bool res = KLFBackend::getOutputData(output, format, &data, &error);
 
     if ( ! res ) {
       setErrorString(error);
@@ -167,6 +268,9 @@ public:
     return QLatin1String("KLFTexExporter");
   }
 
+  virtual bool canExportInWorkerThread() const { return true; }
+  virtual bool isPureFunctionOfOutput() const { return true; }
+
   virtual QStringList supportedFormats(const KLFBackend::klfOutput& ) const
   {
     return QStringList() << "tex-with-klf-metainfo" << "tex";
@@ -261,6 +365,9 @@ public:
     return QLatin1String("KLFOpenOfficeDrawExporter");
   }
 
+  // not in a worker thread: reads the export scale from klfconfig
+  virtual bool canExportInWorkerThread() const { return false; }
+
   virtual QStringList supportedFormats(const KLFBackend::klfOutput& ) const
   {
     return QStringList() << "odg";
@@ -311,7 +418,8 @@ public:
       bgcols = "-";
     }
 
-    templ.replace("<!--KLF_PNG_BASE64_DATA-->", pngdata.toBase64());
+    templ.replace("<!--KLF_PNG_BASE64_DATA-->", klf_exporter_base64_png_data(klfoutput, pngdata,
+                                                                          klfoutput.input.dpi));
 
     templ.replace("<!--KLF_INPUT_LATEX-->", toHtmlAttrTextAscii(klfoutput.input.latex));
     templ.replace("<!--KLF_INPUT_MATHMODE-->", toHtmlAttrTextAscii(klfoutput.input.mathmode));
@@ -400,6 +508,9 @@ public:
     return QLatin1String("KLFHtmlDataExporter");
   }
 
+  // not in a worker thread: calls other exporters through the exporter manager and reads klfconfig
+  virtual bool canExportInWorkerThread() const { return false; }
+
   virtual QStringList supportedFormats(const KLFBackend::klfOutput& output) const
   {
     QStringList list;
@@ -598,19 +709,24 @@ public:
 
   inline QByteArray get_png_data_for_dpi(const KLFBackend::klfOutput & output, int html_export_dpi)
   {
-    QImage img = output.result;
-    if (html_export_dpi > 0 && html_export_dpi != output.input.dpi) {
-      // needs to be rescaled
-      QSize targetSize = img.size();
-      targetSize *= (double) html_export_dpi / output.input.dpi;
-      klfDbg("scaling to "<<html_export_dpi<<" DPI from "<<output.input.dpi<<" DPI... targetSize="<<targetSize) ;
-      img = klfImageScaled(img, targetSize);
+    if (html_export_dpi <= 0 || html_export_dpi == output.input.dpi) {
+      return output.pngdata;
     }
+    // needs to be rescaled -- do this only once for all copies of the output
+    const QString key = KLFBackend::EncodedDataStore::makeKey("PNG", html_export_dpi);
+    if (output.encodedData != NULL && output.encodedData->contains(key)) {
+      return output.encodedData->value(key);
+    }
+    klfDbg("getting image at "<<html_export_dpi<<" DPI from "<<output.input.dpi<<" DPI output") ;
+    QImage img = KLFBackend::getResultForDpi(output, html_export_dpi);
     QByteArray png;
     { QBuffer buffer(&png);
       buffer.open(QIODevice::WriteOnly);
       img.save(&buffer, "PNG"); // writes image into ba in PNG format
     }
+    if (output.encodedData != NULL) {
+      output.encodedData->insert(key, png);
+    }
     return png;
   }
 
@@ -634,7 +750,7 @@ public:
     QString w_in = QString::number((float)imgsize.width() / html_export_display_dpi, 'f', 3);
     QString h_in = QString::number((float)imgsize.height() / html_export_display_dpi, 'f', 3);
 
-    QByteArray base64imgdata = png.toBase64();
+    QByteArray base64imgdata = klf_exporter_base64_png_data(output, png, html_export_dpi);
     
     klfDbg("origimg/size="<<output.result.size()<<"; origDPI="<<output.input.dpi
            <<"; html_export_dpi="<<html_export_dpi
@@ -685,6 +801,10 @@ public:
     return QLatin1String("UserScript:") + pUserScript.userScriptBaseName();
   }
 
+  // not in a worker thread: the script's input is obtained from other exporters through the
+  // exporter manager, and klfconfig is read while preparing the script's environment
+  virtual bool canExportInWorkerThread() const { return false; }
+
   virtual QStringList supportedFormats(const KLFBackend::klfOutput& ) const
   {
     /// \bug FIXME: make sure that the input-file-type is an available format from klfoutput
@@ -709,14 +829,77 @@ public:
 
     clearErrorString();
 
+    QScopedPointer<KLFUserScriptExportRun> run(prepareRun(format, klfoutput, params));
+    if (run.isNull()) {
+      return QByteArray();
+    }
+
+    bool ok = false;
+    if (QThread::currentThread() == qApp->thread()) {
+      run->process.setProcessAppEvents(true);
+
+      KLFPleaseWaitPopup waitPopup(tr("Please wait while user script ‘%1’ is being run ...")
+                                 .arg(pUserScript.userScriptBaseName()));
+      // only show the popup after a short delay
+      QTimer timer;
+      connect(&timer, SIGNAL(timeout()), &waitPopup, SLOT(showPleaseWait()));
+      timer.setSingleShot(true);
+      timer.start(1000);
+
+      // now, run the user script
+      ok = run->process.run(QByteArray(), run->outdatamap);
+
+      timer.stop();
+    } else {
+      // in a worker thread, there's no GUI to keep alive
+      run->process.setProcessAppEvents(false);
+      ok = run->process.run(QByteArray(), run->outdatamap);
+    }
+
+    return collectRun(run.data(), ok);
+  }
+
+  /** Runs the script in a process which is waited for from the event loop, without
+   * blocking it. Canceling or deleting the job kills the process. */
+  virtual KLFExporterJob * getDataAsync(const QString& format, const KLFBackend::klfOutput& klfoutput,
+                                        const QVariantMap& params = QVariantMap());
+
+  /** \internal The state of one run of the user script: the process, its input file and
+   * the buffers its output is collected to. */
+  struct KLFUserScriptExportRun
+  {
+    KLFUserScriptExportRun(const QString& userScriptPath, const KLFBackend::klfSettings *settings)
+      : process(userScriptPath, settings)
+    {
+    }
+
+    KLFUserScriptFilterProcess process;
+    QScopedPointer<QTemporaryFile> f_in;
+
+    QByteArray stdoutdata;
+    QByteArray stderrdata;
+    QByteArray foutdata;
+    QMap<QString,QByteArray*> outdatamap;
+    QString outfn;
+  };
+
+  /** Gets the script's input data, writes it to a temporary file and sets up the process
+   * to run the script. Returns NULL, with the error string set, if the input data can't be
+   * obtained. The caller takes ownership of the returned object. */
+  KLFUserScriptExportRun * prepareRun(const QString& format, const KLFBackend::klfOutput& klfoutput,
+                                      const QVariantMap& params)
+  {
+    clearErrorString();
+
     // `params` is not used at the moment. In the future, `params` may correspond to
     // export options (e.g., jpeg quality) provided by the user in a separate dialog after
     // specifying the file name to save to.
     //
     //klfDbg("param="<<param) ;
 
-    // now actually call the script
-    KLFUserScriptFilterProcess p(pUserScript.userScriptPath(), &klfoutput.settings);
+    QScopedPointer<KLFUserScriptExportRun> run(new KLFUserScriptExportRun(pUserScript.userScriptPath(),
+                                                                          &klfoutput.settings));
+    KLFUserScriptFilterProcess & p = run->process;
 
     if (klfconfig.UserScripts.userScriptConfig.contains(pUserScript.userScriptPath())) {
       p.addUserScriptConfig(klfconfig.UserScripts.userScriptConfig.value(pUserScript.userScriptPath()));
@@ -738,7 +921,8 @@ public:
       // can't get SVG data, fall back to only PNG
       klfWarning("Can't get data for user script " << pUserScript.userScriptName()
                  << ": no available input format found!") ;
-      return QByteArray();
+      setErrorString(tr("Can't get input data for user script %1").arg(pUserScript.userScriptBaseName()));
+      return NULL;
     }
 
     QString ver = KLF_VERSION_STRING;
@@ -755,11 +939,11 @@ public:
       ext = "tmp";
     }
 
-    QTemporaryFile f_in(tempfnametmpl + "." + ext);
+    run->f_in.reset(new QTemporaryFile(tempfnametmpl + "." + ext));
+    QTemporaryFile & f_in = *run->f_in;
     f_in.setAutoRemove(true);
     f_in.open();
   
-    QString errstr;
     f_in.write(input_data);
     f_in.close();
 
@@ -780,62 +964,47 @@ public:
     p.addExecEnviron(addenv);
 
     // buffers to collect output
-    QByteArray stdoutdata;
-    QByteArray stderrdata;
-    p.collectStdoutTo(&stdoutdata);
-    p.collectStderrTo(&stderrdata);
+    p.collectStdoutTo(&run->stdoutdata);
+    p.collectStderrTo(&run->stderrdata);
 
     QString outfext = (QStringList()<<pUserScript.getFormat(format).fileNameExtensions()<<"out").first();
 
-    QByteArray foutdata;
-    QMap<QString,QByteArray*> outdatamap;
-    QString outfn;
     if (!pUserScript.hasStdoutOutput()) {
       QFileInfo infi(f_in.fileName());
-      outfn = infi.absolutePath() + "/" + infi.completeBaseName() + "." + outfext;
-      outdatamap[outfn] = &foutdata;
-      klfDbg("outfn = " << outfn) ;
+      run->outfn = infi.absolutePath() + "/" + infi.completeBaseName() + "." + outfext;
+      run->outdatamap[run->outfn] = &run->foutdata;
+      klfDbg("outfn = " << run->outfn) ;
     }
 
-    p.setProcessAppEvents(true);
-
-    bool ok = false;
-    {
-      KLFPleaseWaitPopup waitPopup(tr("Please wait while user script ‘%1’ is being run ...")
-                                 .arg(pUserScript.userScriptBaseName()));
-      // only show the popup after a short delay
-      QTimer timer;
-      connect(&timer, SIGNAL(timeout()), &waitPopup, SLOT(showPleaseWait()));
-      timer.setSingleShot(true);
-      timer.start(1000);
-
-      // now, run the user script
-      ok = p.run(QByteArray(), outdatamap);
-
-      timer.stop();
-    }
+    return run.take();
+  }
 
-    if (outfn.size() && QFile::exists(outfn)) {
-      QFile::remove(outfn);
+  /** Cleans up after the script of \c run has finished and returns its output. \c ok is
+   * the result of running the process. */
+  QByteArray collectRun(KLFUserScriptExportRun *run, bool ok)
+  {
+    if (run->outfn.size() && QFile::exists(run->outfn)) {
+      QFile::remove(run->outfn);
     }
 
     if (!ok) {
       // error
       setErrorString(tr("Error running user script %1: %2").arg(pUserScript.userScriptBaseName())
-                     .arg(p.resultErrorString()));
+                     .arg(run->process.resultErrorString()));
       klfWarning("Error: " << qPrintable(errorString())) ;
       return QByteArray();
     }
 
-    klfDbg("Ran script "<<pUserScript.userScriptPath()<<": stdout="<<stdoutdata<<"\n\tstderr="<<stderrdata) ;
+    klfDbg("Ran script "<<pUserScript.userScriptPath()<<": stdout="<<run->stdoutdata
+           <<"\n\tstderr="<<run->stderrdata) ;
 
     // and retreive the output data
-    if (!foutdata.isEmpty()) {
-      klfDbg("Got file output data: size="<<foutdata.size()) ;
-      return foutdata;
+    if (!run->foutdata.isEmpty()) {
+      klfDbg("Got file output data: size="<<run->foutdata.size()) ;
+      return run->foutdata;
     }
 
-    return stdoutdata;
+    return run->stdoutdata;
   }
 
 private:
@@ -843,6 +1012,36 @@ private:
 };
 
 
+/** \internal
+ *
+ * The job returned by \ref KLFUserScriptExporter::getDataAsync(). The script's input is
+ * prepared when the job is started, and the script's process is then waited for from the
+ * event loop.
+ */
+class KLFUserScriptExporterJob : public KLFExporterJob
+{
+  Q_OBJECT
+public:
+  KLFUserScriptExporterJob(KLFUserScriptExporter *exporter, const QString& format,
+                           const KLFBackend::klfOutput& output, const QVariantMap& params);
+  virtual ~KLFUserScriptExporterJob();
+
+protected:
+  virtual void startExport();
+  virtual void cancelExport();
+
+private slots:
+  void processFinished();
+
+private:
+  KLFUserScriptExporter *pUserScriptExporter;
+  QScopedPointer<KLFUserScriptExporter::KLFUserScriptExportRun> pRun;
+  KLFBlockProcess *pProcess;
+
+  void killProcess();
+};
+
+
 
 
 
@@ -900,58 +1099,48 @@ public:
     if (targetDpi <= 0) {
       targetDpi = output.input.dpi;
     }
-
-    // a hash value of the output's result and the target dpi
-    qint64 hashkey = output.result.cacheKey() ^ targetDpi;
-
-    if (tempFilesCache[format].contains(hashkey)) {
-      klfDbg("found cached temporary file: " << tempFilesCache[format][hashkey]) ;
-      return tempFilesCache[format][hashkey];
-    }
-
-    QString templ = klfconfig.BackendSettings.tempDir +
-      QString::fromLatin1("/klf_%2_XXXXXX.%1.%3")
-      .arg(targetDpi).arg(QDateTime::currentDateTime().toString("yyyy-MM-dd_hh-mm")).arg(format);
-
-    klfDbg("Attempting to create temp file from template name " << templ) ;
-
-    QTemporaryFile *tempfile = new QTemporaryFile(templ, qApp);
-    tempfile->setAutoRemove(true); // will be deleted when klatexformula exists (= qApp destroyed)
-    if (tempfile->open() == false) {
-      klfWarning("Can't create or open temp file for KLFTempFileUriExporter: template is " << templ) ;
-      return QString();
+    bool rescale = !isVectorFormat(format) && targetDpi != output.input.dpi;
+
+    // remember the file for all copies of this output, so that we don't even need to encode
+    // and hash the data again
+    const QString key = KLFBackend::EncodedDataStore::makeKey(QLatin1String("tempfile:") + format, targetDpi);
+    if (output.encodedData != NULL && output.encodedData->contains(key)) {
+      QString tempfilename = QString::fromUtf8(output.encodedData->value(key));
+      if (QFile::exists(tempfilename)) {
+        klfDbg("found cached temporary file: " << tempfilename) ;
+        return tempfilename;
+      }
     }
 
-    QString tempfilename = QFileInfo(tempfile->fileName()).absoluteFilePath();
-
-    if (isVectorFormat(format) || targetDpi <= 0 || targetDpi == output.input.dpi) {
+    QByteArray data;
+    QString ext = format;
+    if (!rescale) {
       QString errStr;
-      bool res = KLFBackend::saveOutputToDevice(output, tempfile, format, &errStr);
-      if (!res) {
-        klfWarning("Can't save to temp file " << tempfilename << ": " << errStr) ;
-        tempfile->close();
+      if (!KLFBackend::getOutputData(output, format, &data, &errStr)) {
+        klfWarning("Can't get " << format << " data for temp file: " << errStr) ;
         return QString();
       }
-    } else { // need to rescale image to given DPI
-      QImage img = output.result;
-      QSize targetSize = img.size();
-      targetSize *= (double) targetDpi / output.input.dpi;
-      klfDbg("scaling to "<<targetDpi<<" DPI from "<<output.input.dpi<<" DPI... targetSize="<<targetSize) ;
-      img = klfImageScaled(img, targetSize);
-      bool res = img.save(tempfile, "PNG");
-      if (!res) {
-        klfWarning("Can't save dpi-rescaled image to temp file " << tempfile->fileName());
-        tempfile->close();
+    } else { // need the image at the given DPI
+      klfDbg("getting image at "<<targetDpi<<" DPI from "<<output.input.dpi<<" DPI output") ;
+      QImage img = KLFBackend::getResultForDpi(output, targetDpi);
+      QBuffer buffer(&data);
+      buffer.open(QIODevice::WriteOnly);
+      if (!img.save(&buffer, "PNG")) {
+        klfWarning("Can't save dpi-rescaled image for temp file");
         return QString();
       }
+      ext = QLatin1String("png");
     }
 
-    tempfile->close();
-
-    // cache this temp file for other formats' use or other QMimeData instantiation...
-    tempFilesCache[format][hashkey] = tempfilename;
+    // identical data, e.g. from another copy of the same equation, is stored only once
+    QString tempfilename = KLFTempArtifactStore::defaultStore()->storeData(data, ext);
+    if (tempfilename.isEmpty()) {
+      return QString();
+    }
 
-    klfDbg("Wrote temp file with name " << tempfilename) ;
+    if (output.encodedData != NULL) {
+      output.encodedData->insert(key, tempfilename.toUtf8());
+    }
 
     return tempfilename;
   }
@@ -965,8 +1154,6 @@ private:
     }
     return false;
   }
-
-  static QMap<QString,QMap<qint64,QString> > tempFilesCache;
 };
 
 
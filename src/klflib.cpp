@@ -30,8 +30,14 @@
 #include <QDataStream>
 #include <QColor>
 #include <QMimeData>
+#include <QThread>
+#include <QEventLoop>
+#include <QtEndian>
+#include <QVector>
+#include <QPair>
 
 #include <klfutil.h>
+#include <klfguiutil.h>
 #include "klflib_p.h"
 #include "klflib.h"
 
@@ -289,6 +295,444 @@ bool KLFLibEntrySorter::operator()(const KLFLibEntry& a, const KLFLibEntry& b) c
 }
 
 
+// ---------------------------------------------------
+
+/** \internal Returns \c entry with its preview encoded as PNG data */
+static KLFLibResourceEngine::KLFLibEncodedEntryWithId klf_lib_encoded_entry(KLFLib::entryId id,
+									    const KLFLibEntry& entry)
+{
+  KLFLibResourceEngine::KLFLibEncodedEntryWithId e(id, entry);
+  QImage preview = e.entry.preview();
+  if (!preview.isNull()) {
+    QBuffer buf(&e.previewData);
+    buf.open(QIODevice::WriteOnly);
+    preview.save(&buf, "PNG");
+    e.entry.setPreviewSize(preview.size());
+    e.entry.setPreview(QImage());
+  }
+  return e;
+}
+
+/** \internal Returns the entry in \c e with its preview decoded */
+static KLFLibEntry klf_lib_decoded_entry(const KLFLibResourceEngine::KLFLibEncodedEntryWithId& e)
+{
+  KLFLibEntry entry = e.entry;
+  if (!e.previewData.isEmpty())
+    entry.setPreview(QImage::fromData(e.previewData, "PNG"));
+  return entry;
+}
+
+
+static const char klf_columnar_magic[8] = { 'K', 'L', 'F', 'L', 'C', 'O', 'L', '\0' };
+/** \internal Value stored for an invalid date/time */
+static const qint64 klf_columnar_invalid_datetime = Q_INT64_C(-9223372036854775807) - 1;
+
+static inline void klf_col_put_u32(QByteArray *a, quint32 v)
+{
+  uchar b[4];
+  qToLittleEndian<quint32>(v, b);
+  a->append((const char*)b, 4);
+}
+static inline void klf_col_put_u64(QByteArray *a, quint64 v)
+{
+  uchar b[8];
+  qToLittleEndian<quint64>(v, b);
+  a->append((const char*)b, 8);
+}
+
+/** \internal Builds the tables and columns of a KLFLibEntryColumnarData. Blob offsets are
+ * first relative to the blob area, and made absolute in data() once the size of what comes
+ * before is known. */
+class KLFLibEntryColumnarWriter
+{
+public:
+  KLFLibEntryColumnarWriter(int n)
+    : count(n)
+  {
+    latexCol.reserve(n); categoryCol.reserve(n); tagsCol.reserve(n); dateTimeCol.reserve(n);
+    styleCol.reserve(n); previewWCol.reserve(n); previewHCol.reserve(n);
+    previewCol.reserve(n); extraCol.reserve(n);
+  }
+
+  void addEntry(const KLFLibEntry& entry, const QByteArray& previewData)
+  {
+    latexCol << internString(entry.latex());
+    categoryCol << internString(entry.category());
+    tagsCol << internString(entry.tags());
+    QDateTime dt = entry.dateTime();
+    dateTimeCol << (dt.isValid() ? dt.toMSecsSinceEpoch() : klf_columnar_invalid_datetime);
+    QVariant vstyle = entry.property(KLFLibEntry::Style);
+    styleCol << (vstyle.isValid() ? internStyle(entry.style()) : 0xFFFFFFFFu);
+    QSize sz = entry.previewSize();
+    previewWCol << (quint32)qMax(0, sz.width());
+    previewHCol << (quint32)qMax(0, sz.height());
+    previewCol << addBlob(previewData);
+
+    // any other (non-built-in) properties, by name
+    QVariantMap extra;
+    QList<int> propids = entry.registeredPropertyIdList();
+    int k;
+    for (k = 0; k < propids.size(); ++k) {
+      if (propids[k] <= KLFLibEntry::Style)
+	continue;
+      QVariant v = entry.property(propids[k]);
+      if (v.isValid())
+	extra[entry.propertyNameForId(propids[k])] = v;
+    }
+    QByteArray extradata;
+    if (!extra.isEmpty()) {
+      QDataStream str(&extradata, QIODevice::WriteOnly);
+      str.setVersion(QDataStream::Qt_4_4);
+      str << extra;
+    }
+    extraCol << addBlob(extradata);
+  }
+
+  QByteArray data(const QVariantMap& metaData) const
+  {
+    QByteArray metadata;
+    { QDataStream str(&metadata, QIODevice::WriteOnly);
+      str.setVersion(QDataStream::Qt_4_4);
+      str << metaData;
+    }
+
+    const quint64 HeaderSize = KLFLibEntryColumnarDataPrivate::HeaderSize;
+    const quint64 RecSize = KLFLibEntryColumnarDataPrivate::IndexRecordSize;
+    const quint64 metaDataOffset = HeaderSize;
+    const quint64 stringIndexOffset = metaDataOffset + metadata.size();
+    const quint64 styleIndexOffset = stringIndexOffset + RecSize*stringIndex.size();
+    const quint64 columnsOffset = styleIndexOffset + RecSize*styleIndex.size();
+    const quint64 blobsOffset = columnsOffset
+      + (quint64)KLFLibEntryColumnarDataPrivate::ColumnsSize*count;
+    const quint64 totalSize = blobsOffset + blobs.size();
+
+    QByteArray d;
+    d.reserve((int)totalSize);
+    d.append(klf_columnar_magic, 8);
+    klf_col_put_u32(&d, KLFLibEntryColumnarData::Version);
+    klf_col_put_u32(&d, count);
+    klf_col_put_u32(&d, stringIndex.size());
+    klf_col_put_u32(&d, styleIndex.size());
+    klf_col_put_u64(&d, metaDataOffset);
+    klf_col_put_u32(&d, metadata.size());
+    klf_col_put_u64(&d, stringIndexOffset);
+    klf_col_put_u64(&d, styleIndexOffset);
+    klf_col_put_u64(&d, columnsOffset);
+    klf_col_put_u64(&d, totalSize);
+    KLF_ASSERT_CONDITION((quint64)d.size() == HeaderSize, "Bad header size "<<d.size(), ; ) ;
+
+    d.append(metadata);
+    putRecords(&d, stringIndex, blobsOffset);
+    putRecords(&d, styleIndex, blobsOffset);
+
+    int k;
+    for (k = 0; k < latexCol.size(); ++k)
+      klf_col_put_u32(&d, latexCol[k]);
+    for (k = 0; k < categoryCol.size(); ++k)
+      klf_col_put_u32(&d, categoryCol[k]);
+    for (k = 0; k < tagsCol.size(); ++k)
+      klf_col_put_u32(&d, tagsCol[k]);
+    for (k = 0; k < dateTimeCol.size(); ++k)
+      klf_col_put_u64(&d, (quint64)dateTimeCol[k]);
+    for (k = 0; k < styleCol.size(); ++k)
+      klf_col_put_u32(&d, styleCol[k]);
+    for (k = 0; k < previewWCol.size(); ++k)
+      klf_col_put_u32(&d, previewWCol[k]);
+    for (k = 0; k < previewHCol.size(); ++k)
+      klf_col_put_u32(&d, previewHCol[k]);
+    putRecords(&d, previewCol, blobsOffset);
+    putRecords(&d, extraCol, blobsOffset);
+
+    d.append(blobs);
+    return d;
+  }
+
+private:
+  /** (offset relative to the blob area, length) */
+  typedef QPair<quint64,quint32> Record;
+
+  quint32 count;
+
+  QHash<QString,quint32> stringIds;
+  QList<Record> stringIndex;
+  QHash<QByteArray,quint32> styleIds;
+  QList<Record> styleIndex;
+
+  QVector<quint32> latexCol, categoryCol, tagsCol, styleCol, previewWCol, previewHCol;
+  QVector<qint64> dateTimeCol;
+  QVector<Record> previewCol, extraCol;
+
+  QByteArray blobs;
+
+  Record addBlob(const QByteArray& data)
+  {
+    Record r(blobs.size(), data.size());
+    blobs.append(data);
+    return r;
+  }
+
+  quint32 internString(const QString& s)
+  {
+    QHash<QString,quint32>::const_iterator it = stringIds.constFind(s);
+    if (it != stringIds.constEnd())
+      return *it;
+    quint32 id = stringIndex.size();
+    stringIndex << addBlob(s.toUtf8());
+    stringIds.insert(s, id);
+    return id;
+  }
+
+  quint32 internStyle(const KLFStyle& style)
+  {
+    QByteArray sdata;
+    { QDataStream str(&sdata, QIODevice::WriteOnly);
+      str.setVersion(QDataStream::Qt_4_4);
+      str << style;
+    }
+    QHash<QByteArray,quint32>::const_iterator it = styleIds.constFind(sdata);
+    if (it != styleIds.constEnd())
+      return *it;
+    quint32 id = styleIndex.size();
+    styleIndex << addBlob(sdata);
+    styleIds.insert(sdata, id);
+    return id;
+  }
+
+  template<class List>
+  static void putRecords(QByteArray *d, const List& records, quint64 blobsOffset)
+  {
+    int k;
+    for (k = 0; k < records.size(); ++k) {
+      klf_col_put_u64(d, blobsOffset + records[k].first);
+      klf_col_put_u32(d, records[k].second);
+    }
+  }
+};
+
+
+KLFLibEntryColumnarData::KLFLibEntryColumnarData(const QByteArray& data)
+{
+  KLF_INIT_PRIVATE(KLFLibEntryColumnarData) ;
+  d->ownData = data;
+  d->init((const uchar*)d->ownData.constData(), d->ownData.size());
+}
+KLFLibEntryColumnarData::KLFLibEntryColumnarData(const uchar *data, qint64 size)
+{
+  KLF_INIT_PRIVATE(KLFLibEntryColumnarData) ;
+  d->init(data, size);
+}
+KLFLibEntryColumnarData::~KLFLibEntryColumnarData()
+{
+  KLF_DELETE_PRIVATE ;
+}
+
+void KLFLibEntryColumnarDataPrivate::init(const uchar *d, qint64 sz)
+{
+  data = d;
+  size = (sz > 0) ? (quint64)sz : 0;
+  valid = false;
+
+  if (data == NULL || size < HeaderSize ||
+      QByteArray::fromRawData((const char*)data, 8) != QByteArray::fromRawData(klf_columnar_magic, 8)) {
+    klfDbg("not columnar data.") ;
+    return;
+  }
+  quint32 version = u32(8);
+  if (version != KLFLibEntryColumnarData::Version) {
+    klfWarning("unsupported columnar data version "<<version) ;
+    return;
+  }
+  count = u32(12);
+  stringCount = u32(16);
+  styleCount = u32(20);
+  metaDataOffset = u64(24);
+  metaDataLength = u32(32);
+  stringIndexOffset = u64(36);
+  styleIndexOffset = u64(44);
+  columnsOffset = u64(52);
+  quint64 totalSize = u64(60);
+
+  if (totalSize > size ||
+      !inRange(metaDataOffset, metaDataLength) ||
+      !inRange(stringIndexOffset, (quint64)IndexRecordSize*stringCount) ||
+      !inRange(styleIndexOffset, (quint64)IndexRecordSize*styleCount) ||
+      !inRange(columnsOffset, (quint64)ColumnsSize*count)) {
+    klfWarning("columnar data is truncated or corrupt.") ;
+    return;
+  }
+  valid = true;
+}
+
+QByteArray KLFLibEntryColumnarDataPrivate::rawBlob(quint64 recordOffset) const
+{
+  quint64 offset = u64(recordOffset);
+  quint32 length = u32(recordOffset + 8);
+  if (!inRange(offset, length)) {
+    klfWarning("blob at "<<offset<<" of length "<<length<<" is out of range.") ;
+    return QByteArray();
+  }
+  return QByteArray::fromRawData((const char*)data + offset, length);
+}
+
+QString KLFLibEntryColumnarDataPrivate::string(quint32 index) const
+{
+  if (index >= stringCount)
+    return QString();
+  QByteArray s = rawBlob(stringIndexOffset + (quint64)IndexRecordSize*index);
+  return QString::fromUtf8(s.constData(), s.size());
+}
+
+// static
+bool KLFLibEntryColumnarData::hasHeader(const QByteArray& data)
+{
+  return data.startsWith(QByteArray::fromRawData(klf_columnar_magic, 8));
+}
+
+// static
+QByteArray KLFLibEntryColumnarData::encode(const QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId>& entryList,
+					   const QVariantMap& metaData)
+{
+  KLFLibEntryColumnarWriter writer(entryList.size());
+  int k;
+  for (k = 0; k < entryList.size(); ++k)
+    writer.addEntry(entryList[k].entry, entryList[k].previewData);
+  return writer.data(metaData);
+}
+// static
+QByteArray KLFLibEntryColumnarData::encode(const KLFLibEntryList& entryList, const QVariantMap& metaData)
+{
+  KLFLibEntryColumnarWriter writer(entryList.size());
+  int k;
+  for (k = 0; k < entryList.size(); ++k) {
+    KLFLibResourceEngine::KLFLibEncodedEntryWithId e = klf_lib_encoded_entry(-1, entryList[k]);
+    writer.addEntry(e.entry, e.previewData);
+  }
+  return writer.data(metaData);
+}
+
+bool KLFLibEntryColumnarData::isValid() const
+{
+  return d->valid;
+}
+int KLFLibEntryColumnarData::count() const
+{
+  return d->valid ? (int)d->count : 0;
+}
+QVariantMap KLFLibEntryColumnarData::metaData() const
+{
+  if (!d->valid)
+    return QVariantMap();
+  QByteArray mdata = QByteArray::fromRawData((const char*)d->data + d->metaDataOffset, d->metaDataLength);
+  QDataStream str(mdata);
+  str.setVersion(QDataStream::Qt_4_4);
+  QVariantMap metadata;
+  str >> metadata;
+  return metadata;
+}
+
+#define KLF_COLUMNAR_CHECK_INDEX(i, retval)				\
+  KLF_ASSERT_CONDITION( d->valid && (i) >= 0 && (quint32)(i) < d->count ,	\
+			"Invalid entry index "<<(i) , return retval ; )
+
+QString KLFLibEntryColumnarData::latex(int i) const
+{
+  KLF_COLUMNAR_CHECK_INDEX(i, QString()) ;
+  return d->string(d->u32(d->cell(KLFLibEntryColumnarDataPrivate::ColLatex, i, 4)));
+}
+QString KLFLibEntryColumnarData::category(int i) const
+{
+  KLF_COLUMNAR_CHECK_INDEX(i, QString()) ;
+  return d->string(d->u32(d->cell(KLFLibEntryColumnarDataPrivate::ColCategory, i, 4)));
+}
+QString KLFLibEntryColumnarData::tags(int i) const
+{
+  KLF_COLUMNAR_CHECK_INDEX(i, QString()) ;
+  return d->string(d->u32(d->cell(KLFLibEntryColumnarDataPrivate::ColTags, i, 4)));
+}
+QDateTime KLFLibEntryColumnarData::dateTime(int i) const
+{
+  KLF_COLUMNAR_CHECK_INDEX(i, QDateTime()) ;
+  qint64 msecs = d->s64(d->cell(KLFLibEntryColumnarDataPrivate::ColDateTime, i, 8));
+  if (msecs == klf_columnar_invalid_datetime)
+    return QDateTime();
+  return QDateTime::fromMSecsSinceEpoch(msecs);
+}
+KLFStyle KLFLibEntryColumnarData::style(int i) const
+{
+  KLF_COLUMNAR_CHECK_INDEX(i, KLFStyle()) ;
+  quint32 index = d->u32(d->cell(KLFLibEntryColumnarDataPrivate::ColStyle, i, 4));
+  if (index >= d->styleCount)
+    return KLFStyle();
+  QHash<quint32,KLFStyle>::const_iterator it = d->styleCache.constFind(index);
+  if (it != d->styleCache.constEnd())
+    return *it;
+  QByteArray sdata = d->rawBlob(d->styleIndexOffset + (quint64)KLFLibEntryColumnarDataPrivate::IndexRecordSize*index);
+  QDataStream str(sdata);
+  str.setVersion(QDataStream::Qt_4_4);
+  KLFStyle style;
+  str >> style;
+  d->styleCache.insert(index, style);
+  return style;
+}
+QSize KLFLibEntryColumnarData::previewSize(int i) const
+{
+  KLF_COLUMNAR_CHECK_INDEX(i, QSize()) ;
+  return QSize((int)d->u32(d->cell(KLFLibEntryColumnarDataPrivate::ColPreviewWidth, i, 4)),
+	       (int)d->u32(d->cell(KLFLibEntryColumnarDataPrivate::ColPreviewHeight, i, 4)));
+}
+QByteArray KLFLibEntryColumnarData::previewData(int i) const
+{
+  KLF_COLUMNAR_CHECK_INDEX(i, QByteArray()) ;
+  // copy the data, which may belong to a mapped file
+  QByteArray png = d->rawBlob(d->cell(KLFLibEntryColumnarDataPrivate::ColPreview, i, 12));
+  return QByteArray(png.constData(), png.size());
+}
+
+KLFLibResourceEngine::KLFLibEncodedEntryWithId KLFLibEntryColumnarData::encodedEntry(int i) const
+{
+  KLF_COLUMNAR_CHECK_INDEX(i, KLFLibResourceEngine::KLFLibEncodedEntryWithId()) ;
+
+  KLFLibEntry entry(latex(i), dateTime(i), QImage(), previewSize(i), category(i), tags(i), style(i));
+
+  QByteArray extradata = d->rawBlob(d->cell(KLFLibEntryColumnarDataPrivate::ColExtra, i, 12));
+  if (!extradata.isEmpty()) {
+    QDataStream str(extradata);
+    str.setVersion(QDataStream::Qt_4_4);
+    QVariantMap extra;
+    str >> extra;
+    for (QVariantMap::const_iterator it = extra.constBegin(); it != extra.constEnd(); ++it)
+      entry.setEntryProperty(it.key(), it.value());
+  }
+
+  return KLFLibResourceEngine::KLFLibEncodedEntryWithId(i, entry, previewData(i));
+}
+KLFLibEntry KLFLibEntryColumnarData::entry(int i, bool withPreview) const
+{
+  KLF_COLUMNAR_CHECK_INDEX(i, KLFLibEntry()) ;
+  KLFLibResourceEngine::KLFLibEncodedEntryWithId e = encodedEntry(i);
+  if (!withPreview)
+    return e.entry;
+  return klf_lib_decoded_entry(e);
+}
+
+KLFLibEntryList KLFLibEntryColumnarData::entryList() const
+{
+  KLFLibEntryList elist;
+  int k;
+  for (k = 0; k < count(); ++k)
+    elist << entry(k);
+  return elist;
+}
+QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId> KLFLibEntryColumnarData::encodedEntryList() const
+{
+  QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId> elist;
+  int k;
+  for (k = 0; k < count(); ++k)
+    elist << encodedEntry(k);
+  return elist;
+}
+
+
 // ---------------------------------------------------
 
 KLFAbstractLibEntryMimeEncoder::KLFAbstractLibEntryMimeEncoder()
@@ -350,6 +794,13 @@ QMimeData *KLFAbstractLibEntryMimeEncoder::createMimeData(const KLFLibEntryList&
   return mime;
 }
 
+// static
+QMimeData *KLFAbstractLibEntryMimeEncoder::createMimeData(const QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId>& entryList,
+							  const QVariantMap& metaData)
+{
+  return new KLFLibEntryListMimeData(KLFLibEntryColumnarData::encode(entryList, metaData), metaData);
+}
+
 
 // static
 bool KLFAbstractLibEntryMimeEncoder::canDecodeMimeData(const QMimeData *mimeData)
@@ -382,6 +833,80 @@ bool KLFAbstractLibEntryMimeEncoder::decodeMimeData(const QMimeData *mimeData,
   return false;
 }
 
+// static
+bool KLFAbstractLibEntryMimeEncoder::decodeMimeData(const QMimeData *mimeData,
+						    QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId> *entryListPtr,
+						    QVariantMap *metaDataPtr)
+{
+  if (mimeData->hasFormat("application/x-klf-libentries-columnar")) {
+    KLFLibEntryColumnarData cdata(mimeData->data("application/x-klf-libentries-columnar"));
+    if (cdata.isValid()) {
+      *metaDataPtr = cdata.metaData();
+      *entryListPtr = cdata.encodedEntryList();
+      return true;
+    }
+    // else try the other formats
+  }
+
+  KLFLibEntryList elist;
+  if (!decodeMimeData(mimeData, &elist, metaDataPtr))
+    return false;
+  entryListPtr->clear();
+  int k;
+  for (k = 0; k < elist.size(); ++k)
+    *entryListPtr << klf_lib_encoded_entry(k, elist[k]);
+  return true;
+}
+
+
+QStringList KLFLibEntryListMimeData::formats() const
+{
+  QStringList fmts = QMimeData::formats();
+  QStringList encfmts = KLFAbstractLibEntryMimeEncoder::allEncodingMimeTypes();
+  // the columnar format is first in the list, so that it is preferred when decoding
+  encfmts.removeAll("application/x-klf-libentries-columnar");
+  encfmts.prepend("application/x-klf-libentries-columnar");
+  int k;
+  for (k = encfmts.size()-1; k >= 0; --k) {
+    if (!fmts.contains(encfmts[k]))
+      fmts.prepend(encfmts[k]);
+  }
+  return fmts;
+}
+
+bool KLFLibEntryListMimeData::hasFormat(const QString& mimeType) const
+{
+  return formats().contains(mimeType);
+}
+
+QVariant KLFLibEntryListMimeData::retrieveData(const QString& mimeType, QVariant::Type type) const
+{
+  KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
+  klfDbg("mimeType="<<mimeType) ;
+
+  if (QMimeData::formats().contains(mimeType))
+    return QMimeData::retrieveData(mimeType, type);
+
+  if (mimeType == "application/x-klf-libentries-columnar")
+    return QVariant::fromValue<QByteArray>(pColumnarData);
+
+  QMap<QString,QByteArray>::const_iterator it = pEncodedData.constFind(mimeType);
+  if (it != pEncodedData.constEnd())
+    return QVariant::fromValue<QByteArray>(*it);
+
+  KLFAbstractLibEntryMimeEncoder *encoder = KLFAbstractLibEntryMimeEncoder::findEncoderFor(mimeType, false);
+  if (encoder == NULL)
+    return QVariant();
+
+  if (!pDecoded) {
+    pEntryList = KLFLibEntryColumnarData(pColumnarData).entryList();
+    pDecoded = true;
+  }
+  QByteArray data = encoder->encodeMime(pEntryList, pMetaData, mimeType);
+  pEncodedData[mimeType] = data;
+  return QVariant::fromValue<QByteArray>(data);
+}
+
 
 
 KLFAbstractLibEntryMimeEncoder *KLFAbstractLibEntryMimeEncoder::findEncoderFor(const QString& mimeType,
@@ -453,6 +978,23 @@ KLFLibResourceEngine::KLFLibResourceEngine(const QUrl& url, uint featureflags,
 }
 KLFLibResourceEngine::~KLFLibResourceEngine()
 {
+  stopAsyncJobs();
+}
+
+void KLFLibResourceEngine::stopAsyncJobs()
+{
+  emit asyncJobsStopping();
+
+  QList<KLFLibResourceQueryJob*> queryJobs =
+    findChildren<KLFLibResourceQueryJob*>(QString(), Qt::FindDirectChildrenOnly);
+  foreach (KLFLibResourceQueryJob *job, queryJobs) {
+    job->stopWorker();
+  }
+  QList<KLFLibResourceCopyJob*> copyJobs =
+    findChildren<KLFLibResourceCopyJob*>(QString(), Qt::FindDirectChildrenOnly);
+  foreach (KLFLibResourceCopyJob *job, copyJobs) {
+    job->stopWorker();
+  }
 }
 
 void KLFLibResourceEngine::initRegisteredProperties()
@@ -646,6 +1188,17 @@ QList<KLFLibResourceEngine::KLFLibEntryWithId>
   return entries(pDefaultSubResource, idList, wantedEntryProperties);
 }
 
+QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId>
+/* */ KLFLibResourceEngine::encodedEntries(const QString& subResource, const QList<KLFLib::entryId>& idList)
+{
+  QList<KLFLibEntryWithId> elist = entries(subResource, idList);
+  QList<KLFLibEncodedEntryWithId> encodedlist;
+  int k;
+  for (k = 0; k < elist.size(); ++k)
+    encodedlist << klf_lib_encoded_entry(elist[k].id, elist[k].entry);
+  return encodedlist;
+}
+
 QList<KLFLibResourceEngine::KLFLibEntryWithId>
 /* */ KLFLibResourceEngine::allEntries(const QList<int>& wantedEntryProperties)
 {
@@ -678,6 +1231,477 @@ bool KLFLibResourceEngine::thisOperationProgressBlocked() const
   return blocked;
 }
 
+KLFLibResourceQueryJob * KLFLibResourceEngine::queryAsync(const QString& subResource, const Query& query,
+							  uint fillFlags, int batchSize)
+{
+  KLF_DEBUG_BLOCK(KLF_FUNC_NAME);
+  klfDbg( "\t: subResource="<<subResource<<"; query="<<query<<"; batchSize="<<batchSize ) ;
+
+  KLF_ASSERT_CONDITION( batchSize > 0 , "Invalid batch size: "<<batchSize ,
+			batchSize = 200 ; ) ;
+
+  KLFLibResourceQueryJob *job = new KLFLibResourceQueryJob(this, subResource, query, fillFlags, batchSize,
+							   !thisOperationProgressBlocked());
+  job->start();
+  return job;
+}
+
+KLFLibResourceCopyJob * KLFLibResourceEngine::copyEntriesAsync(const QString& subResource,
+							       KLFLibResourceEngine *dest,
+							       const QString& destSubResource,
+							       int batchSize)
+{
+  KLF_DEBUG_BLOCK(KLF_FUNC_NAME);
+  klfDbg( "\t: subResource="<<subResource<<"; dest="<<dest<<"; destSubResource="<<destSubResource ) ;
+
+  KLF_ASSERT_NOT_NULL( dest , "destination resource is NULL!" , return NULL ) ;
+  KLF_ASSERT_CONDITION( batchSize > 0 , "Invalid batch size: "<<batchSize ,
+			batchSize = 200 ; ) ;
+
+  KLFLibResourceCopyJob *job = new KLFLibResourceCopyJob(this, subResource, dest, destSubResource,
+							 batchSize, !dest->thisOperationProgressBlocked());
+  job->start();
+  return job;
+}
+
+
+// ---------------------------------------------------------------
+
+
+KLFLibResourceQueryWorker::KLFLibResourceQueryWorker(KLFLibResourceEngine *resource,
+						     const QString& subResource,
+						     const KLFLibResourceEngine::Query& query,
+						     uint fillFlags, int batchSize)
+  : QObject(NULL), pResource(resource), pSubResource(subResource), pQuery(query),
+    pFillFlags(fillFlags), pBatchSize(batchSize), pStarted(false), pRemaining(query.limit),
+    pAbort(0)
+{
+}
+KLFLibResourceQueryWorker::~KLFLibResourceQueryWorker()
+{
+}
+
+void KLFLibResourceQueryWorker::run()
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+  while (runBatch())
+    ;
+}
+
+bool KLFLibResourceQueryWorker::runBatch()
+{
+  if (isAborted()) {
+    emit done(false);
+    return false;
+  }
+
+  bool inresourcethread = (QThread::currentThread() == pResource->thread());
+
+  if (!pStarted) {
+    pStarted = true;
+    // the number of entries in the sub-resource is an upper bound for the number of results
+    int total = pResource->allIds(pSubResource).size();
+    if (pRemaining >= 0)
+      total = qMin(total, pRemaining);
+    emit totalCountKnown(total);
+  }
+
+  KLFLibResourceEngine::Query q = pQuery;
+  q.limit = (pRemaining >= 0) ? qMin(pBatchSize, pRemaining) : pBatchSize;
+  if (q.limit == 0) {
+    emit done(true);
+    return false;
+  }
+
+  KLFLibResourceEngine::QueryResult result(pFillFlags);
+  // progress is reported for the whole query by the job, not for every batch
+  if (inresourcethread)
+    pResource->blockProgressReportingForNextOperation();
+  int count = pResource->query(pSubResource, q, &result);
+  if (count < 0) {
+    qWarning()<<KLF_FUNC_NAME<<": query failed on sub-resource "<<pSubResource;
+    emit done(false);
+    return false;
+  }
+
+  // the next batch starts right after this one; the query's skip applies to the first batch only
+  pQuery.skip = 0;
+  pQuery.continueAfter = result.nextCursor;
+  if (pRemaining >= 0)
+    pRemaining -= count;
+
+  if (isAborted()) {
+    emit done(false);
+    return false;
+  }
+
+  if (count > 0)
+    emit batchReady(result, count);
+
+  if (count < q.limit) {
+    // no more results
+    emit done(true);
+    return false;
+  }
+  return true;
+}
+
+
+// ---------------------------------------------------------------
+
+
+KLFLibResourceQueryJob::KLFLibResourceQueryJob(KLFLibResourceEngine *resource, const QString& subResource,
+					       const KLFLibResourceEngine::Query& query, uint fillFlags,
+					       int batchSize, bool reportProgress)
+  : QObject(resource), pResource(resource), pSubResource(subResource), pQuery(query),
+    pReportProgress(reportProgress), pRunning(false), pCanceled(false), pResultCount(0),
+    pWorker(NULL), pThread(NULL), pProgressReporter(NULL)
+{
+  qRegisterMetaType<KLFLibResourceEngine::QueryResult>("KLFLibResourceEngine::QueryResult");
+
+  pWorker = new KLFLibResourceQueryWorker(resource, subResource, query, fillFlags, batchSize);
+  // these connections become queued if the worker is moved to another thread
+  connect(pWorker, SIGNAL(totalCountKnown(int)), this, SLOT(workerTotalCountKnown(int)));
+  connect(pWorker, SIGNAL(batchReady(const KLFLibResourceEngine::QueryResult&, int)),
+	  this, SLOT(workerBatchReady(const KLFLibResourceEngine::QueryResult&, int)));
+  connect(pWorker, SIGNAL(done(bool)), this, SLOT(workerDone(bool)));
+}
+
+KLFLibResourceQueryJob::~KLFLibResourceQueryJob()
+{
+  pWorker->abort();
+  if (pThread != NULL) {
+    // the worker stops after the batch it is currently reading
+    pThread->quit();
+    pThread->wait();
+  }
+  delete pWorker;
+}
+
+void KLFLibResourceQueryJob::start()
+{
+  pRunning = true;
+
+  if (pResource->supportedFeatureFlags() & KLFLibResourceEngine::FeatureConcurrentRead) {
+    pThread = new QThread(this);
+    pWorker->moveToThread(pThread);
+    connect(pThread, SIGNAL(started()), pWorker, SLOT(run()));
+    pThread->start();
+  } else {
+    // read one batch per event loop iteration. Queue also the first one, so that the caller can
+    // connect to our signals first.
+    QMetaObject::invokeMethod(this, "runNextBatchInThisThread", Qt::QueuedConnection);
+  }
+}
+
+void KLFLibResourceQueryJob::runNextBatchInThisThread()
+{
+  if (!pRunning)
+    return;
+  if (pWorker->runBatch())
+    QMetaObject::invokeMethod(this, "runNextBatchInThisThread", Qt::QueuedConnection);
+}
+
+void KLFLibResourceQueryJob::cancel()
+{
+  if (!pRunning)
+    return;
+
+  klfDbg("canceling query on "<<pResource->url()<<", sub-resource "<<pSubResource) ;
+  pCanceled = true;
+  pWorker->abort();
+  finish(false);
+}
+
+void KLFLibResourceQueryJob::stopWorker()
+{
+  pWorker->abort();
+  if (pThread != NULL) {
+    // the worker stops after the batch it is currently reading
+    pThread->quit();
+    pThread->wait();
+  }
+  // last, as the receivers of finished() may delete us
+  cancel();
+}
+
+void KLFLibResourceQueryJob::workerTotalCountKnown(int total)
+{
+  if (!pRunning || !pReportProgress || pProgressReporter != NULL)
+    return;
+
+  pProgressReporter = new KLFProgressReporter(0, total, this);
+  emit pResource->operationStartReportingProgress(pProgressReporter,
+						  tr("Loading library entries ..."));
+}
+
+void KLFLibResourceQueryJob::workerBatchReady(const KLFLibResourceEngine::QueryResult& batch, int count)
+{
+  if (!pRunning)
+    return; // canceled, discard
+
+  pResultCount += count;
+  // finished() is emitted by the progress reporter when the job finishes
+  if (pProgressReporter != NULL && pResultCount < pProgressReporter->max())
+    pProgressReporter->doReportProgress(pResultCount);
+
+  emit resultsAvailable(batch);
+}
+
+void KLFLibResourceQueryJob::workerDone(bool success)
+{
+  finish(success && !pCanceled);
+}
+
+void KLFLibResourceQueryJob::finish(bool success)
+{
+  if (!pRunning)
+    return;
+
+  pRunning = false;
+  if (pThread != NULL)
+    pThread->quit();
+  if (pProgressReporter != NULL) {
+    delete pProgressReporter; // reports the maximum value and emits finished()
+    pProgressReporter = NULL;
+  }
+  emit finished(success);
+}
+
+
+// ---------------------------------------------------------------
+
+
+KLFLibResourceCopyReader::KLFLibResourceCopyReader(KLFLibResourceEngine *resource,
+						   const QString& subResource, int batchSize,
+						   int maxPendingBatches)
+  : QObject(NULL), pResource(resource), pSubResource(subResource), pBatchSize(batchSize),
+    pStarted(false), pPos(0), pFreeSlots(maxPendingBatches), pAbort(0)
+{
+}
+KLFLibResourceCopyReader::~KLFLibResourceCopyReader()
+{
+}
+
+void KLFLibResourceCopyReader::run()
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+  do {
+    // wait until the writer has caught up enough
+    pFreeSlots.acquire();
+  } while (runBatch());
+}
+
+bool KLFLibResourceCopyReader::runBatch()
+{
+  if (isAborted()) {
+    emit done(false);
+    return false;
+  }
+
+  bool inresourcethread = (QThread::currentThread() == pResource->thread());
+
+  if (!pStarted) {
+    pStarted = true;
+    pIds = pResource->allIds(pSubResource);
+    emit totalCountKnown(pIds.size());
+  }
+
+  if (pPos >= pIds.size()) {
+    emit done(true);
+    return false;
+  }
+
+  QList<KLFLib::entryId> ids = pIds.mid(pPos, pBatchSize);
+  pPos += ids.size();
+
+  // progress is reported for the whole copy by the job, not for every batch
+  if (inresourcethread)
+    pResource->blockProgressReportingForNextOperation();
+  QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId> batch
+    = pResource->encodedEntries(pSubResource, ids);
+
+  if (isAborted()) {
+    emit done(false);
+    return false;
+  }
+
+  emit batchReady(batch);
+
+  if (pPos >= pIds.size()) {
+    emit done(true);
+    return false;
+  }
+  return true;
+}
+
+
+// ---------------------------------------------------------------
+
+
+KLFLibResourceCopyJob::KLFLibResourceCopyJob(KLFLibResourceEngine *resource, const QString& subResource,
+					     KLFLibResourceEngine *destResource,
+					     const QString& destSubResource,
+					     int batchSize, bool reportProgress)
+  : QObject(resource), pResource(resource), pSubResource(subResource), pDestResource(destResource),
+    pDestSubResource(destSubResource), pReportProgress(reportProgress), pRunning(false),
+    pCanceled(false), pSuccess(false), pCopiedCount(0), pFailedCount(0), pReader(NULL),
+    pThread(NULL), pProgressReporter(NULL)
+{
+  qRegisterMetaType<QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId> >
+    ("QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId>");
+
+  pReader = new KLFLibResourceCopyReader(resource, subResource, batchSize);
+  // these connections become queued if the reader is moved to another thread
+  connect(pReader, SIGNAL(totalCountKnown(int)), this, SLOT(readerTotalCountKnown(int)));
+  connect(pReader, SIGNAL(batchReady(const QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId>&)),
+	  this, SLOT(readerBatchReady(const QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId>&)));
+  connect(pReader, SIGNAL(done(bool)), this, SLOT(readerDone(bool)));
+}
+
+KLFLibResourceCopyJob::~KLFLibResourceCopyJob()
+{
+  pReader->abort();
+  if (pThread != NULL) {
+    // the reader stops after the batch it is currently reading
+    pThread->quit();
+    pThread->wait();
+  }
+  delete pReader;
+}
+
+void KLFLibResourceCopyJob::start()
+{
+  pRunning = true;
+
+  if (pResource->supportedFeatureFlags() & KLFLibResourceEngine::FeatureConcurrentRead) {
+    pThread = new QThread(this);
+    pReader->moveToThread(pThread);
+    connect(pThread, SIGNAL(started()), pReader, SLOT(run()));
+    pThread->start();
+  } else {
+    // read and write one batch per event loop iteration. Queue also the first one, so that the
+    // caller can connect to our signals first.
+    QMetaObject::invokeMethod(this, "runNextBatchInThisThread", Qt::QueuedConnection);
+  }
+}
+
+bool KLFLibResourceCopyJob::waitForFinished(QEventLoop::ProcessEventsFlags flags)
+{
+  if (pRunning) {
+    // finished() is emitted from the event loop only, so quit() can't be called before exec().
+    QEventLoop loop;
+    connect(this, SIGNAL(finished(bool)), &loop, SLOT(quit()));
+    loop.exec(flags);
+  }
+  return pSuccess;
+}
+
+void KLFLibResourceCopyJob::runNextBatchInThisThread()
+{
+  if (!pRunning)
+    return;
+  // the batch is written by readerBatchReady() before runBatch() returns
+  if (pReader->runBatch())
+    QMetaObject::invokeMethod(this, "runNextBatchInThisThread", Qt::QueuedConnection);
+}
+
+void KLFLibResourceCopyJob::cancel()
+{
+  if (!pRunning)
+    return;
+
+  klfDbg("canceling copy from "<<pResource->url()<<", sub-resource "<<pSubResource) ;
+  pCanceled = true;
+  pReader->abort();
+  finish(false);
+}
+
+void KLFLibResourceCopyJob::stopWorker()
+{
+  pReader->abort();
+  if (pThread != NULL) {
+    // the reader stops after the batch it is currently reading
+    pThread->quit();
+    pThread->wait();
+  }
+  // last, as the receivers of finished() may delete us
+  cancel();
+}
+
+void KLFLibResourceCopyJob::readerTotalCountKnown(int total)
+{
+  if (!pRunning || !pReportProgress || pProgressReporter != NULL)
+    return;
+
+  pProgressReporter = new KLFProgressReporter(0, total, this);
+  emit pDestResource->operationStartReportingProgress(pProgressReporter,
+						      tr("Copying library entries ..."));
+}
+
+void KLFLibResourceCopyJob::readerBatchReady(const QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId>& batch)
+{
+  if (!pRunning)
+    return; // canceled, discard
+
+  // skip the entries that disappeared from the source since the IDs were listed
+  QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId> elist;
+  int k;
+  for (k = 0; k < batch.size(); ++k) {
+    if (batch[k].id >= 0)
+      elist << batch[k];
+  }
+
+  QList<KLFLib::entryId> insertedIds;
+  if (!elist.isEmpty()) {
+    pDestResource->blockProgressReportingForNextOperation();
+    insertedIds = pDestResource->insertEncodedEntries(pDestSubResource, elist);
+  }
+  if (pThread != NULL)
+    pReader->batchWritten();
+
+  if (insertedIds.size() != elist.size()) {
+    qWarning()<<KLF_FUNC_NAME<<": failed to insert "<<elist.size()<<" entries into "
+	      <<pDestResource->url()<<", sub-resource "<<pDestSubResource;
+    pFailedCount += elist.size();
+  } else {
+    for (k = 0; k < insertedIds.size(); ++k) {
+      if (insertedIds[k] < 0)
+	++pFailedCount;
+      else
+	++pCopiedCount;
+    }
+  }
+
+  // finished() is emitted by the progress reporter when the job finishes
+  if (pProgressReporter != NULL && pCopiedCount+pFailedCount < pProgressReporter->max())
+    pProgressReporter->doReportProgress(pCopiedCount+pFailedCount);
+
+  if (!insertedIds.isEmpty())
+    emit entriesCopied(insertedIds);
+}
+
+void KLFLibResourceCopyJob::readerDone(bool success)
+{
+  finish(success && !pCanceled && pFailedCount == 0);
+}
+
+void KLFLibResourceCopyJob::finish(bool success)
+{
+  if (!pRunning)
+    return;
+
+  pRunning = false;
+  pSuccess = success;
+  if (pThread != NULL)
+    pThread->quit();
+  if (pProgressReporter != NULL) {
+    delete pProgressReporter; // reports the maximum value and emits finished()
+    pProgressReporter = NULL;
+  }
+  emit finished(success);
+}
+
 
 KLFLibResourceEngine::entryId KLFLibResourceEngine::insertEntry(const QString& subResource,
 								const KLFLibEntry& entry)
@@ -699,6 +1723,17 @@ QList<KLFLibResourceEngine::entryId> KLFLibResourceEngine::insertEntries(const K
   return insertEntries(pDefaultSubResource, entrylist);
 }
 
+QList<KLFLibResourceEngine::entryId>
+/* */ KLFLibResourceEngine::insertEncodedEntries(const QString& subResource,
+						 const QList<KLFLibEncodedEntryWithId>& entrylist)
+{
+  KLFLibEntryList elist;
+  int k;
+  for (k = 0; k < entrylist.size(); ++k)
+    elist << klf_lib_decoded_entry(entrylist[k]);
+  return insertEntries(subResource, elist);
+}
+
 bool KLFLibResourceEngine::changeEntries(const QList<entryId>& idlist, const QList<int>& properties,
 					 const QList<QVariant>& values)
 {
@@ -899,7 +1934,8 @@ KLF_EXPORT  QDebug& operator<<(QDebug& dbg, const KLFLibResourceEngine::Query& q
   //  KLF_DEBUG_BLOCK("operator<<(QDebug, KLFLibRes.Eng.::Query)") ;
   return dbg << "Query(cond.="<<q.matchCondition<<"; skip="<<q.skip<<",limit="<<q.limit
 	     <<"; orderpropid="<<q.orderPropId<<"/"<<(q.orderDirection==Qt::AscendingOrder ? "Asc":"Desc")
-	     <<"; wanted props="<<q.wantedEntryProperties<<")" ;
+	     <<"; wanted props="<<q.wantedEntryProperties
+	     <<"; continue after="<<q.continueAfter.lastOrderValue<<"/id="<<q.continueAfter.lastId<<")" ;
 }
 
 
@@ -910,9 +1946,11 @@ KLF_EXPORT  QDebug& operator<<(QDebug& dbg, const KLFLibResourceEngine::Query& q
 QList<KLFLib::entryId> KLFLibResourceSimpleEngine::allIds(const QString& subResource)
 {
   QList<KLFLib::entryId> idList;
-  QList<KLFLibResourceEngine::KLFLibEntryWithId> elist = allEntries(subResource);
+  // don't fetch (and decode) all the properties just to get the IDs
+  QList<KLFLibResourceEngine::KLFLibEntryWithId> elist
+    = allEntries(subResource, QList<int>() << KLFLibEntry::DateTime);
   int k;
-  for (k = 0; k < idList.size(); ++k)
+  for (k = 0; k < elist.size(); ++k)
     idList << elist[k].id;
   return idList;
 }
@@ -948,31 +1986,6 @@ QList<QVariant> KLFLibResourceSimpleEngine::queryValues(const QString& subResour
 }
 
 
-template<class T>
-static void qlist_skip_and_limit(QList<T> *list, int skip, int limit)
-{
-  KLF_ASSERT_NOT_NULL( list, "list is NULL!", return; ) ;
-
-  // skip `skip' first entries
-
-  if (skip <= 0) {
-    // nothing to do
-  } else if (list->size() <= skip) {
-    list->clear();
-  } else {
-    *list = list->mid(skip);
-  }
-
-  // and limit to `limit'
-  if (limit < 0)
-    return; // no limit
-
-  if (list->size() > limit)
-    *list = list->mid(0, limit);
-
-  return;
-}
-
 // static
 int KLFLibResourceSimpleEngine::queryImpl(KLFLibResourceEngine *resource, const QString& subResource,
 					  const Query& query, QueryResult *result)
@@ -990,7 +2003,9 @@ int KLFLibResourceSimpleEngine::queryImpl(KLFLibResourceEngine *resource, const
   QList<KLFLibEntryWithId> allEList = resource->allEntries(subResource);
 
   KLFLibEntrySorter sorter(query.orderPropId, query.orderDirection);
-  QueryResultListSorter lsorter(&sorter, result);
+  // always sort into an entry-with-id list, we need the IDs to locate the continuation cursor
+  QueryResult ordered(QueryResult::FillEntryWithIdList);
+  QueryResultListSorter lsorter(&sorter, &ordered);
 
   // we first need to order _all_ the entries (yes, since the order of allEntries()
   // is undefined ... and limit/skip refer to _ordered_ entry list...)
@@ -1003,18 +2018,55 @@ int KLFLibResourceSimpleEngine::queryImpl(KLFLibResourceEngine *resource, const
     }
   }
 
-  klfDbgSt("queried ordered list. result->entryWithIdList: \n"<<result->entryWithIdList) ;
-
-  // now we need to remove the first 'query.skip' number of results.
-  // we can't do this while inserting because the order counts.
+  const QList<KLFLibEntryWithId>& olist = ordered.entryWithIdList;
+
+  klfDbgSt("queried ordered list: \n"<<olist) ;
+
+  // now find where to start. We can't do this while inserting because the order counts.
+
+  int start = 0;
+  if (query.continueAfter.isValid()) {
+    // emulate keyset pagination: start right after the entry the cursor refers to
+    for (start = 0; start < olist.size() && olist[start].id != query.continueAfter.lastId; ++start)
+      ;
+    if (start < olist.size()) {
+      ++start;
+    } else if (query.orderPropId >= 0) {
+      // that entry is gone, locate the cursor with its sort key value instead
+      KLFLibEntry cursorentry;
+      cursorentry.setProperty(query.orderPropId, query.continueAfter.lastOrderValue);
+      for (start = 0; start < olist.size() && !sorter(cursorentry, olist[start].entry); ++start)
+	;
+    } else {
+      start = olist.size();
+    }
+  }
+  start = qMin(start + qMax(query.skip, 0), olist.size());
+  int end = olist.size();
+  if (query.limit >= 0)
+    end = qMin(end, start + query.limit);
+
+  for (k = start; k < end; ++k) {
+    const KLFLibEntryWithId& ewid = olist[k];
+    if (result->fillFlags & QueryResult::FillEntryIdList)
+      result->entryIdList << ewid.id;
+    if (result->fillFlags & QueryResult::FillRawEntryList)
+      result->rawEntryList << ewid.entry;
+    if (result->fillFlags & QueryResult::FillEntryWithIdList)
+      result->entryWithIdList << ewid;
+  }
 
-  qlist_skip_and_limit(&result->entryIdList, query.skip, query.limit);
-  qlist_skip_and_limit(&result->rawEntryList, query.skip, query.limit);
-  qlist_skip_and_limit(&result->entryWithIdList, query.skip, query.limit);
+  if (end > start) {
+    const KLFLibEntryWithId& last = olist[end-1];
+    result->nextCursor = QueryCursor(query.orderPropId >= 0 ? last.entry.property(query.orderPropId) : QVariant(),
+				     last.id);
+  } else {
+    result->nextCursor = query.continueAfter;
+  }
 
   klfDbgSt("About to return. Number of entries in TEE VALUE.") ;
 
-  return KLF_DEBUG_TEE( lsorter.numberOfEntries() );
+  return KLF_DEBUG_TEE( end - start );
 }
 
 // static
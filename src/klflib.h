@@ -30,6 +30,7 @@
 #include <QDataStream>
 #include <QDateTime>
 #include <QFileInfo>
+#include <QEventLoop>
 
 #include <klfdefs.h>
 #include <klfbackend.h>
@@ -40,7 +41,10 @@
 
 
 
+class QThread;
 class KLFProgressReporter;
+class KLFLibResourceQueryJob;
+class KLFLibResourceCopyJob;
 
 
 
@@ -451,6 +455,22 @@ public:
     KLFLibEntry entry;
   };
 
+  //! A KLFLibEntry with its ID, whose preview is kept in encoded form
+  /** Used to copy entries from one resource to another without decoding and re-encoding the
+   * previews, see \ref encodedEntries(), \ref insertEncodedEntries() and \ref copyEntriesAsync().
+   *
+   * The \c entry has no \ref KLFLibEntry::Preview property set, but its
+   * \ref KLFLibEntry::PreviewSize is set. The preview itself is given as PNG data in
+   * \c previewData. */
+  struct KLFLibEncodedEntryWithId {
+    KLFLibEncodedEntryWithId(entryId i = -1, const KLFLibEntry& e = KLFLibEntry(),
+			     const QByteArray& pdata = QByteArray())
+      : id(i), entry(e), previewData(pdata) { }
+    entryId id;
+    KLFLibEntry entry;
+    QByteArray previewData;
+  };
+
   /** List of built-in KLFPropertizedObject-properties. See
    * \ref KLFLibResourceEngine "class documentation" and \ref setResourceProperty(). */
   enum ResourceProperty {
@@ -512,7 +532,13 @@ public:
      * Note that views may assume that implementing sub-resource properties means also providing
      * sensible values and/or loaded/stored values for the built-in sub-resource properties
      * described in the \ref SubResourceProperty enum. */
-    FeatureSubResourceProps	= 0x0010
+    FeatureSubResourceProps	= 0x0010,
+    //! Reading functions may be called from other threads
+    /** Flag indicating that the data reading functions (\ref query(), \ref queryValues(),
+     * \ref entries(), \ref allIds(), ...) may safely be called from a thread other than the one
+     * this object lives in, concurrently with the main thread. \ref queryAsync() then runs the
+     * query in a worker thread. */
+    FeatureConcurrentRead	= 0x0020
   };
 
   /**
@@ -896,6 +922,53 @@ public:
   virtual QList<KLFLibEntryWithId> entries(const QList<KLFLib::entryId>& idList,
 					   const QList<int>& wantedEntryProperties = QList<int>());
 
+  //! query multiple entries, leaving their previews encoded
+  /** Same as \ref entries(const QString&, const QList<KLFLib::entryId>&, const QList<int>&) with
+   * all properties, except that the previews are returned as PNG data instead of being decoded
+   * into a QImage. See \ref KLFLibEncodedEntryWithId.
+   *
+   * This function is used to copy entries between resources (see \ref copyEntriesAsync()). If
+   * \ref FeatureConcurrentRead is supported, it may be called from another thread.
+   *
+   * The default implementation calls \ref entries() and encodes the preview images. Engines
+   * that store their previews as PNG data should reimplement this function to return that data
+   * directly.
+   */
+  virtual QList<KLFLibEncodedEntryWithId> encodedEntries(const QString& subResource,
+							 const QList<KLFLib::entryId>& idList);
+
+
+  /** \brief A continuation token to page through the results of query()
+   *
+   * A cursor remembers the position of the last entry that was returned by a query() call, in
+   * the form of the value of the sort key (the property given by <tt>Query::orderPropId</tt>)
+   * and of the entry ID of that entry. Each query() call stores such a cursor into
+   * <tt>QueryResult::nextCursor</tt>; set it as <tt>Query::continueAfter</tt> in the next
+   * query() call to get the following batch of results (\a keyset pagination).
+   *
+   * As opposed to setting a <tt>Query::skip</tt> value, an engine can seek directly to the
+   * position given by a cursor (eg. in SQL, <tt>WHERE (key,id) > (?,?)</tt>), so that fetching
+   * a batch of results costs the same at any depth in the result list.
+   *
+   * The value stored in \c lastOrderValue is engine-specific (eg. the raw database value) and
+   * should be treated as opaque by the caller. A cursor is only meaningful if the following
+   * query uses the same match condition, \c orderPropId and \c orderDirection as the query
+   * that returned it.
+   */
+  struct QueryCursor
+  {
+    /** Builds an invalid cursor, i.e. one that does not refer to any position. */
+    QueryCursor() : lastOrderValue(), lastId(-1)  { }
+    QueryCursor(const QVariant& lastordervalue, KLFLib::entryId lastid)
+      : lastOrderValue(lastordervalue), lastId(lastid)  { }
+
+    inline bool isValid() const { return lastId >= 0; }
+
+    //! The (engine-specific) value of the sort key of the last returned entry
+    QVariant lastOrderValue;
+    //! The entry ID of the last returned entry
+    KLFLib::entryId lastId;
+  };
 
   /** \brief A structure that describes a query for query()
    *
@@ -917,6 +990,13 @@ public:
    *
    * A \c limit may be set to limit the number of returned results (default is \c -1, meaning no limit).
    *
+   * If \c continueAfter is a valid \ref QueryCursor, then only the entries that come strictly after
+   * the position of the cursor (in the order given by \c orderPropId and \c orderDirection) are
+   * considered. The \c skip value, if any, then counts from that position. To page through a
+   * large result list, prefer passing the <tt>QueryResult::nextCursor</tt> of the previous call
+   * over increasing \c skip. Entries that compare equal with respect to the sort key are ordered
+   * by their entry ID, in the same direction. By default, \c continueAfter is invalid.
+   *
    * \c orderPropId specifies along which KLFLibEntry property ID the items should be ordered. This
    * can be \c -1 to specify that elements should not be ordered; their order will then be undefined.
    * Default value: \c -1.
@@ -939,7 +1019,8 @@ public:
 	limit(-1),
 	orderPropId(-1),
 	orderDirection(Qt::AscendingOrder),
-	wantedEntryProperties(QList<int>())
+	wantedEntryProperties(QList<int>()),
+	continueAfter()
     {
     }
 
@@ -949,6 +1030,7 @@ public:
     int orderPropId;
     Qt::SortOrder orderDirection;
     QList<int> wantedEntryProperties;
+    QueryCursor continueAfter;
   };
 
   /** \brief A structure that will hold the result of a query() query.
@@ -963,6 +1045,10 @@ public:
    * Once the \c fillFlags adjusted, pass a pointer to this object to the query() function to
    * retrieve results.
    *
+   * \c nextCursor is set by query() to the position of the last returned entry, independently of
+   * the \c fillFlags. Pass it as <tt>Query::continueAfter</tt> to fetch the next results. If no
+   * entries were returned, it is set to the <tt>Query::continueAfter</tt> cursor of the query.
+   *
    * \warning The lists in this object are not garanteed to be cleared at the beginning of
    *   query(). If you recycle this object to call query() a second time, be sure to clean this
    *   object first.
@@ -973,12 +1059,14 @@ public:
 
     /** Constructor. Sets \c fillFlags as given, and sets reasonable default values for the other
      * members. */
-    QueryResult(uint fill_flags = 0x00)  : fillFlags(fill_flags)   {  }
+    QueryResult(uint fill_flags = 0x00)  : fillFlags(fill_flags), nextCursor()   {  }
     uint fillFlags;
 
     QList<KLFLib::entryId> entryIdList;
     KLFLibEntryList rawEntryList;
     QList<KLFLibEntryWithId> entryWithIdList;
+
+    QueryCursor nextCursor;
   };
 
 
@@ -1056,6 +1144,49 @@ public:
   virtual QList<QVariant> queryValues(const QString& subResource, int entryPropId) = 0;
 
 
+  //! Query entries asynchronously, delivering results in batches
+  /** Starts running \c query on sub-resource \c subResource in the background, and returns
+   * immediately a \ref KLFLibResourceQueryJob handle that reports results in batches of at most
+   * \c batchSize entries through its \ref KLFLibResourceQueryJob::resultsAvailable() signal. The
+   * lists of the delivered \ref QueryResult objects are filled according to \c fillFlags.
+   *
+   * The batches are obtained by calling \ref query() repeatedly, chaining the
+   * <tt>QueryResult::nextCursor</tt> of each batch to the next one. If this engine supports
+   * \ref FeatureConcurrentRead, the batches are read in a worker thread. Otherwise, they are read
+   * one at a time from the event loop of this object's thread, so that the user interface stays
+   * responsive in between.
+   *
+   * Progress is reported with \ref operationStartReportingProgress() (unless progress reporting
+   * is blocked for this operation).
+   *
+   * The returned job is a child of this resource; delete it (eg. with \c deleteLater()) once
+   * you don't need it any more. Deleting the job cancels the query.
+   */
+  virtual KLFLibResourceQueryJob * queryAsync(const QString& subResource, const Query& query,
+					      uint fillFlags, int batchSize = 200);
+
+  //! Copy all entries of a sub-resource into another resource, in the background
+  /** Copies all entries of sub-resource \c subResource of this resource into sub-resource
+   * \c destSubResource of resource \c dest, and returns immediately a
+   * \ref KLFLibResourceCopyJob handle that reports when the copy is finished.
+   *
+   * The entries are read in batches of \c batchSize entries with \ref encodedEntries(), and
+   * are inserted into \c dest with \ref insertEncodedEntries(), so that the previews are never
+   * decoded if both engines store PNG data. If this engine supports \ref FeatureConcurrentRead,
+   * the entries are read in a worker thread while the previous batch is being written.
+   * Otherwise, one batch is read and written per event loop iteration.
+   *
+   * Progress is reported by \c dest with \ref operationStartReportingProgress() (unless
+   * progress reporting is blocked for its next operation).
+   *
+   * The returned job is a child of this resource; delete it (eg. with \c deleteLater()) once
+   * you don't need it any more. Deleting the job cancels the copy. \c dest must not be deleted
+   * while the job is running.
+   */
+  virtual KLFLibResourceCopyJob * copyEntriesAsync(const QString& subResource, KLFLibResourceEngine *dest,
+						   const QString& destSubResource, int batchSize = 200);
+
+
   //! Returns all IDs in this resource (and this sub-resource)
   /** Returns a list of the ID of each entry in this resource.
    *
@@ -1193,6 +1324,12 @@ signals:
   void operationStartReportingProgress(KLFProgressReporter *progressReporter,
 				       const QString& descriptiveText);
 
+  //! Emitted by \ref stopAsyncJobs(), before the resource is destroyed
+  /** Objects that read this resource from other threads by other means than the asynchronous jobs
+   * (eg. with a QThreadPool) must connect to this signal with a Qt::DirectConnection, and stop
+   * accessing the resource before returning. */
+  void asyncJobsStopping();
+
 
 
 public slots:
@@ -1399,6 +1536,19 @@ public slots:
    */
   virtual QList<entryId> insertEntries(const KLFLibEntryList& entrylist);
 
+  //! Insert new entries whose previews are given in encoded form
+  /** Inserts the given entries into sub-resource \c subResource, as \ref insertEntries()
+   * would, with the preview of each entry given as PNG data (see
+   * \ref KLFLibEncodedEntryWithId). The IDs of the given entries are ignored. Returns the list
+   * of the IDs attributed to the new entries, as \ref insertEntries() does.
+   *
+   * The default implementation decodes the previews and calls \ref insertEntries(). Engines
+   * that store their previews as PNG data should reimplement this function to store the given
+   * data directly.
+   */
+  virtual QList<entryId> insertEncodedEntries(const QString& subResource,
+					      const QList<KLFLibEncodedEntryWithId>& entrylist);
+
   //! Change some entries in this resource.
   /** The entries specified by the ids \c idlist are modified. The properties given
    * in \c properties (which should be KLFLibEntry property IDs) are to be set to the respective
@@ -1541,6 +1691,16 @@ protected:
 
   bool thisOperationProgressBlocked() const;
 
+  //! Stops the asynchronous jobs reading from this resource
+  /** Cancels the running \ref KLFLibResourceQueryJob "query" and \ref KLFLibResourceCopyJob "copy"
+   * jobs started on this resource, and waits until their worker threads no longer access it.
+   * Emits \ref asyncJobsStopping() for the other readers.
+   *
+   * The workers call the virtual methods of this object, so subclasses must call this function
+   * at the beginning of their destructor. It is called again by this class' destructor, but the
+   * subclass part of the object is already destroyed at that point. */
+  void stopAsyncJobs();
+
 private:
   void initRegisteredProperties();
 
@@ -1553,12 +1713,188 @@ private:
   mutable bool pProgressBlocked;
   bool pThisOperationProgressBlockedOnly;
 
+  friend class KLFLibResourceQueryJob;
+  friend class KLFLibResourceCopyJob;
+
   KLF_DEBUG_DECLARE_REF_INSTANCE( QFileInfo(url().path()).fileName()+":"+defaultSubResource()  ) ;
 };
 
 
 Q_DECLARE_METATYPE(KLFLibResourceEngine::KLFLibEntryWithId)
   ;
+Q_DECLARE_METATYPE(KLFLibResourceEngine::QueryResult)
+  ;
+Q_DECLARE_METATYPE(KLFLibResourceEngine::KLFLibEncodedEntryWithId)
+  ;
+
+
+class KLFLibResourceQueryWorker;
+
+//! A handle to a running asynchronous query
+/** Objects of this class are returned by \ref KLFLibResourceEngine::queryAsync(). They deliver
+ * the query results in batches with \ref resultsAvailable(), and emit \ref finished() when
+ * all results have been delivered, when an error occurred or when the query was canceled.
+ *
+ * All signals of this object are emitted in the thread of the resource engine, even if the
+ * query itself runs in a worker thread.
+ */
+class KLF_EXPORT KLFLibResourceQueryJob : public QObject
+{
+  Q_OBJECT
+public:
+  virtual ~KLFLibResourceQueryJob();
+
+  KLFLibResourceEngine * resource() const { return pResource; }
+  QString subResource() const { return pSubResource; }
+  KLFLibResourceEngine::Query query() const { return pQuery; }
+
+  //! Whether the query is still running
+  bool isRunning() const { return pRunning; }
+  //! Whether \ref cancel() was called before the query completed
+  bool isCanceled() const { return pCanceled; }
+  //! The number of entries delivered so far with \ref resultsAvailable()
+  int resultCount() const { return pResultCount; }
+
+signals:
+  //! A new batch of results is available
+  /** \c batch contains the next results of the query, in the requested order. Its
+   * <tt>nextCursor</tt> may be used to continue the query later with \ref KLFLibResourceEngine::query().
+   */
+  void resultsAvailable(const KLFLibResourceEngine::QueryResult& batch);
+  //! The query is finished
+  /** \c success is FALSE if the query failed or was canceled. No more results will be delivered
+   * after this signal has been emitted. */
+  void finished(bool success);
+
+public slots:
+  //! Stops the query as soon as possible
+  /** Batches that are already under way are discarded; finished() is emitted with FALSE. Has no
+   * effect if the query has already finished. */
+  void cancel();
+
+private slots:
+  void workerTotalCountKnown(int total);
+  void workerBatchReady(const KLFLibResourceEngine::QueryResult& batch, int count);
+  void workerDone(bool success);
+  void runNextBatchInThisThread();
+
+private:
+  KLFLibResourceQueryJob(KLFLibResourceEngine *resource, const QString& subResource,
+			 const KLFLibResourceEngine::Query& query, uint fillFlags, int batchSize,
+			 bool reportProgress);
+  void start();
+  void finish(bool success);
+  /** Cancels the job and waits for the worker thread to stop accessing the resource */
+  void stopWorker();
+
+  friend class KLFLibResourceEngine;
+
+  KLFLibResourceEngine *pResource;
+  QString pSubResource;
+  KLFLibResourceEngine::Query pQuery;
+
+  bool pReportProgress;
+  bool pRunning;
+  bool pCanceled;
+  int pResultCount;
+
+  KLFLibResourceQueryWorker *pWorker;
+  QThread *pThread;
+  KLFProgressReporter *pProgressReporter;
+};
+
+
+class KLFLibResourceCopyReader;
+
+//! A handle to a running copy of entries between two resources
+/** Objects of this class are returned by \ref KLFLibResourceEngine::copyEntriesAsync(). The
+ * entries are read from the source resource in batches with
+ * \ref KLFLibResourceEngine::encodedEntries(), and each batch is written to the destination
+ * resource with \ref KLFLibResourceEngine::insertEncodedEntries() in the thread of the
+ * destination resource. If the source resource supports
+ * \ref KLFLibResourceEngine::FeatureConcurrentRead, the next batches are read in a worker
+ * thread meanwhile; at most a few batches are read ahead of the writer.
+ *
+ * All signals of this object are emitted in the thread of the source resource, which must be
+ * the thread of the destination resource.
+ */
+class KLF_EXPORT KLFLibResourceCopyJob : public QObject
+{
+  Q_OBJECT
+public:
+  virtual ~KLFLibResourceCopyJob();
+
+  KLFLibResourceEngine * resource() const { return pResource; }
+  QString subResource() const { return pSubResource; }
+  KLFLibResourceEngine * destResource() const { return pDestResource; }
+  QString destSubResource() const { return pDestSubResource; }
+
+  //! Whether the copy is still running
+  bool isRunning() const { return pRunning; }
+  //! Whether \ref cancel() was called before the copy completed
+  bool isCanceled() const { return pCanceled; }
+  //! Whether the copy finished successfully
+  /** Only meaningful once the job has finished. */
+  bool isSuccessful() const { return pSuccess; }
+  //! The number of entries inserted so far into the destination resource
+  int copiedCount() const { return pCopiedCount; }
+  //! The number of entries that could not be inserted into the destination resource
+  int failedCount() const { return pFailedCount; }
+
+  //! Waits until the job has finished
+  /** Runs a local event loop with the given \c flags until the job has finished. Only allow
+   * user input events if a modal dialog (e.g. with a cancel button) is shown meanwhile.
+   * Returns \ref isSuccessful(). */
+  bool waitForFinished(QEventLoop::ProcessEventsFlags flags = QEventLoop::ExcludeUserInputEvents);
+
+signals:
+  //! A batch of entries was inserted into the destination resource
+  /** \c insertedIds are the IDs of the new entries in the destination resource. */
+  void entriesCopied(const QList<KLFLib::entryId>& insertedIds);
+  //! The copy is finished
+  /** \c success is FALSE if some entries could not be read or written, or if the copy was
+   * canceled. The entries that were already copied are not removed from the destination. */
+  void finished(bool success);
+
+public slots:
+  //! Stops the copy as soon as possible
+  /** The batch that is being written is completed, further batches are discarded; finished()
+   * is emitted with FALSE. Has no effect if the copy has already finished. */
+  void cancel();
+
+private slots:
+  void readerTotalCountKnown(int total);
+  void readerBatchReady(const QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId>& batch);
+  void readerDone(bool success);
+  void runNextBatchInThisThread();
+
+private:
+  KLFLibResourceCopyJob(KLFLibResourceEngine *resource, const QString& subResource,
+			KLFLibResourceEngine *destResource, const QString& destSubResource,
+			int batchSize, bool reportProgress);
+  void start();
+  void finish(bool success);
+  /** Cancels the job and waits for the worker thread to stop accessing the resource */
+  void stopWorker();
+
+  friend class KLFLibResourceEngine;
+
+  KLFLibResourceEngine *pResource;
+  QString pSubResource;
+  KLFLibResourceEngine *pDestResource;
+  QString pDestSubResource;
+
+  bool pReportProgress;
+  bool pRunning;
+  bool pCanceled;
+  bool pSuccess;
+  int pCopiedCount;
+  int pFailedCount;
+
+  KLFLibResourceCopyReader *pReader;
+  QThread *pThread;
+  KLFProgressReporter *pProgressReporter;
+};
 
 
 KLF_EXPORT QDataStream& operator<<(QDataStream& stream,
@@ -1835,6 +2171,76 @@ private:
 // -------------------------
 
 
+struct KLFLibEntryColumnarDataPrivate;
+
+//! Columnar binary encoding of a list of library entries
+/** This class writes and reads the <tt>application/x-klf-libentries-columnar</tt> format, see
+ * \ref appxMimeLib_columnar. As opposed to the QDataStream-based
+ * <tt>application/x-klf-libentries</tt> format, strings and styles are stored once in tables,
+ * previews are stored as raw PNG data, and the entries can be read individually (random access)
+ * without parsing the whole data.
+ *
+ * Use encode() to produce the data. To read the data, construct an object on it and check
+ * isValid(). The data can be read directly from a memory-mapped file (see \ref QFile::map()),
+ * in which case the mapping must stay valid while this object is used.
+ */
+class KLF_EXPORT KLFLibEntryColumnarData
+{
+public:
+  //! The current version of the format
+  enum { Version = 1 };
+
+  //! Read the data in \c data
+  KLFLibEntryColumnarData(const QByteArray& data);
+  //! Read the data of size \c size at \c data, which is not copied
+  /** \c data must stay valid while this object exists. */
+  KLFLibEntryColumnarData(const uchar *data, qint64 size);
+  ~KLFLibEntryColumnarData();
+
+  //! Encodes the given entries with their preview PNG data, and the given meta data
+  /** The IDs of the entries are not stored. */
+  static QByteArray encode(const QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId>& entryList,
+			   const QVariantMap& metaData);
+  //! Encodes the given entries and the given meta data
+  /** The previews are encoded as PNG. */
+  static QByteArray encode(const KLFLibEntryList& entryList, const QVariantMap& metaData);
+
+  //! TRUE if \c data starts with the magic string of this format (the data is not validated)
+  /** The magic string is 8 bytes long. */
+  static bool hasHeader(const QByteArray& data);
+
+  //! TRUE if the data has a valid header and tables
+  bool isValid() const;
+  //! The number of entries in the data
+  int count() const;
+  //! The meta data stored with the entries
+  QVariantMap metaData() const;
+
+  QString latex(int i) const;
+  QString category(int i) const;
+  QString tags(int i) const;
+  QDateTime dateTime(int i) const;
+  KLFStyle style(int i) const;
+  QSize previewSize(int i) const;
+  //! The PNG data of the preview of entry \c i
+  QByteArray previewData(int i) const;
+
+  //! Entry \c i. The preview is decoded only if \c withPreview is TRUE
+  KLFLibEntry entry(int i, bool withPreview = true) const;
+  //! Entry \c i, with its preview as PNG data. The ID is set to \c i.
+  KLFLibResourceEngine::KLFLibEncodedEntryWithId encodedEntry(int i) const;
+
+  //! All entries, with decoded previews
+  KLFLibEntryList entryList() const;
+  //! All entries, with their previews as PNG data. The IDs are set to the entry index.
+  QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId> encodedEntryList() const;
+
+private:
+  KLF_DECLARE_PRIVATE(KLFLibEntryColumnarData) ;
+  Q_DISABLE_COPY(KLFLibEntryColumnarData)
+};
+
+
 class QMimeData;
 
 //! Helper class to encode an entry list as mime data (abstract interface)
@@ -1860,9 +2266,21 @@ public:
   static QStringList allDecodingMimeTypes();
   //! Creates a QMetaData with all known registered encoding mime types
   static QMimeData *createMimeData(const KLFLibEntryList& entryList, const QVariantMap& metaData);
+  //! Creates a QMimeData for entries whose previews are given as PNG data
+  /** Only the <tt>application/x-klf-libentries-columnar</tt> data is encoded right away, from
+   * the given PNG data. The other registered mime types are encoded when they are requested. */
+  static QMimeData *createMimeData(const QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId>& entryList,
+				   const QVariantMap& metaData);
   static bool canDecodeMimeData(const QMimeData *mimeData);
   static bool decodeMimeData(const QMimeData *mimeData, KLFLibEntryList *entryList,
 			     QVariantMap *metaData);
+  //! Decodes the entries in \c mimeData, leaving their previews encoded
+  /** If \c mimeData has <tt>application/x-klf-libentries-columnar</tt> data, the previews are
+   * read directly from it. Otherwise the data is decoded with \ref decodeMimeData() and the
+   * previews are encoded as PNG. */
+  static bool decodeMimeData(const QMimeData *mimeData,
+			     QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId> *entryList,
+			     QVariantMap *metaData);
 
   static KLFAbstractLibEntryMimeEncoder *findEncoderFor(const QString& mimeType,
 							bool warnIfNotFound = true);
@@ -31,6 +31,10 @@
 #include <QDomDocument>
 #include <QDomNode>
 #include <QDomElement>
+#include <QAtomicInt>
+#include <QSemaphore>
+#include <QMimeData>
+#include <QtEndian>
 
 #include "klflib.h"
 
@@ -46,6 +50,7 @@ public:
   virtual QStringList supportedEncodingMimeTypes() const
   {
     return QStringList() /*<< "application/x-klf-library-entries"*/
+			 << "application/x-klf-libentries-columnar"
 			 << "application/x-klf-libentries"
 			 << "text/html"
 			 << "text/plain"
@@ -54,7 +59,9 @@ public:
   }
   virtual QStringList supportedDecodingMimeTypes() const
   {
-    return QStringList()/* << "application/x-klf-library-entries"*/ << "application/x-klf-libentries";
+    return QStringList()/* << "application/x-klf-library-entries"*/
+			<< "application/x-klf-libentries-columnar"
+			<< "application/x-klf-libentries";
   }
 
   virtual QByteArray encodeMime(const KLFLibEntryList& entryList, const QVariantMap& metaData,
@@ -62,6 +69,9 @@ public:
   {
     int k;
     QByteArray data;
+    if (mimeType == "application/x-klf-libentries-columnar") {
+      return KLFLibEntryColumnarData::encode(entryList, metaData);
+    }
     if (mimeType == "application/x-klf-libentries") {
       // prepare the data through the stream in a separate block
       { QDataStream str(&data, QIODevice::WriteOnly);
@@ -141,6 +151,16 @@ public:
   {
     KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
 
+    if (mimeType == "application/x-klf-libentries-columnar") {
+      KLFLibEntryColumnarData cdata(data);
+      if (!cdata.isValid()) {
+	klfWarning(": invalid columnar data.");
+	return false;
+      }
+      *metaData = cdata.metaData();
+      *entryList = cdata.entryList();
+      return true;
+    }
     if (mimeType == "application/x-klf-libentries") {
       QDataStream str(data);
       str.setVersion(QDataStream::Qt_4_4);
@@ -161,9 +181,259 @@ public:
 
 
 
+/** \internal
+ *
+ * Mime data for entries whose previews are PNG data, created by
+ * \ref KLFAbstractLibEntryMimeEncoder::createMimeData(const QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId>&, const QVariantMap&).
+ *
+ * Holds the <tt>application/x-klf-libentries-columnar</tt> data only. The other registered
+ * formats are encoded from it the first time they are requested, so that dragging entries
+ * between library views does not encode (and decode) the previews in every format.
+ */
+class KLFLibEntryListMimeData : public QMimeData
+{
+  Q_OBJECT
+public:
+  KLFLibEntryListMimeData(const QByteArray& columnarData, const QVariantMap& metaData)
+    : QMimeData(), pColumnarData(columnarData), pMetaData(metaData), pDecoded(false)
+  {
+  }
+  virtual ~KLFLibEntryListMimeData() { }
+
+  virtual QStringList formats() const;
+  virtual bool hasFormat(const QString& mimeType) const;
+
+protected:
+  virtual QVariant retrieveData(const QString& mimeType, QVariant::Type type) const;
+
+private:
+  QByteArray pColumnarData;
+  QVariantMap pMetaData;
+
+  mutable bool pDecoded;
+  mutable KLFLibEntryList pEntryList;
+  mutable QMap<QString,QByteArray> pEncodedData;
+};
+
+
+
+/** \internal
+ *
+ * Reading helpers for \ref KLFLibEntryColumnarData. All integers are little-endian; the
+ * constructor checks that the header and all the tables lie within the data, the blobs they
+ * refer to are checked when they are read.
+ */
+struct KLFLibEntryColumnarDataPrivate
+{
+  KLF_PRIVATE_HEAD(KLFLibEntryColumnarData)
+  {
+    data = NULL;
+    size = 0;
+    valid = false;
+    count = stringCount = styleCount = 0;
+    metaDataOffset = stringIndexOffset = styleIndexOffset = columnsOffset = 0;
+    metaDataLength = 0;
+  }
+
+  enum { HeaderSize = 68, IndexRecordSize = 12 };
+  /** Offsets of the columns relative to the start of the columns, in units of the number of
+   * entries */
+  enum { ColLatex = 0, ColCategory = 4, ColTags = 8, ColDateTime = 12, ColStyle = 20,
+	 ColPreviewWidth = 24, ColPreviewHeight = 28, ColPreview = 32, ColExtra = 44,
+	 ColumnsSize = 56 };
+
+  /** Keeps a reference to the data if we were given a QByteArray */
+  QByteArray ownData;
+  const uchar *data;
+  quint64 size;
+
+  bool valid;
+  quint32 count;
+  quint32 stringCount;
+  quint32 styleCount;
+  quint64 metaDataOffset;
+  quint32 metaDataLength;
+  quint64 stringIndexOffset;
+  quint64 styleIndexOffset;
+  quint64 columnsOffset;
+
+  mutable QHash<quint32,KLFStyle> styleCache;
+
+  void init(const uchar *d, qint64 sz);
+
+  inline bool inRange(quint64 offset, quint64 length) const
+  { return offset <= size && length <= size - offset; }
+
+  inline quint32 u32(quint64 offset) const { return qFromLittleEndian<quint32>(data + offset); }
+  inline quint64 u64(quint64 offset) const { return qFromLittleEndian<quint64>(data + offset); }
+  inline qint64 s64(quint64 offset) const { return qFromLittleEndian<qint64>(data + offset); }
+
+  /** Offset of the value for entry \c i in column \c col */
+  inline quint64 cell(int col, int i, int cellSize) const
+  { return columnsOffset + (quint64)col*count + (quint64)i*cellSize; }
+
+  /** Returns the blob referenced by the (offset, length) record at \c recordOffset, without
+   * copying it. Returns a null QByteArray if the blob is not within the data. */
+  QByteArray rawBlob(quint64 recordOffset) const;
+
+  QString string(quint32 index) const;
+};
+
+
+/** \internal
+ *
+ * Reads the results of a query in batches for \ref KLFLibResourceQueryJob. The worker either
+ * lives in a dedicated thread, in which case run() reads all the batches in a row, or in the
+ * resource's thread, in which case the job calls runBatch() once per event loop iteration.
+ *
+ * abort() may be called from any thread.
+ */
+class KLFLibResourceQueryWorker : public QObject
+{
+  Q_OBJECT
+public:
+  KLFLibResourceQueryWorker(KLFLibResourceEngine *resource, const QString& subResource,
+			    const KLFLibResourceEngine::Query& query, uint fillFlags, int batchSize);
+  virtual ~KLFLibResourceQueryWorker();
+
+  void abort() { pAbort.fetchAndStoreOrdered(1); }
+  bool isAborted() const { return pAbort.loadAcquire() != 0; }
+
+signals:
+  void totalCountKnown(int total);
+  void batchReady(const KLFLibResourceEngine::QueryResult& batch, int count);
+  void done(bool success);
+
+public slots:
+  /** Reads all batches until the end of the results or until aborted. */
+  void run();
+  /** Reads the next batch only. Returns FALSE if there are no more batches to read, in which
+   * case done() has been emitted. */
+  bool runBatch();
+
+private:
+  KLFLibResourceEngine *pResource;
+  QString pSubResource;
+  KLFLibResourceEngine::Query pQuery;
+  uint pFillFlags;
+  int pBatchSize;
+
+  bool pStarted;
+  /** Number of results still to read if the query has a limit, -1 otherwise */
+  int pRemaining;
+
+  QAtomicInt pAbort;
+};
+
+
+
+/** \internal
+ *
+ * Reads the entries to copy in batches for \ref KLFLibResourceCopyJob. As the query worker
+ * above, the reader either lives in a dedicated thread, in which case run() reads all the batches
+ * in a row, or in the resource's thread, in which case the job calls runBatch() once per event
+ * loop iteration.
+ *
+ * In a dedicated thread, the reader may only be ahead of the writer by \c maxPendingBatches
+ * batches: it acquires a slot before reading each batch, and the job releases it with
+ * batchWritten() when it has written that batch.
+ *
+ * abort() and batchWritten() may be called from any thread.
+ */
+class KLFLibResourceCopyReader : public QObject
+{
+  Q_OBJECT
+public:
+  KLFLibResourceCopyReader(KLFLibResourceEngine *resource, const QString& subResource, int batchSize,
+			   int maxPendingBatches = 4);
+  virtual ~KLFLibResourceCopyReader();
+
+  void abort() { pAbort.fetchAndStoreOrdered(1); pFreeSlots.release(); }
+  bool isAborted() const { return pAbort.loadAcquire() != 0; }
+
+  void batchWritten() { pFreeSlots.release(); }
+
+signals:
+  void totalCountKnown(int total);
+  void batchReady(const QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId>& batch);
+  void done(bool success);
+
+public slots:
+  /** Reads all batches until all entries are read or until aborted. */
+  void run();
+  /** Reads the next batch only. Returns FALSE if there are no more batches to read, in which
+   * case done() has been emitted. */
+  bool runBatch();
+
+private:
+  KLFLibResourceEngine *pResource;
+  QString pSubResource;
+  int pBatchSize;
+
+  bool pStarted;
+  QList<KLFLib::entryId> pIds;
+  int pPos;
+
+  QSemaphore pFreeSlots;
+  QAtomicInt pAbort;
+};
+
+
+
 
 
 /** \page appxMimeLib Appendix: KLF's Own Mime Formats for Library Entries
+ *
+ * \section appxMimeLib_columnar The application/x-klf-libentries-columnar data format
+ *
+ * A versioned binary format that stores the entries column by column, written and read by
+ * \ref KLFLibEntryColumnarData. It is the preferred format for drag and drop and copy/paste of
+ * library entries; the <tt>application/x-klf-libentries</tt> format below is still provided for
+ * other applications and older versions of KLatexFormula.
+ *
+ * All integers are little-endian. All offsets are counted in bytes from the beginning of the
+ * data. The data starts with a header:
+ * <table>
+ * <tr><th>Offset</th><th>Size</th><th>Contents</th></tr>
+ * <tr><td>0</td><td>8</td><td>The magic string <tt>"KLFLCOL\0"</tt></td></tr>
+ * <tr><td>8</td><td>4</td><td>Format version, currently 1</td></tr>
+ * <tr><td>12</td><td>4</td><td>\a N, the number of entries</td></tr>
+ * <tr><td>16</td><td>4</td><td>\a S, the number of strings in the string table</td></tr>
+ * <tr><td>20</td><td>4</td><td>\a Y, the number of styles in the style table</td></tr>
+ * <tr><td>24</td><td>8</td><td>Offset of the meta data</td></tr>
+ * <tr><td>32</td><td>4</td><td>Length of the meta data</td></tr>
+ * <tr><td>36</td><td>8</td><td>Offset of the string table</td></tr>
+ * <tr><td>44</td><td>8</td><td>Offset of the style table</td></tr>
+ * <tr><td>52</td><td>8</td><td>Offset of the columns</td></tr>
+ * <tr><td>60</td><td>8</td><td>Total size of the data</td></tr>
+ * </table>
+ *
+ * The meta data is a QVariantMap (as described below) written by a QDataStream with version
+ * <tt>QDataStream::Qt_4_4</tt>.
+ *
+ * The string table is an array of \a S (offset, length) records of 8+4 bytes, each referring to
+ * a string encoded in UTF-8. Each distinct latex, category and tags string is stored only once.
+ * The style table is an array of \a Y (offset, length) records referring to a \ref KLFStyle
+ * written by a QDataStream with version <tt>QDataStream::Qt_4_4</tt>. Each distinct style is
+ * stored only once.
+ *
+ * The columns are arrays of \a N values each, stored one after the other in this order:
+ *  - latex: 4-byte index in the string table;
+ *  - category: 4-byte index in the string table;
+ *  - tags: 4-byte index in the string table;
+ *  - date/time: signed 8-byte number of milliseconds since the epoch (UTC), or the smallest
+ *    8-byte integer for an invalid date/time;
+ *  - style: 4-byte index in the style table, or <tt>0xFFFFFFFF</tt> for no style;
+ *  - preview width and preview height: two columns of 4-byte values;
+ *  - preview: (offset, length) records of 8+4 bytes referring to the PNG data of the preview.
+ *    A length of zero means no preview;
+ *  - other properties: (offset, length) records of 8+4 bytes referring to a QVariantMap of
+ *    the other entry properties, by property name, written by a QDataStream with version
+ *    <tt>QDataStream::Qt_4_4</tt>. A length of zero means no other properties.
+ *
+ * The location of the value for any entry can thus be computed from the header, so that
+ * individual entries can be read without reading the whole data. The referenced strings,
+ * styles and blobs follow the columns. Readers must ignore data that is not referenced.
  *
  * \section appxMimeLib_elist The application/x-klf-libentries data format
  *
@@ -130,11 +130,13 @@ KLFLibBrowser::KLFLibBrowser(QWidget *parent)
   pImportExportMenu->addAction(u->aOpenAll);
   pImportExportMenu->addAction(u->aExport);
   pImportExportMenu->addAction(u->aExportSelection);
+  pImportExportMenu->addAction(u->aExportSelectionToFiles);
   u->btnImportExport->setMenu(pImportExportMenu);
 
   connect(u->aOpenAll, SIGNAL(triggered()), this, SLOT(slotOpenAll()));
   connect(u->aExport, SIGNAL(triggered()), this, SLOT(slotExport()));
   connect(u->aExportSelection, SIGNAL(triggered()), this, SLOT(slotExportSelection()));
+  connect(u->aExportSelectionToFiles, SIGNAL(triggered()), this, SLOT(slotExportSelectionToFiles()));
   
 
   // CATEGORY/TAGS
@@ -1527,7 +1529,7 @@ void KLFLibBrowser::slotPaste()
   if ( view == NULL )
     return;
 
-  KLFLibEntryList elist;
+  QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId> elist;
   QVariantMap vprops;
 
   const QMimeData* mimeData = QApplication::clipboard()->mimeData();
@@ -1539,7 +1541,8 @@ void KLFLibBrowser::slotPaste()
   }
 
   klfDbg( ": Pasting data! props="<<vprops ) ;
-  QList<KLFLib::entryId> inserted = view->resourceEngine()->insertEntries(elist);
+  KLFLibResourceEngine *resource = view->resourceEngine();
+  QList<KLFLib::entryId> inserted = resource->insertEncodedEntries(resource->defaultSubResource(), elist);
   if (inserted.isEmpty() || inserted.contains(-1)) {
     QMessageBox::critical(this, tr("Error"), tr("Error pasting items"));
   }
@@ -1617,7 +1620,7 @@ bool KLFLibBrowser::slotExport()
   klfDbg("Export: to resource "<<exportRes->url().toString()<<". Export: "<<exportUrls);
 
   // visual feedback for export
-  KLFProgressDialog pdlg(QString(), this);
+  KLFProgressDialog pdlg(true, QString(), this);
   connect(exportRes, SIGNAL(operationStartReportingProgress(KLFProgressReporter *,
 							    const QString&)),
 	  &pdlg, SLOT(startReportingProgress(KLFProgressReporter *)));
@@ -1674,16 +1677,24 @@ bool KLFLibBrowser::slotExport()
     pdlg.setDescriptiveText(tr("Exporting ... %3 (%1/%2)")
 			    .arg(k+1).arg(exportUrls.size()).arg(title));
 
-    QList<KLFLibResourceEngine::KLFLibEntryWithId> elistwid = res->allEntries(usr);
-    /** \bug ....... Add a 'KLFLibEntryList KLFLibResourceEngine::entryList(idList)'
-     * function so that we don't have to manually get rid of ID's ! */
-    KLFLibEntryList elist;
-    int j;
-    for (j = 0; j < elistwid.size(); ++j)
-      elist << elistwid[j].entry;
-
-    QList<KLFLib::entryId> insertedIds = exportRes->insertEntries(subres, elist);
-    if (!insertedIds.size() || insertedIds.contains(-1)) {
+    // copy the entries in batches, without decoding the previews
+    KLFLibResourceCopyJob *job = res->copyEntriesAsync(usr, exportRes, subres);
+    if (job == NULL) {
+      fail = true;
+      continue;
+    }
+    connect(&pdlg, SIGNAL(canceled()), job, SLOT(cancel()));
+    // the progress dialog is modal, let the user reach its cancel button
+    bool ok = job->waitForFinished(QEventLoop::AllEvents);
+    bool canceled = job->isCanceled();
+    delete job;
+    if (canceled) {
+      klfDbg("Export canceled by user.");
+      fail = true;
+      break;
+    }
+    if (!ok) {
+      fail = true;
       QMessageBox::critical(this, tr("Error"), tr("Error exporting items!"));
     }
   }
@@ -1763,6 +1774,24 @@ bool KLFLibBrowser::slotExportSelection()
   return true;
 }
 
+bool KLFLibBrowser::slotExportSelectionToFiles()
+{
+  KLFAbstractLibView *view = curLibView();
+  if (view == NULL) {
+    qWarning()<<KLF_FUNC_NAME<<": NULL View!";
+    return false;
+  }
+
+  KLFLibEntryList entryList = view->selectedEntries();
+  if (entryList.isEmpty()) {
+    klfDbg("No entries selected.") ;
+    return false;
+  }
+
+  emit requestExportEntriesToFiles(entryList);
+  return true;
+}
+
 void KLFLibBrowser::slotStartProgress(KLFProgressReporter *progressReporter, const QString& text)
 {
   KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
@@ -95,6 +95,10 @@ public:
 signals:
   void requestRestore(const KLFLibEntry& entry, uint restoreFlags);
   void requestRestoreStyle(const KLFStyle& style);
+  /** Emitted when the user asked to save each of the given entries to a separate file. The
+   * actual exporting is left to the receiver (the main window), which knows the current
+   * backend settings. */
+  void requestExportEntriesToFiles(const KLFLibEntryList& entries);
 
   void resourceTabChanged(const QUrl& currentUrl);
   void libEntriesSelected(const KLFLibEntryList& entries);
@@ -205,6 +209,7 @@ protected slots:
   void slotOpenAll();
   bool slotExport();
   bool slotExportSelection();
+  bool slotExportSelectionToFiles();
 
   void slotStartProgress(KLFProgressReporter *progressReporter, const QString& text);
 
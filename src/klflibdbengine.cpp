@@ -27,8 +27,16 @@
 #include <QUrl>
 #include <QUrlQuery>
 #include <QBuffer>
+#include <QImageReader>
 #include <QFile>
+#include <QFileInfo>
+#include <QThread>
+#include <QThreadStorage>
+#include <QMutexLocker>
+#include <QAtomicInt>
 #include <QByteArray>
+#include <QHash>
+#include <QCryptographicHash>
 #include <QDataStream>
 #include <QMessageBox>
 #include <QSqlRecord>
@@ -36,6 +44,7 @@
 #include <QSqlQuery>
 #include <QSqlError>
 
+#include <klfdatautil.h>
 #include <klfguiutil.h>
 #include "klflib.h"
 #include "klflibview.h"
@@ -55,13 +64,26 @@
  *   - klf_dbmetainfo  (id INTEGER PRIMARY KEY, name TEXT, value BLOB) stores database-specific
  *     information
  *      - created by klf version (name=<tt>klf_version</tt>, value=<i>klf-version</i>)
- *      - database version (name=<tt>klf_dbversion</tt>, value=<tt>1</tt>) currently, db version
- *        is <tt>1</tt>.
+ *      - database version (name=<tt>klf_dbversion</tt>, value=<tt>2</tt>) currently, db version
+ *        is <tt>2</tt>. Version <tt>1</tt> databases don't have the <tt>klf_styles</tt> table.
+ *        Only new databases are created with version <tt>2</tt>; existing version <tt>1</tt>
+ *        databases are not converted and keep being written in the version <tt>1</tt> format.
+ *        \warning Releases that predate the <tt>klf_styles</tt> table don't check the database
+ *        version. They open version <tt>2</tt> databases, but read the style IDs as invalid
+ *        styles, so that the entries are shown and reused with the default style. Use a version
+ *        <tt>1</tt> database (or export to a <tt>.klf</tt> file) to share a library with older
+ *        releases.
  *   - klf_subresprops (id INTEGER PRIMARY KEY, pid INTEGER, subresource TEXT, pvalue BLOB) stores
  *     sub-resource properties
  *      - properties are stored with <tt>pid</tt> = sub-property ID (eg.
  *        KLFLibResourceEngine::SubResPropTitle), <tt>subresource</tt> = the sub-resource whose
  *        given property has this given value, <tt>value</tt> = the value of the sub-resource property
+ *   - klf_styles (id INTEGER PRIMARY KEY, hash BLOB UNIQUE, style BLOB) stores each distinct
+ *     style used by the entries once
+ *     - styles no longer used by any entry are deleted when entries or sub-resources are deleted
+ *       and when the resource is saved to another file
+ *     - <tt>style</tt> is the KLFStyle saved with klfSave() in the <tt>CompactBinary</tt> format,
+ *       <tt>hash</tt> is the SHA-1 hash of that data
  *   - klf_properties (id INTEGER PRIMARY KEY, name TEXT, value BLOB)
  *     stores resource properties
  *     - properties are stored with <tt>name</tt> = resource property name (see KLFPropertizedObject in
@@ -74,6 +96,8 @@
  *     - Preview is stored as PNG data (blob)
  *     - Category and Tags are stored as strings
  *     - PreviewSize is stored as a 64-bit integer in the format <tt>(width << 32) | height</tt>
+ *     - Style is stored as the integer <tt>id</tt> of the style in <tt>klf_styles</tt>. In version
+ *       <tt>1</tt> databases, it is stored like any other property (see below).
  *     - Any other property that is integer type (incl. bool) will be stored as an integer
  *     - Any other property will be stored as <tt>[<i>TypeName</i>]</tt> and (possibly binary) data
  *       for that property value. QImage data is stored as PNG (ie. <tt>[QImage]<i>png-data</i></tt>),
@@ -125,6 +149,90 @@ static T metatype_from_data(const QByteArray& data)
 
 
 
+/** \internal
+ * Tunes a freshly opened SQLite connection.
+ *
+ * The main (read-write) connection switches the database to write-ahead logging, so that the
+ * read connections of other threads (see readDatabase()) don't block the history inserts and
+ * vice versa. The WAL mode is persistent in the database file, so it is only set if we can write
+ * to the file. Read connections are opened read-only and only get the cache settings.
+ */
+static void tune_sqlite_connection(QSqlDatabase db, bool readonly)
+{
+  if (db.driverName() != QLatin1String("QSQLITE"))
+    return;
+
+  QStringList pragmas;
+  if (readonly) {
+    pragmas << "PRAGMA query_only = 1";
+  } else if (QFileInfo(db.databaseName()).isWritable()) {
+    pragmas << "PRAGMA journal_mode = WAL"
+	    << "PRAGMA synchronous = NORMAL"; // safe in WAL mode: only the checkpoints are synced
+  }
+  pragmas << "PRAGMA cache_size = -16384" // in KiB, ie. 16MB of page cache
+	  << "PRAGMA mmap_size = 268435456" // memory-map up to 256MB of the database file
+	  << "PRAGMA temp_store = MEMORY";
+
+  int k;
+  for (k = 0; k < pragmas.size(); ++k) {
+    QSqlQuery q(db);
+    if ( !q.exec(pragmas[k]) || q.lastError().isValid() ) {
+      // not fatal, we can still work with the default settings
+      qWarning()<<KLF_FUNC_NAME<<": "<<pragmas[k]<<" failed: "<<q.lastError().text();
+      continue;
+    }
+    if (q.next())
+      klfDbg(pragmas[k]<<" -> "<<q.value(0)) ;
+  }
+}
+
+
+// --------------------------------------------
+
+// static
+QThreadStorage<KLFLibDBThreadReadConnections*> KLFLibDBThreadReadConnections::pThreadConnections;
+
+KLFLibDBThreadReadConnections::~KLFLibDBThreadReadConnections()
+{
+  QStringList names = pConnectionNames.values();
+  int k;
+  for (k = 0; k < names.size(); ++k) {
+    {
+      QSqlDatabase db = QSqlDatabase::database(names[k], false);
+      db.close();
+    } // db must be out of scope for removeDatabase()
+    QSqlDatabase::removeDatabase(names[k]);
+  }
+}
+
+// static
+QSqlDatabase KLFLibDBThreadReadConnections::connection(const QString& driverName, const QString& fileName)
+{
+  if (!pThreadConnections.hasLocalData())
+    pThreadConnections.setLocalData(new KLFLibDBThreadReadConnections);
+
+  KLFLibDBThreadReadConnections *c = pThreadConnections.localData();
+  if (c->pConnectionNames.contains(fileName))
+    return QSqlDatabase::database(c->pConnectionNames[fileName]);
+
+  static QAtomicInt counter;
+  QString name = QString("klflibdb-reader-%1-%2").arg(counter.fetchAndAddRelaxed(1)).arg(fileName);
+  QSqlDatabase db = QSqlDatabase::addDatabase(driverName, name);
+  db.setDatabaseName(fileName);
+  if (driverName == QLatin1String("QSQLITE"))
+    db.setConnectOptions("QSQLITE_OPEN_READONLY");
+  if ( !db.open() ) {
+    qWarning()<<KLF_FUNC_NAME<<": Can't open read connection to "<<fileName<<": "<<db.lastError().text();
+    // still remember it, so that we remove it when the thread exits
+  } else {
+    tune_sqlite_connection(db, true);
+  }
+  c->pConnectionNames[fileName] = name;
+  return db;
+}
+
+
+
 // --------------------------------------------
 
 
@@ -186,6 +294,7 @@ KLFLibDBEngine * KLFLibDBEngine::openUrl(const QUrl& givenurl, QObject *parent)
 			      .arg(path, db.driverName(), db.lastError().text()), QMessageBox::Ok);
 	return NULL;
       }
+      tune_sqlite_connection(db, false);
     }
   } else {
     qWarning("KLFLibDBEngine::openUrl: bad url scheme in URL\n\t%s",
@@ -230,6 +339,7 @@ KLFLibDBEngine * KLFLibDBEngine::createSqlite(const QString& fileName, const QSt
 			    .arg(path, db.lastError().text()), QMessageBox::Ok);
       return NULL;
     }
+    tune_sqlite_connection(db, false);
   }
 
   if (subresname.isEmpty()) {
@@ -278,7 +388,7 @@ KLFLibDBEngine * KLFLibDBEngine::createSqlite(const QString& fileName, const QSt
 KLFLibDBEngine::KLFLibDBEngine(const QSqlDatabase& db, bool autodisconnect,
 			       const QUrl& url, bool accessshared, QObject *parent)
   : KLFLibResourceEngine(url, FeatureReadOnly|FeatureLocked|FeatureSubResources
-			 |FeatureSubResourceProps, parent)
+			 |FeatureSubResourceProps|FeatureConcurrentRead, parent)
 {
   pAutoDisconnectDB = autodisconnect;
 
@@ -305,6 +415,9 @@ KLFLibDBEngine::KLFLibDBEngine(const QSqlDatabase& db, bool autodisconnect,
 
 KLFLibDBEngine::~KLFLibDBEngine()
 {
+  // the workers of asynchronous jobs use our database connection
+  stopAsyncJobs();
+
   pDBConnectionName = pDB.connectionName();
   KLFLibDBEnginePropertyChangeNotifier *dbNotifier = dbPropertyNotifierInstance(pDBConnectionName);
   if (dbNotifier->deRef() && pAutoDisconnectDB) {
@@ -376,6 +489,28 @@ bool KLFLibDBEngine::validDatabase() const
 void KLFLibDBEngine::setDatabase(const QSqlDatabase& db)
 {
   pDB = db;
+  pDBDriverName = db.driverName();
+  pDBFileName = db.databaseName();
+
+  pHaveStyleTable = db.tables().contains("klf_styles");
+  clearStyleCache();
+}
+
+// private
+void KLFLibDBEngine::clearStyleCache()
+{
+  QMutexLocker locker(&pStyleCacheMutex);
+  pStyleIdByHash.clear();
+  pStyleById.clear();
+}
+
+// private
+QSqlDatabase KLFLibDBEngine::readDatabase() const
+{
+  if (inGuiThread())
+    return pDB;
+  // Qt SQL connections can only be used in the thread that created them
+  return KLFLibDBThreadReadConnections::connection(pDBDriverName, pDBFileName);
 }
 
 // private
@@ -491,8 +626,14 @@ void KLFLibDBEngine::readAvailColumns(const QString& subResource)
   for (k = 0; k < rec.count(); ++k)
     columns << rec.fieldName(k);
 
+  QMutexLocker locker(&pAvailColumnsMutex);
   pDBAvailColumns[subResource] = columns;
 }
+QStringList KLFLibDBEngine::availColumns(const QString& subResource) const
+{
+  QMutexLocker locker(&pAvailColumnsMutex);
+  return pDBAvailColumns.value(subResource);
+}
 
 
 
@@ -501,11 +642,12 @@ QStringList KLFLibDBEngine::columnNameList(const QString& subResource, const QLi
 					   bool wantIdFirst)
 {
   QStringList cols;
+  QStringList avail = availColumns(subResource);
   KLFLibEntry dummy; // to get prop name
   int k;
   for (k = 0; k < entryPropList.size(); ++k) {
     QString col = dummy.propertyNameForId(entryPropList[k]);
-    if (pDBAvailColumns[subResource].contains(col))
+    if (avail.contains(col))
       cols << col;
     else if (entryPropList[k] == KLFLibEntry::PreviewSize) // previewsize not available, use preview
       cols << "Preview";
@@ -537,7 +679,7 @@ QStringList KLFLibDBEngine::detectEntryColumns(const QSqlQuery& q)
   return cols;
 }
 // private
-KLFLibEntry KLFLibDBEngine::readEntry(const QSqlQuery& q, const QStringList& cols)
+KLFLibEntry KLFLibDBEngine::readEntry(const QSqlQuery& q, const QStringList& cols, QByteArray *previewData)
 {
   // and actually read the result and return it
   KLFLibEntry entry;
@@ -546,6 +688,10 @@ KLFLibEntry KLFLibDBEngine::readEntry(const QSqlQuery& q, const QStringList& col
     QVariant v = q.value(k);
     if (cols[k] == "id")
       continue;
+    if (previewData != NULL && cols[k] == "Preview") {
+      *previewData = v.toByteArray();
+      continue;
+    }
     int propId = entry.propertyIdForName(cols[k]);
     QVariant value = dbReadEntryPropertyValue(q.value(k), propId);
     entry.setEntryProperty(cols[k], value);
@@ -560,7 +706,13 @@ KLFLibEntry KLFLibDBEngine::readEntry(const QSqlQuery& q, const QStringList& col
       klfDbg( ": missing or incorrect preview size set to "<<entry.preview().size() ) ;
       entry.setPreviewSize(entry.preview().size());
     }
-  }      
+  } else if (previewData != NULL && !previewData->isEmpty() &&
+	     !entry.property(KLFLibEntry::PreviewSize).toSize().isValid()) {
+    // only read the PNG header to get the size
+    QBuffer buf(previewData);
+    QImageReader reader(&buf, "PNG");
+    entry.setPreviewSize(reader.size());
+  }
   return entry;
 }
 
@@ -570,7 +722,7 @@ QList<KLFLib::entryId> KLFLibDBEngine::allIds(const QString& subResource)
   KLF_ASSERT_CONDITION( validDatabase() , "Database connection not valid!" ,
 			return QList<KLFLib::entryId>() ) ;
 
-  QSqlQuery q = QSqlQuery(pDB);
+  QSqlQuery q = QSqlQuery(readDatabase());
   q.prepare(QString("SELECT id FROM %1").arg(quotedDataTableName(subResource)));
   q.setForwardOnly(true);
   bool r = q.exec();
@@ -590,7 +742,7 @@ bool KLFLibDBEngine::hasEntry(const QString& subResource, entryId id)
   KLF_ASSERT_CONDITION( validDatabase() , "Database connection not valid!" ,
 			return false ) ;
 
-  QSqlQuery q = QSqlQuery(pDB);
+  QSqlQuery q = QSqlQuery(readDatabase());
   q.prepare(QString("SELECT id FROM %1 WHERE id = ?").arg(quotedDataTableName(subResource)));
   q.addBindValue(id);
   bool r = q.exec();
@@ -603,6 +755,65 @@ bool KLFLibDBEngine::hasEntry(const QString& subResource, entryId id)
     return true;
   return false;
 }
+// private
+void KLFLibDBEngine::fetchEntries(const QString& subResource, const QStringList& cols,
+				  const QList<KLFLib::entryId>& idList, KLFProgressReporter *progr,
+				  QHash<KLFLib::entryId, KLFLibEntry> *fetched,
+				  QHash<KLFLib::entryId, QByteArray> *previews)
+{
+  // Fetch the entries by chunks of ids, with a 'WHERE id IN (?,?,...)' query. Rows come back in
+  // arbitrary order, so store them by ID and re-order them as requested afterwards.
+  // Keep the number of placeholders well below SQLite's default limit of 999 host parameters.
+  static const int ChunkSize = 500;
+
+  fetched->reserve(idList.size());
+  if (previews != NULL)
+    previews->reserve(idList.size());
+
+  QSqlQuery q = QSqlQuery(readDatabase());
+  q.setForwardOnly(true);
+  int preparedChunkSize = -1;
+
+  int k;
+  for (k = 0; k < idList.size(); k += ChunkSize) {
+    if (progr != NULL)
+      progr->doReportProgress(k);
+
+    int n = qMin(ChunkSize, idList.size() - k);
+    if (n != preparedChunkSize) {
+      // (re-)prepare the query for this number of placeholders (only the last chunk may differ)
+      QStringList qmarks;
+      int j;
+      for (j = 0; j < n; ++j)
+	qmarks << "?";
+      q.prepare(QString("SELECT %1 FROM %2 WHERE id IN (%3)").arg(cols.join(","),
+								   quotedDataTableName(subResource),
+								   qmarks.join(",")));
+      preparedChunkSize = n;
+    }
+    int j;
+    for (j = 0; j < n; ++j)
+      q.bindValue(j, idList[k+j]);
+
+    bool r = q.exec();
+    if ( !r || q.lastError().isValid() ) {
+      klfDbg( " SQL Error, sql="<<q.lastQuery()<<"; boundvalues="<<q.boundValues() ) ;
+      qWarning("KLFLibDBEngine::fetchEntries: Error\n"
+	       "SQL Error (?): %s", qPrintable(q.lastError().text()));
+      continue;
+    }
+    while (q.next()) {
+      KLFLib::entryId id = q.value(0).toInt();
+      if (previews != NULL) {
+	QByteArray previewData;
+	fetched->insert(id, readEntry(q, cols, &previewData));
+	previews->insert(id, previewData);
+      } else {
+	fetched->insert(id, readEntry(q, cols));
+      }
+    }
+  }
+}
 QList<KLFLibResourceEngine::KLFLibEntryWithId>
 /* */ KLFLibDBEngine::entries(const QString& subResource, const QList<KLFLib::entryId>& idList,
 			      const QList<int>& wantedEntryProperties)
@@ -617,43 +828,27 @@ QList<KLFLibResourceEngine::KLFLibEntryWithId>
   if (cols.contains("*")) {
     cols = QStringList();
     cols << "id" // first column is ID.
-	 << pDBAvailColumns[subResource];
+	 << availColumns(subResource);
   }
 
-  QSqlQuery q = QSqlQuery(pDB);
-  q.prepare(QString("SELECT %1 FROM %2 WHERE id = ?").arg(cols.join(","),
-							  quotedDataTableName(subResource)));
-
-  KLFProgressReporter progr(0, idList.size(), this);
-  if (!thisOperationProgressBlocked())
+  KLFProgressReporter progr(0, idList.size(), inGuiThread() ? this : NULL);
+  if (inGuiThread() && !thisOperationProgressBlocked())
     emit operationStartReportingProgress(&progr, tr("Fetching items from library database ..."));
 
-  QList<KLFLibEntryWithId> eList;
+  QHash<KLFLib::entryId, KLFLibEntry> fetched;
+  fetchEntries(subResource, cols, idList, &progr, &fetched, NULL);
 
-  int k;
+  // now return the entries in the order in which they were requested
+  QList<KLFLibEntryWithId> eList;
   for (k = 0; k < idList.size(); ++k) {
-    if (k % 10 == 0)
-      progr.doReportProgress(k);
-
-    q.bindValue(0, idList[k]);
-    bool r = q.exec();
-    if ( !r || q.lastError().isValid() ) {
-      klfDbg( " SQL Error, sql="<<q.lastQuery()<<"; boundvalues="<<q.boundValues() ) ;
-      qWarning("KLFLibDBEngine::entries: Error\n"
-	       "SQL Error (?): %s", qPrintable(q.lastError().text()));
-      continue;
-    }
-    if ( !q.next() ) {
+    QHash<KLFLib::entryId, KLFLibEntry>::const_iterator it = fetched.constFind(idList[k]);
+    if (it == fetched.constEnd()) {
       klfDbg( ": id="<<idList[k]<<" does not exist in DB." ) ;
       KLFLibEntryWithId e; e.entry = KLFLibEntry(); e.id = -1;
       eList << e;
       continue;
     }
-    // get the entry
-    KLFLibEntryWithId e;
-    e.entry = readEntry(q, cols);
-    e.id = q.value(0).toInt();
-    eList << e;
+    eList << KLFLibEntryWithId(idList[k], *it);
   }
 
   progr.doReportProgress(idList.size());
@@ -661,6 +856,38 @@ QList<KLFLibResourceEngine::KLFLibEntryWithId>
   return eList;
 }
 
+QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId>
+/* */ KLFLibDBEngine::encodedEntries(const QString& subResource, const QList<KLFLib::entryId>& idList)
+{
+  KLF_DEBUG_BLOCK(KLF_FUNC_NAME); klfDbg( "\t: subResource="<<subResource<<"; idlist="<<idList ) ;
+  KLF_ASSERT_CONDITION( validDatabase() , "Database connection not valid!" ,
+			return QList<KLFLibEncodedEntryWithId>() ) ;
+  if (idList.isEmpty())
+    return QList<KLFLibEncodedEntryWithId>();
+
+  QStringList cols;
+  cols << "id" // first column is ID.
+       << availColumns(subResource);
+
+  // the previews are stored as PNG data already, pass that through without decoding it
+  QHash<KLFLib::entryId, KLFLibEntry> fetched;
+  QHash<KLFLib::entryId, QByteArray> previews;
+  fetchEntries(subResource, cols, idList, NULL, &fetched, &previews);
+
+  QList<KLFLibEncodedEntryWithId> eList;
+  int k;
+  for (k = 0; k < idList.size(); ++k) {
+    QHash<KLFLib::entryId, KLFLibEntry>::const_iterator it = fetched.constFind(idList[k]);
+    if (it == fetched.constEnd()) {
+      klfDbg( ": id="<<idList[k]<<" does not exist in DB." ) ;
+      eList << KLFLibEncodedEntryWithId(-1);
+      continue;
+    }
+    eList << KLFLibEncodedEntryWithId(idList[k], *it, previews.value(idList[k]));
+  }
+  return eList;
+}
+
 
 static QString escape_sql_data_string(QString s)
 {
@@ -762,7 +989,7 @@ static QString make_sql_condition(const KLFLib::EntryMatchCondition m, QVariantL
     }
     KLFLib::EntryMatchCondition postm = KLFLib::EntryMatchCondition::mkMatchAll(); // has to be initialized to sth..
     QString c = "(NOT " + make_sql_condition(m.conditionList()[0], placeholders,
-					     haspostsqlcondition, &postm) ;
+					     haspostsqlcondition, &postm) + ")" ;
     if (*haspostsqlcondition) {
       *postsqlcondition = KLFLib::EntryMatchCondition::mkNegateMatch(postm);
     }
@@ -814,6 +1041,14 @@ int KLFLibDBEngine::query(const QString& subResource, const Query& query, QueryR
 
   QStringList cols = columnNameList(subResource, query.wantedEntryProperties, true);
 
+  // the column holding the sort key. We need it in the result to build the continuation cursor.
+  QString ordercol;
+  if (query.orderPropId != -1) {
+    ordercol = KLFLibEntry().propertyNameForId(query.orderPropId);
+    if (!cols.contains("*") && !cols.contains(ordercol))
+      cols << ordercol;
+  }
+
   QString sql;
   // prepare SQL string.
   sql = QString("SELECT %1 FROM %2 ").arg(cols.join(","), quotedDataTableName(subResource));
@@ -822,7 +1057,7 @@ int KLFLibDBEngine::query(const QString& subResource, const Query& query, QueryR
   KLFLib::EntryMatchCondition postsqlcondition = KLFLib::EntryMatchCondition::mkMatchAll();
   QString wherecond = make_sql_condition(query.matchCondition, &placeholders, &haspostsqlcondition,
 					 &postsqlcondition);
-  sql += " WHERE "+wherecond;
+  sql += " WHERE ("+wherecond+")";
 
   /** \bug. ................ postsqlcondition is NOT implemented ............. */
   if (haspostsqlcondition) {
@@ -832,18 +1067,49 @@ int KLFLibDBEngine::query(const QString& subResource, const Query& query, QueryR
     return KLFLibResourceSimpleEngine::queryImpl(this, subResource, query, result);
   }
 
-  if (query.orderPropId != -1) {
-    sql += " ORDER BY "+KLFLibEntry().propertyNameForId(query.orderPropId)+" ";
-    sql += (query.orderDirection==Qt::AscendingOrder)?"ASC ":"DESC ";
+  bool ascending = (query.orderDirection == Qt::AscendingOrder);
+
+  if (query.continueAfter.isValid()) {
+    // keyset pagination: seek to the row following (sort key, id) of the cursor. Rows are ordered
+    // by (sort key, id), see ORDER BY clause below. SQLite puts NULL values first in ascending
+    // order, and last in descending order.
+    const KLFLibResourceEngine::QueryCursor& cur = query.continueAfter;
+    QString idcmp = ascending ? "id > ?" : "id < ?";
+    if (ordercol.isEmpty()) {
+      sql += " AND "+idcmp;
+      placeholders << cur.lastId;
+    } else if (cur.lastOrderValue.isNull()) {
+      if (ascending)
+	sql += " AND ("+ordercol+" IS NOT NULL OR "+idcmp+")";
+      else
+	sql += " AND ("+ordercol+" IS NULL AND "+idcmp+")";
+      placeholders << cur.lastId;
+    } else {
+      QString keycmp = ordercol + (ascending ? " > ?" : " < ?");
+      sql += " AND ("+keycmp+" OR ("+ordercol+" = ? AND "+idcmp+")";
+      if (!ascending)
+	sql += " OR "+ordercol+" IS NULL";
+      sql += ")";
+      placeholders << cur.lastOrderValue << cur.lastOrderValue << cur.lastId;
+    }
   }
 
-  if (query.limit != -1) {
-    sql += " LIMIT "+QString::number(query.skip+query.limit);
+  // always order by id as second key, so that the order is well-defined for paging
+  if (!ordercol.isEmpty()) {
+    sql += " ORDER BY "+ordercol+(ascending ? " ASC" : " DESC")+", id"+(ascending ? " ASC" : " DESC");
+  } else {
+    sql += " ORDER BY id ASC";
+  }
+
+  if (query.limit != -1 || query.skip > 0) {
+    sql += " LIMIT "+QString::number(query.limit);
+    if (query.skip > 0)
+      sql += " OFFSET "+QString::number(query.skip);
   }
 
   klfDbg("Built query: SQL="<<sql<<"; placeholders="<<placeholders) ;
 
-  QSqlQuery q = QSqlQuery(pDB);
+  QSqlQuery q = QSqlQuery(readDatabase());
   q.prepare(sql);
   q.setForwardOnly(true);
   int k;
@@ -861,27 +1127,19 @@ int KLFLibDBEngine::query(const QString& subResource, const Query& query, QueryR
   // retrieve the entries
 
   cols = detectEntryColumns(q);
+  int ordercolindex = ordercol.isEmpty() ? -1 : cols.indexOf(ordercol);
 
   int N = q.size();
   if (N == -1)
     N = 100;
-  else
-    N -= query.skip;
-  KLFProgressReporter progr(0, N, this);
-  if (!thisOperationProgressBlocked())
+  KLFProgressReporter progr(0, N, inGuiThread() ? this : NULL);
+  if (inGuiThread() && !thisOperationProgressBlocked())
     emit operationStartReportingProgress(&progr, tr("Querying items from library database ..."));
 
-  // skip the first 'query.skip' entries
-  int skipped = 0;
-  bool ok = true;
-  while (skipped < query.skip && (ok = q.next()))
-    ++skipped;
-  klfDbg("skipped "<<skipped<<" entries.") ;
-
-  // warning: Qt crashes on two consequent failing q.next() calls, if forward-only mode is enabled.
+  result->nextCursor = query.continueAfter;
 
   int count = 0;
-  while (ok && q.next()) {
+  while (q.next()) {
     if (count % 10 == 0 && count < N) {
       // emit every 10 items, without exceeding what maximum we gave
       progr.doReportProgress(count);
@@ -897,6 +1155,10 @@ int KLFLibDBEngine::query(const QString& subResource, const Query& query, QueryR
       result->rawEntryList << e.entry;
     if (result->fillFlags & QueryResult::FillEntryWithIdList)
       result->entryWithIdList << e;
+
+    // remember the raw sort key value as it is stored in the database
+    result->nextCursor = KLFLibResourceEngine::QueryCursor(ordercolindex >= 0 ? q.value(ordercolindex) : QVariant(),
+							    e.id);
     ++count;
   }
 
@@ -912,7 +1174,9 @@ QList<QVariant> KLFLibDBEngine::queryValues(const QString& subResource, int entr
   KLF_ASSERT_CONDITION( validDatabase() , "Database connection not valid!" ,
 			return QList<QVariant>() ) ;
 
-  if (!pDBAvailColumns.contains(subResource) || !hasSubResource(subResource)) {
+  QStringList avail = availColumns(subResource);
+  // hasSubResource() queries the GUI thread's connection, the column cache is enough here
+  if (avail.isEmpty() || (inGuiThread() && !hasSubResource(subResource))) {
     qWarning()<<KLF_FUNC_NAME<<": bad sub-resource: "<<subResource;
     return QVariantList();
   }
@@ -924,15 +1188,15 @@ QList<QVariant> KLFLibDBEngine::queryValues(const QString& subResource, int entr
     return QVariantList();
   }
   pname = dummye.propertyNameForId(entryPropId);
-  if (!pDBAvailColumns[subResource].contains(pname)) {
+  if (!avail.contains(pname)) {
     qWarning()<<KLF_FUNC_NAME<<": property "<<pname<<" is not available in tables for sub-res "<<subResource
-	      <<" (avail are "<<pDBAvailColumns[subResource]<<")";
+	      <<" (avail are "<<avail<<")";
     return QVariantList();
   }
 
   QString sql = "SELECT DISTINCT "+pname+" FROM "+quotedDataTableName(subResource);
 
-  QSqlQuery q = QSqlQuery(pDB);
+  QSqlQuery q = QSqlQuery(readDatabase());
   q.prepare(sql);
   q.setForwardOnly(true);
   bool r = q.exec();
@@ -958,7 +1222,7 @@ KLFLibEntry KLFLibDBEngine::entry(const QString& subResource, entryId id)
   KLF_ASSERT_CONDITION( validDatabase() , "Database connection not valid!" ,
 			return KLFLibEntry() ) ;
 
-  QSqlQuery q = QSqlQuery(pDB);
+  QSqlQuery q = QSqlQuery(readDatabase());
   q.prepare(QString("SELECT * FROM %1 WHERE id = ?").arg(quotedDataTableName(subResource)));
   q.addBindValue(id);
   bool r = q.exec();
@@ -993,7 +1257,7 @@ QList<KLFLibResourceEngine::KLFLibEntryWithId>
 
   QStringList cols = columnNameList(subResource, wantedEntryProperties, true);
 
-  QSqlQuery q = QSqlQuery(pDB);
+  QSqlQuery q = QSqlQuery(readDatabase());
   q.prepare(QString("SELECT %1 FROM %2 ORDER BY id ASC").arg(cols.join(","), quotedDataTableName(subResource)));
   q.setForwardOnly(true);
   bool r = q.exec();
@@ -1009,8 +1273,8 @@ QList<KLFLibResourceEngine::KLFLibEntryWithId>
 
   int count = q.size();
 
-  KLFProgressReporter progr(0, count, this);
-  if (!thisOperationProgressBlocked())
+  KLFProgressReporter progr(0, count, inGuiThread() ? this : NULL);
+  if (inGuiThread() && !thisOperationProgressBlocked())
     emit operationStartReportingProgress(&progr, tr("Fetching items from library database ..."));
 
   int n = 0;
@@ -1175,6 +1439,13 @@ QVariant KLFLibDBEngine::dbMakeEntryPropertyValue(const QVariant& entryval, int
     return QVariant::fromValue<qulonglong>( (((qulonglong)s.width()) <<         32)  |
 					    (((qulonglong)s.height()) & 0xFFFFFFFF) );
   }
+  if (propertyId == KLFLibEntry::Style && pHaveStyleTable &&
+      entryval.userType() == qMetaTypeId<KLFStyle>()) {
+    int styleid = internStyle(entryval);
+    if (styleid >= 0)
+      return QVariant::fromValue<qlonglong>(styleid);
+    // otherwise fall back to the generic encapsulation
+  }
   // otherwise, return a generic encapsulation
   return convertVariantToDBData(entryval);
 }
@@ -1199,10 +1470,110 @@ QVariant KLFLibDBEngine::dbReadEntryPropertyValue(const QVariant& dbdata, int pr
     int h = (int)(val       & 0xFFFFFFFF) ;
     return QVariant::fromValue<QSize>(QSize(w, h));
   }
+  if (propertyId == KLFLibEntry::Style &&
+      (dbdata.type() == QVariant::LongLong || dbdata.type() == QVariant::Int)) {
+    // reference to the klf_styles table
+    return styleForId(dbdata.toInt());
+  }
   // otherwise, return the generic decapsulation
   return convertVariantFromDBData(dbdata);
 }
 
+// private
+int KLFLibDBEngine::internStyle(const QVariant& style)
+{
+  KLFStyle sty = style.value<KLFStyle>();
+  QByteArray data = klfSave(&sty, QLatin1String("CompactBinary"));
+  QByteArray hash = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+
+  { QMutexLocker locker(&pStyleCacheMutex);
+    QHash<QByteArray,int>::const_iterator it = pStyleIdByHash.find(hash);
+    if (it != pStyleIdByHash.end())
+      return it.value();
+  }
+
+  int styleid = -1;
+  QSqlQuery q = QSqlQuery(pDB);
+  q.prepare("SELECT id FROM klf_styles WHERE hash = ?");
+  q.addBindValue(hash);
+  if (q.exec() && q.next()) {
+    styleid = q.value(0).toInt();
+  } else {
+    QSqlQuery qins = QSqlQuery(pDB);
+    qins.prepare("INSERT INTO klf_styles (hash, style) VALUES (?, ?)");
+    qins.addBindValue(hash);
+    qins.addBindValue(data);
+    if ( !qins.exec() || qins.lastError().isValid() ) {
+      qWarning()<<KLF_FUNC_NAME<<": can't store style!\n\t"<<qins.lastError().text();
+      return -1;
+    }
+    styleid = qins.lastInsertId().toInt();
+  }
+
+  QMutexLocker locker(&pStyleCacheMutex);
+  pStyleIdByHash[hash] = styleid;
+  pStyleById[styleid] = style;
+  return styleid;
+}
+
+// private
+void KLFLibDBEngine::purgeUnusedStyles()
+{
+  if (!pHaveStyleTable)
+    return;
+
+  QStringList subres = subResourceList();
+  QStringList usedStyles;
+  int k;
+  for (k = 0; k < subres.size(); ++k)
+    usedStyles << QString("SELECT Style FROM %1 WHERE Style IS NOT NULL")
+      .arg(quotedDataTableName(subres[k]));
+
+  QString sql = "DELETE FROM klf_styles";
+  if (!usedStyles.isEmpty())
+    sql += " WHERE id NOT IN (" + usedStyles.join(" UNION ") + ")";
+
+  QSqlQuery q = QSqlQuery(pDB);
+  if ( !q.exec(sql) || q.lastError().isValid() ) {
+    qWarning()<<KLF_FUNC_NAME<<": can't delete unused styles: "<<q.lastError().text()
+	      <<"\n\tSQL="<<sql;
+    return;
+  }
+  klfDbg("deleted "<<q.numRowsAffected()<<" unused styles") ;
+  if (q.numRowsAffected() > 0) {
+    // the IDs of deleted styles may be reused by the next ones stored
+    clearStyleCache();
+  }
+}
+
+// private
+QVariant KLFLibDBEngine::styleForId(int styleId)
+{
+  { QMutexLocker locker(&pStyleCacheMutex);
+    QHash<int,QVariant>::const_iterator it = pStyleById.find(styleId);
+    if (it != pStyleById.end())
+      return it.value();
+  }
+
+  QSqlQuery q = QSqlQuery(readDatabase());
+  q.prepare("SELECT style FROM klf_styles WHERE id = ?");
+  q.addBindValue(styleId);
+  if ( !q.exec() || !q.next() ) {
+    qWarning()<<KLF_FUNC_NAME<<": can't find style #"<<styleId<<"\n\t"<<q.lastError().text();
+    return QVariant();
+  }
+  KLFStyle sty;
+  if ( !klfLoad(q.value(0).toByteArray(), &sty) ) {
+    qWarning()<<KLF_FUNC_NAME<<": can't read style #"<<styleId;
+    return QVariant();
+  }
+  QVariant value = QVariant::fromValue<KLFStyle>(sty);
+
+  QMutexLocker locker(&pStyleCacheMutex);
+  pStyleById[styleId] = value;
+  return value;
+}
+
 
 
 
@@ -1378,6 +1749,8 @@ bool KLFLibDBEngine::deleteSubResource(const QString& subResource)
     return false;
   }
 
+  purgeUnusedStyles();
+
   // all ok
   emit subResourceDeleted(subResource);
 
@@ -1427,6 +1800,28 @@ bool KLFLibDBEngine::createSubResource(const QString& subResource, const QString
 
 QList<KLFLibResourceEngine::entryId> KLFLibDBEngine::insertEntries(const QString& subres,
 								   const KLFLibEntryList& entrylist)
+{
+  return insertEntriesImpl(subres, entrylist, NULL);
+}
+
+QList<KLFLibResourceEngine::entryId>
+/* */ KLFLibDBEngine::insertEncodedEntries(const QString& subres,
+					   const QList<KLFLibEncodedEntryWithId>& entrylist)
+{
+  KLFLibEntryList elist;
+  QList<QByteArray> previewDataList;
+  int k;
+  for (k = 0; k < entrylist.size(); ++k) {
+    elist << entrylist[k].entry;
+    previewDataList << entrylist[k].previewData;
+  }
+  return insertEntriesImpl(subres, elist, &previewDataList);
+}
+
+// private
+QList<KLFLibResourceEngine::entryId>
+/* */ KLFLibDBEngine::insertEntriesImpl(const QString& subres, const KLFLibEntryList& entrylist,
+					const QList<QByteArray> *previewDataList)
 {
   int k, j;
 
@@ -1466,6 +1861,13 @@ QList<KLFLibResourceEngine::entryId> KLFLibDBEngine::insertEntries(const QString
   if (!thisOperationProgressBlocked())
     emit operationStartReportingProgress(&progr, tr("Inserting items into library database ..."));
 
+  // insert all the entries in a single transaction, rather than committing (and syncing the
+  // file) after each of them
+  bool intransaction = pDB.transaction();
+  if (!intransaction)
+    klfDbg("can't start transaction, inserting without: "<<pDB.lastError().text()) ;
+  bool failed = false;
+
   QSqlQuery q = QSqlQuery(pDB);
   q.prepare("INSERT INTO " + quotedDataTableName(subres) + " (" + props.join(",") + ") "
 	    " VALUES (" + questionmarks.join(",") + ")");
@@ -1476,7 +1878,11 @@ QList<KLFLibResourceEngine::entryId> KLFLibDBEngine::insertEntries(const QString
       progr.doReportProgress(j);
     //    klfDbg( "New entry to insert." ) ;
     for (k = 0; k < propids.size(); ++k) {
-      QVariant data = dbMakeEntryPropertyValue(entrylist[j].property(propids[k]), propids[k]);
+      QVariant data;
+      if (previewDataList != NULL && propids[k] == KLFLibEntry::Preview) // already PNG data
+	data = QVariant::fromValue<QByteArray>(previewDataList->value(j));
+      else
+	data = dbMakeEntryPropertyValue(entrylist[j].property(propids[k]), propids[k]);
       // and add a corresponding bind value for sql query
       klfDbg( "Binding value "<<k<<": "<<data ) ;
       q.bindValue(k, data);
@@ -1485,6 +1891,11 @@ QList<KLFLibResourceEngine::entryId> KLFLibDBEngine::insertEntries(const QString
     bool r = q.exec();
     if ( ! r || q.lastError().isValid() ) {
       qWarning()<<"INSERT failed! SQL Error: "<<q.lastError().text()<<"\n\tSQL="<<q.lastQuery();
+      if (intransaction) {
+	// don't commit a partial insertion, roll back everything below
+	failed = true;
+	break;
+      }
       insertedIds << -1;
     } else {
       QVariant v_id = q.lastInsertId();
@@ -1494,11 +1905,26 @@ QList<KLFLibResourceEngine::entryId> KLFLibDBEngine::insertEntries(const QString
 	insertedIds << v_id.toInt();
     }
   }
+  q.finish();
+
+  if (intransaction && !failed && !pDB.commit()) {
+    qWarning()<<KLF_FUNC_NAME<<": COMMIT failed! SQL Error: "<<pDB.lastError().text();
+    failed = true;
+  }
+  if (failed) {
+    pDB.rollback();
+    // the styles stored meanwhile by internStyle() were rolled back as well
+    clearStyleCache();
+    insertedIds = QList<entryId>();
+  }
 
   // make sure the last signal is emitted as specified by KLFLibResourceEngine doc (needed
   // for example to close progress dialog!)
   progr.doReportProgress(entrylist.size());
 
+  if (failed)
+    return insertedIds;
+
   emit dataChanged(subres, InsertData, insertedIds);
   return insertedIds;
 }
@@ -1613,6 +2039,8 @@ bool KLFLibDBEngine::deleteEntries(const QString& subResource, const QList<entry
 
   progr.doReportProgress(idlist.size());
 
+  purgeUnusedStyles();
+
   emit dataChanged(subResource, DeleteData, idlist);
 
   return !failed;
@@ -1625,6 +2053,14 @@ bool KLFLibDBEngine::saveTo(const QUrl& newPath)
       qWarning()<<"KLFLibDBEngine::saveTo("<<newPath<<"): Expected empty host!";
       return false;
     }
+    // don't carry styles no entry uses any more into the copy
+    if (!locked() && !isReadOnly())
+      purgeUnusedStyles();
+    // make sure all changes logged in the WAL file are written to the database file itself
+    QSqlQuery q = QSqlQuery(pDB);
+    if ( !q.exec("PRAGMA wal_checkpoint(TRUNCATE)") || q.lastError().isValid() )
+      qWarning()<<"KLFLibDBEngine::saveTo("<<newPath<<"): checkpoint failed: "<<q.lastError().text();
+    q.finish();
     return QFile::copy(klfUrlLocalFilePath(url()), klfUrlLocalFilePath(newPath));
   }
   qWarning()<<"KLFLibDBEngine::saveTo("<<newPath<<"): Bad scheme!";
@@ -1646,8 +2082,9 @@ bool KLFLibDBEngine::initFreshDatabase(QSqlDatabase db)
   sql << "CREATE TABLE klf_dbmetainfo (id INTEGER PRIMARY KEY, name TEXT, value BLOB)";
   sql << "INSERT INTO klf_dbmetainfo (name, value) VALUES ('klf_version', '" KLF_VERSION_STRING "')";
   sql << "INSERT INTO klf_dbmetainfo (name, value) VALUES ('klf_dbversion', '"+
-    QString::number(1)+"')";
+    QString::number(2)+"')";
   sql << "CREATE TABLE klf_subresprops (id INTEGER PRIMARY KEY, pid INTEGER, subresource TEXT, pvalue BLOB)";
+  sql << "CREATE TABLE klf_styles (id INTEGER PRIMARY KEY, hash BLOB UNIQUE, style BLOB)";
 
   int k;
   for (k = 0; k < sql.size(); ++k) {
@@ -26,6 +26,9 @@
 
 #include <QSqlDatabase>
 #include <QSqlQuery>
+#include <QHash>
+#include <QMutex>
+#include <QThread>
 
 #include <klfdefs.h>
 #include <klflib.h>
@@ -68,6 +71,13 @@ class KLFLibDBEnginePropertyChangeNotifier;
  *
  * Sub-resource properties are also supported in a limited way
  * (only built-in properties Title and ViewType are supported).
+ *
+ * SQLite databases are used in write-ahead logging (WAL) mode. The functions that only read data
+ * (allIds(), hasEntry(), entries(), entry(), allEntries(), query() and queryValues()) may be called
+ * from other threads than the one this object lives in; they then use a separate, read-only
+ * connection that is opened once per thread (and closed when that thread exits). They don't report
+ * progress when called from another thread. All other functions must be called from this
+ * object's thread.
  */
 class KLF_EXPORT KLFLibDBEngine : public KLFLibResourceEngine, private KLFLibDBConnectionClassUser
 {
@@ -120,6 +130,8 @@ public:
   virtual bool hasEntry(const QString&, entryId id);
   virtual QList<KLFLibEntryWithId> entries(const QString&, const QList<KLFLib::entryId>& idList,
 					   const QList<int>& wantedEntryProperties = QList<int>());
+  virtual QList<KLFLibEncodedEntryWithId> encodedEntries(const QString& subResource,
+							 const QList<KLFLib::entryId>& idList);
 
   virtual int query(const QString& subResource, const Query& query, QueryResult *result);
   virtual QList<QVariant> queryValues(const QString& subResource, int entryPropId);
@@ -146,6 +158,8 @@ public slots:
   virtual bool deleteSubResource(const QString& subResource);
 
   virtual QList<entryId> insertEntries(const QString& subRes, const KLFLibEntryList& entries);
+  virtual QList<entryId> insertEncodedEntries(const QString& subRes,
+					      const QList<KLFLibEncodedEntryWithId>& entrylist);
   virtual bool changeEntries(const QString& subRes, const QList<entryId>& idlist,
 			     const QList<int>& properties, const QList<QVariant>& values);
   virtual bool deleteEntries(const QString& subRes, const QList<entryId>& idlist);
@@ -178,16 +192,58 @@ private:
 		 bool accessshared, QObject *parent);
 
   QSqlDatabase pDB;
+  QString pDBDriverName;
+  QString pDBFileName;
 
   int pDBVersion;
 
-  /** Key is sub-resource name (not raw table name) */
+  /** Whether the database has the \c klf_styles table, in which case the \c Style column of the
+   * data tables holds an ID in that table (see \ref libfmt_klfdb). */
+  bool pHaveStyleTable;
+  /** Cache of the \c klf_styles table. Protected by \c pStyleCacheMutex, as styles are decoded
+   * by the read functions that may be called from other threads. */
+  QHash<QByteArray,int> pStyleIdByHash;
+  QHash<int,QVariant> pStyleById;
+  mutable QMutex pStyleCacheMutex;
+  /** Returns the ID of \c style in the \c klf_styles table, storing it there if needed. Returns
+   * -1 on error. */
+  int internStyle(const QVariant& style);
+  /** Returns the style stored with ID \c styleId in the \c klf_styles table. */
+  QVariant styleForId(int styleId);
+  /** Forgets the cached styles, eg. after rolling back a transaction that stored some. */
+  void clearStyleCache();
+  /** Deletes the styles that no entry of any sub-resource refers to from the \c klf_styles
+   * table. */
+  void purgeUnusedStyles();
+
+  /** Key is sub-resource name (not raw table name). Protected by \c pAvailColumnsMutex, as the read
+   * functions may be called from other threads. Use availColumns() to read. */
   QMap<QString,QStringList> pDBAvailColumns;
+  mutable QMutex pAvailColumnsMutex;
+  QStringList availColumns(const QString& subResource) const;
+
+  inline bool inGuiThread() const { return QThread::currentThread() == thread(); }
+  /** Returns \c pDB if called from this object's thread, or a read-only connection to the same
+   * database owned by the calling thread otherwise. */
+  QSqlDatabase readDatabase() const;
   
   QStringList columnNameList(const QString& subResource, const QList<int>& entryPropList,
 			     bool wantIdFirst = true);
   QStringList detectEntryColumns(const QSqlQuery& q);
-  KLFLibEntry readEntry(const QSqlQuery& q, const QStringList& columns);
+  /** Reads the entry in the current row of \c q. If \c previewData is not NULL, the preview is
+   * not decoded but its PNG data is stored in \c previewData. */
+  KLFLibEntry readEntry(const QSqlQuery& q, const QStringList& columns, QByteArray *previewData = NULL);
+  /** Reads the columns \c columns (the first one being \c "id") of the entries with IDs \c idList
+   * into \c fetched. If \c previews is not NULL, the previews are stored there as PNG data
+   * instead of being decoded, see readEntry(). */
+  void fetchEntries(const QString& subResource, const QStringList& columns,
+		    const QList<KLFLib::entryId>& idList, KLFProgressReporter *progr,
+		    QHash<KLFLib::entryId, KLFLibEntry> *fetched,
+		    QHash<KLFLib::entryId, QByteArray> *previews);
+  /** Implements insertEntries() and insertEncodedEntries(). If \c previewDataList is not NULL,
+   * it gives the PNG data to store for the preview of each entry. */
+  QList<entryId> insertEntriesImpl(const QString& subRes, const KLFLibEntryList& entrylist,
+				   const QList<QByteArray> *previewDataList);
 
   QVariant dbMakeEntryPropertyValue(const QVariant& entryValue, int entryPropertyId);
   QVariant dbReadEntryPropertyValue(const QVariant& dbdata, int entryPropertyId);
@@ -31,6 +31,10 @@
 #define KLFLIBDBENGINE_P_H
 
 #include <QObject>
+#include <QMap>
+#include <QString>
+#include <QSqlDatabase>
+#include <QThreadStorage>
 
 
 /** \internal */
@@ -69,4 +73,28 @@ private:
 
 
 
+/** \internal
+ *
+ * The read-only database connections of one thread, one per database file. An instance is
+ * created on demand for each thread that calls connection(); it is deleted (and the connections
+ * are closed) by QThreadStorage when the thread exits.
+ */
+class KLFLibDBThreadReadConnections
+{
+public:
+  ~KLFLibDBThreadReadConnections();
+
+  /** Returns the calling thread's read-only connection to database file \c fileName, opening it
+   * with the driver \c driverName if needed. */
+  static QSqlDatabase connection(const QString& driverName, const QString& fileName);
+
+private:
+  /** Key is the database file name, value the Qt SQL connection name */
+  QMap<QString,QString> pConnectionNames;
+
+  static QThreadStorage<KLFLibDBThreadReadConnections*> pThreadConnections;
+};
+
+
+
 #endif
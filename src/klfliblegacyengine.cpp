@@ -30,8 +30,10 @@
 #include <QDir>
 #include <QFile>
 #include <QFileInfo>
+#include <QBuffer>
 #include <QMessageBox>
 #include <QApplication> // qApp
+#include <QImageReader>
 
 #include "klflib.h"
 #include "klflibview.h"
@@ -87,19 +89,121 @@ QDebug& operator<<(QDebug& s, const KLFLegacyData::KLFLibraryResource& res)
 
 
 
+static const char klf_png_signature[] = "\x89PNG\r\n\x1a\n";
+
+QImage KLFLegacyData::KLFLibraryItem::previewImage() const
+{
+  if (!previewData.isEmpty()) {
+    return QImage::fromData(previewData, "PNG");
+  }
+  return preview.toImage();
+}
+
+QSize KLFLegacyData::KLFLibraryItem::previewSize() const
+{
+  if (!previewData.isEmpty()) {
+    // read the size in the PNG header chunk, which always comes first
+    if (previewData.size() >= 24 && previewData.mid(12, 4) == "IHDR") {
+      const uchar *hdr = (const uchar*)previewData.constData() + 16;
+      int w = (hdr[0] << 24) | (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+      int h = (hdr[4] << 24) | (hdr[5] << 16) | (hdr[6] << 8) | hdr[7];
+      return QSize(w, h);
+    }
+    return previewImage().size();
+  }
+  return preview.size();
+}
+
+/** \internal
+ * Reads a preview pixmap written by QDataStream, keeping the PNG data as is in
+ * item->previewData instead of decoding it (which is the most expensive part of reading a
+ * library file).
+ *
+ * For stream versions >= 5, Qt writes a non-null marker followed by the raw PNG data, which
+ * has no size prefix: we walk the PNG chunks up to IEND to find where it ends.
+ */
+static void klf_legacy_read_preview(QDataStream& stream, KLFLegacyData::KLFLibraryItem *item)
+{
+  item->preview = QPixmap();
+  item->previewData = QByteArray();
+
+  QIODevice *dev = stream.device();
+  if (stream.version() < 5 || dev == NULL) {
+    stream >> item->preview;
+    return;
+  }
+  qint32 nonnull;
+  stream >> nonnull;
+  if (!nonnull) {
+    return; // null preview
+  }
+  if (dev->peek(8) != QByteArray(klf_png_signature, 8)) {
+    // not PNG data (?), let Qt find out
+    item->preview = QPixmap::fromImage(QImageReader(dev, 0).read());
+    return;
+  }
+  QByteArray png = dev->read(8);
+  forever {
+    QByteArray head = dev->read(8);
+    if (head.size() != 8) {
+      stream.setStatus(QDataStream::ReadPastEnd);
+      return;
+    }
+    const uchar *h = (const uchar*)head.constData();
+    quint32 len = (h[0] << 24) | (h[1] << 16) | (h[2] << 8) | h[3];
+    if (len > 0x7fffffffu - 4) {
+      stream.setStatus(QDataStream::ReadCorruptData);
+      return;
+    }
+    QByteArray rest = dev->read(len + 4); // chunk data and CRC
+    if (rest.size() != (int)len + 4) {
+      stream.setStatus(QDataStream::ReadPastEnd);
+      return;
+    }
+    png += head;
+    png += rest;
+    if (head.mid(4, 4) == "IEND") {
+      break;
+    }
+  }
+  item->previewData = png;
+}
+
 KLF_EXPORT QDataStream& operator<<(QDataStream& stream, const KLFLegacyData::KLFLibraryItem& item)
 {
-  return stream << item.id << item.datetime
-      << item.latex // category and tags are included.
-      << item.preview << item.style;
+  stream << item.id << item.datetime
+	 << item.latex; // category and tags are included.
+  if (!item.previewData.isEmpty() && stream.version() >= 5) {
+    // same as what QDataStream writes for the pixmap, without decoding and encoding it again
+    stream << (qint32)1;
+    stream.writeRawData(item.previewData.constData(), item.previewData.size());
+  } else if (!item.previewData.isEmpty()) {
+    stream << QPixmap::fromImage(item.previewImage());
+  } else {
+    stream << item.preview;
+  }
+  return stream << item.style;
 }
 
 // it is important to note that the >> operator imports in a compatible way to KLF 2.0
 KLF_EXPORT QDataStream& operator>>(QDataStream& stream, KLFLegacyData::KLFLibraryItem& item)
 {
-  stream >> item.id >> item.datetime >> item.latex >> item.preview >> item.style;
+  QIODevice *dev = stream.device();
+  qint64 offset = (dev != NULL && !dev->isSequential()) ? dev->pos() : -1;
+
+  stream >> item.id >> item.datetime >> item.latex;
+  klf_legacy_read_preview(stream, &item);
+  stream >> item.style;
   item.category = KLFLibEntry::categoryFromLatex(item.latex);
   item.tags = KLFLibEntry::tagsFromLatex(item.latex);
+
+  if (offset >= 0 && stream.status() == QDataStream::Ok) {
+    item.fileOffset = offset;
+    item.fileLength = dev->pos() - offset;
+  } else {
+    item.fileOffset = -1;
+    item.fileLength = 0;
+  }
   return stream;
 }
 
@@ -238,10 +342,90 @@ bool KLFLibLegacyFileDataPrivate::load(const QString& fnm)
 	KLFLegacyData::KLFLibraryItem::MaxId = ll[j].id+1;
     }
   }
+
+  // the positions of the items in the file are only useful to patch our own file, and only if
+  // the items are stored as save() writes them
+  if (stream.version() != QDataStream::Qt_3_3 ||
+      canonicalFilePath(fname) != canonicalFilePath(filename)) {
+    forgetFileOffsets();
+  } else {
+    updateFileStamp();
+  }
+
   haschanges = false;
   return true;
 }
 
+void KLFLibLegacyFileDataPrivate::forgetFileOffsets()
+{
+  KLFLegacyData::KLFLibrary::iterator it;
+  for (it = library.begin(); it != library.end(); ++it) {
+    KLFLegacyData::KLFLibraryList& ll = it.value();
+    for (int j = 0; j < ll.size(); ++j) {
+      ll[j].fileOffset = -1;
+    }
+  }
+  fileStampSize = -1;
+  fileStampModified = QDateTime();
+}
+
+void KLFLibLegacyFileDataPrivate::updateFileStamp()
+{
+  QFileInfo fi(filename);
+  fi.refresh();
+  fileStampSize = fi.size();
+  fileStampModified = fi.lastModified();
+}
+
+bool KLFLibLegacyFileDataPrivate::canPatchFile(const QString& fname) const
+{
+  if (canonicalFilePath(fname) != canonicalFilePath(filename) || fileStampSize < 0) {
+    return false;
+  }
+  // make sure nobody else wrote to the file since we last read or wrote it
+  QFileInfo fi(filename);
+  return fi.exists() && fi.size() == fileStampSize && fi.lastModified() == fileStampModified;
+}
+
+void KLFLibLegacyFileDataPrivate::writeItemList(QDataStream& stream, KLFLegacyData::KLFLibraryList& list,
+						WriteMode mode)
+{
+  QIODevice *dev = stream.device();
+  stream << (quint32)list.size();
+  for (int k = 0; k < list.size(); ++k) {
+    KLFLegacyData::KLFLibraryItem& item = list[k];
+    qint64 pos = dev->pos();
+    if (mode == PatchOwnFile && item.fileOffset == pos && item.fileLength > 0) {
+      // this item is unchanged and already at the right place in the file
+      dev->seek(pos + item.fileLength);
+      continue;
+    }
+    stream << item;
+    if (mode != WriteOtherFile) {
+      item.fileOffset = pos;
+      item.fileLength = dev->pos() - pos;
+    }
+  }
+}
+
+void KLFLibLegacyFileDataPrivate::writeLibrary(QDataStream& stream, WriteMode mode)
+{
+  // write as QDataStream does for a QMap, but using writeItemList() for the values
+  stream << (quint32)library.size();
+  KLFLegacyData::KLFLibrary::iterator it = library.end();
+  while (it != library.begin()) {
+    --it;
+    stream << it.key();
+    writeItemList(stream, it.value(), mode);
+  }
+}
+
+void KLFLibLegacyFileDataPrivate::autoSave()
+{
+  if (haschanges)
+    save();
+}
+
 bool KLFLibLegacyFileDataPrivate::save(const QString& fnm)
 {
   KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME+"('"+fnm+"')") ;
@@ -254,8 +438,18 @@ bool KLFLibLegacyFileDataPrivate::save(const QString& fnm)
   QString fname = (!fnm.isEmpty() ? fnm : filename) ;
   klfDbg(" saving to file "<<fname<<" a "<<legacyLibType<<"-type library with N="<<resources.size()
 	 <<" resources (our filename="<<filename<<")") ;
+
+  // If we are saving to our own file, which we have read or written ourselves, don't rewrite
+  // the items which haven't changed and are still at the same place in the file.
+  const bool ownfile = (canonicalFilePath(fname) == canonicalFilePath(filename));
+  WriteMode mode = WriteOtherFile;
+  if (ownfile) {
+    mode = canPatchFile(fname) ? PatchOwnFile : RewriteOwnFile;
+  }
+  klfDbg("write mode: "<<mode) ;
+
   QFile fsav(fname);
-  if ( ! fsav.open(QIODevice::WriteOnly) ) {
+  if ( ! fsav.open(mode == PatchOwnFile ? QIODevice::ReadWrite : (QIODevice::WriteOnly|QIODevice::Truncate)) ) {
     qWarning("Can't write to file %s!", qPrintable(fname));
     QMessageBox::critical(NULL, tr("Error"), tr("Can't write to file %1").arg(fname));
     return false;
@@ -287,12 +481,8 @@ bool KLFLibLegacyFileDataPrivate::save(const QString& fnm)
   switch (llt) {
   case LocalHistoryType:
     {
-      KLFLegacyData::KLFLibraryList liblist;
-      if (resources.size() == 0) {
-	liblist = KLFLegacyData::KLFLibraryList(); // no resources !
-      } else {
-	liblist = library[resources[0]];
-      }
+      KLFLegacyData::KLFLibraryList emptylist; // if no resources !
+      KLFLegacyData::KLFLibraryList& liblist = (resources.size() == 0) ? emptylist : library[resources[0]];
       if (resources.size() > 1) {
 	qWarning("%s: Saving an old \"history\" resource. Only one resource can be saved, "
 		 "it will be the first: %s", KLF_FUNC_NAME, qPrintable(resources[0].name));
@@ -302,7 +492,8 @@ bool KLFLibLegacyFileDataPrivate::save(const QString& fnm)
       }
       // find history resource in our
       stream << QString("KLATEXFORMULA_HISTORY") << (qint16)2 << (qint16)0
-	     << (quint32)KLFLegacyData::KLFLibraryItem::MaxId << liblist;
+	     << (quint32)KLFLegacyData::KLFLibraryItem::MaxId;
+      writeItemList(stream, liblist, mode);
       break;
     }
   case LocalLibraryType:
@@ -310,7 +501,8 @@ bool KLFLibLegacyFileDataPrivate::save(const QString& fnm)
       stream << QString("KLATEXFORMULA_LIBRARY") << (qint16)2 << (qint16)1;
       // don't save explicitely QDataStream version: we're writing KLF 2.1-compatible;
       // version explicitely saved only since KLF >= 3.x.
-      stream << (quint32)KLFLegacyData::KLFLibraryItem::MaxId << resources << library;
+      stream << (quint32)KLFLegacyData::KLFLibraryItem::MaxId << resources;
+      writeLibrary(stream, mode);
       // additionally, save our meta-data at the end (this will be ignored by previous versions
       // of KLF)
       stream << metadata;
@@ -324,7 +516,8 @@ bool KLFLibLegacyFileDataPrivate::save(const QString& fnm)
     }
 
     stream << QString("KLATEXFORMULA_LIBRARY_EXPORT") << (qint16)2 << (qint16)1
-	   << resources << library;
+	   << resources;
+    writeLibrary(stream, mode);
     // additionally, save our meta-data at the end (this will be ignored by versions of KLF which
     // don't know about metadata...)
     stream << metadata;
@@ -339,8 +532,22 @@ bool KLFLibLegacyFileDataPrivate::save(const QString& fnm)
     break;
   }
 
-  if (fnm.isEmpty() || canonicalFilePath(fnm) == canonicalFilePath(filename))
+  // we may have written less than what was in the file
+  if (mode == PatchOwnFile)
+    fsav.resize(fsav.pos());
+  fsav.close();
+
+  if (stream.status() != QDataStream::Ok || fsav.error() != QFile::NoError) {
+    qWarning("Error writing to file %s!", qPrintable(fname));
+    if (ownfile)
+      forgetFileOffsets(); // don't trust what we wrote
+    return false;
+  }
+
+  if (ownfile) {
+    updateFileStamp();
     haschanges = false; // saving to the reference file, not a copy
+  }
   return true;
 }
 
@@ -497,6 +704,8 @@ KLFLibLegacyEngine::~KLFLibLegacyEngine()
 {
   KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
 
+  stopAsyncJobs();
+
   KLF_ASSERT_NOT_NULL( d , "d is NULL!" , return ) ;
 
   if ( ! d->deref() ) {
@@ -575,7 +784,7 @@ KLFLibEntry KLFLibLegacyEngine::entry(const QString& resource, entryId id)
 
 
 QList<KLFLibResourceEngine::KLFLibEntryWithId>
-/* */ KLFLibLegacyEngine::allEntries(const QString& resource, const QList<int>& /*wantedEntryProperties*/)
+/* */ KLFLibLegacyEngine::allEntries(const QString& resource, const QList<int>& wantedEntryProperties)
 {
   KLF_ASSERT_NOT_NULL( d , "d is NULL!" , return QList<KLFLibEntryWithId>() ) ;
 
@@ -583,12 +792,16 @@ QList<KLFLibResourceEngine::KLFLibEntryWithId>
   if (rindex < 0)
     return QList<KLFLibEntryWithId>();
 
+  // only decode the previews if they are needed
+  const bool withPreview = wantedEntryProperties.isEmpty() ||
+    wantedEntryProperties.contains(KLFLibEntry::Preview);
+
   QList<KLFLibEntryWithId> entryList;
   KLFLegacyData::KLFLibraryList ll = d->library[d->resources[rindex]];
   int k;
   for (k = 0; k < ll.size(); ++k) {
     KLFLibEntryWithId e;
-    e.entry = d->toLibEntry(ll[k]);
+    e.entry = d->toLibEntry(ll[k], withPreview);
     e.id = ll[k].id;
     entryList << e;
   }
@@ -596,6 +809,61 @@ QList<KLFLibResourceEngine::KLFLibEntryWithId>
 }
 
 
+QList<KLFLib::entryId> KLFLibLegacyEngine::allIds(const QString& resource)
+{
+  KLF_ASSERT_NOT_NULL( d , "d is NULL!" , return QList<KLFLib::entryId>() ) ;
+
+  int rindex = d->findResourceName(resource);
+  if (rindex < 0)
+    return QList<KLFLib::entryId>();
+
+  QList<KLFLib::entryId> idList;
+  const KLFLegacyData::KLFLibraryList& ll = d->library[d->resources[rindex]];
+  int k;
+  for (k = 0; k < ll.size(); ++k)
+    idList << ll[k].id;
+  return idList;
+}
+
+QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId>
+/* */ KLFLibLegacyEngine::encodedEntries(const QString& resource, const QList<KLFLib::entryId>& idList)
+{
+  KLF_ASSERT_NOT_NULL( d , "d is NULL!" , return QList<KLFLibEncodedEntryWithId>() ) ;
+
+  int rindex = d->findResourceName(resource);
+  if (rindex < 0)
+    return QList<KLFLibEncodedEntryWithId>();
+
+  const KLFLegacyData::KLFLibraryList& ll = d->library[d->resources[rindex]];
+  QList<KLFLibEncodedEntryWithId> entryList;
+  int k;
+  int i = 0;
+  for (k = 0; k < idList.size(); ++k) {
+    // the IDs are usually requested in the order of allIds(), so look first right after the
+    // previous entry
+    if (i >= ll.size() || ll[i].id != (quint32)idList[k]) {
+      for (i = 0; i < ll.size() && ll[i].id != (quint32)idList[k]; ++i)
+	;
+    }
+    if (i == ll.size()) {
+      entryList << KLFLibEncodedEntryWithId(-1);
+      continue;
+    }
+    const KLFLegacyData::KLFLibraryItem& item = ll[i];
+    KLFLibEncodedEntryWithId e(item.id, d->toLibEntry(item, false), item.previewData);
+    if (e.previewData.isEmpty() && !item.preview.isNull()) {
+      // preview was set in memory but not yet encoded
+      QBuffer buf(&e.previewData);
+      buf.open(QIODevice::WriteOnly);
+      item.preview.save(&buf, "PNG");
+    }
+    entryList << e;
+    ++i;
+  }
+  return entryList;
+}
+
+
 QStringList KLFLibLegacyEngine::subResourceList() const
 {
   KLF_ASSERT_NOT_NULL( d , "d is NULL!" , return QStringList() ) ;
@@ -767,6 +1035,43 @@ QList<KLFLibResourceEngine::entryId> KLFLibLegacyEngine::insertEntries(const QSt
   return newIds;
 }
 
+QList<KLFLibResourceEngine::entryId>
+/* */ KLFLibLegacyEngine::insertEncodedEntries(const QString& subResource,
+					       const QList<KLFLibEncodedEntryWithId>& entrylist)
+{
+  KLF_ASSERT_NOT_NULL( d , "d is NULL!" , return QList<entryId>() ) ;
+
+  if ( entrylist.size() == 0 )
+     return QList<entryId>();
+  if (!canModifyData(subResource, InsertData)) {
+    klfDbg("cannot modify data.") ;
+    return QList<entryId>();
+  }
+
+  int index = d->findResourceName(subResource);
+  if (index < 0) {
+    klfDbg("cannot find sub-resource: "<<subResource) ;
+    return QList<entryId>();
+  }
+
+  QList<entryId> newIds;
+
+  int k;
+  for (k = 0; k < entrylist.size(); ++k) {
+    KLFLegacyData::KLFLibraryItem item = d->toLegacyLibItem(entrylist[k].entry);
+    // the PNG data is written as is to the file
+    item.preview = QPixmap();
+    item.previewData = entrylist[k].previewData;
+    d->library[d->resources[index]] << item;
+    newIds << item.id;
+  }
+  d->haschanges = true;
+
+  emit dataChanged(subResource, InsertData, newIds);
+
+  return newIds;
+}
+
 bool KLFLibLegacyEngine::changeEntries(const QString& subResource, const QList<entryId>& idlist,
 				       const QList<int>& properties, const QList<QVariant>& values)
 {
@@ -797,7 +1102,8 @@ bool KLFLibLegacyEngine::changeEntries(const QString& subResource, const QList<e
       success = false;
       continue;
     }
-    // modify this entry as requested.
+    // modify this entry as requested. It will have to be written to the file again.
+    d->library[d->resources[index]][libindex].fileOffset = -1;
     for (j = 0; j < properties.size(); ++j) {
       switch (properties[j]) {
       case KLFLibEntry::Latex:
@@ -813,6 +1119,7 @@ bool KLFLibLegacyEngine::changeEntries(const QString& subResource, const QList<e
 	break;
       case KLFLibEntry::Preview:
 	d->library[d->resources[index]][libindex].preview = QPixmap::fromImage(values[j].value<QImage>());
+	d->library[d->resources[index]][libindex].previewData = QByteArray();
 	break;
       case KLFLibEntry::Category:
 	// remember that entry.latex has redundancy for category+tags in the form "%: ...\n% ...\n<latex>"
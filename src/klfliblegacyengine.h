@@ -65,6 +65,8 @@ public:
   };
 
   struct KLFLibraryItem {
+    KLFLibraryItem() : id(0), fileOffset(-1), fileLength(0) { }
+
     quint32 id;
     static quint32 MaxId;
 
@@ -72,7 +74,24 @@ public:
     /** \note \c latex contains also information of category (first line, %: ...) and
      * tags (first/second line, after category: % ...) */
     QString latex;
+    /** \note When read from a file, the preview is not decoded and this is a null pixmap; the
+     * PNG data is kept in \ref previewData instead. Use \ref previewImage() and \ref
+     * previewSize() to access the preview. */
     QPixmap preview;
+    /** The preview image data (PNG) exactly as read from the file, if it was not decoded. It is
+     * written back as is. Clear this field when setting \ref preview. */
+    QByteArray previewData;
+
+    /** The preview image, decoding \ref previewData if needed */
+    QImage previewImage() const;
+    /** The size of the preview image. Does not need to decode \ref previewData. */
+    QSize previewSize() const;
+
+    /** Position and length in bytes of this item in the library file, or -1 if this item was
+     * never written to or read from the file, or if it has changed since. Any code modifying
+     * an item must reset \c fileOffset to -1 ! */
+    qint64 fileOffset;
+    qint64 fileLength;
 
     QString category;
     QString tags;
@@ -153,6 +172,9 @@ public:
   virtual KLFLibEntry entry(const QString& resource, entryId id);
   virtual QList<KLFLibEntryWithId> allEntries(const QString& resource,
 					      const QList<int>& wantedEntryProperties = QList<int>());
+  virtual QList<KLFLib::entryId> allIds(const QString& resource);
+  virtual QList<KLFLibEncodedEntryWithId> encodedEntries(const QString& resource,
+							 const QList<KLFLib::entryId>& idList);
 
   virtual QStringList subResourceList() const;
 
@@ -170,6 +192,8 @@ public slots:
   virtual void setAutoSaveInterval(int intervalms);
 
   virtual QList<entryId> insertEntries(const QString& subResource, const KLFLibEntryList& entries);
+  virtual QList<entryId> insertEncodedEntries(const QString& subResource,
+					      const QList<KLFLibEncodedEntryWithId>& entrylist);
   virtual bool changeEntries(const QString& subResource, const QList<entryId>& idlist,
 			     const QList<int>& properties, const QList<QVariant>& values);
   virtual bool deleteEntries(const QString& subResource, const QList<entryId>& idlist);
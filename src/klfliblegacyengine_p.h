@@ -32,6 +32,7 @@
 #include <QObject>
 #include <QMap>
 #include <QFileInfo>
+#include <QDateTime>
 
 #include "klfliblegacyengine.h"
 
@@ -148,10 +149,11 @@ public:
 
 
 
-  static inline KLFLibEntry toLibEntry(const KLFLegacyData::KLFLibraryItem& item)
+  /** If \c withPreview is FALSE, the preview is not decoded (but the preview size is set). */
+  static inline KLFLibEntry toLibEntry(const KLFLegacyData::KLFLibraryItem& item, bool withPreview = true)
   {
     return KLFLibEntry(KLFLibEntry::stripCategoryTagsFromLatex(item.latex), item.datetime,
-		       item.preview.toImage(), item.preview.size(), item.category,
+		       withPreview ? item.previewImage() : QImage(), item.previewSize(), item.category,
 		       item.tags, item.style.toNewStyle());
   }
   static inline KLFLegacyData::KLFLibraryItem toLegacyLibItem(const KLFLibEntry& entry)
@@ -164,6 +166,7 @@ public:
     item.category = entry.category();
     item.tags = entry.tags();
     item.preview = QPixmap::fromImage(entry.preview());
+    item.previewData = QByteArray();
     item.datetime = entry.dateTime();
     item.style = KLFLegacyData::KLFLegacyStyle::fromNewStyle(entry.style());
     return item;
@@ -179,15 +182,40 @@ public slots:
    *   to \ref library and \ref resources.  */
   bool load(const QString& fname = QString());
 
-  /** Saves the current object to the file */
+  /** Saves the current object to the file.
+   *
+   * When saving to our own file, only the items which have changed or moved are written (see
+   * KLFLegacyData::KLFLibraryItem::fileOffset), unless the file was modified by someone else
+   * in the meantime. */
   bool save(const QString& fname = QString());
 
+  /** Saves the file if there are changes. Called by \ref autoSaveTimer. */
+  void autoSave();
+
   void emitResourcePropertyChanged(int propId) { emit resourcePropertyChanged(propId); }
 
 private:
-  KLFLibLegacyFileDataPrivate() { }
+  KLFLibLegacyFileDataPrivate() : fileStampSize(-1), refcount(0) { }
+
+  enum WriteMode {
+    WriteOtherFile = 0, //!< Write all items, don't remember where they are
+    RewriteOwnFile, //!< Write all items, remember where they are for next time
+    PatchOwnFile //!< Skip the items which are unchanged and at the right place
+  };
+
+  void writeItemList(QDataStream& stream, KLFLegacyData::KLFLibraryList& list, WriteMode mode);
+  void writeLibrary(QDataStream& stream, WriteMode mode);
+
+  bool canPatchFile(const QString& fname) const;
+  void forgetFileOffsets();
+  void updateFileStamp();
+
+  /** Size and modification time of our file when we last read or wrote it, to detect changes
+   * by someone else. \c fileStampSize is -1 if we can't patch the file. */
+  qint64 fileStampSize;
+  QDateTime fileStampModified;
 
-  KLFLibLegacyFileDataPrivate(const QString& fname) : refcount(0), filename(fname)
+  KLFLibLegacyFileDataPrivate(const QString& fname) : fileStampSize(-1), refcount(0), filename(fname)
   {
     klfDbg(" filename is "<<filename ) ;
 
@@ -204,7 +232,7 @@ private:
     // prepare the autosave timer
     autoSaveTimer = new QTimer(NULL);
     autoSaveTimer->setSingleShot(false);
-    connect(autoSaveTimer, SIGNAL(timeout()), this, SLOT(save()));
+    connect(autoSaveTimer, SIGNAL(timeout()), this, SLOT(autoSave()));
   }
 
   int refcount;
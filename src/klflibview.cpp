@@ -51,6 +51,15 @@
 #include <QStandardItemModel>
 #include <QItemDelegate>
 #include <QShortcut>
+#include <QPixmap>
+#include <QPixmapCache>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QSet>
+#include <QTimer>
+
+#include <algorithm>
 
 #include <ui_klflibopenresourcedlg.h>
 #include <ui_klflibrespropeditor.h>
@@ -379,6 +388,193 @@ KLF_EXPORT QDebug& operator<<(QDebug& d, const KLFLibViewDelegate::ColorRegion&
 
 
 
+// -------------------------------------------------------
+
+//   THUMBNAIL LOADER
+
+//! Default budget of the thumbnail loader's image cache
+static const int KLF_THUMBNAIL_CACHE_DEFAULT_BYTES = 64*1024*1024;
+//! Number of previews read from the resource at once by the thumbnail loader
+static const int KLF_THUMBNAIL_LOAD_BATCH = 16;
+//! Older requests are dropped beyond this number, eg. when the user scrolls quickly
+static const int KLF_THUMBNAIL_MAX_PENDING = 256;
+
+/** \internal Reads a batch of previews in the thumbnail loader's worker thread */
+class KLFLibThumbnailLoadTask : public QRunnable
+{
+public:
+  KLFLibThumbnailLoadTask(KLFLibThumbnailLoader *loader, int generation, KLFLibResourceEngine *resource,
+			  const QString& subResource, const QList<KLFLib::entryId>& eids)
+    : pLoader(loader), pGeneration(generation), pResource(resource), pSubResource(subResource),
+      pEntryIds(eids)
+  {
+  }
+
+  virtual void run()
+  {
+    QList<KLFLibResourceEngine::KLFLibEntryWithId> elist =
+      pResource->entries(pSubResource, pEntryIds, QList<int>() << KLFLibEntry::Preview);
+    QList<int> eids;
+    QList<QImage> images;
+    for (int k = 0; k < elist.size(); ++k) {
+      eids << elist[k].id;
+      images << elist[k].entry.preview();
+    }
+    // don't forget the entries that could not be read, so that they may be requested again
+    for (int k = 0; k < pEntryIds.size(); ++k) {
+      if (!eids.contains(pEntryIds[k])) {
+	eids << pEntryIds[k];
+	images << QImage();
+      }
+    }
+    QMetaObject::invokeMethod(pLoader, "loaded", Qt::QueuedConnection, Q_ARG(int, pGeneration),
+			      Q_ARG(QList<int>, eids), Q_ARG(QList<QImage>, images));
+  }
+
+private:
+  KLFLibThumbnailLoader *pLoader;
+  int pGeneration;
+  KLFLibResourceEngine *pResource;
+  QString pSubResource;
+  QList<KLFLib::entryId> pEntryIds;
+};
+
+
+KLFLibThumbnailLoader::KLFLibThumbnailLoader(KLFLibModelCache *cache)
+  : QObject(NULL), pCache(cache), pLoadScheduled(false), pGeneration(0)
+{
+  qRegisterMetaType<QList<QImage> >("QList<QImage>");
+  setMaxCacheBytes(KLF_THUMBNAIL_CACHE_DEFAULT_BYTES);
+  pPool.setMaxThreadCount(1);
+}
+
+KLFLibThumbnailLoader::~KLFLibThumbnailLoader()
+{
+  pPending.clear();
+  pPool.waitForDone();
+}
+
+QImage KLFLibThumbnailLoader::thumbnail(KLFLib::entryId eid)
+{
+  QImage *img = pImages.object(eid); // marks it as recently used
+  if (img != NULL)
+    return *img;
+  request(QList<KLFLib::entryId>() << eid);
+  return QImage();
+}
+
+void KLFLibThumbnailLoader::request(const QList<KLFLib::entryId>& eids)
+{
+  for (int k = 0; k < eids.size(); ++k) {
+    if (pImages.contains(eids[k]) || pRequested.contains(eids[k]))
+      continue;
+    pPending.append(eids[k]);
+    pRequested.insert(eids[k]);
+  }
+  // drop the oldest requests, they were probably scrolled out of view. They will be requested
+  // again if they are painted.
+  while (pPending.size() > KLF_THUMBNAIL_MAX_PENDING)
+    pRequested.remove(pPending.takeFirst());
+
+  scheduleLoad();
+}
+
+void KLFLibThumbnailLoader::invalidate(const QList<KLFLib::entryId>& eids)
+{
+  for (int k = 0; k < eids.size(); ++k) {
+    pImages.remove(eids[k]);
+    if (pLoading.contains(eids[k]))
+      pInvalidatedWhileLoading.insert(eids[k]);
+  }
+}
+
+void KLFLibThumbnailLoader::clear()
+{
+  ++pGeneration;
+  pPending.clear();
+  pRequested.clear();
+  pPool.waitForDone();
+  pImages.clear();
+  pLoading.clear();
+  pInvalidatedWhileLoading.clear();
+  pLoadScheduled = false;
+}
+
+void KLFLibThumbnailLoader::scheduleLoad()
+{
+  if (pLoadScheduled || pPending.isEmpty())
+    return;
+  pLoadScheduled = true;
+  QMetaObject::invokeMethod(this, "loadPending", Qt::QueuedConnection);
+}
+
+void KLFLibThumbnailLoader::loadPending()
+{
+  KLFLibResourceEngine *resource = pCache->pModel->resource();
+  if (resource == NULL || pPending.isEmpty()) {
+    pLoadScheduled = false;
+    return;
+  }
+
+  // only one batch is being loaded at a time (pLoadScheduled stays TRUE until loaded() is called),
+  // so that the requests that are still pending can be dropped if they become obsolete
+  QList<KLFLib::entryId> batch = pPending.mid(0, KLF_THUMBNAIL_LOAD_BATCH);
+  pPending = pPending.mid(batch.size());
+  pLoading = batch.toSet();
+
+  KLFLibThumbnailLoadTask *task = new KLFLibThumbnailLoadTask(this, pGeneration, resource,
+							      resource->defaultSubResource(), batch);
+  if (resource->supportedFeatureFlags() & KLFLibResourceEngine::FeatureConcurrentRead) {
+    // the task uses the resource from the pool's thread, wait for it if the resource is destroyed
+    connect(resource, SIGNAL(asyncJobsStopping()), this, SLOT(clear()),
+	    Qt::ConnectionType(Qt::DirectConnection|Qt::UniqueConnection));
+    pPool.start(task);
+  } else {
+    // read this batch now; loaded() is called from the event loop, so that pending events are
+    // processed before the next batch is read
+    resource->blockProgressReportingForNextOperation();
+    task->run();
+    delete task;
+  }
+}
+
+void KLFLibThumbnailLoader::loaded(int generation, const QList<int>& eids, const QList<QImage>& images)
+{
+  if (generation != pGeneration)
+    return; // obsolete request, the resource was changed in the meantime
+
+  pLoadScheduled = false;
+
+  QList<KLFLib::entryId> done;
+  QList<KLFLib::entryId> outdated;
+  for (int k = 0; k < eids.size() && k < images.size(); ++k) {
+    pRequested.remove(eids[k]);
+    if (pInvalidatedWhileLoading.contains(eids[k])) {
+      // the entry was changed while its preview was being read, read it again
+      outdated << eids[k];
+      continue;
+    }
+    if (images[k].isNull())
+      continue;
+    // cost in kilobytes
+    int cost = qMax(1, (int)(images[k].byteCount() / 1024));
+    pImages.insert(eids[k], new QImage(images[k]), cost);
+    done << eids[k];
+  }
+
+  pLoading.clear();
+  pInvalidatedWhileLoading.clear();
+
+  pCache->thumbnailsLoaded(done);
+
+  if (!outdated.isEmpty())
+    request(outdated); // calls scheduleLoad()
+  else
+    scheduleLoad();
+}
+
+
+
 // -------------------------------------------------------
 
 //   MODEL CACHE OBJECT
@@ -405,120 +601,478 @@ bool KLFLibModelCache::KLFLibModelSorter::operator()(const NodeId& a, const Node
 	return false;
       }
       // when grouping sub-categories, always sort the categories *ascending*
-      return QString::localeAwareCompare(cache->getCategoryLabelNodeRef(a).categoryLabel,
-					 cache->getCategoryLabelNodeRef(b).categoryLabel)  < 0;
+      return cache->nodeSortKey(a, -1).compare(cache->nodeSortKey(b, -1)) < 0;
     }
-    // both are entrykind
-    return entrysorter->operator()(cache->getEntryNodeRef(a).entry, cache->getEntryNodeRef(b).entry);
+    // both are entrykind, compare them below
   }
 
+  // compare the precomputed sort keys of the entrysorter's entryValue()'s (or category labels)
   int entryProp = entrysorter->propId();
-  int sortorderfactor = (entrysorter->order() == Qt::AscendingOrder) ? 1 : -1;
-  QString nodevaluea = cache->nodeValue(a, entryProp);
-  QString nodevalueb = cache->nodeValue(b, entryProp);
-  return sortorderfactor*QString::localeAwareCompare(nodevaluea, nodevalueb) < 0;
+  int c = cache->nodeSortKey(a, entryProp).compare(cache->nodeSortKey(b, entryProp));
+  return (entrysorter->order() == Qt::AscendingOrder) ? (c < 0) : (c > 0);
 }
 
 
 
 // ---
 
-void KLFLibModelCache::rebuildCache()
+/** \internal Same order as KLFLibModelCache::KLFLibModelSorter, but only compares sort keys that
+ * were computed beforehand, so that it may be used from several threads at once. */
+struct KLFLibModelCacheKeyLessThan
 {
-  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
-  klfDbg(klfFmtCC("flavorFlags=%#010x", pModel->pFlavorFlags));
-  int k;
+  const KLFLibModelCache::EntryNode *entries;
+  const KLFLibModelCache::CategoryLabelNode *categoryLabels;
+  bool groupCategories;
+  bool ascending;
 
-  // report progress
-#ifndef KLF_WS_MAC
-  KLFProgressReporter progressReporter(0, 100, NULL);
-  QString msg = QObject::tr("Updating View...", "[[KLFLibModelCache, progress text]]");
-  emit pModel->operationStartReportingProgress(&progressReporter, msg);
-  progressReporter.doReportProgress(0);
-#endif
+  inline const QCollatorSortKey& key(const KLFLibModelCache::NodeId& n) const
+  {
+    if (n.kind == KLFLibModelCache::EntryKind)
+      return *entries[n.index].sortKey;
+    return *categoryLabels[n.index].sortKey;
+  }
 
-  klfDbgT("saving persistent indexes ...");
-  QModelIndexList persistentIndexes = pModel->persistentIndexList();
-  QList<KLFLibModel::PersistentId> persistentIndexIds = pModel->persistentIdList(persistentIndexes);
-  klfDbgT("... done saving persistent indexes.");
+  bool operator()(const KLFLibModelCache::NodeId& a, const KLFLibModelCache::NodeId& b) const
+  {
+    if (groupCategories) {
+      bool acat = (a.kind != KLFLibModelCache::EntryKind);
+      bool bcat = (b.kind != KLFLibModelCache::EntryKind);
+      if (acat != bcat)
+	return acat; // categories before entries
+      if (acat) // categories are always sorted ascending
+	return key(a).compare(key(b)) < 0;
+    }
+    int c = key(a).compare(key(b));
+    return ascending ? (c < 0) : (c > 0);
+  }
+};
 
-  pModel->beginResetModel();
+/** \internal Computes the sort key of an entry node, see KLFLibModelCache::nodeSortKey() */
+static void klf_set_node_sort_key(KLFLibModelCache::EntryNode *n, const QCollator& collator,
+				  const KLFLibEntrySorter *entrySorter, int propId)
+{
+  n->sortKey = QSharedPointer<QCollatorSortKey>(new QCollatorSortKey(collator.sortKey(entrySorter->entryValue(n->entry, propId))));
+  n->sortKeyPropId = propId;
+}
+/** \internal Computes the sort key of a category label node, see KLFLibModelCache::nodeSortKey() */
+static void klf_set_node_sort_key(KLFLibModelCache::CategoryLabelNode *n, const QCollator& collator,
+				  const KLFLibEntrySorter *, int)
+{
+  n->sortKey = QSharedPointer<QCollatorSortKey>(new QCollatorSortKey(collator.sortKey(n->categoryLabel)));
+}
+
+/** \internal Computes the sort keys of \c count contiguous nodes in a pool thread */
+template<class N>
+class KLFLibModelCacheSortKeyTask : public QRunnable
+{
+public:
+  KLFLibModelCacheSortKeyTask(N *nodes, int count, const KLFLibEntrySorter *entrySorter, int propId,
+			      QSemaphore *doneSemaphore)
+    : pNodes(nodes), pCount(count), pEntrySorter(entrySorter), pPropId(propId), pDone(doneSemaphore)
+  {
+  }
+
+  virtual void run()
+  {
+    QCollator collator; // QCollator is not thread-safe, use one per task
+    for (int k = 0; k < pCount; ++k) {
+      if (pNodes[k].allocated)
+	klf_set_node_sort_key(&pNodes[k], collator, pEntrySorter, pPropId);
+    }
+    pDone->release();
+  }
+
+private:
+  N *pNodes;
+  int pCount;
+  const KLFLibEntrySorter *pEntrySorter;
+  int pPropId;
+  QSemaphore *pDone;
+};
+
+/** \internal Sorts the node IDs <tt>[begin, end[</tt> in a pool thread */
+class KLFLibModelCacheSortTask : public QRunnable
+{
+public:
+  KLFLibModelCacheSortTask(KLFLibModelCache::NodeId *begin, KLFLibModelCache::NodeId *end,
+			   const KLFLibModelCacheKeyLessThan& lessThan, QSemaphore *doneSemaphore)
+    : pBegin(begin), pEnd(end), pLessThan(lessThan), pDone(doneSemaphore)
+  {
+  }
+
+  virtual void run()
+  {
+    std::stable_sort(pBegin, pEnd, pLessThan);
+    pDone->release();
+  }
+
+private:
+  KLFLibModelCache::NodeId *pBegin;
+  KLFLibModelCache::NodeId *pEnd;
+  KLFLibModelCacheKeyLessThan pLessThan;
+  QSemaphore *pDone;
+};
+
+//! Number of nodes handled by each pool task when building the cache
+static const int KLF_CACHE_BUILD_CHUNK_SIZE = 2048;
+
+
+KLFLibModelCacheBuilder::KLFLibModelCacheBuilder(KLFLibResourceEngine *resource, uint flavorFlags,
+						 int fetchBatchCount, const KLFLibEntrySorter *entrySorter,
+						 int sortPropId, Qt::SortOrder sortOrder)
+  : QThread(NULL), pResource(resource), pFlavorFlags(flavorFlags), pFetchBatchCount(fetchBatchCount),
+    pEntrySorter(entrySorter), pSortKeyPropId(entrySorter->propId()),
+    pSortAscending(entrySorter->order() == Qt::AscendingOrder), pSortPropId(sortPropId),
+    pSortOrder(sortOrder)
+{
+}
+
+void KLFLibModelCacheBuilder::build()
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+  klfDbg(klfFmtCC("flavorFlags=%#010x", pFlavorFlags));
+
+  typedef KLFLibModelCache::NodeId NodeId;
+
+  entryCache.clear();
+  categoryLabelCache.clear();
+  categories.clear();
 
-  // clear cache first
-  pEntryCache.clear();
-  pCategoryLabelCache.clear();
   // root category label MUST ALWAYS (in every display flavor) occupy index 0 in category label cache
-  pCategoryLabelCache.append(CategoryLabelNode());
-  CategoryLabelNode& root = pCategoryLabelCache[0];
+  KLFLibModelCache::CategoryLabelNode root;
   root.fullCategoryPath = "/";
   root.categoryLabel = "/";
   root.allChildrenFetched = false;
 
-  QList<int> wantedProps = minimalistEntryPropIds();
   KLFLibResourceEngine::Query q;
-  q.orderPropId = pLastSortPropId;
-  q.orderDirection = pLastSortOrder;
-  if (pModel->pFlavorFlags & KLFLibModel::CategoryTree) {
+  q.orderPropId = pSortPropId;
+  q.orderDirection = pSortOrder;
+  if (pFlavorFlags & KLFLibModel::CategoryTree) {
     // fetch only elements in root category
     KLFLib::PropertyMatch pmatch(KLFLibEntry::Category, KLFLib::StringMatch(QString("")));
     q.matchCondition = KLFLib::EntryMatchCondition::mkPropertyMatch(pmatch);
   }
-  q.wantedEntryProperties = minimalistEntryPropIds();
-  q.limit = pModel->pFetchBatchCount; // limit number of results
+  q.wantedEntryProperties = KLFLibModelCache::minimalistEntryPropIds();
+  q.limit = pFetchBatchCount; // limit number of results
   KLFLibResourceEngine::QueryResult qr(KLFLibResourceEngine::QueryResult::FillEntryWithIdList);
   // query the resource
   klfDbgT("about to query resource...");
-  int count = pModel->pResource->query(pModel->pResource->defaultSubResource(), q, &qr);
+  int count = pResource->query(pResource->defaultSubResource(), q, &qr);
   klfDbgT("resource returned "<<count<<" entries.");
   if (count < 0) {
     qWarning()<<KLF_FUNC_NAME<<": query() returned an error.";
     // don't return, continue with empty list
   }
-  if (count < pModel->pFetchBatchCount) {
+  if (count < pFetchBatchCount) {
     // we have fetched all children
     klfDbg("all children have been fetched.") ;
     root.allChildrenFetched = true;
   }
+  root.fetchCursor = qr.nextCursor;
+  categoryLabelCache.append(root);
+
+  QSet<QString> seenCategories;
+
+  // all queried entries are children of the root node: either we're displaying a linear list, or
+  // we queried the entries of the root category only
   const QList<KLFLibResourceEngine::KLFLibEntryWithId>& everything = qr.entryWithIdList;
+  entryCache.reserve(everything.size());
+  categoryLabelCache[0].children.reserve(everything.size());
   QList<KLFLibResourceEngine::KLFLibEntryWithId>::const_iterator it;
-
-  k = 0; // used for progress reporting
   for (it = everything.begin(); it != everything.end(); ++it) {
-    const KLFLibResourceEngine::KLFLibEntryWithId& ewid = *it;
-    klfDbgT( "Adding entry id="<<ewid.id<<"; entry="<<ewid.entry ) ;
-    EntryNode e;
-    e.entryid = ewid.id;
+    KLFLibModelCache::EntryNode e;
+    e.entryid = (*it).id;
     e.minimalist = true;
-    e.entry = ewid.entry;
-    treeInsertEntry(e, true); // rebuildingCache=TRUE
-
-#ifndef KLF_WS_MAC
-    if (k % 10 == 0)
-      progressReporter.doReportProgress((++k) * 100 / everything.size());
-#endif
+    e.entry = (*it).entry;
+    e.parent = NodeId::rootNode();
+    seenCategories.insert(e.entry.category());
+    KLFLibModelCache::IndexType i = entryCache.insertNewNode(e);
+    categoryLabelCache[0].children.append(NodeId(KLFLibModelCache::EntryKind, i));
   }
 
-  if (pModel->pFlavorFlags & KLFLibModel::CategoryTree) {
-    // now fetch all categories, and insert them
+  if (pFlavorFlags & KLFLibModel::CategoryTree) {
+    // now fetch all categories, and create their nodes
     klfDbgT("About to query categories...");
-    QVariantList vcatlist = pModel->pResource->queryValues(pModel->pResource->defaultSubResource(),
-							   KLFLibEntry::Category);
-    klfDbgT("... got categories. inserting them ...");
+    QVariantList vcatlist = pResource->queryValues(pResource->defaultSubResource(), KLFLibEntry::Category);
+    klfDbgT("... got categories. creating their nodes ...");
     for (QVariantList::const_iterator vcit = vcatlist.begin(); vcit != vcatlist.end(); ++vcit) {
       QString cat = (*vcit).toString();
       if (cat.isEmpty() || cat == "/")
 	continue;
-      // cacheFindCategoryLabel(categoryelements, createIfNotExists, notifyQtApi, newCreatedAreChildrenFetched)
-      QStringList catelements = cat.split('/', QString::SkipEmptyParts);
-      int i = cacheFindCategoryLabel(catelements, true, false, false);
-      if (i < 0) {
-	qWarning()<<KLF_FUNC_NAME<<": Failed to create category node for category "<<cat;
-      }
-      // remember this category as suggestion
-      insertCategoryStringInSuggestionCache(catelements);
+      (void) createCategoryLabel(cat.split('/', QString::SkipEmptyParts));
+      seenCategories.insert(cat);
     }
-    klfDbgT("... ins catnodes done.") ;
+    klfDbgT("... category nodes done.") ;
+  }
+
+  seenCategories.remove(QString());
+  categories = seenCategories.toList();
+
+  if (pSortPropId < 0)
+    return; // no sorting, keep the order of the query
+
+  computeSortKeys();
+  for (int k = 0; k < categoryLabelCache.size(); ++k)
+    sortChildren(&categoryLabelCache[k].children);
+  klfDbgT("... nodes sorted.") ;
+}
+
+KLFLibModelCache::IndexType KLFLibModelCacheBuilder::createCategoryLabel(const QStringList& catelements)
+{
+  if (catelements.isEmpty())
+    return 0; // index of root category label
+
+  QString catelpath = catelements.join("/");
+  KLFLibModelCache::IndexType i = categoryLabelCache.findNode(catelpath);
+  if (i >= 0)
+    return i;
+
+  KLFLibModelCache::IndexType parent_index = createCategoryLabel(catelements.mid(0, catelements.size()-1));
+
+  KLFLibModelCache::CategoryLabelNode c;
+  c.allChildrenFetched = false;
+  c.fullCategoryPath = catelpath;
+  c.categoryLabel = catelements.last(); // catelements is non-empty, see above
+  c.parent = KLFLibModelCache::NodeId(KLFLibModelCache::CategoryLabelKind, parent_index);
+  KLFLibModelCache::IndexType this_index = categoryLabelCache.insertNewNode(c);
+  categoryLabelCache[parent_index].children
+    .append(KLFLibModelCache::NodeId(KLFLibModelCache::CategoryLabelKind, this_index));
+  return this_index;
+}
+
+void KLFLibModelCacheBuilder::computeSortKeys()
+{
+  QThreadPool *pool = QThreadPool::globalInstance();
+  QSemaphore done;
+  int ntasks = 0;
+  int propId = pSortKeyPropId;
+  int k;
+
+  // the caches are not shared, data() does not detach them while the tasks run
+  KLFLibModelCache::EntryNode *entries = entryCache.data();
+  int nentries = entryCache.size();
+  for (k = 0; k < nentries; k += KLF_CACHE_BUILD_CHUNK_SIZE) {
+    pool->start(new KLFLibModelCacheSortKeyTask<KLFLibModelCache::EntryNode>
+		(entries+k, qMin(KLF_CACHE_BUILD_CHUNK_SIZE, nentries-k), pEntrySorter, propId, &done));
+    ++ntasks;
+  }
+  KLFLibModelCache::CategoryLabelNode *catlabels = categoryLabelCache.data();
+  int ncatlabels = categoryLabelCache.size();
+  for (k = 0; k < ncatlabels; k += KLF_CACHE_BUILD_CHUNK_SIZE) {
+    pool->start(new KLFLibModelCacheSortKeyTask<KLFLibModelCache::CategoryLabelNode>
+		(catlabels+k, qMin(KLF_CACHE_BUILD_CHUNK_SIZE, ncatlabels-k), pEntrySorter, propId, &done));
+    ++ntasks;
+  }
+
+  done.acquire(ntasks);
+}
+
+void KLFLibModelCacheBuilder::sortChildren(QList<KLFLibModelCache::NodeId> *children)
+{
+  if (children->size() < 2)
+    return;
+
+  KLFLibModelCacheKeyLessThan lessThan;
+  lessThan.entries = entryCache.constData();
+  lessThan.categoryLabels = categoryLabelCache.constData();
+  lessThan.groupCategories = (pFlavorFlags & KLFLibModel::GroupSubCategories);
+  lessThan.ascending = pSortAscending;
 
+  QVector<KLFLibModelCache::NodeId> v = children->toVector();
+  KLFLibModelCache::NodeId *data = v.data();
+  int n = v.size();
+
+  int nchunks = qMin(QThreadPool::globalInstance()->maxThreadCount(),
+		     (n + KLF_CACHE_BUILD_CHUNK_SIZE - 1) / KLF_CACHE_BUILD_CHUNK_SIZE);
+  if (nchunks < 2) {
+    std::stable_sort(data, data+n, lessThan);
+  } else {
+    // sort chunks in parallel, then merge them pairwise
+    int chunk = (n + nchunks - 1) / nchunks;
+    QSemaphore done;
+    int ntasks = 0;
+    for (int lo = 0; lo < n; lo += chunk) {
+      QThreadPool::globalInstance()->start(new KLFLibModelCacheSortTask(data+lo, data+qMin(lo+chunk, n),
+									 lessThan, &done));
+      ++ntasks;
+    }
+    done.acquire(ntasks);
+    for (int width = chunk; width < n; width *= 2) {
+      for (int lo = 0; lo + width < n; lo += 2*width)
+	std::inplace_merge(data+lo, data+lo+width, data+qMin(lo+2*width, n), lessThan);
+    }
+  }
+
+  *children = v.toList();
+}
+
+
+KLFLibModelCache::KLFLibModelCache(KLFLibModel * model)
+  : pModel(model)
+{
+  pIsFetchingMore = false;
+  pIsRebuilding = false;
+  pRebuildPending = false;
+  pBuilder = NULL;
+  pRebuildProgress = NULL;
+
+  pLastSortPropId = KLFLibEntry::DateTime;
+  pLastSortOrder = Qt::DescendingOrder;
+
+  pThumbnailLoader = new KLFLibThumbnailLoader(this);
+  pSearchIndex = new KLFLibModelSearchIndex(this);
+}
+
+KLFLibModelCache::~KLFLibModelCache()
+{
+  abortRebuild();
+  cancelFetchJobs();
+  qDeleteAll(pDisposedEntrySorters);
+  delete pSearchIndex;
+  delete pThumbnailLoader;
+}
+
+void KLFLibModelCache::disposeEntrySorter(KLFLibEntrySorter *entrySorter)
+{
+  if (pIsRebuilding) {
+    pDisposedEntrySorters.append(entrySorter);
+    return;
+  }
+  delete entrySorter;
+}
+
+void KLFLibModelCache::rebuildCache()
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+  klfDbg(klfFmtCC("flavorFlags=%#010x", pModel->pFlavorFlags));
+
+  if (pIsRebuilding) {
+    // rebuild once more when the current build is done, see rebuildFinished()
+    pRebuildPending = true;
+    return;
+  }
+  pRebuildPending = false;
+  cancelFetchJobs();
+
+  // report progress
+#ifndef KLF_WS_MAC
+  if (pRebuildProgress == NULL) {
+    pRebuildProgress = new KLFProgressReporter(0, 100, NULL);
+    QString msg = QObject::tr("Updating View...", "[[KLFLibModelCache, progress text]]");
+    emit pModel->operationStartReportingProgress(pRebuildProgress, msg);
+    pRebuildProgress->doReportProgress(0);
+  }
+#endif
+
+  // the builder copies the current flavor and sorting, which may change while it runs
+  KLFLibModelCacheBuilder *builder =
+    new KLFLibModelCacheBuilder(pModel->pResource, pModel->pFlavorFlags, pModel->pFetchBatchCount,
+				pModel->pEntrySorter, pLastSortPropId, pLastSortOrder);
+
+  if ( ! (pModel->pResource->supportedFeatureFlags() & KLFLibResourceEngine::FeatureConcurrentRead) ) {
+    builder->build();
+    installTree(builder);
+    return;
+  }
+
+  // build the tree in the builder thread. Meanwhile the current tree stays as it is (fetching more
+  // is suspended), and rebuildFinished() swaps in the new tree from the event loop.
+  pIsRebuilding = true;
+  pBuilder = builder;
+  QObject::connect(pBuilder, SIGNAL(finished()), pModel, SLOT(cacheRebuilt()), Qt::QueuedConnection);
+  pBuilder->start();
+}
+
+void KLFLibModelCache::rebuildFinished()
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+
+  if (pBuilder == NULL) {
+    // aborted meanwhile
+    return;
+  }
+  KLFLibModelCacheBuilder *builder = pBuilder;
+  pBuilder = NULL;
+  builder->wait();
+  pIsRebuilding = false;
+
+  // the sorters replaced meanwhile are no longer used by any builder
+  qDeleteAll(pDisposedEntrySorters);
+  pDisposedEntrySorters.clear();
+
+  if (pRebuildPending) {
+    // the resource or the sorting changed while building, the new tree is already outdated
+    klfDbg("rebuilding once more.") ;
+    delete builder;
+    rebuildCache();
+    return;
+  }
+
+  installTree(builder);
+}
+
+void KLFLibModelCache::abortRebuild()
+{
+  if (pBuilder != NULL) {
+    klfDbg("waiting for the builder to finish...") ;
+    QObject::disconnect(pBuilder, NULL, pModel, NULL);
+    pBuilder->wait();
+    delete pBuilder;
+    pBuilder = NULL;
+  }
+  pIsRebuilding = false;
+  pRebuildPending = false;
+  qDeleteAll(pDisposedEntrySorters);
+  pDisposedEntrySorters.clear();
+  delete pRebuildProgress;
+  pRebuildProgress = NULL;
+}
+
+void KLFLibModelCache::clearTree()
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+
+  abortRebuild();
+  cancelFetchJobs();
+
+  pModel->beginResetModel();
+  pEntryCache.clear();
+  pCategoryLabelCache.clear();
+  // root category label MUST ALWAYS occupy index 0 in category label cache
+  CategoryLabelNode root;
+  root.fullCategoryPath = "/";
+  root.categoryLabel = "/";
+  root.allChildrenFetched = true;
+  pCategoryLabelCache.append(root);
+  pSearchIndex->clear();
+  pModel->endResetModel();
+}
+
+void KLFLibModelCache::installTree(KLFLibModelCacheBuilder *builder)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+
+#ifndef KLF_WS_MAC
+  if (pRebuildProgress != NULL)
+    pRebuildProgress->doReportProgress(70);
+#endif
+
+  klfDbgT("saving persistent indexes ...");
+  QModelIndexList persistentIndexes = pModel->persistentIndexList();
+  QList<KLFLibModel::PersistentId> persistentIndexIds = pModel->persistentIdList(persistentIndexes);
+  klfDbgT("... done saving persistent indexes.");
+
+  pModel->beginResetModel();
+
+  // swap the new tree in
+  qSwap(pEntryCache, builder->entryCache);
+  qSwap(pCategoryLabelCache, builder->categoryLabelCache);
+  pSearchIndex->clear();
+  for (int k = 0; k < builder->categories.size(); ++k)
+    insertCategoryStringInSuggestionCache(builder->categories[k]);
+  delete builder;
+
+  if (pModel->pFlavorFlags & KLFLibModel::CategoryTree) {
     /** \bug This does not work as expected. TODO: * Make sure the root elements are prefetched
      *    * Maybe translate these few lines of code in NodeId's instead of QModelIndex'es
      */
@@ -533,7 +1087,6 @@ void KLFLibModelCache::rebuildCache()
 	  pModel->fetchMore(i);
       }
     }
-
   }
 
   fullDump(); // DEBUG
@@ -546,6 +1099,12 @@ void KLFLibModelCache::rebuildCache()
   pModel->changePersistentIndexList(persistentIndexes, newPersistentIndexes);
   klfDbg("... done restoring persistent indexes.");
 
+  pSearchIndex->scheduleIndexing();
+
+  // finishes the progress report
+  delete pRebuildProgress;
+  pRebuildProgress = NULL;
+
   klfDbgT( " end of func" ) ;
 }
 
@@ -725,17 +1284,67 @@ void KLFLibModelCache::ensureNotMinimalist(NodeId p, int countdown)
       continue;
     }
     NodeId nid = wantedIds[eid];
+    // the sort key may be kept: the minimalist entry already had all the sortable properties
     pEntryCache[nid.index].entry = updatedentries[k].entry;
     pEntryCache[nid.index].minimalist = false;
   }
   klfDbg( ": updated entries "<<wantedIds.keys() ) ;
 }
 
+QImage KLFLibModelCache::entryPreview(NodeId p)
+{
+  const EntryNode& en = getEntryNodeRef(p);
+  if (!en.minimalist)
+    return en.entry.preview();
+
+  QImage img = pThumbnailLoader->thumbnail(en.entryid);
+  if (!img.isNull())
+    return img;
+
+  // also prepare the previews of the entries that are likely to be shown next
+  QList<KLFLib::entryId> neighbours;
+  NodeId n;
+  int countdown = pModel->pFetchBatchCount;
+  for (n = nextNode(p); n.valid() && countdown > 0; n = nextNode(n)) {
+    if (n.kind != EntryKind)
+      continue;
+    const EntryNode& nn = getEntryNodeRef(n);
+    if (nn.minimalist)
+      neighbours << nn.entryid;
+    --countdown;
+  }
+  countdown = pModel->pFetchBatchCount / 2;
+  for (n = prevNode(p); n.valid() && countdown > 0; n = prevNode(n)) {
+    if (n.kind != EntryKind)
+      continue;
+    const EntryNode& nn = getEntryNodeRef(n);
+    if (nn.minimalist)
+      neighbours << nn.entryid;
+    --countdown;
+  }
+  pThumbnailLoader->request(neighbours);
+
+  return QImage();
+}
+
+void KLFLibModelCache::thumbnailsLoaded(const QList<KLFLib::entryId>& eids)
+{
+  int lastcol = pModel->columnCount() - 1;
+  for (int k = 0; k < eids.size(); ++k) {
+    NodeId n = findEntryId(eids[k]);
+    if (!n.valid())
+      continue; // not displayed any more
+    QModelIndex first = createIndexFromId(n, -1, 0);
+    QModelIndex last = createIndexFromId(n, first.row(), lastcol);
+    emit pModel->dataChanged(first, last);
+  }
+}
+
 bool KLFLibModelCache::canFetchMore(NodeId parentId)
 {
   KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
-  if (pIsFetchingMore)
-    return false;
+  if (pIsFetchingMore || pIsRebuilding)
+    return false; // the current tree will be replaced anyway
 
   if (!parentId.valid())
     parentId = NodeId::rootNode();
@@ -760,9 +1369,8 @@ void KLFLibModelCache::fetchMore(NodeId n, int fetchBatchCount)
   if (fetchBatchCount < 0) // set default value
     fetchBatchCount = pModel->pFetchBatchCount;
 
-  if (pIsFetchingMore)
+  if (pIsFetchingMore || pIsRebuilding)
     return;
-  pIsFetchingMore = true;
 
   // see function doxygen doc for nIndex param info.
 
@@ -782,11 +1390,124 @@ void KLFLibModelCache::fetchMore(NodeId n, int fetchBatchCount)
     // all children have been fetched, cannot do anything more.
     klfDbg("can't fetch more: all children are fetched! noderef="<<noderef<<"; n (the id)="<<n) ;
     //    qWarning()<<KLF_FUNC_NAME<<": can't fetch any more items!";
-    pIsFetchingMore = false;
     return;
   }
 
+  // we fetch the same entries right now, the pending fetch would append them a second time
+  cancelFetchJob(n);
+
+  pIsFetchingMore = true;
+
   // fetch more items, using query().
+  KLFLibResourceEngine::Query q = fetchMoreQuery(noderef);
+  KLFLibResourceEngine::QueryResult qr(KLFLibResourceEngine::QueryResult::FillEntryWithIdList);
+  // _query()_ the resource
+  int count = pModel->pResource->query(pModel->pResource->defaultSubResource(), q, &qr);
+  if (count < 0) {
+    qWarning()<<KLF_FUNC_NAME<<": error fetching more results: count is "<<count;
+    pIsFetchingMore = false;
+    return;
+  }
+
+  appendFetchedEntries(n, qr, q.limit);
+
+  pIsFetchingMore = false;
+}
+
+void KLFLibModelCache::fetchMoreAsync(NodeId n)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME);
+
+  if ( ! (pModel->pResource->supportedFeatureFlags() & KLFLibResourceEngine::FeatureConcurrentRead) ) {
+    // the query job would read the resource in this thread anyway
+    fetchMore(n);
+    return;
+  }
+
+  if (pIsFetchingMore || pIsRebuilding)
+    return;
+
+  if (!n.valid())
+    n = NodeId::rootNode();
+
+  if (n.kind != CategoryLabelKind) {
+    qWarning()<<KLF_FUNC_NAME<<": Can't fetch more children of a non-category-label node.";
+    return;
+  }
+
+  const CategoryLabelNode& noderef = getCategoryLabelNodeRef(n);
+  if (noderef.allChildrenFetched || pFetchJobs.contains(n.index))
+    return;
+
+  KLFLibResourceEngine::Query q = fetchMoreQuery(noderef);
+  // only a batch is read, don't pop up a progress dialog for it
+  pModel->pResource->blockProgressReportingForNextOperation();
+  KLFLibResourceQueryJob *job =
+    pModel->pResource->queryAsync(pModel->pResource->defaultSubResource(), q,
+				  KLFLibResourceEngine::QueryResult::FillEntryWithIdList, q.limit);
+  QObject::connect(job, SIGNAL(resultsAvailable(const KLFLibResourceEngine::QueryResult&)),
+		   pModel, SLOT(fetchJobResultsAvailable(const KLFLibResourceEngine::QueryResult&)));
+  QObject::connect(job, SIGNAL(finished(bool)), pModel, SLOT(fetchJobFinished(bool)));
+  pFetchJobs[n.index] = job;
+  klfDbg("fetching more children of "<<n<<" in the background") ;
+}
+
+bool KLFLibModelCache::isFetchJobPending(NodeId n) const
+{
+  if (!n.valid())
+    n = NodeId::rootNode();
+  return n.kind == CategoryLabelKind && pFetchJobs.contains(n.index);
+}
+
+void KLFLibModelCache::fetchJobResultsAvailable(KLFLibResourceQueryJob *job,
+						const KLFLibResourceEngine::QueryResult& batch)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME);
+
+  IndexType index = pFetchJobs.key(job, -1);
+  if (index < 0 || pIsFetchingMore || pIsRebuilding) {
+    klfDbg("discarding results of an obsolete fetch") ;
+    return;
+  }
+  // the tree didn't change meanwhile (see cancelFetchJobs()), so the results follow the fetched
+  // children of the node
+  pIsFetchingMore = true;
+  appendFetchedEntries(NodeId(CategoryLabelKind, index), batch, job->query().limit);
+  pIsFetchingMore = false;
+}
+
+void KLFLibModelCache::fetchJobFinished(KLFLibResourceQueryJob *job, bool success)
+{
+  IndexType index = pFetchJobs.key(job, -1);
+  if (index >= 0) {
+    pFetchJobs.remove(index);
+    // empty batches are not delivered, so appendFetchedEntries() didn't see the end of the list
+    if (success && job->resultCount() == 0 && !pIsRebuilding)
+      getCategoryLabelNodeRef(NodeId(CategoryLabelKind, index)).allChildrenFetched = true;
+  }
+  job->deleteLater();
+}
+
+void KLFLibModelCache::cancelFetchJob(NodeId n)
+{
+  KLFLibResourceQueryJob *job = pFetchJobs.take(n.index);
+  if (job == NULL)
+    return;
+  klfDbg("canceling the background fetch of children of "<<n) ;
+  QObject::disconnect(job, NULL, pModel, NULL);
+  job->cancel();
+  job->deleteLater();
+}
+
+void KLFLibModelCache::cancelFetchJobs()
+{
+  QList<IndexType> indexes = pFetchJobs.keys();
+  for (int k = 0; k < indexes.size(); ++k)
+    cancelFetchJob(NodeId(CategoryLabelKind, indexes[k]));
+}
+
+KLFLibResourceEngine::Query KLFLibModelCache::fetchMoreQuery(const CategoryLabelNode& noderef)
+{
   KLFLibResourceEngine::Query q;
   if (pModel->pFlavorFlags & KLFLibModel::CategoryTree) {
     QString c = KLFLibEntry::normalizeCategoryPath(noderef.fullCategoryPath);
@@ -796,16 +1517,23 @@ void KLFLibModelCache::fetchMore(NodeId n, int fetchBatchCount)
   q.orderPropId = pLastSortPropId;
   q.orderDirection = pLastSortOrder;
   q.limit = pModel->pFetchBatchCount;
-  q.skip = noderef.children.size();
-  q.wantedEntryProperties = minimalistEntryPropIds();
-  KLFLibResourceEngine::QueryResult qr(KLFLibResourceEngine::QueryResult::FillEntryWithIdList);
-  // _query()_ the resource
-  int count = pModel->pResource->query(pModel->pResource->defaultSubResource(), q, &qr);
-  if (count < 0) {
-    qWarning()<<KLF_FUNC_NAME<<": error fetching more results: count is "<<count;
-    pIsFetchingMore = false;
-    return;
+  if (noderef.fetchCursor.isValid()) {
+    // continue right after the last entry we got, the resource can seek there directly
+    q.continueAfter = noderef.fetchCursor;
+  } else {
+    // skip the entries we already have (children may also contain sub-category labels)
+    int k;
+    for (k = 0; k < noderef.children.size(); ++k)
+      if (noderef.children[k].kind == EntryKind)
+	++q.skip;
   }
+  q.wantedEntryProperties = minimalistEntryPropIds();
+  return q;
+}
+
+void KLFLibModelCache::appendFetchedEntries(NodeId n, const KLFLibResourceEngine::QueryResult& qr, int limit)
+{
+  CategoryLabelNode& noderef = getCategoryLabelNodeRef(n);
 
   /** \todo ....... the items are _appended_. this supposes that the items that may have already
    * been listed as children nodes are the beginning, and that what we fetched is what
@@ -821,10 +1549,12 @@ void KLFLibModelCache::fetchMore(NodeId n, int fetchBatchCount)
 			  noderef.children.size() + qr.entryWithIdList.size()-1);
 
   // if we fetched all the remaining entries, then set allChildrenFetched to TRUE
-  if (count < q.limit) {
+  if (qr.entryWithIdList.size() < limit) {
     noderef.allChildrenFetched = true;
   }
+  noderef.fetchCursor = qr.nextCursor;
 
+  QList<NodeId> newnodes;
   int k;
   for (k = 0; k < qr.entryWithIdList.size(); ++k) {
     const KLFLibResourceEngine::KLFLibEntryWithId& ewid = qr.entryWithIdList[k];
@@ -833,14 +1563,14 @@ void KLFLibModelCache::fetchMore(NodeId n, int fetchBatchCount)
     e.minimalist = true;
     e.entry = ewid.entry;
     e.parent = n;
-    pEntryCache.append(e);
     NodeId entryindex;
     entryindex.kind = EntryKind;
-    entryindex.index = pEntryCache.size()-1;
+    entryindex.index = pEntryCache.insertNewNode(e);
 
     klfDbg("appending "<<e<<" in category node.") ;
 
     noderef.children.append(entryindex);
+    newnodes.append(entryindex);
   }
 
   klfDbg("Fetched more. About to notify view of end of rows inserted ... meanwile the dump:") ;
@@ -852,7 +1582,7 @@ void KLFLibModelCache::fetchMore(NodeId n, int fetchBatchCount)
 
   klfDbg("views notified, persistent indexes restored.") ;
 
-  pIsFetchingMore = false;
+  pSearchIndex->scheduleIndexing(newnodes);
 }
 
 
@@ -862,20 +1592,33 @@ void KLFLibModelCache::updateData(const QList<KLFLib::entryId>& entryIdList, int
   KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
   klfDbg( "modifyType="<<modifyType<<" entryIdList="<<entryIdList ) ;
 
+  if (pIsRebuilding) {
+    // the tree being built may or may not include this change; rebuild once more to be sure
+    klfDbg("cache is being rebuilt, will rebuild again.") ;
+    pRebuildPending = true;
+    return;
+  }
+
+  // the rows of the pending fetches would no longer follow the fetched children
+  cancelFetchJobs();
+
   if (modifyType == KLFLibResourceEngine::UnknownModification) {
     klfDbg("Performing full refresh.") ;
     rebuildCache();
     return;
   }
 
-  if (entryIdList.size() > 10 &&
-      (entryIdList.size() > pEntryCache.size()/3 || entryIdList.size() > 100)) {
-    // too big a modification, just rebuild the cache
+  if (entryIdList.size() > 100 && entryIdList.size() > pEntryCache.size()) {
+    // the modification concerns more entries than we have in cache, it's cheaper to query the
+    // resource again
     klfDbg("Performing full refresh.") ;
     rebuildCache();
     return;
   }
 
+  // the views are notified precisely of which rows were inserted, moved or removed, so that they
+  // keep their scroll position and selection
+
 #ifndef KLF_WS_MAC
   // progress reporting [here, not above, because rebuildCache() has its own progress reporting]
   KLFProgressReporter progressReporter(0, entryIdList.size(), NULL);
@@ -884,62 +1627,37 @@ void KLFLibModelCache::updateData(const QList<KLFLib::entryId>& entryIdList, int
   progressReporter.doReportProgress(0);
 #endif
 
+  int k;
   switch (modifyType) {
   case KLFLibResourceEngine::InsertData:
     {	// entries inserted
       QList<KLFLibResourceEngine::KLFLibEntryWithId> entryList = pModel->pResource->entries(entryIdList);
-      int k;
+      QList<EntryNode> nodes;
       for (k = 0; k < entryList.size(); ++k) {
 	EntryNode en;
 	en.entryid = entryList[k].id;
 	en.minimalist = false;
 	en.entry = entryList[k].entry;
-	/** \todo ...... here the view is notified for each individual insert. would be better for
-	 * contiguous inserts to be notified once .... */
-	treeInsertEntry(en);
-	qDebug("%s: entry ID %d inserted", KLF_FUNC_NAME, entryIdList[k]);
-#ifndef KLF_WS_MAC
-	if (k % 20 == 0)
-	  progressReporter.doReportProgress(k+1);
-#endif
+	nodes << en;
       }
+      treeInsertEntries(nodes);
+      klfDbg("inserted entries "<<entryIdList) ;
       break;
     }
   case KLFLibResourceEngine::ChangeData:
     { // entry moved in category tree or just changed
+      pThumbnailLoader->invalidate(entryIdList);
       QList<KLFLibResourceEngine::KLFLibEntryWithId> entryList = pModel->pResource->entries(entryIdList);
-      int k;
-      for (k = 0; k < entryIdList.size(); ++k) {
-	klfDbg("modifying entry ID="<<entryIdList[k]<<", modif."<<k) ;
-	NodeId n = findEntryId(entryIdList[k]);
+      for (k = 0; k < entryList.size(); ++k) {
+	klfDbg("modifying entry ID="<<entryList[k].id<<", modif."<<k) ;
+	NodeId n = findEntryId(entryList[k].id);
 	if (!n.valid()) {
-	  qWarning()<<KLF_FUNC_NAME<<": n is invalid! (kind="<<n.kind<<", index="<<n.index<<")";
+	  // not fetched yet, nothing to update
+	  klfDbg("entry ID="<<entryList[k].id<<" is not in cache.") ;
 	  continue;
 	}
-	KLFLibEntry oldentry = pEntryCache[n.index].entry;
-	KLFLibEntry newentry = entryList[k].entry;
-	klfDbg("entry change: old="<<oldentry<<"; new="<<newentry) ;
-	// the modified entry may have a different category, move it if needed
-	if (newentry.category() != oldentry.category() && (pModel->pFlavorFlags & KLFLibModel::CategoryTree)) {
-	  pModel->startLayoutChange(false);
-	  EntryNode entrynode = treeTakeEntry(n, true); // remove it from its position in tree
-	  // klfDbg( "\tremoved entry. dump:\n"
-	  //         <<"\t Entry Cache="<<pEntryCache<<"\n\t CategoryLabelCache = "<<pCategoryLabelCache ) ;
-	  // dumpNodeTree(NodeId::rootNode());
-	  // revalidate the removed entry
-	  entrynode.entryid = entryIdList[k];
-	  entrynode.entry = newentry;
-	  // and insert it at the (new) correct position (automatically positioned!)
-	  treeInsertEntry(entrynode);
-	  pModel->endLayoutChange(false);
-	  QModelIndex idx = createIndexFromId(n, -1, 0);
-	  emit pModel->dataChanged(idx, idx);
-	} else {
-	  // just some data change
-	  pEntryCache[n.index].entry = newentry;
-	  QModelIndex idx = createIndexFromId(n, -1, 0);
-	  emit pModel->dataChanged(idx, idx);
-	}
+	// moves the entry if needed, and emits dataChanged()
+	treeChangeEntry(n, entryList[k].entry);
 #ifndef KLF_WS_MAC
 	if (k % 20 == 0)
 	  progressReporter.doReportProgress(k+1);
@@ -949,21 +1667,17 @@ void KLFLibModelCache::updateData(const QList<KLFLib::entryId>& entryIdList, int
     }
   case KLFLibResourceEngine::DeleteData:
     { // entry removed
-      int k;
+      pThumbnailLoader->invalidate(entryIdList);
+      QList<NodeId> nodes;
       for (k = 0; k < entryIdList.size(); ++k) {
-	qDebug("%s: deleting entry ID=%d.", KLF_FUNC_NAME, entryIdList[k]);
-	// entry deleted
 	NodeId n = findEntryId(entryIdList[k]);
 	if (!n.valid()) {
-	  qWarning()<<KLF_FUNC_NAME<<": n not valid! n=(kind="<<n.kind<<", index="<<n.index<<")";
+	  klfDbg("entry ID="<<entryIdList[k]<<" is not in cache.") ;
 	  continue;
 	}
-	(void) treeTakeEntry(n);
-#ifndef KLF_WS_MAC
-	if (k % 20 == 0)
-	  progressReporter.doReportProgress(k+1);
-#endif
+	nodes << n;
       }
+      treeRemoveEntries(nodes);
       break;
     }
   default:
@@ -1042,8 +1756,11 @@ void KLFLibModelCache::treeInsertEntry(const EntryNode& entrynode, bool rebuildi
     } while (retry);
     // by fetching more, we may possibly have actually fetched the entry that we were instructed to insert
     // in the first place. Check.
-    if (insertPos < childlistref.size() && childlistref[insertPos] == n)
-      return; // job already done.
+    NodeId fetched = findEntryId(entrynode.entryid);
+    if (fetched.valid() && fetched != n) {
+      pEntryCache.unlinkNode(n); // job already done, drop our copy
+      return;
+    }
   }
 
   CategoryLabelNode &catLabelNodeRef = getCategoryLabelNodeRef(parentid);
@@ -1117,16 +1834,321 @@ KLFLibModelCache::EntryNode KLFLibModelCache::treeTakeEntry(const NodeId& nodeid
     } else {
       qWarning()<<KLF_FUNC_NAME<<": unlinking elements: unknown node kind in id="<<n<<"!";
     }
-    // remove n from parents
-    Node & parentref = getNodeRef(parentid);
-    klfDbg("removing child #"<<childIndex<<" from parent id="<<parentid<<"; parent itself is "<<parentref) ;
-    parentref.children.removeAt(childIndex);
-    if (notifyQtApi)
-      pModel->endRemoveRows();
-    n = parentid;
-  } while (willRemoveParent);
+    // remove n from parents
+    Node & parentref = getNodeRef(parentid);
+    klfDbg("removing child #"<<childIndex<<" from parent id="<<parentid<<"; parent itself is "<<parentref) ;
+    parentref.children.removeAt(childIndex);
+    if (notifyQtApi)
+      pModel->endRemoveRows();
+    n = parentid;
+  } while (willRemoveParent);
+
+  return entrynode;
+}
+
+
+void KLFLibModelCache::treeInsertEntries(const QList<EntryNode>& entrynodes)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+  int k;
+
+  // create the cache nodes (not linked in the tree yet), and group them by parent category label
+  QMap<IndexType, QList<NodeId> > byParent;
+  for (k = 0; k < entrynodes.size(); ++k) {
+    QStringList catelements = entrynodes[k].entry.category().split('/', QString::SkipEmptyParts);
+    insertCategoryStringInSuggestionCache(catelements);
+    IndexType catindex = 0;
+    if (pModel->displayType() == KLFLibModel::CategoryTree)
+      catindex = cacheFindCategoryLabel(catelements, true, true, true);
+    IndexType index = pEntryCache.insertNewNode(entrynodes[k]);
+    pEntryCache[index].parent = NodeId();
+    byParent[catindex].append(NodeId(EntryKind, index));
+  }
+
+  bool sorting = (pLastSortPropId >= 0);
+  KLFLibModelSorter srt =
+    KLFLibModelSorter(this, pModel->pEntrySorter, pModel->pFlavorFlags & KLFLibModel::GroupSubCategories);
+
+  // the new nodes and their parents, to be indexed for the search
+  QList<NodeId> indexnodes;
+
+  QMap<IndexType, QList<NodeId> >::iterator it;
+  for (it = byParent.begin(); it != byParent.end(); ++it) {
+    NodeId parentid = NodeId(CategoryLabelKind, it.key());
+    QList<NodeId> newnodes = it.value();
+
+    if (sorting) {
+      qStableSort(newnodes.begin(), newnodes.end(), srt);
+      // as in treeInsertEntry(), make sure that all entries that logically appear before the new
+      // ones are fetched. Checking the greatest new node is enough.
+      bool retry;
+      do {
+	retry = false;
+	const QList<NodeId>& childlistref = getCategoryLabelNodeRef(parentid).children;
+	int lastPos = qLowerBound(childlistref.begin(), childlistref.end(), newnodes.last(), srt)
+	  - childlistref.begin();
+	if (lastPos > childlistref.size()-10 && canFetchMore(parentid)) {
+	  fetchMore(parentid);
+	  retry = true;
+	}
+      } while (retry);
+      // by fetching more, we may have fetched some of the new entries already
+      for (k = 0; k < newnodes.size(); ) {
+	NodeId fetched = findEntryId(pEntryCache[newnodes[k].index].entryid);
+	if (fetched.valid() && fetched != newnodes[k]) {
+	  pEntryCache.unlinkNode(newnodes[k]);
+	  newnodes.removeAt(k);
+	} else {
+	  ++k;
+	}
+      }
+    }
+
+    // find where each new node goes in the current child list. As the new nodes are sorted, the
+    // positions are increasing; new nodes with the same position form a contiguous run.
+    QList<int> positions;
+    const QList<NodeId>& curchildren = getCategoryLabelNodeRef(parentid).children;
+    for (k = 0; k < newnodes.size(); ++k) {
+      if (sorting)
+	positions << (qLowerBound(curchildren.begin(), curchildren.end(), newnodes[k], srt) - curchildren.begin());
+      else
+	positions << curchildren.size(); // no sorting, just append the items
+    }
+
+    indexnodes << parentid << newnodes;
+
+    QModelIndex parentidx = createIndexFromId(parentid, -1, 0);
+    int shift = 0; // number of new nodes already inserted before the current run
+    for (k = 0; k < newnodes.size(); ) {
+      int j = k;
+      while (j+1 < newnodes.size() && positions[j+1] == positions[k])
+	++j;
+      int at = positions[k] + shift;
+      klfDbg("inserting run of "<<(j-k+1)<<" entries at row "<<at<<" in "<<parentid) ;
+      pModel->beginInsertRows(parentidx, at, at + (j-k));
+      QList<NodeId>& childlistref = pCategoryLabelCache[parentid.index].children;
+      for (int i = k; i <= j; ++i) {
+	pEntryCache[newnodes[i].index].parent = parentid; // validate the node
+	childlistref.insert(at + (i-k), newnodes[i]);
+      }
+      pModel->endInsertRows();
+      shift += j-k+1;
+      k = j+1;
+    }
+  }
+
+  pSearchIndex->scheduleIndexing(indexnodes);
+}
+
+void KLFLibModelCache::treeRemoveEntries(const QList<NodeId>& nodeids)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+  int k;
+
+  // group the rows to remove by parent
+  QMap<IndexType, QList<int> > rowsByParent;
+  for (k = 0; k < nodeids.size(); ++k) {
+    NodeId n = nodeids[k];
+    if (n.kind != EntryKind || !getEntryNodeRef(n).entryIsValid()) {
+      qWarning()<<KLF_FUNC_NAME<<": nodeid="<<n<<" does not reference a valid entry node!";
+      continue;
+    }
+    NodeId parentid = pEntryCache[n.index].parent;
+    int row = getCategoryLabelNodeRef(parentid).children.indexOf(n);
+    if (row < 0) {
+      qWarning()<<KLF_FUNC_NAME<<"("<<n<<"): !!?! bad child-parent relation, can't find it in its parent "
+		<<parentid;
+      continue;
+    }
+    rowsByParent[parentid.index].append(row);
+  }
+
+  QMap<IndexType, QList<int> >::iterator it;
+  for (it = rowsByParent.begin(); it != rowsByParent.end(); ++it) {
+    NodeId parentid = NodeId(CategoryLabelKind, it.key());
+    QList<int> rows = it.value();
+    qSort(rows.begin(), rows.end(), qGreater<int>());
+    QModelIndex parentidx = createIndexFromId(parentid, -1, 0);
+    // remove runs of contiguous rows, starting from the last ones so that rows don't shift
+    for (k = 0; k < rows.size(); ) {
+      int last = rows[k];
+      int first = last;
+      int j = k+1;
+      while (j < rows.size() && rows[j] >= first-1) {
+	first = qMin(first, rows[j]);
+	++j;
+      }
+      klfDbg("removing rows "<<first<<" to "<<last<<" of "<<parentid) ;
+      pModel->beginRemoveRows(parentidx, first, last);
+      QList<NodeId>& childlistref = pCategoryLabelCache[parentid.index].children;
+      for (int r = last; r >= first; --r) {
+	pEntryCache.unlinkNode(childlistref[r]);
+	childlistref.removeAt(r);
+      }
+      pModel->endRemoveRows();
+      k = j;
+    }
+  }
+
+  // and remove the categories that became empty
+  for (it = rowsByParent.begin(); it != rowsByParent.end(); ++it)
+    treeRemoveEmptyCategory(NodeId(CategoryLabelKind, it.key()));
+}
+
+void KLFLibModelCache::treeChangeEntry(NodeId n, const KLFLibEntry& newentry)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+
+  if (n.kind != EntryKind || !getEntryNodeRef(n).entryIsValid()) {
+    qWarning()<<KLF_FUNC_NAME<<": nodeid="<<n<<" does not reference a valid entry node!";
+    return;
+  }
+
+  KLFLib::entryId eid = pEntryCache[n.index].entryid;
+  NodeId oldparentid = pEntryCache[n.index].parent;
+  pEntryCache[n.index].entry = newentry;
+  pEntryCache[n.index].minimalist = false;
+  pEntryCache[n.index].invalidateSortKey();
+  pSearchIndex->invalidate(n);
+
+  // find (or create) the new parent
+  IndexType newcatindex = 0;
+  if (pModel->displayType() == KLFLibModel::CategoryTree) {
+    QStringList catelements = newentry.category().split('/', QString::SkipEmptyParts);
+    insertCategoryStringInSuggestionCache(catelements);
+    newcatindex = cacheFindCategoryLabel(catelements, true, true, true);
+  }
+  NodeId newparentid = NodeId(CategoryLabelKind, newcatindex);
+
+  bool sorting = (pLastSortPropId >= 0);
+  KLFLibModelSorter srt =
+    KLFLibModelSorter(this, pModel->pEntrySorter, pModel->pFlavorFlags & KLFLibModel::GroupSubCategories);
+
+  if (sorting) {
+    // as in treeInsertEntry(), make sure that the entries that logically appear before this one in
+    // its new category are fetched. This is needed even if the category didn't change: with a new
+    // sort key, the entry may belong past the fetched children, where the next fetch would list
+    // it again (or it would hide the entries that are fetched later).
+    bool retry;
+    do {
+      retry = false;
+      const QList<NodeId>& childlistref = getCategoryLabelNodeRef(newparentid).children;
+      int pos = qLowerBound(childlistref.begin(), childlistref.end(), n, srt) - childlistref.begin();
+      if (pos > childlistref.size()-10 && canFetchMore(newparentid)) {
+	fetchMore(newparentid);
+	retry = true;
+      }
+    } while (retry);
+    NodeId fetched = findEntryId(eid);
+    if (fetched.valid() && fetched != n) {
+      // we fetched the changed entry at its new position, drop the old node
+      treeRemoveEntries(QList<NodeId>() << n);
+      return;
+    }
+  }
+
+  int oldrow = getCategoryLabelNodeRef(oldparentid).children.indexOf(n);
+  if (oldrow < 0) {
+    qWarning()<<KLF_FUNC_NAME<<"("<<n<<"): !!?! bad child-parent relation, can't find it in its parent "
+	      <<oldparentid;
+    return;
+  }
+  // the new row, in the new parent's child list without this node
+  QList<NodeId> newlist = getCategoryLabelNodeRef(newparentid).children;
+  if (newparentid == oldparentid)
+    newlist.removeAt(oldrow);
+  int newrow;
+  if (sorting)
+    newrow = qLowerBound(newlist.begin(), newlist.end(), n, srt) - newlist.begin();
+  else if (newparentid == oldparentid)
+    newrow = oldrow; // no sorting, stay in place
+  else
+    newrow = newlist.size();
+
+  if (newparentid != oldparentid || newrow != oldrow) {
+    // the destination row as understood by beginMoveRows() is a row in the list before the move
+    int destrow = newrow;
+    if (newparentid == oldparentid && newrow > oldrow)
+      destrow = newrow + 1;
+    klfDbg("moving "<<n<<" from row "<<oldrow<<" of "<<oldparentid<<" to row "<<newrow<<" of "<<newparentid) ;
+    if (!pModel->beginMoveRows(createIndexFromId(oldparentid, -1, 0), oldrow, oldrow,
+			       createIndexFromId(newparentid, -1, 0), destrow)) {
+      qWarning()<<KLF_FUNC_NAME<<": invalid move of "<<n<<" to row "<<destrow<<" of "<<newparentid;
+      return;
+    }
+    pCategoryLabelCache[oldparentid.index].children.removeAt(oldrow);
+    pCategoryLabelCache[newparentid.index].children.insert(newrow, n);
+    pEntryCache[n.index].parent = newparentid;
+    pModel->endMoveRows();
+  }
 
-  return entrynode;
+  QModelIndex first = createIndexFromId(n, -1, 0);
+  QModelIndex last = createIndexFromId(n, first.row(), pModel->columnCount() - 1);
+  emit pModel->dataChanged(first, last);
+
+  if (newparentid != oldparentid)
+    treeRemoveEmptyCategory(oldparentid);
+}
+
+void KLFLibModelCache::treeRemoveEmptyCategory(NodeId catid)
+{
+  while (catid.valid() && catid.kind == CategoryLabelKind && !catid.isRoot()) {
+    if (!pCategoryLabelCache.isAllocated(catid.index))
+      return; // already removed
+    const CategoryLabelNode& cn = pCategoryLabelCache[catid.index];
+    // don't remove a category that may have children we didn't fetch yet
+    if (!cn.children.isEmpty() || !cn.allChildrenFetched)
+      return;
+    NodeId parentid = cn.parent;
+    if (!parentid.valid())
+      return;
+    int row = getCategoryLabelNodeRef(parentid).children.indexOf(catid);
+    if (row < 0) {
+      qWarning()<<KLF_FUNC_NAME<<"("<<catid<<"): can't find category label in its parent "<<parentid;
+      return;
+    }
+    klfDbg("removing empty category label "<<catid) ;
+    pModel->beginRemoveRows(createIndexFromId(parentid, -1, 0), row, row);
+    pCategoryLabelCache.unlinkNode(catid);
+    pCategoryLabelCache[parentid.index].children.removeAt(row);
+    pModel->endRemoveRows();
+    catid = parentid;
+  }
+}
+
+bool KLFLibModelCache::resortInPlace()
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+
+  if (pIsRebuilding) {
+    // the tree being built uses the former sorting, build it once more with the new one
+    pRebuildPending = true;
+    return true;
+  }
+
+  cancelFetchJobs();
+
+  if (pLastSortPropId < 0)
+    return false; // can't restore the resource's order ourselves
+
+  int k;
+  for (k = 0; k < pCategoryLabelCache.size(); ++k) {
+    if (pCategoryLabelCache[k].allocated && !pCategoryLabelCache[k].allChildrenFetched)
+      return false;
+  }
+
+  KLFLibModelSorter srt =
+    KLFLibModelSorter(this, pModel->pEntrySorter, pModel->pFlavorFlags & KLFLibModel::GroupSubCategories);
+
+  pModel->startLayoutChange();
+  for (k = 0; k < pCategoryLabelCache.size(); ++k) {
+    if (!pCategoryLabelCache[k].allocated)
+      continue;
+    QList<NodeId>& childlistref = pCategoryLabelCache[k].children;
+    qStableSort(childlistref.begin(), childlistref.end(), srt);
+  }
+  pModel->endLayoutChange();
+  return true;
 }
 
 
@@ -1138,19 +2160,16 @@ KLFLibModelCache::IndexType
 {
   klfDbg( "catelmnts="<<catelements<<", createIfNotExists="<<createIfNotExists<<", notifyQtApi="<<notifyQtApi ) ;
 
+  if (catelements.isEmpty())
+    return 0; // index of root category label
+
   QString catelpath = catelements.join("/");
 
-  int i;
-  for (i = 0; i < pCategoryLabelCache.size(); ++i) {
-    if (pCategoryLabelCache.isAllocated(i) &&
-	pCategoryLabelCache[i].parent.valid() &&
-	pCategoryLabelCache[i].fullCategoryPath == catelpath) {
-      // found the valid category label
-      return i;
-    }
+  IndexType i = pCategoryLabelCache.findNode(catelpath);
+  if (i >= 0 && pCategoryLabelCache[i].parent.valid()) {
+    // found the valid category label
+    return i;
   }
-  if (catelements.isEmpty())
-    return 0; // index of root category label
 
   // if we haven't found the correct category, we may need to create it if requested by
   // caller. If not, return failure immediately
@@ -1229,6 +2248,23 @@ QString KLFLibModelCache::nodeValue(NodeId n, int entryProperty)
   return QString();
 }
 
+const QCollatorSortKey& KLFLibModelCache::nodeSortKey(NodeId n, int entryProperty)
+{
+  if (n.kind == CategoryLabelKind) {
+    CategoryLabelNode& cn = getCategoryLabelNodeRef(n);
+    if (cn.sortKey.isNull())
+      cn.sortKey = QSharedPointer<QCollatorSortKey>(new QCollatorSortKey(pCollator.sortKey(cn.categoryLabel)));
+    return *cn.sortKey;
+  }
+
+  EntryNode& en = getEntryNodeRef(n);
+  if (en.sortKey.isNull() || en.sortKeyPropId != entryProperty) {
+    en.sortKey = QSharedPointer<QCollatorSortKey>(new QCollatorSortKey(pCollator.sortKey(nodeValue(n, entryProperty))));
+    en.sortKeyPropId = entryProperty;
+  }
+  return *en.sortKey;
+}
+
 // private
 void KLFLibModelCache::sortCategory(NodeId category, KLFLibModelSorter *sorter, bool rootCall)
 {
@@ -1431,27 +2467,24 @@ QModelIndexList KLFLibModelCache::findEntryIdList(const QList<KLFLib::entryId>&
   for (k = 0; k < eidlist.size(); ++k)
     indexlist << QModelIndex();
 
-  // walk entry list
-  for (k = 0; k < pEntryCache.size(); ++k) {
-    if (!pEntryCache[k].entryIsValid())
-      continue;
-    int i = eidlist.indexOf(pEntryCache[k].entryid);
-    if (i >= 0) {
-      indexlist[i] = createIndexFromId(NodeId(EntryKind, k), -1, 0);
-      if (++count == eidlist.size())
-	break; // found 'em all
+  // look up each entry ID
+  for (k = 0; k < eidlist.size(); ++k) {
+    NodeId n = findEntryId(eidlist[k]);
+    if (n.valid()) {
+      indexlist[k] = createIndexFromId(n, -1, 0);
+      ++count;
     }
   }
+  klfDbg("found "<<count<<" of "<<eidlist.size()<<" entries") ;
   return indexlist;
 }
 
 KLFLibModelCache::NodeId KLFLibModelCache::findEntryId(KLFLib::entryId eId)
 {
   klfDbg("eId="<<eId) ;
-  int k;
-  for (k = 0; k < pEntryCache.size(); ++k)
-    if (pEntryCache[k].entryid == eId && pEntryCache[k].entryIsValid())
-      return NodeId(EntryKind, k);
+  IndexType k = pEntryCache.findNode(eId);
+  if (k >= 0 && pEntryCache[k].entryIsValid())
+    return NodeId(EntryKind, k);
 
   klfDbg("...not found.") ;
   return NodeId();
@@ -1580,6 +2613,9 @@ void KLFLibModel::setResource(KLFLibResourceEngine *resource)
   KLF_DEBUG_ASSIGN_SAME_REF_INSTANCE(pCache) ;
 
   pResource = resource;
+  pCache->pThumbnailLoader->clear();
+  // don't show (or fetch more of) the tree of the former resource while the new one is built
+  pCache->clearTree();
   updateCacheSetupModel();
 }
 
@@ -1681,6 +2717,12 @@ QVariant KLFLibModel::data(const QModelIndex& index, int role) const
 
     //    klfDbg( "(): role="<<role ) ;
 
+    if (role == entryItemRole(KLFLibEntry::Preview)) {
+      // don't fetch the full entry, the preview is loaded lazily. May be a null image for now, in
+      // which case dataChanged() is emitted later on.
+      return QVariant::fromValue<QImage>(pCache->entryPreview(p));
+    }
+
     KLFLibEntry entry = ep.entry;
 
     if ( ! pCache->minimalistEntryPropIds().contains(entryPropIdForItemRole(role)) &&
@@ -1706,8 +2748,6 @@ QVariant KLFLibModel::data(const QModelIndex& index, int role) const
     if (role == FullEntryItemRole)
       return QVariant::fromValue(entry);
 
-    if (role == entryItemRole(KLFLibEntry::Preview))
-      return QVariant::fromValue<QImage>(entry.preview());
     if (role == entryItemRole(KLFLibEntry::Style))
       return QVariant::fromValue(entry.style());
     // by default
@@ -1902,12 +2942,28 @@ bool KLFLibModel::canFetchMore(const QModelIndex& parent) const
   if (!n.valid())
     n = KLFLibModelCache::NodeId::rootNode();
 
-  return pCache->canFetchMore(pCache->getNodeForIndex(parent));
+  // the rows of a pending fetch are inserted when they arrive
+  return pCache->canFetchMore(n) && !pCache->isFetchJobPending(n);
 }
 void KLFLibModel::fetchMore(const QModelIndex& parent)
 {
   KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
-  pCache->fetchMore(pCache->getNodeForIndex(parent), pFetchBatchCount);
+  // the views call this while scrolling, don't make them wait for the resource
+  pCache->fetchMoreAsync(pCache->getNodeForIndex(parent));
+}
+
+void KLFLibModel::fetchJobResultsAvailable(const KLFLibResourceEngine::QueryResult& batch)
+{
+  KLFLibResourceQueryJob *job = qobject_cast<KLFLibResourceQueryJob*>(sender());
+  KLF_ASSERT_NOT_NULL(job, "sender is not a query job!", return; ) ;
+  pCache->fetchJobResultsAvailable(job, batch);
+}
+
+void KLFLibModel::fetchJobFinished(bool success)
+{
+  KLFLibResourceQueryJob *job = qobject_cast<KLFLibResourceQueryJob*>(sender());
+  KLF_ASSERT_NOT_NULL(job, "sender is not a query job!", return; ) ;
+  pCache->fetchJobFinished(job, success);
 }
 
 
@@ -1928,8 +2984,7 @@ QMimeData *KLFLibModel::mimeData(const QModelIndexList& indlist) const
   // list as containing all the child entries.
   QModelIndexList indexes = indlist;
 
-  // get all entries
-  KLFLibEntryList entries;
+  // get all entry IDs
   QList<KLFLib::entryId> entryids;
   QList<KLFLibModelCache::NodeId> entriesnodeids;
   int k;
@@ -1942,18 +2997,20 @@ QMimeData *KLFLibModel::mimeData(const QModelIndexList& indlist) const
     if (entriesnodeids.contains(n))
       continue; // skip duplicates (for ex. for other model column indexes)
     const KLFLibModelCache::EntryNode& en = pCache->getEntryNodeRef(n);
-    entries << pResource->entry(en.entryid);
     entryids << en.entryid;
     entriesnodeids << n;
   }
 
-  //  klfDbg( "KLFLibModel::mimeData: Encoding entries "<<entries ) ;
+  // fetch the entries all at once, with the previews as stored in the resource
+  QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId> entries
+    = pResource->encodedEntries(pResource->defaultSubResource(), entryids);
 
   // some meta-data properties
   QVariantMap vprop;
   QUrl myurl = url();
   vprop["Url"] = myurl; // originating URL
 
+  // the other formats than application/x-klf-libentries-columnar are only encoded if requested
   QMimeData *mimedata = KLFAbstractLibEntryMimeEncoder::createMimeData(entries, vprop);
 
   QByteArray internalmovedata;
@@ -2054,7 +3111,8 @@ bool KLFLibModel::dropMimeData(const QMimeData *mimedata, Qt::DropAction action,
 
   klfDbg( "Dropping entry list." ) ;
 
-  KLFLibEntryList elist;
+  // keep the previews encoded, they are stored as PNG anyway
+  QList<KLFLibResourceEngine::KLFLibEncodedEntryWithId> elist;
   QVariantMap vprop;
   bool res = KLFAbstractLibEntryMimeEncoder::decodeMimeData(mimedata, &elist, &vprop);
   if ( ! res ) {
@@ -2071,14 +3129,14 @@ bool KLFLibModel::dropMimeData(const QMimeData *mimedata, Qt::DropAction action,
   // debug
 #ifdef KLF_DEBUG
   for (int klj = 0; klj < elist.size(); ++klj) {
-    klfDbg("\tGot Entry: latex="<<elist[klj].latex()<<"; style="<<elist[klj].style()) ;
+    klfDbg("\tGot Entry: latex="<<elist[klj].entry.latex()<<"; style="<<elist[klj].entry.style()) ;
   }
 #endif
 
   // insert list, regardless of parent (no category change)
-  QList<KLFLib::entryId> inserted = pResource->insertEntries(elist);
+  QList<KLFLib::entryId> inserted = pResource->insertEncodedEntries(pResource->defaultSubResource(), elist);
   res = (inserted.size() && !inserted.contains(-1));
-  klfDbg( "Dropped entry list "<<elist<<". Originating URL="
+  klfDbg( "Dropped "<<elist.size()<<" entries. Originating URL="
 	  <<(vprop.contains("Url")?vprop["Url"]:"(none)")<<". result="<<res ) ;
   if (!res)
     return false;
@@ -2201,124 +3259,502 @@ QModelIndex KLFLibModel::walkPrevIndex(const QModelIndex& cur)
   return pCache->createIndexFromId(prevnode, -1, 0);
 }
 
-KLFLib::entryId KLFLibModel::entryIdForIndex(const QModelIndex& index) const
+KLFLib::entryId KLFLibModel::entryIdForIndex(const QModelIndex& index) const
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+  return entryIdForIndexList(QModelIndexList() << index) [0];
+}
+
+QModelIndex KLFLibModel::findEntryId(KLFLib::entryId eid) const
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+  return findEntryIdList(QList<KLFLib::entryId>() << eid) [0];
+}
+
+QList<KLFLib::entryId> KLFLibModel::entryIdForIndexList(const QModelIndexList& indexlist) const
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+  return pCache->entryIdForIndexList(indexlist);
+}
+QModelIndexList KLFLibModel::findEntryIdList(const QList<KLFLib::entryId>& eidlist) const
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+  return pCache->findEntryIdList(eidlist);
+}
+
+
+void KLFLibModel::setEntrySorter(KLFLibEntrySorter *entrySorter)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+  if (pEntrySorter == entrySorter)
+    return;
+  if (entrySorter == NULL) {
+    qWarning()<<KLF_FUNC_NAME<<": NULL entrySorter given!";
+  }
+
+  if (pEntrySorter)
+    pCache->disposeEntrySorter(pEntrySorter);
+  pEntrySorter = entrySorter;
+}
+
+
+/** \internal
+ * Stops the search of a KLFLibModel once searchAbort() was called, remembering the position at which
+ * the search was stopped. */
+class KLFLibModelSearchAbortCheck : public KLFLibModelCache::SearchInterrupt
+{
+public:
+  KLFLibModelSearchAbortCheck(KLFLibModel *model) : pModel(model) { }
+
+  virtual bool searchInterrupted(KLFLibModelCache::NodeId curNode)
+  {
+    if (!pModel->pSearchAborted)
+      return false;
+    klfDbg("search aborted at "<<curNode) ;
+    pModel->pSearchCurNode = pModel->pCache->createIndexFromId(curNode, -1, 0);
+    return true;
+  }
+
+private:
+  KLFLibModel *pModel;
+};
+
+QModelIndex KLFLibModel::searchFind(const QString& queryString, const QModelIndex& fromIndex,
+				    bool forward)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+  klfDbg( " s="<<queryString<<" from "<<fromIndex<<" forward="<<forward ) ;
+  pSearchAborted = false;
+  pSearchString = queryString;
+  pSearchCurNode = fromIndex;
+  return searchFindNext(forward);
+}
+QModelIndex KLFLibModel::searchFindNext(bool forward)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+  pSearchAborted = false;
+  if (pSearchString.isEmpty())
+    return QModelIndex();
+
+  KLFLibModelCache::NodeId curNode = pCache->getNodeForIndex(pSearchCurNode);
+
+  // presence of capital letter switches case sensitivity on (like (X)Emacs)
+  Qt::CaseSensitivity cs = Qt::CaseInsensitive;
+  if (pSearchString.contains(QRegExp("[A-Z]")))
+    cs = Qt::CaseSensitive;
+
+  KLFLibModelSearchAbortCheck abortCheck(this);
+  curNode = pCache->searchFindNode(curNode, forward, pSearchString, cs, &abortCheck);
+  if (!curNode.valid() && pSearchAborted)
+    return QModelIndex(); // keep the position at which the search was aborted
+  pSearchCurNode = pCache->createIndexFromId(curNode, -1, 0);
+  if (curNode.valid()) {
+    klfDbg( "found "<<pSearchString<<" at "<<pSearchCurNode ) ;
+    return pSearchCurNode;
+  }
+  return QModelIndex();
+}
+
+void KLFLibModel::searchAbort()
+{
+  pSearchAborted = true;
+}
+
+QString KLFLibModelCache::nodeSearchText(NodeId nodeId)
+{
+  if (nodeId.kind == CategoryLabelKind)
+    return nodeValue(nodeId);
+
+  QString text = nodeValue(nodeId, KLFLibEntry::Latex) + QLatin1Char('\n')
+    + nodeValue(nodeId, KLFLibEntry::Tags);
+  // let an item match its category only in NON-category tree mode (user friendlyness: category matching
+  // will match the category title, after that, don't walk all the children...)
+  if ((pModel->pFlavorFlags & KLFLibModel::CategoryTree) == 0)
+    text += QLatin1Char('\n') + nodeValue(nodeId, KLFLibEntry::Category);
+  return text;
+}
+
+bool KLFLibModelCache::searchNodeMatches(const NodeId& nodeId, const QString& searchString,
+					 Qt::CaseSensitivity cs)
+{
+  // the folded text contains the folded query if the text contains the query, whatever the case
+  // and the accents
+  if (!pSearchIndex->matches(nodeId, searchString))
+    return false;
+
+  bool ignoreAccents = klfconfig.LibraryBrowser.searchIgnoresAccents;
+  if (cs == Qt::CaseInsensitive && ignoreAccents)
+    return true;
+
+  // check the actual strings
+  QString query = ignoreAccents ? KLFLibModelSearchIndex::stripAccents(searchString) : searchString;
+  QStringList values;
+  if (nodeId.kind == CategoryLabelKind) {
+    values << nodeValue(nodeId);
+  } else {
+    values << nodeValue(nodeId, KLFLibEntry::Latex) << nodeValue(nodeId, KLFLibEntry::Tags);
+    if ((pModel->pFlavorFlags & KLFLibModel::CategoryTree) == 0)
+      values << nodeValue(nodeId, KLFLibEntry::Category);
+  }
+  int k;
+  for (k = 0; k < values.size(); ++k) {
+    QString v = ignoreAccents ? KLFLibModelSearchIndex::stripAccents(values[k]) : values[k];
+    if (v.contains(query, cs))
+      return true;
+  }
+
+  return false;
+}
+
+KLFLibModelCache::NodeId KLFLibModelCache::searchFindNode(NodeId from, bool forward,
+							  const QString& searchString, Qt::CaseSensitivity cs,
+							  SearchInterrupt *interrupt)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+
+  QVector<SearchWalkStep> path = searchWalkPathTo(from);
+  NodeId n;
+
+  QTime t;
+  t.start();
+  for (;;) {
+    searchWalkStep(&path, forward);
+    if (path.isEmpty())
+      return NodeId(); // end of the tree reached
+    const SearchWalkStep& step = path.last();
+    n = pCategoryLabelCache[step.first.index].children[step.second];
+    if (searchNodeMatches(n, searchString, cs))
+      return n;
+
+    // call application's processEvents() from time to time to prevent GUI from freezing
+    if (t.elapsed() > 150) {
+      qApp->processEvents();
+      if (interrupt != NULL && interrupt->searchInterrupted(n)) {
+	klfDbg("search interrupted at "<<n) ;
+	return NodeId();
+      }
+      // the tree may have changed while processing events
+      path = searchWalkPathTo(n);
+      t.restart();
+    }
+  }
+}
+
+// private
+QVector<KLFLibModelCache::SearchWalkStep> KLFLibModelCache::searchWalkPathTo(NodeId n)
+{
+  // the path from the root node to node n. An empty path stands before the first node (resp. after
+  // the last node).
+  QVector<SearchWalkStep> path;
+  while (n.valid() && !n.isRoot()) {
+    NodeId parentid = getNode(n).parent;
+    int row = getNodeRow(n);
+    if (!parentid.valid() || row < 0) {
+      qWarning()<<KLF_FUNC_NAME<<": node "<<n<<" is not in the tree, starting search from the beginning";
+      return QVector<SearchWalkStep>();
+    }
+    path.prepend(SearchWalkStep(parentid, row));
+    n = parentid;
+  }
+  return path;
+}
+
+// private
+bool KLFLibModelCache::searchWalkFetchRow(NodeId parentid, int row)
+{
+  if (parentid.kind != CategoryLabelKind)
+    return false;
+  int count;
+  while ((count = pCategoryLabelCache[parentid.index].children.size()) <= row) {
+    if (!canFetchMore(parentid))
+      return false;
+    fetchMore(parentid);
+    if (pCategoryLabelCache[parentid.index].children.size() == count)
+      return false; // nothing could be fetched, don't loop forever
+  }
+  return true;
+}
+
+// private
+void KLFLibModelCache::searchWalkDescendLast(QVector<SearchWalkStep> *path, NodeId n)
+{
+  // like lastNode(), fetching all children of the nodes on the way
+  while (n.kind == CategoryLabelKind) {
+    while (searchWalkFetchRow(n, pCategoryLabelCache[n.index].children.size()))
+      ;
+    int count = pCategoryLabelCache[n.index].children.size();
+    if (count == 0)
+      return;
+    path->append(SearchWalkStep(n, count-1));
+    n = pCategoryLabelCache[n.index].children[count-1];
+  }
+}
+
+// private
+void KLFLibModelCache::searchWalkStep(QVector<SearchWalkStep> *path, bool forward)
+{
+  if (forward) {
+    // same order as nextNode(): first child if any, otherwise next sibling of the node or of the
+    // closest ancestor that has one
+    if (path->isEmpty()) {
+      if (searchWalkFetchRow(NodeId::rootNode(), 0))
+	path->append(SearchWalkStep(NodeId::rootNode(), 0));
+      return;
+    }
+    const SearchWalkStep& cur = path->last();
+    NodeId n = pCategoryLabelCache[cur.first.index].children[cur.second];
+    if (searchWalkFetchRow(n, 0)) {
+      path->append(SearchWalkStep(n, 0));
+      return;
+    }
+    while (!path->isEmpty()) {
+      SearchWalkStep& step = (*path)[path->size()-1];
+      if (searchWalkFetchRow(step.first, step.second+1)) {
+	++step.second;
+	return;
+      }
+      path->removeLast();
+    }
+    return;
+  }
+
+  // same order as prevNode(): last node of the previous sibling if any, otherwise the parent
+  if (path->isEmpty()) {
+    searchWalkDescendLast(path, NodeId::rootNode());
+    return;
+  }
+  SearchWalkStep& step = (*path)[path->size()-1];
+  if (step.second > 0) {
+    --step.second;
+    searchWalkDescendLast(path, pCategoryLabelCache[step.first.index].children[step.second]);
+    return;
+  }
+  // the parent is the previous node, and the root node isn't returned
+  path->removeLast();
+}
+
+
+// -----------------------------------------------------------------------------
+
+
+/** Number of nodes KLFLibModelSearchIndex::indexSome() indexes per event loop iteration */
+static const int KLF_SEARCH_INDEX_CHUNK_SIZE = 500;
+
+KLFLibModelSearchIndex::KLFLibModelSearchIndex(KLFLibModelCache *cache)
+  : QObject(NULL), pCache(cache), pHasQuery(false), pQueryHasTrigrams(false),
+    pIndexCursor(-1), pIndexScheduled(false)
+{
+}
+
+KLFLibModelSearchIndex::~KLFLibModelSearchIndex()
+{
+}
+
+// static
+QString KLFLibModelSearchIndex::stripAccents(const QString& s)
+{
+  int k;
+  for (k = 0; k < s.size(); ++k)
+    if (s[k].unicode() >= 0x80)
+      break;
+  if (k == s.size()) // plain ASCII, nothing to decompose
+    return s;
+
+  QString d = s.normalized(QString::NormalizationForm_D);
+  QString stripped;
+  stripped.reserve(d.size());
+  for (k = 0; k < d.size(); ++k) {
+    if (d[k].category() != QChar::Mark_NonSpacing)
+      stripped.append(d[k]);
+  }
+  return stripped;
+}
+
+// static
+QString KLFLibModelSearchIndex::foldString(const QString& s)
+{
+  return stripAccents(s).toCaseFolded();
+}
+
+// static
+QSet<quint64> KLFLibModelSearchIndex::trigrams(const QString& text)
+{
+  QSet<quint64> t;
+  const QChar *c = text.constData();
+  for (int k = 0; k+3 <= text.size(); ++k)
+    t.insert(trigramKey(c+k));
+  return t;
+}
+
+bool KLFLibModelSearchIndex::matches(const NodeId& n, const QString& queryString)
+{
+  setQuery(queryString);
+  const Item *item = indexNode(n);
+  if (item == NULL)
+    return false;
+  if (pQueryHasTrigrams)
+    return pCandidates.contains(n.universalId());
+  return item->text.contains(pFoldedQuery);
+}
+
+void KLFLibModelSearchIndex::invalidate(const NodeId& n)
 {
-  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
-  return entryIdForIndexList(QModelIndexList() << index) [0];
+  removeItem(n.universalId());
+  scheduleIndexing(QList<NodeId>() << n);
 }
 
-QModelIndex KLFLibModel::findEntryId(KLFLib::entryId eid) const
+void KLFLibModelSearchIndex::clear()
 {
-  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
-  return findEntryIdList(QList<KLFLib::entryId>() << eid) [0];
+  pItems.clear();
+  pTrigrams.clear();
+  pCandidates.clear();
+  pHasQuery = false;
+  pIndexCursor = -1;
+  pIndexQueue.clear();
 }
 
-QList<KLFLib::entryId> KLFLibModel::entryIdForIndexList(const QModelIndexList& indexlist) const
+void KLFLibModelSearchIndex::scheduleIndexing()
 {
-  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
-  return pCache->entryIdForIndexList(indexlist);
+  // rescan from the start, the nodes that are already indexed are skipped quickly
+  pIndexCursor = 0;
+  pIndexQueue.clear();
+  startIndexing();
 }
-QModelIndexList KLFLibModel::findEntryIdList(const QList<KLFLib::entryId>& eidlist) const
+
+void KLFLibModelSearchIndex::scheduleIndexing(const QList<NodeId>& nodes)
 {
-  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
-  return pCache->findEntryIdList(eidlist);
+  pIndexQueue << nodes;
+  startIndexing();
 }
 
-
-void KLFLibModel::setEntrySorter(KLFLibEntrySorter *entrySorter)
+void KLFLibModelSearchIndex::startIndexing()
 {
-  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
-  if (pEntrySorter == entrySorter)
+  if (pIndexScheduled)
     return;
-  if (entrySorter == NULL) {
-    qWarning()<<KLF_FUNC_NAME<<": NULL entrySorter given!";
-  }
-
-  if (pEntrySorter)
-    delete pEntrySorter;
-  pEntrySorter = entrySorter;
+  pIndexScheduled = true;
+  QTimer::singleShot(0, this, SLOT(indexSome()));
 }
 
-
-QModelIndex KLFLibModel::searchFind(const QString& queryString, const QModelIndex& fromIndex,
-				    bool forward)
+void KLFLibModelSearchIndex::indexSome()
 {
-  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
-  klfDbg( " s="<<queryString<<" from "<<fromIndex<<" forward="<<forward ) ;
-  pSearchAborted = false;
-  pSearchString = queryString;
-  pSearchCurNode = fromIndex;
-  return searchFindNext(forward);
+  pIndexScheduled = false;
+
+  int count = 0;
+  while (!pIndexQueue.isEmpty() && count < KLF_SEARCH_INDEX_CHUNK_SIZE) {
+    indexNode(pIndexQueue.takeFirst());
+    ++count;
+  }
+
+  if (pIndexCursor >= 0) {
+    int nentries = pCache->pEntryCache.size();
+    int total = nentries + pCache->pCategoryLabelCache.size();
+    for ( ; pIndexCursor < total && count < KLF_SEARCH_INDEX_CHUNK_SIZE; ++pIndexCursor, ++count) {
+      if (pIndexCursor < nentries)
+	indexNode(NodeId(KLFLibModelCache::EntryKind, pIndexCursor));
+      else
+	indexNode(NodeId(KLFLibModelCache::CategoryLabelKind, pIndexCursor - nentries));
+    }
+    if (pIndexCursor >= total)
+      pIndexCursor = -1; // full scan done
+  }
+
+  if (!pIndexQueue.isEmpty() || pIndexCursor >= 0)
+    startIndexing();
 }
-QModelIndex KLFLibModel::searchFindNext(bool forward)
-{
-  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
-  pSearchAborted = false;
-  if (pSearchString.isEmpty())
-    return QModelIndex();
 
-  QTime t;
+void KLFLibModelSearchIndex::setQuery(const QString& queryString)
+{
+  if (pHasQuery && queryString == pQueryString)
+    return;
 
-  KLFLibModelCache::NodeId curNode = pCache->getNodeForIndex(pSearchCurNode);
+  pHasQuery = true;
+  pQueryString = queryString;
+  pFoldedQuery = foldString(queryString);
+  pCandidates.clear();
+  pQueryHasTrigrams = (pFoldedQuery.size() >= 3);
+  if (!pQueryHasTrigrams)
+    return;
 
-  // search nodes
-  KLFLibModelCache::NodeId (KLFLibModelCache::*stepfunc)(KLFLibModelCache::NodeId) =
-    forward
-    ? &KLFLibModelCache::nextNode
-    : &KLFLibModelCache::prevNode;
+  // intersect the node sets of the trigrams of the query, starting with the smallest one
+  QList<const QSet<UIDType> *> sets;
+  QSet<quint64> qt = trigrams(pFoldedQuery);
+  for (QSet<quint64>::const_iterator it = qt.begin(); it != qt.end(); ++it) {
+    QHash<quint64, QSet<UIDType> >::const_iterator st = pTrigrams.find(*it);
+    if (st == pTrigrams.end())
+      return; // no indexed node has this trigram
+    int k = 0;
+    while (k < sets.size() && sets[k]->size() < st.value().size())
+      ++k;
+    sets.insert(k, &st.value());
+  }
+  const QSet<UIDType>& smallest = *sets[0];
+  for (QSet<UIDType>::const_iterator it = smallest.begin(); it != smallest.end(); ++it) {
+    int k;
+    for (k = 1; k < sets.size() && sets[k]->contains(*it); ++k)
+      ;
+    // having all trigrams doesn't mean having them in the right order
+    if (k == sets.size() && pItems.value(*it).text.contains(pFoldedQuery))
+      pCandidates.insert(*it);
+  }
+}
 
-  // presence of capital letter switches case sensitivity on (like (X)Emacs)
-  Qt::CaseSensitivity cs = Qt::CaseInsensitive;
-  if (pSearchString.contains(QRegExp("[A-Z]")))
-    cs = Qt::CaseSensitive;
+const KLFLibModelSearchIndex::Item * KLFLibModelSearchIndex::indexNode(const NodeId& n)
+{
+  if (!n.valid() || n.isRoot())
+    return NULL;
 
-  bool found = false;
-  while ( ! found &&
-	  (curNode = (pCache->*stepfunc)(curNode)).valid() ) {
-    if ( pCache->searchNodeMatches(curNode, pSearchString, cs) ) {
-      found = true;
+  Item item;
+  if (n.kind == KLFLibModelCache::EntryKind) {
+    if (n.index >= pCache->pEntryCache.size() || !pCache->pEntryCache[n.index].entryIsValid()) {
+      removeItem(n.universalId());
+      return NULL;
     }
-    if (t.elapsed() > 150) {
-      pSearchCurNode = pCache->createIndexFromId(curNode, -1, 0);
-      qApp->processEvents();
-      if (pSearchAborted)
-	break;
-      t.restart();
+    item.entryid = pCache->pEntryCache[n.index].entryid;
+  } else {
+    if (n.index >= pCache->pCategoryLabelCache.size() ||
+	!pCache->pCategoryLabelCache[n.index].allocated ||
+	!pCache->pCategoryLabelCache[n.index].parent.valid()) {
+      removeItem(n.universalId());
+      return NULL;
     }
+    item.categoryPath = pCache->pCategoryLabelCache[n.index].fullCategoryPath;
   }
-  pSearchCurNode = pCache->createIndexFromId(curNode, -1, 0);
-  if (found) {
-    klfDbg( "found "<<pSearchString<<" at "<<pSearchCurNode ) ;
-    return pSearchCurNode;
+
+  UIDType uid = n.universalId();
+  QHash<UIDType, Item>::iterator it = pItems.find(uid);
+  if (it != pItems.end()) {
+    if (it.value().entryid == item.entryid && it.value().categoryPath == item.categoryPath)
+      return &it.value();
+    // the slot of this node was reused for another node
+    removeItem(uid);
   }
-  return QModelIndex();
-}
 
-void KLFLibModel::searchAbort()
-{
-  pSearchAborted = true;
+  item.text = foldString(pCache->nodeSearchText(n));
+  QSet<quint64> t = trigrams(item.text);
+  for (QSet<quint64>::const_iterator tt = t.begin(); tt != t.end(); ++tt)
+    pTrigrams[*tt].insert(uid);
+  if (pQueryHasTrigrams && item.text.contains(pFoldedQuery))
+    pCandidates.insert(uid);
+
+  return &pItems.insert(uid, item).value();
 }
 
-bool KLFLibModelCache::searchNodeMatches(const NodeId& nodeId, const QString& searchString,
-					 Qt::CaseSensitivity cs)
+void KLFLibModelSearchIndex::removeItem(UIDType uid)
 {
-  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
-  if (nodeId.kind == CategoryLabelKind) {
-    if (nodeValue(nodeId).contains(searchString, cs))
-      return true;
-    return false;
-  }
-  if (nodeValue(nodeId, KLFLibEntry::Latex).contains(searchString, cs) ||
-      nodeValue(nodeId, KLFLibEntry::Tags).contains(searchString, cs))
-    return true;
-  // let an item match its category only in NON-category tree mode (user friendlyness: category matching
-  // will match the category title, after that, don't walk all the children...)
-  if ((pModel->pFlavorFlags & KLFLibModel::CategoryTree) == 0 &&
-      nodeValue(nodeId, KLFLibEntry::Category).contains(searchString, cs)) {
-    return true;
+  QHash<UIDType, Item>::iterator it = pItems.find(uid);
+  if (it == pItems.end())
+    return;
+  QSet<quint64> t = trigrams(it.value().text);
+  for (QSet<quint64>::const_iterator tt = t.begin(); tt != t.end(); ++tt) {
+    QHash<quint64, QSet<UIDType> >::iterator st = pTrigrams.find(*tt);
+    if (st == pTrigrams.end())
+      continue;
+    st.value().remove(uid);
+    if (st.value().isEmpty())
+      pTrigrams.erase(st);
   }
-
-  return false;
+  pCandidates.remove(uid);
+  pItems.erase(it);
 }
 
 
@@ -2379,20 +3815,12 @@ void KLFLibModel::redoSort()
 {
   KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
 
-  // truly need to re-query the resource with our partial querying and fetching more system...
+  // if all entries are in cache, just sort them again (this keeps the persistent indexes)
+  if (pCache->resortInPlace())
+    return;
+
+  // otherwise truly need to re-query the resource with our partial querying and fetching more system...
   updateCacheSetupModel();
-  return;
-  /*
-   // this does not work with partial querying and fetching more, we truly need to re-query the resource
-   startLayoutChange();
-   
-   KLFLibModelCache::KLFLibModelSorter srt = 
-   KLFLibModelCache::KLFLibModelSorter(pCache, pEntrySorter, pFlavorFlags & KLFLibModel::GroupSubCategories);
-   
-   pCache->sortCategory(KLFLibModelCache::NodeId::rootNode(), &srt);
-  
-   endLayoutChange();
-  */
 }
 
 void KLFLibModel::sort(int column, Qt::SortOrder order)
@@ -2497,6 +3925,12 @@ void KLFLibModel::updateCacheSetupModel()
   pCache->rebuildCache();
 }
 
+void KLFLibModel::cacheRebuilt()
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+  pCache->rebuildFinished();
+}
+
 
 // --------------------------------------------------------
 
@@ -2507,6 +3941,11 @@ KLFLibViewDelegate::KLFLibViewDelegate(QObject *parent)
     pPreviewSize(klfconfig.UI.labelOutputFixedSize)
 {
   pAutoBackgroundItems = true;
+
+  // the rendered previews are cached in the QPixmapCache, see paintEntry(). Make sure that it can
+  // hold a screenful of them (the limit is in kilobytes)
+  if (QPixmapCache::cacheLimit() < 32*1024)
+    QPixmapCache::setCacheLimit(32*1024);
 }
 KLFLibViewDelegate::~KLFLibViewDelegate()
 {
@@ -2626,58 +4065,87 @@ void KLFLibViewDelegate::paintEntry(PaintPrivate *p, const QModelIndex& index) c
       // ### space pixels (for retina displays for example).
       qreal dpr = p->p->device()->devicePixelRatioF();
       QImage img = index.data(KLFLibModel::entryItemRole(KLFLibEntry::Preview)).value<QImage>();
-      // now these are actual device pixels...
-      QImage img2 = img.scaled(p->innerRectImage.size()*dpr, Qt::KeepAspectRatio, Qt::SmoothTransformation);
-      if (p->isselected) {
-	img2 = transparentify_image(img2, 0.85);
+      if (img.isNull()) {
+	// the preview is still being loaded (see KLFLibThumbnailLoader), show a placeholder of
+	// the right size. The model emits dataChanged() when the preview is available.
+	QSize s = index.data(KLFLibModel::entryItemRole(KLFLibEntry::PreviewSize)).value<QSize>();
+	s.scale(p->innerRectImage.size(), Qt::KeepAspectRatio);
+	QRect r(p->innerRectImage.topLeft() + QPoint(0, (p->innerRectImage.height()-s.height()) / 2), s);
+	QColor c = p->isselected ? QColor(255,255,255) : QColor(128,128,128);
+	c.setAlpha(40);
+	p->p->save();
+	p->p->setPen(Qt::NoPen);
+	p->p->setBrush(c);
+	p->p->setRenderHint(QPainter::Antialiasing, true);
+	p->p->drawRoundedRect(r, 4, 4);
+	p->p->restore();
+	break;
       }
-      QPoint pos = p->innerRectImage.topLeft()
-	+ QPoint(0, (p->innerRectImage.height()-img2.height()/dpr) / 2);
-      if (pAutoBackgroundItems) {
-	// draw image on different background if it can't be "distinguished" from default background
-	// (eg. a transparent white formula)
-	klfDbg( " BG Brush is "<<p->background ) ;
-	QColor bgcolor = p->background.color();
-	QList<QColor> bglista, bglistb, bglist;
-	// 	bglist << bgcolor
-	// 	       << QColor(255,255,255)
-	// 	       << QColor(220,220,220)
-	// 	       << QColor(180,190,190)
-	// 	       << QColor(200,200,200)
-	// 	       << QColor(150,150,150)
-	// 	       << QColor(100,100,100)
-	// 	       << QColor(50,50,50)
-	// 	       << QColor(0,0,0);
-	bglist << bgcolor; // first try: default color (!)
-	bglista = bglistb = bglist;
-	int count;
-	for (count = 0; count < 5; ++count) // suggest N (ever) darker colors
-	  bglista << bglista.last().darker(105+count*2);
-	for (count = 0; count < 5; ++count) // and N (ever) lighter colors
-	  bglistb << bglistb.last().lighter(105+count*2);
-	// build the full list, and always provide white, and black to be sure
-	bglist << bglista.mid(1) << bglistb.mid(1) << QColor(255,255,255) << QColor(0,0,0);
-	klfDbg( "alt. bg list is "<<bglist );
-	int k;
-	for (k = 0; k < bglist.size(); ++k) {
-	  //	  klfDbg( "calling image_is_distinguishable on entry with latex="
-	  //		  <<index.data(KLFLibModel::entryItemRole(KLFLibEntry::Latex)).toString() );
-	  bool distinguishable = image_is_distinguishable(img2, bglist[k], 20); // 30
-	  if ( distinguishable )
-	    break; // got distinguishable color
+      // The scaled, possibly transparentified and glowed preview is expensive to compute. It is
+      // cached as a pixmap covering the whole item rect. The key includes the image's cacheKey(),
+      // which changes when the entry's preview is changed, so old renderings are never reused
+      // (they are eventually evicted from the bounded QPixmapCache).
+      QColor bgcolor = p->background.color();
+      QString cacheKey =
+	QString("klflibviewdelegate:%1:%2:%3x%4@%5:%6%7:%8:%9:%10")
+	.arg(index.data(KLFLibModel::EntryIdItemRole).toInt()).arg(img.cacheKey())
+	.arg(p->option->rect.width()).arg(p->option->rect.height()).arg(dpr)
+	.arg(p->isselected ? 's' : '-').arg(pAutoBackgroundItems ? 'b' : '-')
+	.arg(bgcolor.rgba())
+	.arg(klfconfig.UI.glowEffect ? klfconfig.UI.glowEffectColor.rgba() : 0)
+	.arg(klfconfig.UI.glowEffect ? klfconfig.UI.glowEffectRadius : -1);
+      QPixmap rendered;
+      if (!QPixmapCache::find(cacheKey, &rendered)) {
+	rendered = QPixmap(p->option->rect.size()*dpr);
+	rendered.setDevicePixelRatio(dpr);
+	rendered.fill(Qt::transparent);
+	QPainter rp(&rendered);
+	// image rect relative to the rendered pixmap
+	QRect innerRectImage = p->innerRectImage.translated(-p->option->rect.topLeft());
+
+	// now these are actual device pixels...
+	QImage img2 = img.scaled(innerRectImage.size()*dpr, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+	if (p->isselected) {
+	  img2 = transparentify_image(img2, 0.85);
 	}
-	// if the background color is not the default one, fill the background with that color
-	if (k > 0 && k < bglist.size())
-	  p->p->fillRect(QRect(pos, img2.size()/dpr), QBrush(bglist[k]));
-      }
-      // and draw the equation
-      p->p->save();
-      p->p->translate(pos);
-      if (klfconfig.UI.glowEffect) {
-	klfDrawGlowedImage(p->p, img2, klfconfig.UI.glowEffectColor, klfconfig.UI.glowEffectRadius, false);
+	QPoint pos = innerRectImage.topLeft()
+	  + QPoint(0, (innerRectImage.height()-img2.height()/dpr) / 2);
+	if (pAutoBackgroundItems) {
+	  // draw image on different background if it can't be "distinguished" from default background
+	  // (eg. a transparent white formula)
+	  klfDbg( " BG Brush is "<<p->background ) ;
+	  QList<QColor> bglista, bglistb, bglist;
+	  bglist << bgcolor; // first try: default color (!)
+	  bglista = bglistb = bglist;
+	  int count;
+	  for (count = 0; count < 5; ++count) // suggest N (ever) darker colors
+	    bglista << bglista.last().darker(105+count*2);
+	  for (count = 0; count < 5; ++count) // and N (ever) lighter colors
+	    bglistb << bglistb.last().lighter(105+count*2);
+	  // build the full list, and always provide white, and black to be sure
+	  bglist << bglista.mid(1) << bglistb.mid(1) << QColor(255,255,255) << QColor(0,0,0);
+	  klfDbg( "alt. bg list is "<<bglist );
+	  int k;
+	  for (k = 0; k < bglist.size(); ++k) {
+	    bool distinguishable = image_is_distinguishable(img2, bglist[k], 20); // 30
+	    if ( distinguishable )
+	      break; // got distinguishable color
+	  }
+	  // if the background color is not the default one, fill the background with that color
+	  if (k > 0 && k < bglist.size())
+	    rp.fillRect(QRect(pos, img2.size()/dpr), QBrush(bglist[k]));
+	}
+	// and draw the equation
+	rp.translate(pos);
+	if (klfconfig.UI.glowEffect) {
+	  klfDrawGlowedImage(&rp, img2, klfconfig.UI.glowEffectColor, klfconfig.UI.glowEffectRadius, false);
+	}
+	rp.drawImage(QRect(QPoint(0,0), img2.size()/dpr), img2);
+	rp.end();
+
+	QPixmapCache::insert(cacheKey, rendered);
       }
-      p->p->drawImage(QRect(QPoint(0,0), img2.size()/dpr), img2);
-      p->p->restore();
+      p->p->drawPixmap(p->option->rect.topLeft(), rendered);
       break;
     }
   case KLFLibEntry::Category:
@@ -3008,6 +4476,436 @@ bool KLFLibViewDelegate::func_indexHasSelectedDescendant(const QModelIndex& pare
 
 
 
+// -------------------------------------------------------
+
+
+KLFLibDefIconView::KLFLibDefIconView(KLFLibDefaultView *parent)
+  : QAbstractItemView(parent), KLFLibDefViewCommon(parent), pFlow(QListView::LeftToRight), pSpacing(0),
+    pInEventFilter(false), pLaidOutCount(0), pItemsPerLine(0), pCellLength(0)
+{
+  installEventFilter(this);
+  viewport()->installEventFilter(this);
+}
+
+void KLFLibDefIconView::setModel(QAbstractItemModel *m)
+{
+  if ( ! setTheModel(m) )
+    return;
+
+  if (model() != NULL) {
+    disconnect(model(), SIGNAL(rowsRemoved(const QModelIndex&, int, int)),
+	       this, SLOT(modelRowsRemoved(const QModelIndex&, int, int)));
+    disconnect(model(), SIGNAL(rowsMoved(const QModelIndex&, int, int, const QModelIndex&, int)),
+	       this, SLOT(modelRowsMoved(const QModelIndex&, int, int, const QModelIndex&, int)));
+  }
+  QAbstractItemView::setModel(m);
+  connect(m, SIGNAL(rowsRemoved(const QModelIndex&, int, int)),
+	  this, SLOT(modelRowsRemoved(const QModelIndex&, int, int)));
+  connect(m, SIGNAL(rowsMoved(const QModelIndex&, int, int, const QModelIndex&, int)),
+	  this, SLOT(modelRowsMoved(const QModelIndex&, int, int, const QModelIndex&, int)));
+
+  invalidateLayout();
+}
+
+void KLFLibDefIconView::setFlow(QListView::Flow flow)
+{
+  if (pFlow == flow)
+    return;
+  pFlow = flow;
+  forceRelayout();
+}
+
+void KLFLibDefIconView::setSpacing(int spacing)
+{
+  if (pSpacing == spacing)
+    return;
+  pSpacing = spacing;
+  forceRelayout();
+}
+
+QRect KLFLibDefIconView::visualRect(const QModelIndex& index) const
+{
+  if (!index.isValid() || index.parent() != rootIndex())
+    return QRect();
+  return itemRect(viewOptions(), index.row()).translated(-offset());
+}
+
+void KLFLibDefIconView::scrollTo(const QModelIndex& index, ScrollHint hint)
+{
+  QRect r = visualRect(index);
+  if (r.isEmpty())
+    return;
+
+  QScrollBar *acrossBar = isLeftToRight() ? verticalScrollBar() : horizontalScrollBar();
+  QScrollBar *alongBar = isLeftToRight() ? horizontalScrollBar() : verticalScrollBar();
+  QSize vsize = viewport()->size();
+
+  // across the flow
+  int start = across(r.topLeft());
+  int end = start + across(r.size());
+  int extent = across(vsize);
+  int delta = 0;
+  switch (hint) {
+  case PositionAtTop:
+    delta = start - pSpacing;
+    break;
+  case PositionAtBottom:
+    delta = end + pSpacing - extent;
+    break;
+  case PositionAtCenter:
+    delta = (start + end - extent) / 2;
+    break;
+  case EnsureVisible:
+  default:
+    if (start < 0)
+      delta = start - pSpacing;
+    else if (end > extent)
+      delta = qMin(start - pSpacing, end + pSpacing - extent);
+    break;
+  }
+  acrossBar->setValue(acrossBar->value() + delta);
+
+  // along the flow, there is something to scroll only if the viewport is smaller than a cell
+  start = along(r.topLeft());
+  end = start + along(r.size());
+  extent = along(vsize);
+  if (start < 0)
+    alongBar->setValue(alongBar->value() + start - pSpacing);
+  else if (end > extent)
+    alongBar->setValue(alongBar->value() + qMin(start - pSpacing, end + pSpacing - extent));
+}
+
+QModelIndex KLFLibDefIconView::indexAt(const QPoint& point) const
+{
+  QPoint p = point + offset();
+  int line = lineAt(across(p));
+  if (line < 0 || along(p) < pSpacing)
+    return QModelIndex();
+  int col = (along(p) - pSpacing) / pCellLength;
+  int row = line * pItemsPerLine + col;
+  if (col >= pItemsPerLine || row >= itemCount())
+    return QModelIndex();
+  if (!itemRect(viewOptions(), row).contains(p))
+    return QModelIndex();
+  return model()->index(row, 0, rootIndex());
+}
+
+void KLFLibDefIconView::doItemsLayout()
+{
+  invalidateLayout();
+  QAbstractItemView::doItemsLayout();
+}
+
+void KLFLibDefIconView::reset()
+{
+  invalidateLayout();
+  QAbstractItemView::reset();
+}
+
+QModelIndex KLFLibDefIconView::moveCursor(CursorAction cursorAction, Qt::KeyboardModifiers modifiers)
+{
+  Q_UNUSED(modifiers) ;
+
+  int count = itemCount();
+  if (count == 0)
+    return QModelIndex();
+  QModelIndex current = currentIndex();
+  if (!current.isValid() || current.parent() != rootIndex())
+    return model()->index(0, 0, rootIndex());
+
+  ensureLayout();
+  bool ltr = isLeftToRight();
+  int row = current.row();
+  switch (cursorAction) {
+  case MovePrevious: row -= 1; break;
+  case MoveNext: row += 1; break;
+  case MoveLeft: row -= ltr ? 1 : pItemsPerLine; break;
+  case MoveRight: row += ltr ? 1 : pItemsPerLine; break;
+  case MoveUp: row -= ltr ? pItemsPerLine : 1; break;
+  case MoveDown: row += ltr ? pItemsPerLine : 1; break;
+  case MoveHome: row = 0; break;
+  case MoveEnd: row = count - 1; break;
+  case MovePageUp:
+  case MovePageDown:
+    {
+      // the same position in the line that is one viewport away
+      int pos = across(itemRect(viewOptions(), row).topLeft());
+      if (cursorAction == MovePageUp)
+	pos -= across(viewport()->size());
+      else
+	pos += across(viewport()->size());
+      row = lineAt(pos) * pItemsPerLine + row % pItemsPerLine;
+      break;
+    }
+  default:
+    break;
+  }
+  row = qBound(0, row, count - 1);
+  return model()->index(row, 0, rootIndex());
+}
+
+void KLFLibDefIconView::setSelection(const QRect& rect, QItemSelectionModel::SelectionFlags command)
+{
+  QRect r = rect.normalized().translated(offset());
+  QItemSelection selection;
+  int first, last;
+  if (rowsInRect(r, &first, &last)) {
+    QStyleOptionViewItem option = viewOptions();
+    // select the runs of consecutive rows that intersect the rectangle
+    int runStart = -1;
+    for (int row = first; row <= last; ++row) {
+      bool in = itemRect(option, row).intersects(r);
+      if (in && runStart < 0) {
+	runStart = row;
+      } else if (!in && runStart >= 0) {
+	selection.select(model()->index(runStart, 0, rootIndex()), model()->index(row-1, 0, rootIndex()));
+	runStart = -1;
+      }
+    }
+    if (runStart >= 0)
+      selection.select(model()->index(runStart, 0, rootIndex()), model()->index(last, 0, rootIndex()));
+  }
+  selectionModel()->select(selection, command);
+}
+
+QRegion KLFLibDefIconView::visualRegionForSelection(const QItemSelection& selection) const
+{
+  // only the visible items matter, the selection may span the whole library
+  QRegion region;
+  int first, last;
+  if (!rowsInRect(viewport()->rect().translated(offset()), &first, &last))
+    return region;
+  QStyleOptionViewItem option = viewOptions();
+  for (int k = 0; k < selection.size(); ++k) {
+    const QItemSelectionRange& range = selection[k];
+    if (range.parent() != rootIndex())
+      continue;
+    int bottom = qMin(range.bottom(), last);
+    for (int row = qMax(range.top(), first); row <= bottom; ++row)
+      region += itemRect(option, row).translated(-offset());
+  }
+  return region;
+}
+
+void KLFLibDefIconView::paintEvent(QPaintEvent *event)
+{
+  QRect area = event->rect().translated(offset());
+  int first, last;
+  if (!rowsInRect(area, &first, &last))
+    return;
+
+  QPainter painter(viewport());
+  QStyleOptionViewItem option = viewOptions();
+  QItemSelectionModel *selModel = selectionModel();
+  QModelIndex current = currentIndex();
+  for (int row = first; row <= last; ++row) {
+    QRect r = itemRect(option, row);
+    if (!r.intersects(area))
+      continue;
+    QModelIndex index = model()->index(row, 0, rootIndex());
+    QStyleOptionViewItem opt = option;
+    opt.rect = r.translated(-offset());
+    if (selModel != NULL && selModel->isSelected(index))
+      opt.state |= QStyle::State_Selected;
+    if (index == current && hasFocus())
+      opt.state |= QStyle::State_HasFocus;
+    if (!(model()->flags(index) & Qt::ItemIsEnabled))
+      opt.state &= ~QStyle::State_Enabled;
+    itemDelegate(index)->paint(&painter, opt, index);
+  }
+}
+
+void KLFLibDefIconView::resizeEvent(QResizeEvent *event)
+{
+  // ensureLayout() notices if the number of items per line changed
+  QAbstractItemView::resizeEvent(event);
+}
+
+void KLFLibDefIconView::updateGeometries()
+{
+  ensureLayout();
+
+  QScrollBar *acrossBar = isLeftToRight() ? verticalScrollBar() : horizontalScrollBar();
+  QScrollBar *alongBar = isLeftToRight() ? horizontalScrollBar() : verticalScrollBar();
+  QSize vsize = viewport()->size();
+
+  acrossBar->setSingleStep(20);
+  acrossBar->setPageStep(across(vsize));
+  acrossBar->setRange(0, qMax(0, pLineOffsets.last() - across(vsize)));
+  alongBar->setSingleStep(20);
+  alongBar->setPageStep(along(vsize));
+  alongBar->setRange(0, qMax(0, pSpacing + pItemsPerLine * pCellLength - along(vsize)));
+
+  // this also fetches more items if the last one is visible
+  QAbstractItemView::updateGeometries();
+}
+
+void KLFLibDefIconView::rowsInserted(const QModelIndex& parent, int start, int end)
+{
+  KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+  if (parent == rootIndex())
+    invalidateLayout(start);
+  QAbstractItemView::rowsInserted(parent, start, end);
+  updateGeometries();
+  viewport()->update();
+}
+
+void KLFLibDefIconView::rowsAboutToBeRemoved(const QModelIndex& parent, int start, int end)
+{
+  if (parent == rootIndex())
+    invalidateLayout(start);
+  QAbstractItemView::rowsAboutToBeRemoved(parent, start, end);
+}
+
+void KLFLibDefIconView::modelRowsRemoved(const QModelIndex& parent, int start, int /*end*/)
+{
+  if (parent != rootIndex())
+    return;
+  invalidateLayout(start);
+  updateGeometries();
+  viewport()->update();
+}
+
+void KLFLibDefIconView::modelRowsMoved(const QModelIndex& parent, int start, int /*end*/,
+				       const QModelIndex& destination, int row)
+{
+  if (parent == rootIndex() && destination == rootIndex())
+    invalidateLayout(qMin(start, row));
+  else if (parent == rootIndex())
+    invalidateLayout(start);
+  else if (destination == rootIndex())
+    invalidateLayout(row);
+  else
+    return;
+  updateGeometries();
+  viewport()->update();
+}
+
+void KLFLibDefIconView::dataChanged(const QModelIndex& topLeft, const QModelIndex& bottomRight,
+				    const QVector<int>& roles)
+{
+  QAbstractItemView::dataChanged(topLeft, bottomRight, roles);
+
+  if (!topLeft.isValid() || !bottomRight.isValid() || topLeft.parent() != rootIndex())
+    return;
+
+  // this is also emitted when previews have been loaded. Only relayout if the thickness of a line
+  // changed.
+  ensureLayout();
+  int count = itemCount();
+  QStyleOptionViewItem option = viewOptions();
+  int lastline = qMin(bottomRight.row(), count-1) / pItemsPerLine;
+  for (int line = topLeft.row() / pItemsPerLine; line <= lastline && line+1 < pLineOffsets.size(); ++line) {
+    int thickness = 0;
+    for (int row = line * pItemsPerLine; row < qMin(count, (line+1) * pItemsPerLine); ++row)
+      thickness = qMax(thickness, across(itemSize(option, row)));
+    if (pLineOffsets[line] + thickness + pSpacing != pLineOffsets[line+1]) {
+      invalidateLayout(line * pItemsPerLine);
+      updateGeometries();
+      viewport()->update();
+      return;
+    }
+  }
+}
+
+int KLFLibDefIconView::itemCount() const
+{
+  if (model() == NULL)
+    return 0;
+  return model()->rowCount(rootIndex());
+}
+
+QSize KLFLibDefIconView::itemSize(const QStyleOptionViewItem& option, int row) const
+{
+  QModelIndex index = model()->index(row, 0, rootIndex());
+  return itemDelegate(index)->sizeHint(option, index);
+}
+
+void KLFLibDefIconView::invalidateLayout(int row)
+{
+  if (row <= 0) {
+    pLaidOutCount = 0;
+    pItemsPerLine = 0; // recompute it, too
+    return;
+  }
+  pLaidOutCount = qMin(pLaidOutCount, row);
+}
+
+void KLFLibDefIconView::ensureLayout() const
+{
+  // the delegate shrinks the previews to the preview size, see KLFLibViewDelegate::sizeHint()
+  int celllength = along(pDView->previewSize() + QSize(2,2)) + pSpacing;
+  int perline = qMax(1, (along(viewport()->size()) - pSpacing) / celllength);
+  if (celllength != pCellLength || perline != pItemsPerLine) {
+    pCellLength = celllength;
+    pItemsPerLine = perline;
+    pLaidOutCount = 0;
+  }
+
+  int count = itemCount();
+  int nlines = (count + perline - 1) / perline;
+  if (pLaidOutCount == count && pLineOffsets.size() == nlines + 1)
+    return; // up to date
+
+  // lay out again the line of the first row that isn't laid out, as it may not be complete
+  int line = qMin(pLaidOutCount, count) / perline;
+  if (pLineOffsets.size() < line + 1)
+    line = 0;
+  if (line == 0) {
+    pLineOffsets.resize(1);
+    pLineOffsets[0] = pSpacing;
+  } else {
+    pLineOffsets.resize(line + 1);
+  }
+
+  QStyleOptionViewItem option = viewOptions();
+  for ( ; line < nlines; ++line) {
+    int thickness = 0;
+    for (int row = line * perline; row < qMin(count, (line+1) * perline); ++row)
+      thickness = qMax(thickness, across(itemSize(option, row)));
+    pLineOffsets.append(pLineOffsets.last() + thickness + pSpacing);
+  }
+  pLaidOutCount = count;
+}
+
+int KLFLibDefIconView::lineAt(int pos) const
+{
+  ensureLayout();
+  int nlines = pLineOffsets.size() - 1;
+  if (nlines <= 0)
+    return -1;
+  int line = std::upper_bound(pLineOffsets.constBegin(), pLineOffsets.constEnd(), pos)
+    - pLineOffsets.constBegin() - 1;
+  return qBound(0, line, nlines - 1);
+}
+
+QRect KLFLibDefIconView::itemRect(const QStyleOptionViewItem& option, int row) const
+{
+  ensureLayout();
+  int line = row / pItemsPerLine;
+  if (row < 0 || line + 1 >= pLineOffsets.size())
+    return QRect();
+  QSize s = itemSize(option, row);
+  // centered in its cell along the flow, aligned on the start of the line across it
+  int a = pSpacing + (row % pItemsPerLine) * pCellLength + (pCellLength - pSpacing - along(s)) / 2;
+  int c = pLineOffsets[line];
+  return isLeftToRight() ? QRect(QPoint(a, c), s) : QRect(QPoint(c, a), s);
+}
+
+bool KLFLibDefIconView::rowsInRect(const QRect& rect, int *first, int *last) const
+{
+  int line1 = lineAt(isLeftToRight() ? rect.top() : rect.left());
+  int line2 = lineAt(isLeftToRight() ? rect.bottom() : rect.right());
+  if (line1 < 0 || line2 < 0)
+    return false;
+  *first = line1 * pItemsPerLine;
+  *last = qMin(itemCount(), (line2 + 1) * pItemsPerLine) - 1;
+  return *first <= *last;
+}
+
+
+
+
 // -------------------------------------------------------
 
 
@@ -3048,19 +4946,16 @@ KLFLibDefaultView::KLFLibDefaultView(QWidget *parent, ViewType view)
   setFocusPolicy(Qt::NoFocus);
 
   KLFLibDefTreeView *treeView = NULL;
-  KLFLibDefListView *listView = NULL;
+  KLFLibDefIconView *iconView = NULL;
   switch (pViewType) {
   case IconView:
-    listView = new KLFLibDefListView(this);
-    klfDbg( "Created list view." ) ;
-    listView->setViewMode(QListView::IconMode);
-    listView->setSpacing(15);
-    listView->setMovement(QListView::Free);
+    iconView = new KLFLibDefIconView(this);
+    klfDbg( "Created icon view." ) ;
+    iconView->setSpacing(15);
     // icon view flow is set later with setIconViewFlow()
-    listView->setResizeMode(QListView::Adjust);
-    listView->setFrameStyle(QFrame::NoFrame|QFrame::Plain);
-    klfDbg( "prepared list view." ) ;
-    pView = listView;
+    iconView->setFrameStyle(QFrame::NoFrame|QFrame::Plain);
+    klfDbg( "prepared icon view." ) ;
+    pView = iconView;
     break;
   case CategoryTreeView:
   case ListTreeView:
@@ -3288,8 +5183,8 @@ QModelIndex KLFLibDefaultView::currentVisibleIndex(bool forward) const
 {
   QModelIndex index;
   if (pViewType == IconView) {
-    KLFLibDefListView *lv = qobject_cast<KLFLibDefListView*>(pView);
-    KLF_ASSERT_NOT_NULL( lv, "KLFLibDefListView List View is NULL in view type "<<pViewType<<" !!",
+    KLFLibDefIconView *lv = qobject_cast<KLFLibDefIconView*>(pView);
+    KLF_ASSERT_NOT_NULL( lv, "KLFLibDefIconView Icon View is NULL in view type "<<pViewType<<" !!",
 			 return QModelIndex() )
       ;
     index = lv->curVisibleIndex(forward);
@@ -3355,7 +5250,7 @@ void KLFLibDefaultView::updateResourceEngine()
 #endif
 
   if (pViewType == IconView) {
-    qobject_cast<KLFLibDefListView*>(pView)->modelInitialized();
+    qobject_cast<KLFLibDefIconView*>(pView)->modelInitialized();
   } else {
     qobject_cast<KLFLibDefTreeView*>(pView)->modelInitialized();
   }
@@ -3523,8 +5418,8 @@ void KLFLibDefaultView::showEvent(QShowEvent *event)
 QListView::Flow KLFLibDefaultView::iconViewFlow() const
 {
   if (pViewType == IconView) {
-    KLFLibDefListView *lv = qobject_cast<KLFLibDefListView*>(pView);
-    KLF_ASSERT_NOT_NULL( lv, "KLFLibDefListView List View is NULL in view type "<<pViewType<<" !!",
+    KLFLibDefIconView *lv = qobject_cast<KLFLibDefIconView*>(pView);
+    KLF_ASSERT_NOT_NULL( lv, "KLFLibDefIconView Icon View is NULL in view type "<<pViewType<<" !!",
 			 return QListView::TopToBottom)
       ;
     return lv->flow();
@@ -3730,10 +5625,10 @@ void KLFLibDefaultView::slotPreviewSizeActionsRefreshChecked()
 
 void KLFLibDefaultView::slotRelayoutIcons()
 {
-  if (pViewType != IconView || !pView->inherits("KLFLibDefListView")) {
+  if (pViewType != IconView || !pView->inherits("KLFLibDefIconView")) {
     return;
   }
-  KLFLibDefListView *lv = qobject_cast<KLFLibDefListView*>(pView);
+  KLFLibDefIconView *lv = qobject_cast<KLFLibDefIconView*>(pView);
   // force a re-layout
   lv->forceRelayout();
 }
@@ -3741,8 +5636,8 @@ void KLFLibDefaultView::slotRelayoutIcons()
 void KLFLibDefaultView::setIconViewFlow(QListView::Flow flow)
 {
   if (pViewType == IconView) {
-    KLFLibDefListView *lv = qobject_cast<KLFLibDefListView*>(pView);
-    KLF_ASSERT_NOT_NULL( lv, "KLFLibDefListView List View is NULL in view type "<<pViewType<<" !!",
+    KLFLibDefIconView *lv = qobject_cast<KLFLibDefIconView*>(pView);
+    KLF_ASSERT_NOT_NULL( lv, "KLFLibDefIconView Icon View is NULL in view type "<<pViewType<<" !!",
 			 return )
       ;
     // set the flow
@@ -599,6 +599,13 @@ public slots:
   /** how many items to fetch at a time when fetching preview and style (non-minimalist) */
   virtual void setFetchBatchCount(int count) { pFetchBatchCount = count; }
 
+private slots:
+  /** Called from the event loop once the tree being rebuilt in a worker thread is ready */
+  void cacheRebuilt();
+  /** Called by the query jobs of the cache's background fetches */
+  void fetchJobResultsAvailable(const KLFLibResourceEngine::QueryResult& batch);
+  void fetchJobFinished(bool success);
+
 private:
 
   friend class KLFLibModelCache;
@@ -635,6 +642,7 @@ private:
   QString pSearchString;
   QModelIndex pSearchCurNode;
   bool pSearchAborted;
+  friend class KLFLibModelSearchAbortCheck;
 
   bool dropCanInternal(const QMimeData *data);
 
@@ -34,9 +34,19 @@
 
 #include <QApplication>
 #include <QStringList>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+#include <QSharedPointer>
+#include <QCollator>
+#include <QThread>
+#include <QThreadPool>
+#include <QCache>
+#include <QImage>
 #include <QAbstractItemView>
 #include <QTreeView>
 #include <QListView>
+#include <QScrollBar>
 #include <QMimeData>
 #include <QDrag>
 #include <QDragEnterEvent>
@@ -69,6 +79,80 @@ inline QSizeF pointToSizeF(const QPointF& p) { return QSizeF(p.x(), p.y()); }
 
 // -----------------------------
 
+class KLFLibModelCache;
+class KLFLibModelSearchIndex;
+class KLFLibModelCacheBuilder;
+
+/** \internal
+ *
+ * Loads the previews of the entries displayed by a \ref KLFLibModel lazily. Minimalist entries
+ * don't have their preview (see KLFLibModelCache::minimalistEntryPropIds()); KLFLibModel::data()
+ * asks for it with thumbnail(), which returns the image if it is in the cache and otherwise
+ * schedules it for loading and returns a null image. The delegate paints a placeholder until the
+ * model cache announces with dataChanged() that the preview has arrived.
+ *
+ * Only previews of items that are being painted (and their neighbours, see
+ * KLFLibModelCache::entryPreview()) are requested. Previews are read from the resource, which
+ * decodes them, in a worker thread if the resource supports
+ * \ref KLFLibResourceEngine::FeatureConcurrentRead, and otherwise in this thread between two
+ * events. Decoded previews are kept in an LRU cache with a budget in bytes.
+ */
+class KLFLibThumbnailLoader : public QObject
+{
+  Q_OBJECT
+public:
+  KLFLibThumbnailLoader(KLFLibModelCache *cache);
+  virtual ~KLFLibThumbnailLoader();
+
+  /** Returns the cached preview of entry \c eid. If it is not cached, schedules it for loading and
+   * returns a null image. */
+  QImage thumbnail(KLFLib::entryId eid);
+  /** Schedules the previews of the given entries for loading, unless they are cached or already
+   * scheduled. */
+  void request(const QList<KLFLib::entryId>& eids);
+  /** Forgets the cached previews of the given entries, eg. because they were changed. */
+  void invalidate(const QList<KLFLib::entryId>& eids);
+
+  /** The maximum size in bytes of the decoded previews kept in the cache. */
+  int maxCacheBytes() const { return pImages.maxCost() * 1024; }
+  void setMaxCacheBytes(int bytes) { pImages.setMaxCost(qMax(1, bytes / 1024)); }
+
+public slots:
+  /** Forgets all cached previews and pending requests, eg. because the resource changed. Waits for
+   * the worker thread to finish its current batch. Also called when the resource is destroyed, see
+   * \ref KLFLibResourceEngine::asyncJobsStopping(). */
+  void clear();
+
+private slots:
+  void loadPending();
+  /** Called in this thread with the previews that were loaded by a worker task */
+  void loaded(int generation, const QList<int>& eids, const QList<QImage>& images);
+
+private:
+  KLFLibModelCache *pCache;
+
+  /** The decoded previews, with cost in kilobytes */
+  QCache<KLFLib::entryId, QImage> pImages;
+  /** Entries whose preview should be loaded, in request order */
+  QList<KLFLib::entryId> pPending;
+  /** Entries in \c pPending or being loaded */
+  QSet<KLFLib::entryId> pRequested;
+  /** TRUE if loadPending() was scheduled or a batch is being loaded */
+  bool pLoadScheduled;
+  /** The entries of the batch being loaded */
+  QSet<KLFLib::entryId> pLoading;
+  /** Entries of \c pLoading that were invalidated meanwhile, their loaded preview is outdated */
+  QSet<KLFLib::entryId> pInvalidatedWhileLoading;
+
+  /** Incremented by clear() so that results of obsolete requests are ignored */
+  int pGeneration;
+
+  /** Loads the batches one at a time, in a single worker thread */
+  QThreadPool pPool;
+
+  void scheduleLoad();
+};
+
 
 /** \internal */
 class KLFLibModelCache
@@ -134,74 +218,138 @@ public:
     bool allChildrenFetched;
   };
   struct EntryNode : public Node {
-    EntryNode() : Node(EntryKind), entryid(-1), minimalist(false), entry()
+    EntryNode() : Node(EntryKind), entryid(-1), minimalist(false), entry(), sortKey(), sortKeyPropId(-1)
     {
       allChildrenFetched = true; // no children to fetch
     }
     EntryNode(const EntryNode& copy)
-      : Node(copy), entryid(copy.entryid), minimalist(copy.minimalist), entry(copy.entry) { }
+      : Node(copy), entryid(copy.entryid), minimalist(copy.minimalist), entry(copy.entry),
+	sortKey(copy.sortKey), sortKeyPropId(copy.sortKeyPropId) { }
 
     inline bool entryIsValid() const  { return allocated && parent != NodeId() && entryid >= 0; }
 
+    //! Call this when \c entry is changed
+    inline void invalidateSortKey() { sortKey.clear(); sortKeyPropId = -1; }
+
+    //! Entry nodes are indexed by entry ID in the EntryCache, see NodeCache::findNode()
+    typedef KLFLib::entryId KeyType;
+    inline KeyType key() const { return entryid; }
+
     KLFLib::entryId entryid;
     /** if TRUE, 'entry' only holds category/tags/datetime/latex/previewsize, no pixmap, no style. */
     bool minimalist;
     KLFLibEntry entry;
+    /** Collation key of the value of the property \c sortKeyPropId of \c entry, see
+     * KLFLibModelCache::nodeSortKey(). NULL if not computed yet. */
+    QSharedPointer<QCollatorSortKey> sortKey;
+    int sortKeyPropId;
   };
   struct CategoryLabelNode : public Node {
-    CategoryLabelNode() : Node(CategoryLabelKind), categoryLabel(), fullCategoryPath()  { }
+    CategoryLabelNode() : Node(CategoryLabelKind), categoryLabel(), fullCategoryPath(), fetchCursor(),
+			  sortKey()  { }
     CategoryLabelNode(const CategoryLabelNode& copy)
-      : Node(copy), categoryLabel(copy.categoryLabel), fullCategoryPath(copy.fullCategoryPath) { }
+      : Node(copy), categoryLabel(copy.categoryLabel), fullCategoryPath(copy.fullCategoryPath),
+	fetchCursor(copy.fetchCursor), sortKey(copy.sortKey) { }
+
+    //! Category label nodes are indexed by full category path, see NodeCache::findNode()
+    typedef QString KeyType;
+    inline KeyType key() const { return fullCategoryPath; }
+
     //! The last element in \ref fullCategoryPath eg. "General Relativity"
     QString categoryLabel;
     //! The full category path of this category eg. "Physics/General Relativity"
     QString fullCategoryPath;
+    /** \brief Where to continue querying the resource when fetching more children of this node.
+     *
+     * Invalid if no entries have been fetched by query yet. */
+    KLFLibResourceEngine::QueryCursor fetchCursor;
+    /** Collation key of \c categoryLabel, see KLFLibModelCache::nodeSortKey(). NULL if not
+     * computed yet. */
+    QSharedPointer<QCollatorSortKey> sortKey;
   };
 
+  /** A contiguous array of nodes of a given kind. Unlinked nodes leave a hole that is remembered in
+   * a free list, and is reused by the next insertNewNode(). Node indexes stay valid until clear();
+   * the cache is built anew, thus compact, by rebuildCache().
+   *
+   * In addition, the nodes are indexed by their \c key() (the entry ID or the full category path),
+   * so that findNode() does not need to walk the cache. The index is maintained by insertNewNode(),
+   * unlinkNode() and clear(): other ways of adding nodes don't index them.
+   *
+   * \warning Inserting nodes may reallocate the array, invalidating references to its nodes.
+   */
   template<class N>
-  class NodeCache : public QList<N> {
+  class NodeCache : public QVector<N> {
   public:
-    NodeCache() : QList<N>(), pContainsNonAllocated(false) { }
+    typedef typename N::KeyType KeyType;
 
-    inline bool isAllocated(IndexType i) { return QList<N>::at(i).allocated; }
+    NodeCache() : QVector<N>() { }
+
+    inline bool isAllocated(IndexType i) { return QVector<N>::at(i).allocated; }
 
     IndexType insertNewNode(const N& n) {
-      IndexType insertPos = QList<N>::size();
-      if (pContainsNonAllocated) {
-	// walk the cache, and find an invalid node
-	for (insertPos = 0; insertPos < QList<N>::size() && QList<N>::at(insertPos).allocated; ++insertPos)
-	  ;
-      }
-      if (insertPos == QList<N>::size()) {
-	pContainsNonAllocated = false;
+      IndexType insertPos;
+      if (!pFreeList.isEmpty()) {
+	// reuse the most recently freed slot
+	insertPos = pFreeList.last();
+	pFreeList.removeLast();
+	QVector<N>::operator[](insertPos) = n;
+      } else {
+	insertPos = QVector<N>::size();
 	this->append(n);
-	return insertPos;
       }
-      QList<N>::operator[](insertPos) = n;
+      pKeyIndex.insert(n.key(), insertPos);
       return insertPos;
     }
 
     /** \warning: you must check manually before calling this function that \c nid is right kind! */
     inline void unlinkNode(const NodeId& nid) { unlinkNode(nid.index); }
     void unlinkNode(IndexType index) {
-      N& node = QList<N>::operator[](index);
+      N& node = QVector<N>::operator[](index);
+      if (!node.allocated)
+	return; // already unlinked, don't free it twice
       node.allocated = false; // render invalid
-      pContainsNonAllocated = true;
+      pFreeList.append(index);
+      typename QHash<KeyType,IndexType>::iterator it = pKeyIndex.find(node.key());
+      if (it != pKeyIndex.end() && it.value() == index)
+	pKeyIndex.erase(it);
+    }
+
+    void clear() {
+      QVector<N>::clear();
+      pFreeList.clear();
+      pKeyIndex.clear();
+    }
+
+    /** Returns the index of the allocated node with the given \c key, or -1 if there is none. If
+     * several nodes were inserted with the same key, the one inserted last is returned.
+     *
+     * The caller should still check that the node is linked in the tree (valid parent). */
+    IndexType findNode(const KeyType& key) const {
+      typename QHash<KeyType,IndexType>::const_iterator it = pKeyIndex.find(key);
+      if (it == pKeyIndex.end())
+	return -1;
+      const N& node = QVector<N>::at(it.value());
+      if (!node.allocated || !(node.key() == key))
+	return -1;
+      return it.value();
     }
 
     /** \warning: you must check manually before calling this function that \c nid is right kind! */
     inline N takeNode(const NodeId& nid) { return takeNode(nid.index); }
     N takeNode(IndexType index) {
-      if (index < 0 || index >= QList<N>::size()) {
+      if (index < 0 || index >= QVector<N>::size()) {
 	qWarning()<<KLF_FUNC_NAME<<": invalid index="<<index;
 	return N();
       }
-      N node = QList<N>::at(index);
+      N node = QVector<N>::at(index);
       unlinkNode(index);
       return node;
     }
   private:
-    bool pContainsNonAllocated;
+    /** Indexes of the unallocated nodes */
+    QVector<IndexType> pFreeList;
+    QHash<KeyType,IndexType> pKeyIndex;
   };
 
   typedef NodeCache<EntryNode> EntryCache;
@@ -211,20 +359,24 @@ public:
   //                              of functions aborting their call eg. getNodeRef()
 
 
-  KLFLibModelCache(KLFLibModel * model)
-    : pModel(model)
-  {
-    pIsFetchingMore = false;
-
-    pLastSortPropId = KLFLibEntry::DateTime;
-    pLastSortOrder = Qt::DescendingOrder;
-  }
-
-  virtual ~KLFLibModelCache() { }
+  KLFLibModelCache(KLFLibModel * model);
+  virtual ~KLFLibModelCache();
 
   KLFLibModel *pModel;
 
+  /** Re-queries the resource and rebuilds the whole tree with a KLFLibModelCacheBuilder, then
+   * resets the model once. If the resource supports concurrent reads, the tree is built in a
+   * worker thread and this function returns right away; the current tree stays in place until
+   * rebuildFinished() swaps in the new one. */
   void rebuildCache();
+  /** Called from the event loop (see KLFLibModel::cacheRebuilt()) once the builder thread
+   * started by rebuildCache() has finished. */
+  void rebuildFinished();
+  /** Waits for the builder thread (if any) and discards its tree. */
+  void abortRebuild();
+  /** Aborts any rebuild and resets the model to an empty tree, eg. before building the tree of
+   * another resource. */
+  void clearTree();
 
   /** If row is negative, it will be looked up automatically.
    */
@@ -257,8 +409,38 @@ public:
    * If count is -1, uses pModel->fetchBatchCount(). */
   void ensureNotMinimalist(NodeId nodeId, int count = -1);
 
+  /** Returns the preview of the entry \c nodeId without fetching the full entry. If the node is
+   * minimalist, the preview is taken from the thumbnail loader. If it isn't loaded yet, a null
+   * image is returned and the previews of this entry and of its neighbours (up to the fetch batch
+   * count) are scheduled for loading; thumbnailsLoaded() is then called. */
+  QImage entryPreview(NodeId nodeId);
+
+  /** Emits dataChanged() for the given entries, whose previews have been loaded. */
+  void thumbnailsLoaded(const QList<KLFLib::entryId>& eids);
+
+  KLFLibThumbnailLoader *pThumbnailLoader;
+
+  /** Folded search texts of the nodes, see searchNodeMatches() */
+  KLFLibModelSearchIndex *pSearchIndex;
+
   bool canFetchMore(NodeId parentId);
+  /** Queries the resource right away for the next children of \c parentId. */
   void fetchMore(NodeId parentId, int batchCount = -1);
+  /** Same as fetchMore(), but if the resource supports
+   * \ref KLFLibResourceEngine::FeatureConcurrentRead, the children are queried in the background
+   * with \ref KLFLibResourceEngine::queryAsync() and appended when they arrive. */
+  void fetchMoreAsync(NodeId parentId);
+  /** Whether children of \c parentId are being fetched by fetchMoreAsync() */
+  bool isFetchJobPending(NodeId parentId) const;
+  /** Called (through KLFLibModel) with the results of a query job started by fetchMoreAsync() */
+  void fetchJobResultsAvailable(KLFLibResourceQueryJob *job, const KLFLibResourceEngine::QueryResult& batch);
+  void fetchJobFinished(KLFLibResourceQueryJob *job, bool success);
+  /** Cancels the fetch of \c parentId started by fetchMoreAsync(), if any */
+  void cancelFetchJob(NodeId parentId);
+  /** Cancels all fetches started by fetchMoreAsync(). Must be called before changing the tree in
+   * a way that the results of a pending fetch would no longer follow the fetched children of their
+   * category. */
+  void cancelFetchJobs();
 
   void updateData(const QList<KLFLib::entryId>& entryIdList, int modifyType);
 
@@ -281,6 +463,31 @@ public:
    * future search. */
   EntryNode treeTakeEntry(const NodeId& e, bool notifyQtApi = true);
 
+  /** Inserts several new entry nodes at their sorted positions, like treeInsertEntry(). The views
+   * are notified with one beginInsertRows()/endInsertRows() per run of contiguous new rows in each
+   * category, rather than once per entry. */
+  void treeInsertEntries(const QList<EntryNode>& entrynodes);
+
+  /** Removes several entry nodes from the tree, like treeTakeEntry(). The views are notified with
+   * one beginRemoveRows()/endRemoveRows() per run of contiguous rows in each category. Category
+   * labels that become empty are removed too. */
+  void treeRemoveEntries(const QList<NodeId>& nodeids);
+
+  /** Replaces the entry of node \c n by \c newentry, and moves the node to its new position in the
+   * tree with beginMoveRows()/endMoveRows() if its category or sort key changed, so that the
+   * persistent indexes (eg. the selection) follow the entry. Creates the new category label and
+   * removes the old one if it becomes empty, as needed. */
+  void treeChangeEntry(NodeId n, const KLFLibEntry& newentry);
+
+  /** Removes category label \c catid if it has no children, and then its parent if it is empty in
+   * turn, etc. The root node is never removed. */
+  void treeRemoveEmptyCategory(NodeId catid);
+
+  /** Re-sorts all categories in place, emitting layoutChanged(), provided that all children of all
+   * categories have been fetched. Returns FALSE (and does nothing) otherwise, in which case the
+   * resource has to be queried again in the new order (see rebuildCache()). */
+  bool resortInPlace();
+
   /** emits QAbstractItemModel-appropriate signals and updates indexes if \c notifyQtApi is true.
    *
    * If \c newlyCreatedAreChildrenFetched is TRUE, then any newly created CategoryLabelNode will have its
@@ -312,10 +519,55 @@ public:
   /** If node is a category label, then \c propId is ignored. */
   QString nodeValue(NodeId node, int propId = KLFLibEntry::Latex);
 
+  /** Returns the collation key of nodeValue(\c node, \c propId), so that comparing the keys of two
+   * nodes is equivalent to a locale-aware comparison of their values. The key is computed once and
+   * stored in the node, so that sorting doesn't need to build and collate strings for every
+   * comparison.
+   *
+   * \warning The returned reference is valid until the next node is inserted in the cache. */
+  const QCollatorSortKey& nodeSortKey(NodeId node, int propId);
+
+  /** Returns the text in which the search bar looks for the query string: the category label for
+   * a category label node; the latex code and the tags, and the category in non-category-tree mode,
+   * separated by newlines for an entry node. */
+  QString nodeSearchText(NodeId node);
+
+  /** Lets searchFindNode() know that a search was interrupted by the user. */
+  class SearchInterrupt
+  {
+  public:
+    virtual ~SearchInterrupt() { }
+    /** Called from time to time by searchFindNode(), after the application's events have been
+     * processed. \c curNode is the last node that was looked at. Return TRUE to stop the search. */
+    virtual bool searchInterrupted(NodeId curNode) = 0;
+  };
+
   /** returns TRUE if the node \c nodeId matches the search query defined by \c searchString and
-   * case-sensitivity \c cs. */
+   * case-sensitivity \c cs.
+   *
+   * The node is looked up in the search index (see KLFLibModelSearchIndex). Accents are ignored if
+   * \c klfconfig.LibraryBrowser.searchIgnoresAccents is set. */
   bool searchNodeMatches(const NodeId& nodeId, const QString& searchString, Qt::CaseSensitivity cs);
 
+  /** Returns the next node after \c from (or before it, if \c forward is FALSE) in the order nodes
+   * are displayed in, that matches \c searchString with case-sensitivity \c cs. Fetches more
+   * children as needed.
+   *
+   * If \c from is invalid the search starts at the first (resp. last) node. Returns an invalid node
+   * if no match was found until the last (resp. first) node; this is the same as stepping with
+   * nextNode() (resp. prevNode()), but the walk keeps track of the rows instead of looking each node
+   * up in its parent.
+   *
+   * While walking, the application's events are processed from time to time to keep the GUI
+   * responsive, after which \c interrupt (if non-NULL) is asked whether the search should be
+   * stopped. An interrupted search returns an invalid node. */
+  NodeId searchFindNode(NodeId from, bool forward, const QString& searchString, Qt::CaseSensitivity cs,
+			SearchInterrupt *interrupt = NULL);
+
+  /** Deletes \c entrySorter, which the model no longer uses. If the cache is being rebuilt, the
+   * sorter is deleted only once the rebuild is finished, as the builder threads use it. */
+  void disposeEntrySorter(KLFLibEntrySorter *entrySorter);
+
   /** Remembers the given sort parameters, but does NOT update anything. */
   void setSortingBy(int propId, Qt::SortOrder order)
   {
@@ -364,6 +616,8 @@ public:
   void dumpNodeTree(NodeId node, int indent = 0);
 
 private:
+  friend class KLFLibModelSearchIndex;
+
   EntryCache pEntryCache;
   CategoryLabelCache pCategoryLabelCache;
 
@@ -389,22 +643,206 @@ private:
   }
 
   bool pIsFetchingMore;
+  /** Query jobs started by fetchMoreAsync(), by category label node index */
+  QHash<IndexType,KLFLibResourceQueryJob*> pFetchJobs;
+  /** The query to fetch the next children of \c noderef */
+  KLFLibResourceEngine::Query fetchMoreQuery(const CategoryLabelNode& noderef);
+  /** Appends the entries of \c qr to the children of \c n, notifying the views */
+  void appendFetchedEntries(NodeId n, const KLFLibResourceEngine::QueryResult& qr, int limit);
+
+  /** TRUE while a new tree is being built in \c pBuilder */
+  bool pIsRebuilding;
+  /** The builder thread started by rebuildCache(), NULL if none is running */
+  KLFLibModelCacheBuilder *pBuilder;
+  /** Reports the progress of rebuildCache(), until the new tree is installed */
+  KLFProgressReporter *pRebuildProgress;
+  /** Swaps in the tree built by \c builder, with a single model reset, and deletes it */
+  void installTree(KLFLibModelCacheBuilder *builder);
+  /** Set by updateData() when the resource changed while the cache was being rebuilt, or by
+   * resortInPlace() when the sorting changed meanwhile */
+  bool pRebuildPending;
+  /** Entry sorters replaced while the cache was being rebuilt, see disposeEntrySorter() */
+  QList<KLFLibEntrySorter*> pDisposedEntrySorters;
+
+  /** Used to compute the nodes' sort keys */
+  QCollator pCollator;
 
   int pLastSortPropId;
   Qt::SortOrder pLastSortOrder;
 
+  /** A position in the walk of searchFindNode(): the parent node and the row of the current node
+   * in it. */
+  typedef QPair<NodeId,int> SearchWalkStep;
+  /** Makes sure that the child at \c row of category \c parentid is fetched. Returns FALSE if
+   * there is no such child. */
+  bool searchWalkFetchRow(NodeId parentid, int row);
+  /** Returns the walk path from the root node to node \c n, see searchFindNode(). */
+  QVector<SearchWalkStep> searchWalkPathTo(NodeId n);
+  void searchWalkDescendLast(QVector<SearchWalkStep> *path, NodeId n);
+  void searchWalkStep(QVector<SearchWalkStep> *path, bool forward);
+
   KLF_DEBUG_DECLARE_ASSIGNABLE_REF_INSTANCE() ;
 };
 
 
+/** \internal
+ *
+ * Search index of the nodes of a \ref KLFLibModelCache, so that the search bar doesn't build and
+ * compare the latex, tags and category strings of every node it walks by, for every key stroke.
+ *
+ * For each node, the index keeps its search text (KLFLibModelCache::nodeSearchText()) folded
+ * with foldString(), ie. lower-cased and without accents, and the trigrams (three consecutive
+ * characters) of all folded texts. When the query changes, the nodes whose text contains all the
+ * trigrams of the query, and then the query itself, are collected once; matching a node is then a
+ * lookup in this set. These nodes are a superset of the nodes that match the query with any case
+ * sensitivity, with or without accents (see KLFLibModelCache::searchNodeMatches()).
+ *
+ * Nodes are indexed on demand, and in the background (a chunk per event loop iteration): all of
+ * them after the cache has been rebuilt, and only the new ones after more nodes were fetched or
+ * inserted. An indexed node is checked to be the one it was indexed as (same entry ID, resp. same
+ * category path) before being used, since the node caches reuse the slots of removed nodes; a node
+ * whose entry changed must be invalidate()d.
+ */
+class KLFLibModelSearchIndex : public QObject
+{
+  Q_OBJECT
+public:
+  typedef KLFLibModelCache::NodeId NodeId;
+  typedef KLFLibModelCache::UIDType UIDType;
+
+  KLFLibModelSearchIndex(KLFLibModelCache *cache);
+  virtual ~KLFLibModelSearchIndex();
+
+  /** Returns \c s decomposed and without its combining marks, ie. without accents. */
+  static QString stripAccents(const QString& s);
+  /** Returns \c s without accents (see stripAccents()) and case-folded. */
+  static QString foldString(const QString& s);
+
+  /** Returns TRUE if the folded search text of node \c n contains the folded \c queryString. */
+  bool matches(const NodeId& n, const QString& queryString);
+
+  /** Forgets the indexed text of node \c n, eg. because its entry changed. */
+  void invalidate(const NodeId& n);
+  /** Forgets all nodes, eg. because the cache was rebuilt. */
+  void clear();
+  /** (Re-)indexes all nodes of the cache in the background. */
+  void scheduleIndexing();
+  /** Indexes the given nodes in the background, eg. because they were just fetched. */
+  void scheduleIndexing(const QList<NodeId>& nodes);
+
+private slots:
+  void indexSome();
+
+private:
+  KLFLibModelCache *pCache;
+
+  struct Item {
+    Item() : entryid(-1) { }
+    /** The entry ID of an entry node, or -1 */
+    KLFLib::entryId entryid;
+    /** The full category path of a category label node */
+    QString categoryPath;
+    /** The folded search text */
+    QString text;
+  };
+  QHash<UIDType, Item> pItems;
+  /** The nodes whose text contains a given trigram, see trigramKey() */
+  QHash<quint64, QSet<UIDType> > pTrigrams;
+
+  bool pHasQuery;
+  QString pQueryString;
+  QString pFoldedQuery;
+  /** TRUE if the folded query is long enough to have trigrams, in which case \c pCandidates is
+   * the set of nodes whose text contains the query */
+  bool pQueryHasTrigrams;
+  QSet<UIDType> pCandidates;
+
+  /** Position of indexSome() in the entry cache followed by the category label cache, or -1 if
+   * all nodes were scanned since the last call to scheduleIndexing() */
+  int pIndexCursor;
+  /** Nodes given to scheduleIndexing(const QList<NodeId>&) that are yet to be indexed */
+  QList<NodeId> pIndexQueue;
+  bool pIndexScheduled;
+
+  void startIndexing();
+
+  static inline quint64 trigramKey(const QChar *c)
+  {
+    return ((quint64)c[0].unicode() << 32) | ((quint64)c[1].unicode() << 16) | (quint64)c[2].unicode();
+  }
+  static QSet<quint64> trigrams(const QString& text);
+
+  void setQuery(const QString& queryString);
+  /** Indexes node \c n if it isn't, or if it was indexed as another node. Returns the index item,
+   * valid until the next node is indexed, or NULL if \c n isn't a node of the tree. */
+  const Item *indexNode(const NodeId& n);
+  void removeItem(UIDType uid);
+};
+
+
+/** \internal
+ *
+ * Builds a new tree for KLFLibModelCache::rebuildCache() in a separate pair of node caches, which
+ * the model cache then swaps in with a single model reset.
+ *
+ * build() only reads the resource and the parameters given to the constructor; it does not touch
+ * the model nor the model cache. It can thus run in this thread (see run()) if the resource supports
+ * \ref KLFLibResourceEngine::FeatureConcurrentRead.
+ *
+ * The sort keys of the nodes are computed and the children of each category are sorted using the
+ * global QThreadPool.
+ */
+class KLFLibModelCacheBuilder : public QThread
+{
+public:
+  /** The flavor flags and the sort parameters are copied, so that they may change while the
+   * tree is being built. The \c entrySorter must stay alive until the builder is done, see
+   * KLFLibModelCache::disposeEntrySorter(). */
+  KLFLibModelCacheBuilder(KLFLibResourceEngine *resource, uint flavorFlags, int fetchBatchCount,
+			  const KLFLibEntrySorter *entrySorter, int sortPropId, Qt::SortOrder sortOrder);
+  virtual ~KLFLibModelCacheBuilder() { }
+
+  /** Queries the resource and builds \c entryCache and \c categoryLabelCache. */
+  void build();
+
+  KLFLibModelCache::EntryCache entryCache;
+  KLFLibModelCache::CategoryLabelCache categoryLabelCache;
+  /** All category paths that were encountered, for the category suggestion cache */
+  QStringList categories;
+
+protected:
+  virtual void run() { build(); }
+
+private:
+  KLFLibResourceEngine *pResource;
+  uint pFlavorFlags;
+  int pFetchBatchCount;
+  /** only KLFLibEntrySorter::entryValue() is called, from this thread and from pool threads. */
+  const KLFLibEntrySorter *pEntrySorter;
+  /** KLFLibEntrySorter::propId() and order() at construction time */
+  int pSortKeyPropId;
+  bool pSortAscending;
+  int pSortPropId;
+  Qt::SortOrder pSortOrder;
+
+  KLFLibModelCache::IndexType createCategoryLabel(const QStringList& catelements);
+  void computeSortKeys();
+  void sortChildren(QList<KLFLibModelCache::NodeId> *children);
+};
+
+
 // -----------------------------------------
 
 
-class KLFLibViewSearchable : public KLFIteratorSearchable<QModelIndex>
+class KLFLibViewSearchable : public KLFIteratorSearchable<QModelIndex>,
+			     public KLFLibModelCache::SearchInterrupt
 {
   KLFLibDefaultView *v;
   inline KLFLibModel *m() { return v->pModel; }
 
+  /** The current search position, see searchIterFindNext() */
+  SearchIterator pSearchPos;
+
 public:
   KLFLibViewSearchable(KLFLibDefaultView *view)
     : v(view)
@@ -450,6 +888,55 @@ public:
     return KLF_DEBUG_TEE( m()->pCache->searchNodeMatches(n, queryString, cs) ) ;
   }
 
+  virtual SearchIterator searchIterFind(const SearchIterator& startPos, const QString& queryString, bool forward)
+  {
+    KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
+    Q_UNUSED(queryString) ;
+    pSearchPos = startPos;
+    return searchIterFindNext(forward);
+  }
+
+  /** Reimplemented to let the model cache walk straight to the next match with
+   * KLFLibModelCache::searchFindNode(), instead of creating an index for every node on the way. */
+  virtual SearchIterator searchIterFindNext(bool forward)
+  {
+    KLF_DEBUG_TIME_BLOCK(KLF_FUNC_NAME) ;
+    KLF_ASSERT_NOT_NULL(m(), "Model is NULL!", return QModelIndex() ) ;
+    KLF_ASSERT_NOT_NULL(m()->pCache, "Model Cache is NULL!", return QModelIndex() ) ;
+
+    QString queryString = searchQueryString();
+    if (queryString.isEmpty()) {
+      klfDbg("empty search query string.") ;
+      pSearchPos = searchIterEnd();
+    } else {
+      Qt::CaseSensitivity cs = Qt::CaseInsensitive;
+      if (queryString.contains(QRegExp("[A-Z]")))
+	cs = Qt::CaseSensitive;
+      KLFLibModelCache *cache = m()->pCache;
+      KLFLibModelCache::NodeId n = cache->searchFindNode(cache->getNodeForIndex(pSearchPos), forward,
+							 queryString, cs, this);
+      if (!n.valid() && searchHasInterruptRequested()) {
+	// interrupted: searchInterrupted() kept the position at which the search was stopped
+	searchPerformed(searchIterEnd());
+	return searchIterEnd();
+      }
+      pSearchPos = cache->createIndexFromId(n, -1, 0);
+    }
+    searchPerformed(pSearchPos);
+    return pSearchPos;
+  }
+
+  /** Reimplemented from KLFLibModelCache::SearchInterrupt to remember where the search was
+   * stopped and to honor searchHasInterruptRequested(). */
+  virtual bool searchInterrupted(KLFLibModelCache::NodeId curNode)
+  {
+    if (!searchHasInterruptRequested())
+      return false;
+    klfDbg("interrupting...") ;
+    pSearchPos = m()->pCache->createIndexFromId(curNode, -1, 0);
+    return true;
+  }
+
   virtual void searchMoveToIterPos(const SearchIterator& pos)
   {
     KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
@@ -823,18 +1310,27 @@ protected:
   bool pInEventFilter;
 };
 
-/** \internal */
-class KLFLibDefListView : public QListView, public KLFLibDefViewCommon
+/** \internal
+ *
+ * The icon view of KLFLibDefaultView.
+ *
+ * Unlike QListView in icon mode, this view doesn't store a position for each item. The items are
+ * placed on lines of equal cells (rows with a \ref QListView::LeftToRight flow, columns with a
+ * \ref QListView::TopToBottom flow), the cell size along the flow being given by the preview size
+ * of the view. An item's line and position in the line is thus computed from its row; the only
+ * layout data is the offset of each line, which is the sum of the thicknesses of the lines before
+ * it, ie. the largest item size hint (which comes from the \ref KLFLibEntry::PreviewSize of
+ * the minimalist entries) across the flow.
+ *
+ * Lines are laid out incrementally as rows are appended by fetchMore(), and only the visible
+ * items are painted.
+ */
+class KLFLibDefIconView : public QAbstractItemView, public KLFLibDefViewCommon
 {
   Q_OBJECT
 public:
-  KLFLibDefListView(KLFLibDefaultView *parent)
-    : QListView(parent), KLFLibDefViewCommon(parent), inPaintEvent(false), pInEventFilter(false),
-      pInitialLayoutDone(false), pWantRelayout(true)
-  {
-    installEventFilter(this);
-    viewport()->installEventFilter(this);
-  }
+  KLFLibDefIconView(KLFLibDefaultView *parent);
+  virtual ~KLFLibDefIconView() { }
 
   virtual bool eventFilter(QObject *object, QEvent *event) {
     if (pInEventFilter)
@@ -848,37 +1344,38 @@ public:
     } else if (event->type() == QEvent::Drop) {
       eat = evDrop((QDropEvent*)event, eventPos(object, (QDragEnterEvent*)event));
     }
-    //    if (object == this && event->type() == QEvent::Paint)
-    //      preparePaintEvent((QPaintEvent*)event);
     pInEventFilter = false;
     if (eat)
       return eat;
-    return QListView::eventFilter(object, event);
-  }
-  virtual void setModel(QAbstractItemModel *model) {
-    if ( setTheModel(model) ) {
-      QListView::setModel(model);
-    }
+    return QAbstractItemView::eventFilter(object, event);
   }
+  virtual void setModel(QAbstractItemModel *model);
 
+  QListView::Flow flow() const { return pFlow; }
+  void setFlow(QListView::Flow flow);
+
+  int spacing() const { return pSpacing; }
+  void setSpacing(int spacing);
 
   void forceRelayout() {
-    scheduleDelayedItemsLayout(); // force a re-layout
+    invalidateLayout();
+    scheduleDelayedItemsLayout();
   }
-  
+
   virtual void modelInitialized() {
     klfDbg("scheduling an items layout...");
-    if (isVisible()) {
-      scheduleDelayedItemsLayout();
-      pInitialLayoutDone = true;
-    } else {
-      pInitialLayoutDone = false;
-    }
+    forceRelayout();
   }
 
+  virtual QRect visualRect(const QModelIndex& index) const;
+  virtual void scrollTo(const QModelIndex& index, ScrollHint hint = EnsureVisible);
+  virtual QModelIndex indexAt(const QPoint& point) const;
+
+  virtual void doItemsLayout();
+  virtual void reset();
+
 protected:
   virtual QModelIndexList commonSelectedIndexes() const { return selectedIndexes(); }
-  //  virtual void commonInternalDrag(Qt::DropActions a) { internalDrag(a); }
   virtual QAbstractItemView *thisView() { return this; }
   virtual const QAbstractItemView *thisConstView() const { return this; }
   virtual QPoint scrollOffset() const { return QPoint(horizontalOffset(), verticalOffset()); }
@@ -887,31 +1384,69 @@ protected:
     return eventPosBase(object, event, horizontalOffset(), verticalOffset());
   }
 
-  bool inPaintEvent;
-  virtual void paintEvent(QPaintEvent *event) {
-    QListView::paintEvent(event);
-  }
-
-  bool pInEventFilter;
-  bool pInitialLayoutDone;
-
   virtual void startDrag(Qt::DropActions supportedActions) {
     commonStartDrag(supportedActions);
   }
 
-  virtual void showEvent(QShowEvent *event) {
-    if (!event->spontaneous()) {
-      klfDbg("Show event! initialLayoutDone="<<pInitialLayoutDone<<"; size hint="<<sizeHint());
-      if (!pInitialLayoutDone) {
-	scheduleDelayedItemsLayout();
-	pInitialLayoutDone = true;
-      }
-    }
-    QListView::showEvent(event);
-  }
-  
-  bool pWantRelayout;
+  virtual QModelIndex moveCursor(CursorAction cursorAction, Qt::KeyboardModifiers modifiers);
+  virtual int horizontalOffset() const { return horizontalScrollBar()->value(); }
+  virtual int verticalOffset() const { return verticalScrollBar()->value(); }
+  virtual bool isIndexHidden(const QModelIndex& /*index*/) const { return false; }
+  virtual void setSelection(const QRect& rect, QItemSelectionModel::SelectionFlags command);
+  virtual QRegion visualRegionForSelection(const QItemSelection& selection) const;
+
+  virtual void paintEvent(QPaintEvent *event);
+  virtual void resizeEvent(QResizeEvent *event);
+  virtual void updateGeometries();
+
+protected slots:
+  virtual void rowsInserted(const QModelIndex& parent, int start, int end);
+  virtual void rowsAboutToBeRemoved(const QModelIndex& parent, int start, int end);
+  virtual void dataChanged(const QModelIndex& topLeft, const QModelIndex& bottomRight,
+			   const QVector<int>& roles = QVector<int>());
+
+private slots:
+  void modelRowsRemoved(const QModelIndex& parent, int start, int end);
+  void modelRowsMoved(const QModelIndex& parent, int start, int end,
+		      const QModelIndex& destination, int row);
+
+private:
+  QListView::Flow pFlow;
+  int pSpacing;
+  bool pInEventFilter;
 
+  /** The offset across the flow of each line that was laid out, followed by the end of the last
+   * line. Never empty: the first line starts at pSpacing. */
+  mutable QVector<int> pLineOffsets;
+  /** Number of model rows that are laid out in \c pLineOffsets */
+  mutable int pLaidOutCount;
+  /** Number of items per line, or zero if it must be computed again */
+  mutable int pItemsPerLine;
+  /** The cell size along the flow, including spacing */
+  mutable int pCellLength;
+
+  inline bool isLeftToRight() const { return pFlow == QListView::LeftToRight; }
+  /** Returns the coordinate along the flow of \c p */
+  inline int along(const QPoint& p) const { return isLeftToRight() ? p.x() : p.y(); }
+  /** Returns the coordinate across the flow of \c p */
+  inline int across(const QPoint& p) const { return isLeftToRight() ? p.y() : p.x(); }
+  inline int along(const QSize& s) const { return isLeftToRight() ? s.width() : s.height(); }
+  inline int across(const QSize& s) const { return isLeftToRight() ? s.height() : s.width(); }
+  inline QPoint offset() const { return QPoint(horizontalOffset(), verticalOffset()); }
+
+  int itemCount() const;
+  QSize itemSize(const QStyleOptionViewItem& option, int row) const;
+  /** Forgets the layout of the lines from the one containing \c row */
+  void invalidateLayout(int row = 0);
+  /** Lays out the lines that are not laid out */
+  void ensureLayout() const;
+  /** Returns the line at position \c pos across the flow, or -1 */
+  int lineAt(int pos) const;
+  /** Returns the rectangle of the item at \c row, in contents coordinates */
+  QRect itemRect(const QStyleOptionViewItem& option, int row) const;
+  /** Returns the first and the last row whose line intersects \c rect (in contents coordinates).
+   * Returns FALSE if there is none. */
+  bool rowsInRect(const QRect& rect, int *first, int *last) const;
 };
 
 
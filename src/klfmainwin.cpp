@@ -296,6 +296,8 @@ KLFMainWin::KLFMainWin()
 	  this, SLOT(restoreFromLibrary(const KLFLibEntry&, uint)));
   connect(d->mLibBrowser, SIGNAL(requestRestoreStyle(const KLFStyle&)),
 	  this, SLOT(slotLoadStyle(const KLFStyle&)));
+  connect(d->mLibBrowser, SIGNAL(requestExportEntriesToFiles(const KLFLibEntryList&)),
+	  this, SLOT(exportLibEntriesToFiles(const KLFLibEntryList&)));
   connect(d->mLatexSymbols, SIGNAL(insertSymbol(const KLFLatexSymbol&)),
 	  this, SLOT(insertSymbol(const KLFLatexSymbol&)));
 
@@ -470,6 +472,9 @@ KLFMainWin::KLFMainWin()
 
   // ADDITIONAL SETUP
 
+  klfconfig.BackendSettings.tempDir.connectQObjectSlot(d, "slotTempDirChanged");
+  klfconfig.ExportData.tempFilesMaxSize.connectQObjectSlot(d, "slotTempFilesMaxSizeChanged");
+
 #ifdef KLF_WS_MAC
   klfDbg("Mac OS X main win features setup") ;
 
@@ -600,6 +605,9 @@ KLFMainWin::~KLFMainWin()
   }
   klfDbg("mime datas flushed.");
 
+  // don't leave more temporary files behind than allowed by the settings
+  KLFTempArtifactStore::defaultStore()->cleanUp();
+
 
   klfDbg("about to save settings etc.");
 
@@ -1141,7 +1149,7 @@ void KLFMainWin::loadLibrary()
     klfDbg("Importing library from "<<importfname) ;
 
     // visual feedback for import
-    KLFProgressDialog pdlg(QString(), this);
+    KLFProgressDialog pdlg(true, QString(), this);
     connect(d->mHistoryLibResource, SIGNAL(operationStartReportingProgress(KLFProgressReporter *,
 									   const QString&)),
 	    &pdlg, SLOT(startReportingProgress(KLFProgressReporter *)));
@@ -1174,18 +1182,22 @@ void KLFMainWin::loadLibrary()
 	pdlg.setDescriptiveText(tr("Importing Library from previous version of KLatexFormula ... "
 				   "%3 (%1/%2)")
 				.arg(j+1).arg(subResList.size()).arg(subResList[j]));
-	QList<KLFLibResourceEngine::KLFLibEntryWithId> allentries
-	  = importres->allEntries(subres);
-	klfDbg("Got "<<allentries.size()<<" entries from sub-resource "<<subres);
-	int k;
-	KLFLibEntryList insertentries;
-	for (k = 0; k < allentries.size(); ++k) {
-	  insertentries << allentries[k].entry;
-	}
 	if ( ! d->mHistoryLibResource->hasSubResource(subres) ) {
 	  d->mHistoryLibResource->createSubResource(subres);
 	}
-	d->mHistoryLibResource->insertEntries(subres, insertentries);
+	// copy the entries in batches, passing the preview PNG data through as is
+	KLFLibResourceCopyJob *job = importres->copyEntriesAsync(subres, d->mHistoryLibResource, subres);
+	if (job == NULL)
+	  continue;
+	connect(&pdlg, SIGNAL(canceled()), job, SLOT(cancel()));
+	// the progress dialog is modal, let the user reach its cancel button
+	job->waitForFinished(QEventLoop::AllEvents);
+	klfDbg("Copied "<<job->copiedCount()<<" entries from sub-resource "<<subres
+	       <<"; failed: "<<job->failedCount());
+	bool canceled = job->isCanceled();
+	delete job;
+	if (canceled)
+	  break;
       }
     }
   }
@@ -3020,6 +3032,12 @@ void KLFMainWin::slotEvaluate()
 
   // this accounts for both user script configuration and overriding of bbox margins
   KLFBackend::klfSettings settings = currentSettings();
+  // the HTML exporters embed the image at this resolution, directly or through a temporary
+  // file. If the formula is going to be copied or dragged as HTML, have the backend render it
+  // along; otherwise the HTML exporters rescale the result image if they are ever used.
+  int htmldpi = klfconfig.ExportData.htmlExportDpi;
+  if (htmldpi > 0 && htmldpi != input.dpi && d->copyDragProfilesExportHtml())
+    settings.extraRasterDpis << htmldpi;
 
   // ****  and GO !
   d->output = KLFBackend::getLatexFormula(input, settings);
@@ -3869,10 +3887,27 @@ void KLFMainWin::slotSave(const QString& suggestfname)
 
     klfDbg( "Saving using exporter `" << exporter->exporterName() << "' with format `" << formatname << "'" ) ;
 
-    QByteArray data = exporter->getData(formatname, d->output);
+    // export in the background, so that the window stays responsive with slow exporters
+    KLFExporterJob * job = exporter->getDataAsync(formatname, d->output);
+    if (job->isRunning()) {
+      KLFProgressDialog pdlg(true, tr("Exporting data for saving to %1 ...").arg(fi.fileName()), this);
+      pdlg.setRange(0, 0);
+      connect(&pdlg, SIGNAL(canceled()), job, SLOT(cancel()));
+      // the progress dialog is modal, so that the user can only reach its cancel button
+      pdlg.show();
+      job->waitForFinished(QEventLoop::AllEvents);
+    }
+    QByteArray data = job->data();
+    bool canceled = job->isCanceled();
+    QString errorString = job->errorString();
+    delete job;
+    if (canceled) {
+      klfDbg("Export canceled by user.") ;
+      return;
+    }
     if (data.isEmpty()) {
       QMessageBox::critical(this, tr("Error saving file"),
-                            tr("Error exporting the data: %1").arg(exporter->errorString()));
+                            tr("Error exporting the data: %1").arg(errorString));
       return;
     }
     {
@@ -3896,6 +3931,211 @@ void KLFMainWin::slotSave(const QString& suggestfname)
                         tr("Internal error: can't determine save format"));
 }
 
+
+KLFLibEntryBatchExporter::KLFLibEntryBatchExporter(const QString& format, QObject *parent)
+  : QObject(parent), pFormat(format), pCanceled(0), pDoneCount(0), pFinished(false), pElapsedMs(0)
+{
+}
+
+KLFLibEntryBatchExporter::~KLFLibEntryBatchExporter()
+{
+  // the running tasks access our items, wait for them
+  pCanceled.storeRelease(1);
+  pPool.clear();
+  pPool.waitForDone();
+}
+
+void KLFLibEntryBatchExporter::start()
+{
+  KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
+
+  pTimer.start();
+
+  if (pItems.isEmpty()) {
+    setFinished();
+    return;
+  }
+
+  int k;
+  for (k = 0; k < pItems.size(); ++k) {
+    pPool.start(new KLFLibEntryBatchExportTask(this, k));
+  }
+}
+
+void KLFLibEntryBatchExporter::cancel()
+{
+  if (pFinished) {
+    return;
+  }
+  klfDbg("Canceling batch export after "<<pDoneCount<<" of "<<pItems.size()<<" items.") ;
+  pCanceled.storeRelease(1);
+  pPool.clear();
+  setFinished();
+}
+
+void KLFLibEntryBatchExporter::itemDone(int index, const QString& errorString)
+{
+  if (pFinished) {
+    return;
+  }
+
+  ++pDoneCount;
+  if (!errorString.isEmpty()) {
+    klfWarning("Failed to export "<<pItems[index].fileName<<": "<<errorString) ;
+    pErrors << QString("%1: %2").arg(QFileInfo(pItems[index].fileName).fileName()).arg(errorString);
+  }
+
+  emit progress(pDoneCount);
+
+  if (pDoneCount == pItems.size()) {
+    setFinished();
+  }
+}
+
+void KLFLibEntryBatchExporter::setFinished()
+{
+  pFinished = true;
+  pElapsedMs = pTimer.elapsed();
+  emit finished();
+}
+
+// static
+QString KLFLibEntryBatchExporter::exportItem(const Item& item, const QString& format)
+{
+  KLFBackend::klfOutput output = KLFBackend::getLatexFormula(item.input, item.settings, false);
+  if (output.status == KLFERR_GSPOSTPROC_NOOUTLINEFONTS) {
+    // same as in slotEvaluate(): re-run without font outlines
+    KLFBackend::klfSettings settings = item.settings;
+    settings.outlineFonts = false;
+    output = KLFBackend::getLatexFormula(item.input, settings, false);
+  }
+  if (output.status != KLFERR_NOERROR) {
+    if (output.status == KLFERR_PROGERR_LATEX) {
+      return KLFProgErr::extractLatexError(output.errorstr);
+    }
+    return output.errorstr;
+  }
+
+  QString err;
+  if (!KLFBackend::saveOutputToFile(output, item.fileName, format, &err)) {
+    if (err.isEmpty()) {
+      err = QObject::tr("Can't save to file %1").arg(item.fileName);
+    }
+    return err;
+  }
+  return QString();
+}
+
+void KLFLibEntryBatchExportTask::run()
+{
+  if (pExporter->isCanceled()) {
+    return;
+  }
+
+  QString err = KLFLibEntryBatchExporter::exportItem(pExporter->pItems.at(pIndex), pExporter->pFormat);
+
+  QMetaObject::invokeMethod(pExporter, "itemDone", Qt::QueuedConnection,
+                            Q_ARG(int, pIndex), Q_ARG(QString, err));
+}
+
+
+void KLFMainWin::exportLibEntriesToFiles(const KLFLibEntryList& entries)
+{
+  KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
+
+  if (entries.isEmpty()) {
+    return;
+  }
+
+  // application-long persistent format choice
+  static QString lastformat = QLatin1String("PNG");
+
+  QStringList formats = KLFBackend::availableSaveFormats((const KLFBackend::klfOutput*)NULL);
+  bool ok = false;
+  QString format = QInputDialog::getItem(this, tr("Export Equations"),
+                                         tr("Save %n equation(s) in format:", "", entries.size()),
+                                         formats, qMax(0, formats.indexOf(lastformat)), false, &ok);
+  if (!ok || format.isEmpty()) {
+    klfDbg("Aborted by user.") ;
+    return;
+  }
+  lastformat = format;
+
+  QString dirName = QFileDialog::getExistingDirectory(this, tr("Export Equations to Directory"),
+                                                      klfconfig.UI.lastSaveDir);
+  if (dirName.isEmpty()) {
+    klfDbg("Aborted by user.") ;
+    return;
+  }
+  klfconfig.UI.lastSaveDir = dirName;
+  QDir dir(dirName);
+
+  QString ext = format.toLower();
+  int numWidth = QString::number(entries.size()).length();
+
+  KLFLibEntryBatchExporter exporter(format);
+
+  int k;
+  for (k = 0; k < entries.size(); ++k) {
+    const KLFLibEntry& entry = entries[k];
+
+    KLFLibEntryBatchExporter::Item item;
+    item.input = d->inputForStyle(entry.latex(), entry.style());
+    item.settings = d->settingsForStyle(entry.style(), item.input);
+
+    QString slug = item.input.latex.simplified();
+    slug.replace(QRegExp("[^A-Za-z0-9]+"), "_");
+    slug = slug.left(40);
+    item.fileName = dir.absoluteFilePath(QString("%1_%2.%3").arg(k+1, numWidth, 10, QChar('0'))
+                                         .arg(slug).arg(ext));
+
+    exporter.addItem(item);
+  }
+
+  klfDbg("Exporting "<<entries.size()<<" entries to "<<dirName<<" in format "<<format) ;
+
+  KLFProgressDialog pdlg(true, tr("Exporting %n equation(s) ...", "", entries.size()), this);
+  pdlg.setRange(0, entries.size());
+  pdlg.setValue(0);
+  connect(&exporter, SIGNAL(progress(int)), &pdlg, SLOT(setValue(int)));
+  connect(&pdlg, SIGNAL(canceled()), &exporter, SLOT(cancel()));
+
+  QEventLoop loop;
+  connect(&exporter, SIGNAL(finished()), &loop, SLOT(quit()));
+
+  exporter.start();
+  if (!exporter.isFinished()) {
+    // the progress dialog is modal, so that the user can only reach its cancel button
+    pdlg.show();
+    loop.exec(QEventLoop::AllEvents);
+  }
+  pdlg.hide();
+
+  int numOk = exporter.doneCount() - exporter.failedCount();
+  double secs = exporter.elapsed() / 1000.0;
+  QString summary = tr("Saved %n file(s) to %1", "", numOk).arg(QDir::toNativeSeparators(dirName));
+  if (secs > 0.001) {
+    summary += "\n" + tr("(%1 seconds, %2 files per second)").arg(secs, 0, 'f', 1)
+      .arg(exporter.doneCount() / secs, 0, 'f', 1);
+  }
+
+  QMessageBox mbox(this);
+  mbox.setWindowTitle(tr("Export Equations"));
+  if (exporter.failedCount() > 0) {
+    mbox.setIcon(QMessageBox::Warning);
+    summary += "\n\n" + tr("%n equation(s) could not be exported.", "", exporter.failedCount());
+    mbox.setDetailedText(exporter.errors().join("\n"));
+  } else {
+    mbox.setIcon(QMessageBox::Information);
+  }
+  if (exporter.isCanceled()) {
+    summary += "\n\n" + tr("The export was canceled; %1 of %2 equations were processed.")
+      .arg(exporter.doneCount()).arg(entries.size());
+  }
+  mbox.setText(summary);
+  mbox.exec();
+}
+
 void KLFMainWin::slotActivateEditor()
 {
   raise();
@@ -4006,30 +4246,37 @@ KLFBackend::klfSettings KLFMainWin::currentSettings() const
     settings.lborderoffset = u->spnMarginLeft->valueInRefUnit();
   }
 
-  klfDbg("settings.execenv = "<<settings.execenv);
+  d->setupSettingsEnvironment(&settings, currentInputState());
+
+  return settings;
+}
+
+void KLFMainWinPrivate::setupSettingsEnvironment(KLFBackend::klfSettings *settings,
+						 const KLFBackend::klfInput& input) const
+{
+  klfDbg("settings.execenv = "<<settings->execenv);
 
   klfDbg("backendsettings.setTexInputs = "<<klfconfig.BackendSettings.setTexInputs());
   if (!klfconfig.BackendSettings.setTexInputs().isEmpty()) {
-    klfDbg("old environment is"<<settings.execenv);
+    klfDbg("old environment is"<<settings->execenv);
     QStringList newitems = klfSplitEnvironmentPath(klfconfig.BackendSettings.setTexInputs);
-    klfSetEnvironmentPath(&settings.execenv,
+    klfSetEnvironmentPath(&settings->execenv,
 			  newitems,
 			  QLatin1String("TEXINPUTS"),
 			  KlfEnvPathPrepend|KlfEnvPathNoDuplicates);
-    klfDbg("added "<<newitems<<" to TEXINPUTS, new environment is "<<settings.execenv) ;
+    klfDbg("added "<<newitems<<" to TEXINPUTS, new environment is "<<settings->execenv) ;
   }
   // also add the userscripts paths (to expose our `pyklfuserscript` utility or any users'
   // library) to the PYTHONPATH for python scripts
   QStringList pypaths;
   pypaths << klfconfig.globalShareDir+"/userscripts"
           << klfconfig.homeConfigDirUserScripts ;
-  klfSetEnvironmentPath(&settings.execenv, pypaths, QLatin1String("PYTHONPATH"),
+  klfSetEnvironmentPath(&settings->execenv, pypaths, QLatin1String("PYTHONPATH"),
                         KlfEnvPathPrepend|KlfEnvPathNoDuplicates);
   klfDbg("Added "<<pypaths<<" to PYTHONPATHS for user scripts to access our python libraries") ;
 
-  klfDbg("now settings.execenv = "<<settings.execenv);
+  klfDbg("now settings.execenv = "<<settings->execenv);
 
-  KLFBackend::klfInput input = currentInputState();
   // setup user script configuration
   if (!input.userScript.isEmpty()) {
     QString usfn = KLFUserScriptInfo(input.userScript).userScriptPath();
@@ -4038,13 +4285,98 @@ KLFBackend::klfSettings KLFMainWin::currentSettings() const
       QMap<QString,QString> mdata;
       for (QVariantMap::const_iterator it = data.begin(); it != data.end(); ++it)
 	mdata[QLatin1String("KLF_USCONFIG_") + it.key()] = klfSaveVariantToText(it.value(), true);
-      klfMergeEnvironment(&settings.execenv, klfMapToEnvironmentList(mdata));
+      klfMergeEnvironment(&settings->execenv, klfMapToEnvironmentList(mdata));
     }
   }
-  
-  klfDbg("Full environment (w/ userscript config) is "<<settings.execenv) ;
 
-  return settings;
+  klfDbg("Full environment (w/ userscript config) is "<<settings->execenv) ;
+
+}
+
+KLFBackend::klfSettings KLFMainWinPrivate::settingsForStyle(const KLFStyle& style,
+							    const KLFBackend::klfInput& input) const
+{
+  KLFBackend::klfSettings s = settings;
+  if (style.overrideBBoxExpand().valid()) {
+    s.tborderoffset = style.overrideBBoxExpand().top;
+    s.rborderoffset = style.overrideBBoxExpand().right;
+    s.bborderoffset = style.overrideBBoxExpand().bottom;
+    s.lborderoffset = style.overrideBBoxExpand().left;
+  }
+  setupSettingsEnvironment(&s, input);
+  return s;
+}
+
+KLFBackend::klfInput KLFMainWinPrivate::inputForStyle(const QString& latex, const KLFStyle& style) const
+{
+  KLFBackend::klfInput input;
+
+  input.latex = latex;
+  input.mathmode = style.mathmode();
+  input.preamble = style.preamble();
+  if (!style.fontname().isEmpty())
+    input.preamble += latexFontDefs(style.fontname());
+  input.fontsize = (style.fontsize() < 0.001) ? -1 : style.fontsize();
+  input.fg_color = style.fg_color();
+  // same as slotLoadStyle(): an almost transparent background is transparent
+  QColor bgcolor;
+  bgcolor.setRgba(style.bg_color());
+  if (bgcolor.alpha() < 100)
+    input.bg_color = qRgba(255, 255, 255, 0);
+  else
+    input.bg_color = bgcolor.rgb();
+  input.dpi = style.dpi();
+  input.vectorscale = style.vectorscale();
+
+  // styles only remember the user script's file name, see slotSetUserScript()
+  input.userScript = style.userScript();
+  if (!input.userScript.isEmpty() && !input.userScript.contains(QString()+KLF_DIR_SEP)) {
+    int k;
+    for (k = 0; k < K->u->cbxUserScript->count(); ++k) {
+      QString path = K->u->cbxUserScript->itemData(k).toString();
+      if (!path.isEmpty() && QFileInfo(path).fileName() == input.userScript) {
+	input.userScript = path;
+	break;
+      }
+    }
+    if (k == K->u->cbxUserScript->count()) {
+      klfWarning("Couldn't find user script "<<input.userScript<<" !");
+    }
+  }
+  QVariantMap userScriptInput = style.userScriptInput();
+  for (QVariantMap::const_iterator usparam = userScriptInput.begin();
+       usparam != userScriptInput.end();
+       ++usparam) {
+    input.userScriptParam[usparam.key()] = usparam.value().toString();
+  }
+
+  return input;
+}
+
+QString KLFMainWinPrivate::latexFontDefs(const QString& identifier) const
+{
+  int k;
+  for (k = 0; k < pLatexFontDefs.size(); ++k) {
+    if (pLatexFontDefs[k].identifier == identifier)
+      return pLatexFontDefs[k].latexdefs;
+  }
+  klfWarning("Couldn't find font "<<identifier<<" !");
+  return QString();
+}
+
+bool KLFMainWinPrivate::copyDragProfilesExportHtml()
+{
+  QList<KLFMimeExportProfile> profiles;
+  profiles << pMimeExportProfileManager.findExportProfile(klfconfig.ExportData.copyExportProfile)
+	   << pMimeExportProfileManager.findExportProfile(klfconfig.ExportData.dragExportProfile);
+  foreach (const KLFMimeExportProfile& profile, profiles) {
+    foreach (const KLFMimeExportProfile::ExportType& exportType, profile.exportTypes()) {
+      if (exportType.exporterName == QLatin1String("KLFHtmlDataExporter") ||
+	  exportType.exporterName == QLatin1String("KLFTempImgRefHtmlExporter"))
+	return true;
+    }
+  }
+  return false;
 }
 
 KLFBackend::klfOutput KLFMainWin::currentKLFBackendOutput() const
@@ -4088,17 +4420,7 @@ KLFBackend::klfInput KLFMainWin::currentInputState() const
   if (u->cbxLatexFont->isEnabled()) {
     int idx = u->cbxLatexFont->currentIndex();
     if (idx > 0) {
-      // find corresponding font in list
-      int k;
-      for (k = 0; k < d->pLatexFontDefs.size(); ++k) {
-        if (d->pLatexFontDefs[k].identifier == u->cbxLatexFont->itemData(idx).toString()) {
-          input.preamble += d->pLatexFontDefs[k].latexdefs;
-          break;
-        }
-      }
-      if (k == d->pLatexFontDefs.size()) {
-        klfWarning("Couldn't find font "<<u->cbxLatexFont->currentText()<<" !");
-      }
+      input.preamble += d->latexFontDefs(u->cbxLatexFont->itemData(idx).toString());
     }
   }
   input.fg_color = u->colFg->color().rgb();
@@ -4340,6 +4662,16 @@ void KLFMainWinPrivate::slotSetViewControlsEnabled(bool enabled)
   K->u->btnShowBigPreview->setEnabled(enabled);
 }
 
+void KLFMainWinPrivate::slotTempDirChanged(const QString& tempDir)
+{
+  KLFTempArtifactStore::defaultStore()->setDirectory(tempDir + QLatin1String("/klf-tempfiles"));
+}
+
+void KLFMainWinPrivate::slotTempFilesMaxSizeChanged(int maxSizeMB)
+{
+  KLFTempArtifactStore::defaultStore()->setMaxSize((qint64)maxSizeMB * 1024 * 1024);
+}
+
 void KLFMainWinPrivate::slotSetSaveControlsEnabled(bool enabled)
 {
   emit K->userSaveControlsActive(enabled);
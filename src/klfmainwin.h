@@ -322,6 +322,9 @@ public slots:
   void slotDrag();
   void slotCopy();
   void slotSave(const QString& suggestedFname = QString::null);
+  /** Asks the user for a format and a directory, and saves each of the given library entries to
+   * a separate file in that directory. */
+  void exportLibEntriesToFiles(const KLFLibEntryList& entries);
   void slotSetExportProfile(const QString& exportProfile);
 
   void slotActivateEditor();
@@ -40,6 +40,10 @@
 #include <QFileInfo>
 #include <QMessageBox>
 #include <QTextCodec>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QAtomicInt>
+#include <QElapsedTimer>
 
 #include <klfutil.h>
 #include <klfdatautil.h>
@@ -320,6 +324,7 @@ public:
 	  << "text/uri-list"
 	  << "text/plain"
 	  << "application/pdf" // new!
+	  << "application/x-klf-libentries-columnar"
 	  << "application/x-klf-libentries"
 	  << "application/x-klatexformula"
 	  << "application/x-klatexformula-db" ;
@@ -351,6 +356,10 @@ public:
       /// \todo ONLY IF FILE HAS THE RELEVANT META-INFO. .....
       return true;
     }
+    if (KLFLibEntryColumnarData::hasHeader(f.peek(8))) {
+      klfDbg(" ... is library entry data.") ;
+      return true;
+    }
     bool isimage = false;
     if (isKlfImage(&f, &isimage)) {
       klfDbg(" ... is KLF-saved image.") ;
@@ -389,6 +398,10 @@ public:
       return false;
     }
 
+    if (KLFLibEntryColumnarData::hasHeader(data)) {
+      return true;
+    }
+
     // try to read beginning with a QDataStream to look for a known x-klf-libentries header
     QDataStream stream(&buf);
     stream.setVersion(QDataStream::Qt_4_4);
@@ -432,6 +445,18 @@ public:
 	klfDbg(" ... file cannot be opened") ;
 	return false;
       }
+      if (KLFLibEntryColumnarData::hasHeader(f.peek(8))) {
+	// read the entry directly from the mapped file
+	uchar *mapped = f.map(0, f.size());
+	if (mapped != NULL) {
+	  KLFLibEntryColumnarData cdata(mapped, f.size());
+	  bool result = tryOpenKlfLibEntries(cdata);
+	  f.unmap(mapped);
+	  return result;
+	}
+	klfDbg(" ... can't map file, reading it") ;
+	return tryOpenKlfLibEntries(KLFLibEntryColumnarData(f.readAll()));
+      }
       bool isimage = false;
       if (tryOpenImageData(&f, &isimage)) {
 	klfDbg(" ... loaded image data!") ;
@@ -716,10 +741,40 @@ private:
     return true;
   }
 
+  bool tryOpenKlfLibEntries(const KLFLibEntryColumnarData& cdata)
+  {
+    if (!cdata.isValid())
+      return false;
+    if (!checkOpenKlfLibEntriesCount(cdata.count()))
+      return false;
+    // only the latex and style are restored, don't decode the preview
+    mainWin()->restoreFromLibrary(cdata.entry(0, false), KLFLib::RestoreAll);
+    return true;
+  }
+
+  bool checkOpenKlfLibEntriesCount(int count)
+  {
+    if (count > 1) {
+      QMessageBox::critical(mainWin(), tr("Error"),
+			    tr("The data you have request to open contains multiple formulas.\n"
+			       "You may only open one formula into the LaTeX code editor."));
+      return false;
+    }
+    if (count == 0) {
+      QMessageBox::critical(mainWin(), tr("Error"),
+			    tr("The data you have request to open contains no formulas."));
+      return false;
+    }
+    return true;
+  }
+
   bool tryOpenKlfLibEntries(QIODevice *dev)
   {
     // if ONE entry -> load that latex and style
     // if more entries -> warn user, and fail
+    if (KLFLibEntryColumnarData::hasHeader(dev->peek(8)))
+      return tryOpenKlfLibEntries(KLFLibEntryColumnarData(dev->readAll()));
+
     QDataStream stream(dev);
     stream.setVersion(QDataStream::Qt_4_4);
     QString headerstr;
@@ -729,17 +784,8 @@ private:
     QVariantMap properties;
     KLFLibEntryList entries;
     stream >> properties >> entries;
-    if (entries.size() > 1) {
-      QMessageBox::critical(mainWin(), tr("Error"),
-			    tr("The data you have request to open contains multiple formulas.\n"
-			       "You may only open one formula into the LaTeX code editor."));
+    if (!checkOpenKlfLibEntriesCount(entries.size()))
       return false;
-    }
-    if (entries.size() == 0) {
-      QMessageBox::critical(mainWin(), tr("Error"),
-			    tr("The data you have request to open contains no formulas."));
-      return false;
-    }
     mainWin()->restoreFromLibrary(entries[0], KLFLib::RestoreAll);
     return true;
   }
@@ -844,6 +890,103 @@ public:
 
 
 
+// --------------------------------------------------------------------------
+
+
+/** \internal
+ *
+ * Saves a list of library entries to separate files, using a pool of worker threads.
+ *
+ * Each item is given the input and settings to use for rendering it, and is rendered with
+ * KLFBackend::getLatexFormula() in the worker thread. The entries' stored previews are not used:
+ * a preview that was scaled down when it was stored can't be told apart from a full sized one.
+ *
+ * \note KLFBackend serializes the latex and ghostscript runs with its global mutex, so the
+ *   entries are still rendered one at a time. The pool only overlaps the rendering of an entry
+ *   with the encoding and writing of the files of the others.
+ *
+ * progress() is emitted after each item is done, and finished() once all items are done or
+ * after cancel() was called. The exporter must not be deleted while running from a worker thread.
+ */
+class KLFLibEntryBatchExporter : public QObject
+{
+  Q_OBJECT
+public:
+  struct Item
+  {
+    KLFBackend::klfInput input;
+    KLFBackend::klfSettings settings;
+    QString fileName;
+  };
+
+  KLFLibEntryBatchExporter(const QString& format, QObject *parent = NULL);
+  virtual ~KLFLibEntryBatchExporter();
+
+  void addItem(const Item& item) { pItems.append(item); }
+
+  QString format() const { return pFormat; }
+  int count() const { return pItems.size(); }
+  int doneCount() const { return pDoneCount; }
+  int failedCount() const { return pErrors.size(); }
+  /** The errors that occurred, one per failed item, each prefixed by the file name */
+  QStringList errors() const { return pErrors; }
+
+  bool isFinished() const { return pFinished; }
+  bool isCanceled() const { return pCanceled.loadAcquire() != 0; }
+  /** Time since start(), in milliseconds; stops counting when finished. */
+  qint64 elapsed() const { return pFinished ? pElapsedMs : pTimer.elapsed(); }
+
+  /** Renders (if needed) and saves \c item; called from the worker threads. Returns an empty
+   * string on success, or an error message. */
+  static QString exportItem(const Item& item, const QString& format);
+
+signals:
+  void progress(int done);
+  void finished();
+
+public slots:
+  void start();
+  void cancel();
+
+private slots:
+  void itemDone(int index, const QString& errorString);
+
+private:
+  QString pFormat;
+  QList<Item> pItems;
+
+  QThreadPool pPool;
+  QAtomicInt pCanceled;
+
+  int pDoneCount;
+  QStringList pErrors;
+  bool pFinished;
+  QElapsedTimer pTimer;
+  qint64 pElapsedMs;
+
+  void setFinished();
+
+  friend class KLFLibEntryBatchExportTask;
+};
+
+/** \internal */
+class KLFLibEntryBatchExportTask : public QRunnable
+{
+public:
+  KLFLibEntryBatchExportTask(KLFLibEntryBatchExporter *exporter, int index)
+    : pExporter(exporter), pIndex(index)
+  {
+  }
+
+  virtual void run();
+
+private:
+  KLFLibEntryBatchExporter *pExporter;
+  int pIndex;
+};
+
+
+
 // --------------------------------------------------------------------------
 
 
@@ -966,6 +1109,16 @@ public:
    * from slotEvaluate() and FALSE when called to update the preview builder thread. */
   KLFBackend::klfInput collectInput(bool isFinal);
 
+  /** Returns the input to render \c latex with style \c style, i.e. the same input as
+   * \ref currentInputState() after the style was loaded with \ref slotLoadStyle(). */
+  KLFBackend::klfInput inputForStyle(const QString& latex, const KLFStyle& style) const;
+  /** Returns the settings to render \c input with style \c style: the global settings, with
+   * the margins given by the style if it overrides them. See \ref setupSettingsEnvironment(). */
+  KLFBackend::klfSettings settingsForStyle(const KLFStyle& style, const KLFBackend::klfInput& input) const;
+  /** Sets up the environment of \c settings to render \c input: TEXINPUTS, the python path
+   * for user scripts and the configuration of \c input's user script. */
+  void setupSettingsEnvironment(KLFBackend::klfSettings *settings, const KLFBackend::klfInput& input) const;
+
   QList<QAction*> pExportProfileQuickMenuActionList;
 
   bool ignore_close_event;
@@ -990,6 +1143,9 @@ public:
   QList<KLFAbstractDataOpener*> pDataOpeners;
 
   KLFMimeExportProfileManager pMimeExportProfileManager;
+  /** Whether the copy or the drag export profile contains an HTML exporter, i.e. whether
+   * copying or dragging the formula needs it rendered at the HTML export DPI */
+  bool copyDragProfilesExportHtml();
 
 #if defined(KLF_WS_MAC)
   KLFMacPasteboardMime * macFlavorsConverter;
@@ -1017,6 +1173,9 @@ public:
   };
 
   QList<LatexFontDef> pLatexFontDefs;
+  /** The latex definitions of the font with the given identifier, see \ref pLatexFontDefs.
+   * Returns an empty string (and warns) if there is no such font. */
+  QString latexFontDefs(const QString& identifier) const;
 
   void reloadLatexFontDefs();
 
@@ -1084,6 +1243,10 @@ public slots: // .. but in private API
   void slotUserScriptSet(int index);
   void slotUserScriptShowInfo();
   void slotUserScriptDisableInputs(KLFUserScriptInfo * info);
+
+  /** Keep KLFTempArtifactStore::defaultStore() in sync with the settings */
+  void slotTempDirChanged(const QString& tempDir);
+  void slotTempFilesMaxSizeChanged(int maxSizeMB);
 };
 
 
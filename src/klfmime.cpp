@@ -34,6 +34,8 @@
 #include <QPainter>
 #include <QTextCodec>
 #include <QTextDocument>
+#include <QHash>
+#include <QSet>
 
 #if defined(KLF_WS_MAC)
 #include <QMacPasteboardMime> // qRegisterDraggedTypes()
@@ -50,6 +52,7 @@
 #include "klflib.h"
 #include "klfmime.h"
 #include "klfmime_p.h"
+#include "klfexporter_p.h"
 
 // #define OPENOFFICE_DRAWING_MIMETYPE "application/x-openoffice-drawing;windows_formatname=\"Drawing Format\""
 
@@ -570,7 +573,85 @@ struct KLFMimeDataPrivate
   QStringList qtManagedMimeTypes;
   bool allDataTransmitted;
 
+  //! Exported data, by memo key (see memoKey())
+  QHash<QString,QByteArray> exportedData;
+  /** Exports which are running in the background (e.g. pre-encoded formats), by memo
+   * key. The jobs are children of the KLFMimeData object. */
+  QHash<QString,KLFExporterJob*> exportJobs;
+
+  struct LazyQtFormat {
+    LazyQtFormat(int i = -1, const QString& t = QString()) : index(i), qtType(t) { }
+    int index;
+    QString qtType;
+  };
+  /** Default Qt formats (text, html, image, urls) which are only exported when actually
+   * requested, by the mime type under which QMimeData looks them up */
+  QMap<QString,LazyQtFormat> lazyQtFormats;
+  //! Converted values for \ref lazyQtFormats, by mime type
+  QHash<QString,QVariant> lazyQtFormatValues;
+
+  //! Export types of this instance which have already been counted in \ref requestCounts
+  QSet<int> countedRequests;
+
+  /** How often each export type of each profile was requested, over all instances. Keys
+   * are given by requestCountKey(). Only accessed from the main thread. */
+  static QHash<QString,int> requestCounts;
+
+  static QString memoKey(const KLFMimeExportProfile::ExportType& exportType, const QVariantMap& params)
+  {
+    QByteArray paramsdata;
+    if (!params.isEmpty()) {
+      QDataStream str(&paramsdata, QIODevice::WriteOnly);
+      str << params;
+    }
+    return exportType.exporterName + QLatin1Char('\n') + exportType.exporterFormat + QLatin1Char('\n')
+      + QString::fromLatin1(paramsdata.toBase64());
+  }
+  QString requestCountKey(int index) const
+  {
+    KLFMimeExportProfile::ExportType exportType = exportProfile.exportType(index);
+    return exportProfile.profileName() + QLatin1Char('\n') + exportType.exporterName
+      + QLatin1Char('\n') + exportType.exporterFormat;
+  }
+
+  void countRequest(int index)
+  {
+    if (countedRequests.contains(index)) {
+      // clipboard consumers often ask several times for the same target
+      return;
+    }
+    countedRequests.insert(index);
+    ++requestCounts[requestCountKey(index)];
+  }
+
   QByteArray getDataFor(KLFMimeExportProfile::ExportType exportType, const QVariantMap & params)
+  {
+    const QString key = memoKey(exportType, params);
+    if (exportedData.contains(key)) {
+      klfDbg("have memoized data for "<<key) ;
+      return exportedData.value(key);
+    }
+
+    QByteArray data;
+    KLFExporterJob * job = exportJobs.take(key);
+    if (job != NULL && job->isSuccessful()) {
+      klfDbg("collecting data of pre-encoded "<<key) ;
+      data = job->data();
+    } else {
+      // We're called from QMimeData::retrieveData(), where we must not run an event loop to
+      // wait for a job. Export the data right here; if a worker is exporting it at the same
+      // time, we wait for it on the exporter's mutex and find its result memoized.
+      data = exportData(exportType, params);
+    }
+    if (job != NULL) {
+      job->cancel();
+      job->deleteLater();
+    }
+    exportedData[key] = data;
+    return data;
+  }
+
+  QByteArray exportData(KLFMimeExportProfile::ExportType exportType, const QVariantMap & params)
   {
     KLF_ASSERT_NOT_NULL(exporterManager, "We don't have any exporter manager ! It's NULL !",
 			return QByteArray()) ;
@@ -579,15 +660,47 @@ struct KLFMimeDataPrivate
       klfWarning("Can't find exporter name = " << exportType.exporterName << "!") ;
       return QByteArray();
     }
-  
-    // get the data
-    return exporter->getData(exportType.exporterFormat, output, params);
+
+    QMutexLocker lock(exporterManager->exporterMutex(exporter));
+    const QString outputkey = klf_exporter_memo_key(exporter, exportType.exporterFormat, output, params);
+    if (!outputkey.isNull() && output.encodedData->contains(outputkey)) {
+      klfDbg("have memoized data for "<<outputkey) ;
+      return output.encodedData->value(outputkey);
+    }
+    QByteArray data = exporter->getData(exportType.exporterFormat, output, params);
+    if (data.isEmpty()) {
+      klfDbg("export of "<<exportType.exporterName<<"/"<<exportType.exporterFormat<<" failed: "
+             <<exporter->errorString()) ;
+    } else if (!outputkey.isNull()) {
+      output.encodedData->insert(outputkey, data);
+    }
+    return data;
+  }
+
+  KLFExporterJob * startExport(KLFMimeExportProfile::ExportType exportType, const QVariantMap & params)
+  {
+    KLF_ASSERT_NOT_NULL(exporterManager, "We don't have any exporter manager ! It's NULL !",
+			return NULL) ;
+    KLFExporter * exporter = exporterManager->exporterByName(exportType.exporterName);
+    if (exporter == NULL) {
+      klfWarning("Can't find exporter name = " << exportType.exporterName << "!") ;
+      return NULL;
+    }
+
+    KLFExporterJob * job = exporter->getDataAsync(exportType.exporterFormat, output, params);
+    job->setParent(K);
+    exportJobs[memoKey(exportType, params)] = job;
+    return job;
   }
 
+  void startPreEncoding();
+
   QStringList collectedFormatsAsProxyMimes() const;
   QStringList formatsAsProxyMimes(int index) const;
 
   void setDefaultQtFormats();
+  QVariant lazyQtFormatValue(const QString& mimetype);
+  static QVariant convertQtFormatData(const QString& qtType, const QByteArray& data);
 
   QStringList macFlavorsToProxyMimes(const QStringList & flavlist) const;
   QString macFlavorFromProxyMime(const QString & mimeType) const;
@@ -601,6 +714,8 @@ struct KLFMimeDataPrivate
 
 // static
 QList<KLFMimeData*> KLFMimeDataPrivate::activeMimeDataInstances = QList<KLFMimeData*>();
+// static
+QHash<QString,int> KLFMimeDataPrivate::requestCounts = QHash<QString,int>();
 
 
 KLFMimeData::KLFMimeData(const KLFMimeExportProfile& exportProfile,
@@ -627,6 +742,8 @@ KLFMimeData::KLFMimeData(const KLFMimeExportProfile& exportProfile,
 
   klfDbg("have formats: "<<formats()) ;
 
+  d->startPreEncoding();
+
   KLFMimeDataPrivate::activeMimeDataInstances.append(this);
 }
 KLFMimeData::~KLFMimeData()
@@ -635,9 +752,48 @@ KLFMimeData::~KLFMimeData()
 
   KLFMimeDataPrivate::activeMimeDataInstances.removeAll(this);
 
+  // any pending export jobs are our children, and are canceled when deleted
+
   KLF_DELETE_PRIVATE ;
 }
 
+void KLFMimeDataPrivate::startPreEncoding()
+{
+  KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
+
+  QList<KLFMimeExportProfile::ExportType> exportTypes = exportProfile.exportTypes();
+
+  // the default Qt formats are asked for by pretty much any application, then come the
+  // types which were most requested by earlier pastes and drops with this profile
+  QList<int> indexes;
+  QMultiMap<int,int> byRequestCount;
+  int k;
+  for (k = 0; k < exportTypes.size(); ++k) {
+    if (exportTypes[k].defaultQtFormatsOnThisWs().size()) {
+      indexes << k;
+      continue;
+    }
+    int count = requestCounts.value(requestCountKey(k), 0);
+    if (count > 0) {
+      byRequestCount.insert(-count, k);
+    }
+  }
+  const int maxPopular = qMax(1, exporterManager->workerPool()->maxThreadCount());
+  QList<int> popular = byRequestCount.values();
+  indexes << popular.mid(0, maxPopular);
+
+  foreach (int index, indexes) {
+    const KLFMimeExportProfile::ExportType & exportType = exportTypes[index];
+    KLFExporter * exporter = exporterManager->exporterByName(exportType.exporterName);
+    if (exporter == NULL || !exporter->canExportInWorkerThread() ||
+        !exporter->supports(exportType.exporterFormat, output)) {
+      continue;
+    }
+    klfDbg("pre-encoding "<<exportType.exporterName<<" / "<<exportType.exporterFormat) ;
+    startExport(exportType, QVariantMap());
+  }
+}
+
 void KLFMimeDataPrivate::setDefaultQtFormats()
 {
   KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
@@ -651,53 +807,81 @@ void KLFMimeDataPrivate::setDefaultQtFormats()
     klfDbg("Qt formats on this window-system for export type "<<k<<" ("<<exportType.exporterName<<") ; list size="
            << qtformats.size() ) ;
 
-    if (!qtformats.size()) {
-      continue;
-    }
-
     // maybe we should think of a way of querying the user for export params? but this
     // should not be done here interactively, because this is called on "copy" or "drag
     // start", not upon dropped (as in retrievedData()) .... just think about this .....
-    QVariantMap params;
 
-    // this export type needs to be exported via QMimeData::setXXX(...), so we need to
-    // prepare the data to set
-    QByteArray data = getDataFor(exportType, params);
+    // The data is not exported here: we only remember under which mime type QMimeData
+    // will look up each format, and export it (once) when it is actually requested.
     int j;
     for (j = 0; j < qtformats.size(); ++j) {
       KLFMimeExportProfile::ExportType::DefaultQtFormat qtformat = qtformats[j];
+      QString mimetype;
       if (qtformat.qtType == "color") {
         klfWarning("Qt default format \"color\" NOT YET IMPLEMENTED!!! FIXME!! ..........") ;
         K->setColorData(QColor(0,0,0)); // dummy, there's not much to do anyway...
       } else if (qtformat.qtType == "html") {
-        klfDbg("adding html data, data = " << QString::fromUtf8(data)) ;
-        K->setHtml(QString::fromUtf8(data));
+        mimetype = QLatin1String("text/html");
       } else if (qtformat.qtType == "image") {
-        QImage img;
-        img.loadFromData(data);
-        klfDbg("adding image size="<<img.size()) ;
-        K->setImageData(img);
+        mimetype = QLatin1String("application/x-qt-image");
       } else if (qtformat.qtType == "text") {
-        klfDbg("adding text="<<QString::fromUtf8(data)) ;
-        K->setText(QString::fromUtf8(data));
+        mimetype = QLatin1String("text/plain");
       } else if (qtformat.qtType == "urls") {
-        QList<QUrl> urllist;
-        QStringList urls = QString::fromUtf8(data).split('\n');
-        for (int kk = 0; kk < urls.size(); ++kk) {
-          urllist << QUrl(urls[kk]);
-        }
-        klfDbg("adding URLs = " << urllist) ;
-        K->setUrls(urllist) ;
+        mimetype = QLatin1String("text/uri-list");
       } else {
         klfWarning("Ignoring invalid default Qt format " << qtformat.qtType) ;
       }
+      if (!mimetype.isEmpty() && !lazyQtFormats.contains(mimetype)) {
+        lazyQtFormats[mimetype] = LazyQtFormat(k, qtformat.qtType);
+      }
     }
   }
 
   qtManagedMimeTypes = K->QMimeData::formats();
+  qtManagedMimeTypes << lazyQtFormats.keys();
   klfDbg("Qt managed mime types = " << qtManagedMimeTypes) ;
 }
 
+// static
+QVariant KLFMimeDataPrivate::convertQtFormatData(const QString& qtType, const QByteArray& data)
+{
+  if (qtType == "html" || qtType == "text") {
+    return QVariant(QString::fromUtf8(data));
+  }
+  if (qtType == "image") {
+    QImage img;
+    img.loadFromData(data);
+    klfDbg("decoded image size="<<img.size()) ;
+    return QVariant(img);
+  }
+  if (qtType == "urls") {
+    QList<QVariant> urllist;
+    QStringList urls = QString::fromUtf8(data).split('\n');
+    for (int kk = 0; kk < urls.size(); ++kk) {
+      urllist << QVariant(QUrl(urls[kk]));
+    }
+    klfDbg("URLs = " << urllist) ;
+    return QVariant(urllist);
+  }
+  klfWarning("Invalid default Qt format " << qtType) ;
+  return QVariant();
+}
+
+QVariant KLFMimeDataPrivate::lazyQtFormatValue(const QString& mimetype)
+{
+  if (lazyQtFormatValues.contains(mimetype)) {
+    return lazyQtFormatValues.value(mimetype);
+  }
+
+  LazyQtFormat f = lazyQtFormats.value(mimetype);
+  countRequest(f.index);
+
+  QByteArray data = getDataFor(exportProfile.exportType(f.index), QVariantMap());
+  QVariant value = convertQtFormatData(f.qtType, data);
+  lazyQtFormatValues[mimetype] = value;
+  return value;
+}
+
 QStringList KLFMimeDataPrivate::macFlavorsToProxyMimes(const QStringList & flavlist) const
 {
   KLF_DEBUG_BLOCK(KLF_FUNC_NAME) ;
@@ -801,6 +985,7 @@ QStringList KLFMimeData::formats() const
   klfDbg("our mime formats: " << fmts) ;
 
   QStringList qtfmts = QMimeData::formats();
+  qtfmts << d->lazyQtFormats.keys();
   klfDbg("Formats added by qt: " << qtfmts) ;
   fmts << qtfmts;
 
@@ -821,6 +1006,16 @@ QVariant KLFMimeData::retrieveData(const QString& mimetype, QVariant::Type type)
     return QMimeData::retrieveData(mimetype, type);
   }
 
+  if (d->lazyQtFormats.contains(mimetype)) {
+    // a default Qt format, which we export only now
+    klfDbg("Providing default Qt format "<<mimetype<<" w/ type="<<type) ;
+    QVariant value = d->lazyQtFormatValue(mimetype);
+    if (type == QVariant::ByteArray && value.type() == QVariant::String) {
+      return QVariant(value.toString().toUtf8());
+    }
+    return value;
+  }
+
   if (d->qtManagedMimeTypes.contains(mimetype) || mimetype.startsWith("application/x-qt-")) {
     // this mime type is handled by Qt
     klfDbg("Letting Qt handle "<<mimetype<<" w/ type="<<type) ;
@@ -859,6 +1054,8 @@ QVariant KLFMimeData::retrieveData(const QString& mimetype, QVariant::Type type)
 
   KLFMimeExportProfile::ExportType etype = d->exportProfile.exportType(index);
 
+  d->countRequest(index);
+
   /// \todo TODO: add the query-string part of the MIME type into parameters in params for
   ///       the exporter ............... or query the user .... .......
   QVariantMap params;
@@ -888,6 +1085,27 @@ void KLFMimeData::transmitAllData()
     }
 
   }
+  // the default Qt formats must now be set on the QMimeData itself
+  QMap<QString,KLFMimeDataPrivate::LazyQtFormat>::const_iterator it;
+  for (it = d->lazyQtFormats.constBegin(); it != d->lazyQtFormats.constEnd(); ++it) {
+    QVariant value = d->lazyQtFormatValue(it.key());
+    const QString qtType = it.value().qtType;
+    if (qtType == "html") {
+      setHtml(value.toString());
+    } else if (qtType == "image") {
+      setImageData(value);
+    } else if (qtType == "text") {
+      setText(value.toString());
+    } else if (qtType == "urls") {
+      QList<QUrl> urllist;
+      foreach (const QVariant& u, value.toList()) {
+        urllist << u.toUrl();
+      }
+      setUrls(urllist);
+    }
+  }
+  d->lazyQtFormats.clear();
+  d->lazyQtFormatValues.clear();
   d->allDataTransmitted = true;
   d->exporterManager = NULL; // and don't allow any more access to the exporter manager
 }
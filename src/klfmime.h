@@ -203,6 +203,9 @@ struct KLFMimeDataPrivate;
  *
  * This function can be used as a regular QMimeData object to copy or drag any
  * KLFBackend::klfOutput data, with a given export profile.
+ *
+ * The data is exported with \ref KLFExporter::getDataAsync(), so that the application keeps
+ * processing events while a slow exporter (e.g. a user script) is running.
  */
 class KLF_EXPORT KLFMimeData : public QMimeData
 {
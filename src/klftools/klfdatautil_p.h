@@ -30,6 +30,8 @@
 
 #include <QByteArray>
 #include <QBuffer>
+#include <QDataStream>
+#include <QVariant>
 
 #include <string.h>
 #include <klfutil.h>
@@ -38,6 +40,104 @@ static QByteArray compressed_xml_magic = QByteArray("qCompressedXML\0",
 						    strlen("qCompressedXML")+1); // _WITH_ '\0'
 static QByteArray binary_magic = QByteArray("BinaryVariantMap");
 static QByteArray textvariantmap_header = QByteArray("TextVariantMap:");
+static QByteArray compactbinary_magic = QByteArray("KLFcb\x01", 6);
+
+
+/* The "CompactBinary" format stores each property as its UTF-8 name, a one-byte type tag and
+ * the raw value. Only types without a tag below go through the (much more verbose) QDataStream
+ * serialization of QVariant. */
+enum {
+  CompactBinaryInvalid = 0,
+  CompactBinaryBool,
+  CompactBinaryInt,
+  CompactBinaryUInt,
+  CompactBinaryLongLong,
+  CompactBinaryULongLong,
+  CompactBinaryLong,
+  CompactBinaryULong,
+  CompactBinaryDouble,
+  CompactBinaryString,
+  CompactBinaryByteArray,
+  CompactBinaryGeneric = 0xFF
+};
+
+static void compactbinary_write_value(QDataStream& stream, const QVariant& value)
+{
+  switch (value.userType()) {
+  case QMetaType::UnknownType:
+    stream << (quint8)CompactBinaryInvalid;
+    break;
+  case QMetaType::Bool:
+    stream << (quint8)CompactBinaryBool << (quint8)value.toBool();
+    break;
+  case QMetaType::Int:
+    stream << (quint8)CompactBinaryInt << (qint32)value.toInt();
+    break;
+  case QMetaType::UInt:
+    stream << (quint8)CompactBinaryUInt << (quint32)value.toUInt();
+    break;
+  case QMetaType::LongLong:
+    stream << (quint8)CompactBinaryLongLong << (qint64)value.toLongLong();
+    break;
+  case QMetaType::ULongLong:
+    stream << (quint8)CompactBinaryULongLong << (quint64)value.toULongLong();
+    break;
+  case QMetaType::Long:
+    stream << (quint8)CompactBinaryLong << (qint64)value.value<long>();
+    break;
+  case QMetaType::ULong:
+    stream << (quint8)CompactBinaryULong << (quint64)value.value<unsigned long>();
+    break;
+  case QMetaType::Double:
+    stream << (quint8)CompactBinaryDouble << value.toDouble();
+    break;
+  case QMetaType::QString:
+    stream << (quint8)CompactBinaryString << value.toString().toUtf8();
+    break;
+  case QMetaType::QByteArray:
+    stream << (quint8)CompactBinaryByteArray << value.toByteArray();
+    break;
+  default:
+    stream << (quint8)CompactBinaryGeneric << value;
+    break;
+  }
+}
+
+static QVariant compactbinary_read_value(QDataStream& stream)
+{
+  quint8 tag;
+  stream >> tag;
+  switch (tag) {
+  case CompactBinaryInvalid:
+    return QVariant();
+  case CompactBinaryBool:
+    { quint8 x; stream >> x; return QVariant::fromValue<bool>(x != 0); }
+  case CompactBinaryInt:
+    { qint32 x; stream >> x; return QVariant::fromValue<int>(x); }
+  case CompactBinaryUInt:
+    { quint32 x; stream >> x; return QVariant::fromValue<uint>(x); }
+  case CompactBinaryLongLong:
+    { qint64 x; stream >> x; return QVariant::fromValue<qlonglong>(x); }
+  case CompactBinaryULongLong:
+    { quint64 x; stream >> x; return QVariant::fromValue<qulonglong>(x); }
+  case CompactBinaryLong:
+    { qint64 x; stream >> x; return QVariant::fromValue<long>((long)x); }
+  case CompactBinaryULong:
+    { quint64 x; stream >> x; return QVariant::fromValue<unsigned long>((unsigned long)x); }
+  case CompactBinaryDouble:
+    { double x; stream >> x; return QVariant::fromValue<double>(x); }
+  case CompactBinaryString:
+    { QByteArray x; stream >> x; return QVariant::fromValue<QString>(QString::fromUtf8(x)); }
+  case CompactBinaryByteArray:
+    { QByteArray x; stream >> x; return QVariant::fromValue<QByteArray>(x); }
+  case CompactBinaryGeneric:
+    { QVariant x; stream >> x; return x; }
+  default:
+    qWarning()<<KLF_FUNC_NAME<<": Unknown type tag "<<(int)tag;
+    stream.setStatus(QDataStream::ReadCorruptData);
+    return QVariant();
+  }
+}
 
 class KLFBaseFormatsPropertizedObjectSaver : public KLFAbstractPropertizedObjectSaver
 {
@@ -49,7 +149,8 @@ public:
   QStringList supportedTypes() const
   {
     return QStringList() << QLatin1String("XML") << QLatin1String("CompressedXML")
-			 << QLatin1String("Binary") << QLatin1String("TextVariantMap");
+			 << QLatin1String("Binary") << QLatin1String("CompactBinary")
+			 << QLatin1String("TextVariantMap");
   }
   QString recognizeDataFormat(const QByteArray& data) const
   {
@@ -72,6 +173,11 @@ public:
 	return KLF_DEBUG_TEE( QLatin1String("CompressedXML") );
       }
     }
+    { // try to recognize CompactBinary
+      if (data.startsWith(compactbinary_magic)) {
+	return KLF_DEBUG_TEE( QLatin1String("CompactBinary") );
+      }
+    }
     { // try to recognize Binary
       QDataStream stream(data);
       stream.setVersion(QDataStream::Qt_4_4);
@@ -117,6 +223,22 @@ public:
       }
       klfDbg("binary data is " << b) ;
       return b;
+    } else if (format == QLatin1String("CompactBinary")) {
+      QByteArray b = compactbinary_magic;
+      {
+	QBuffer buf(&b);
+	buf.open(QIODevice::WriteOnly | QIODevice::Append);
+	QDataStream stream(&buf);
+	stream.setVersion(QDataStream::Qt_4_4);
+	stream << (quint16)propdata.size();
+	for (QVariantMap::const_iterator it = propdata.begin(); it != propdata.end(); ++it) {
+	  QByteArray name = it.key().toUtf8();
+	  stream << (quint16)name.size();
+	  stream.writeRawData(name.constData(), name.size());
+	  compactbinary_write_value(stream, it.value());
+	}
+      }
+      return b;
     } else if (format == QLatin1String("TextVariantMap")) {
       QByteArray data;
       // see if all values are of the same type, and is a simple type (i.e., not map or list)
@@ -193,6 +315,26 @@ public:
       klfDbg("read variant map: " << vmap) ;
       // now set all the properties
       return obj->setAllProperties(vmap);
+    } else if (format == QLatin1String("CompactBinary")) {
+      KLF_ASSERT_CONDITION(data.startsWith(compactbinary_magic),
+			   "Data is not 'CompactBinary' format! Bad header!", return false; ) ;
+      QDataStream stream(data.mid(compactbinary_magic.size()));
+      stream.setVersion(QDataStream::Qt_4_4);
+      quint16 n;
+      stream >> n;
+      QVariantMap vmap;
+      int k;
+      for (k = 0; k < (int)n && stream.status() == QDataStream::Ok; ++k) {
+	quint16 namelen;
+	stream >> namelen;
+	QByteArray name(namelen, '\0');
+	stream.readRawData(name.data(), namelen);
+	vmap[QString::fromUtf8(name)] = compactbinary_read_value(stream);
+      }
+      KLF_ASSERT_CONDITION(stream.status() == QDataStream::Ok,
+			   "Truncated or corrupt 'CompactBinary' data!", return false; ) ;
+      klfDbg("read variant map: " << vmap) ;
+      return obj->setAllProperties(vmap);
     } else if (format == QLatin1String("TextVariantMap")) {
       klfDbg("Reading a TextVariantMap encoded variant map.") ;
       QVariantMap props;
@@ -473,33 +473,74 @@ KLF_EXPORT void klfDrawGlowedImage(QPainter *p, const QImage& foreground, const
   qreal dpr = p->device()->devicePixelRatioF();
   QSize userspace_size = fg.size() / dpr;
 
-  int r2 = r*dpr;
-
-  QImage glow(fg.size(), QImage::Format_ARGB32_Premultiplied);
+  int r2 = qMax(0, (int)(r*dpr));
+
+  // The glow used to be drawn by overlapping a copy of the image, with its alpha scaled by
+  // alpha(glow_color)/r^2, at every offset in a disc of radius r2 device pixels (stepping by dpr).
+  // Overlapping N layers of (small) alpha a_k gives alpha 1-prod(1-a_k) ~= 1-exp(-sum a_k), and
+  // sum a_k ~= N * alpha(glow_color)/r^2 * (mean alpha of the image around the pixel). The mean
+  // is computed with a separable box filter of radius r2, ie. two passes of running sums.
+  int ndisc = 0; // number of offsets in the disc, as above
+  int dx, dy;
+  int step = qMax(1, (int)dpr);
+  for (dx = -r2; dx <= r2; dx += step)
+    for (dy = -r2; dy <= r2; dy += step)
+      if (dx*dx+dy*dy <= r2*r2)
+	++ndisc;
+
+  const int w = fg.width();
+  const int h = fg.height();
+  // the glow extends r2 pixels beyond the image on each side
+  const int gw = w + 2*r2;
+  const int gh = h + 2*r2;
+  const int win = 2*r2 + 1;
+
+  // horizontal pass: hsum[y*gw+x] = sum of alpha in fg row y over columns [x-2*r2, x] (in glow coords)
+  QVector<int> hsum(gw*h);
   int x, y;
-  qreal ga = qAlpha(glow_color) / qreal(255);
-  ga /= r*r; // heuristic scaling of alpha
-  for (x = 0; x < fg.width(); ++x) {
-    for (y = 0; y < fg.height(); ++y) {
-      qreal ai = qAlpha(fg.pixel(x,y)) * ga;
-      qreal a = ai / 255;
-      // glow format is argb32_premultiplied
-      glow.setPixel(x,y, qRgba(qRed(glow_color)*a, qGreen(glow_color)*a, qBlue(glow_color)*a, ai));
+  for (y = 0; y < h; ++y) {
+    const QRgb *line = reinterpret_cast<const QRgb*>(fg.constScanLine(y));
+    int *out = hsum.data() + y*gw;
+    int acc = 0;
+    for (x = 0; x < gw; ++x) {
+      if (x < w)
+	acc += qAlpha(line[x]);
+      if (x - win >= 0 && x - win < w)
+	acc -= qAlpha(line[x - win]);
+      out[x] = acc;
     }
   }
-  // now draw that glowed image a few times moving around the interest point to do a glow effect
-  //  p->save();
-  //  p->setOpacity(std::log(-numoverlaps));
-  //  p->setCompositionMode(QPainter::CompositionMode_Plus);
-  int dx, dy;
-  for (dx = -r2; dx <= r2; dx += dpr) {
-    for (dy = -r2; dy <= r2; dy += dpr) {
-      if (dx*dx+dy*dy > r2*r2) // don't go beyond r2 device pixels from (0,0)
-	continue;
-      p->drawImage(QRectF(QPointF(dx/dpr,dy/dpr), userspace_size), glow);
+
+  // vertical pass, accumulating whole rows at a time
+  qreal ga = qAlpha(glow_color) / qreal(255);
+  ga /= qMax(1, r*r); // heuristic scaling of alpha, as before
+  const float scale = float(ndisc * ga / (255.0 * win * win));
+  const int gr = qRed(glow_color), gg = qGreen(glow_color), gb = qBlue(glow_color);
+
+  QImage glow(gw, gh, QImage::Format_ARGB32_Premultiplied);
+  QVector<int> vacc(gw, 0);
+  for (y = 0; y < gh; ++y) {
+    if (y < h) {
+      const int *add = hsum.constData() + y*gw;
+      for (x = 0; x < gw; ++x)
+	vacc[x] += add[x];
+    }
+    if (y - win >= 0 && y - win < h) {
+      const int *sub = hsum.constData() + (y - win)*gw;
+      for (x = 0; x < gw; ++x)
+	vacc[x] -= sub[x];
+    }
+    QRgb *out = reinterpret_cast<QRgb*>(glow.scanLine(y));
+    for (x = 0; x < gw; ++x) {
+      float a = 1.f - std::exp(-scale * vacc[x]);
+      // glow format is argb32_premultiplied
+      out[x] = qRgba(int(gr*a), int(gg*a), int(gb*a), int(255*a));
     }
   }
-  //  p->restore();
+
+  // and composite it once
+  p->drawImage(QRectF(QPointF(-r2/dpr, -r2/dpr), QSizeF(gw/dpr, gh/dpr)), glow);
+
   if (also_draw_image) {
     p->drawImage(QRect(QPoint(0,0), userspace_size), fg);
   }
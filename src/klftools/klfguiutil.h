@@ -544,11 +544,11 @@ public:
 
 /** \brief Draws the given image with a glow effect.
  *
- * Draws a glow effect for image \c foreground by extracting the alpha channel, and
- * creating fills an image of color \c glow_color with the same alpha channel. The
- * image is then drawn at all points (x,y) around (0,0) such that
- * <tt>|(x,y)-(0,0)| &lt; r</tt>, effectively overlapping the glow image with itself
- * creating a blur effect.
+ * Draws a glow effect for image \c foreground by blurring its alpha channel over a radius
+ * \c r, and filling an image of color \c glow_color with the blurred alpha channel. The
+ * result looks like the image overlapped with itself at all points (x,y) around (0,0) such
+ * that <tt>|(x,y)-(0,0)| &lt; r</tt>, but it is computed with a separable box filter and
+ * painted only once.
  *
  * The resulting graphics are painted using the painter \c painter, at the reference
  * position <tt>(0,0)</tt>. If you want your image drawn at another position, use